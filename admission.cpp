@@ -0,0 +1,187 @@
+#include "public.h"
+#include "admission.h"
+#include "metrics.h"
+
+static MetricCounter *g_rejected_conns = NewMetricCounter("moserver_admission_rejected_total",
+		"Connections and requests rejected with a BUSY frame", "reason=\"conns\"");
+static MetricCounter *g_rejected_client_conns = NewMetricCounter("moserver_admission_rejected_total",
+		"Connections and requests rejected with a BUSY frame", "reason=\"client_conns\"");
+static MetricCounter *g_rejected_inflight = NewMetricCounter("moserver_admission_rejected_total",
+		"Connections and requests rejected with a BUSY frame", "reason=\"inflight\"");
+static MetricCounter *g_rejected_client_inflight = NewMetricCounter("moserver_admission_rejected_total",
+		"Connections and requests rejected with a BUSY frame", "reason=\"client_inflight\"");
+static MetricCounter *g_rejected_queue_delay = NewMetricCounter("moserver_admission_rejected_total",
+		"Connections and requests rejected with a BUSY frame", "reason=\"queue_delay\"");
+static MetricGauge *g_inflight = NewMetricGauge("moserver_admission_inflight",
+		"Requests queued or being handled");
+static MetricGauge *g_overloaded = NewMetricGauge("moserver_admission_overloaded",
+		"1 while the minimum queue delay stays above the target");
+
+Admission::Admission()
+{
+	m_max_conns = 0;
+	m_max_conns_per_client = 0;
+	m_max_inflight = 0;
+	m_target = 5 * 1000000L;
+	m_interval = 100 * 1000000L;
+	m_blifo = true;
+	m_reject_delay = 10 * 1000000L;
+
+	m_conns = 0;
+	m_inflight = 0;
+	m_active_clients = 0;
+
+	m_interval_end = 0;
+	m_min_sojourn = ~0UL;
+	m_boverloaded = false;
+}
+
+/**
+ * @brief 接受连接前检查连接数
+ * @param addr 客户端IPv4地址，网络字节序
+ * @return 允许返回true
+ */
+bool Admission::AdmitConn(const unsigned int addr)
+{
+	if (m_max_conns > 0 && m_conns >= m_max_conns)
+	{
+		g_rejected_conns->Add();
+		return false;
+	}
+
+	Client &client = m_clients[addr];
+	if (m_max_conns_per_client > 0 && client.m_conns >= m_max_conns_per_client)
+	{
+		if (client.m_conns == 0)
+		{
+			m_clients.erase(addr);
+		}
+		g_rejected_client_conns->Add();
+		return false;
+	}
+
+	client.m_conns++;
+	m_conns++;
+
+	return true;
+}
+
+void Admission::ReleaseConn(const unsigned int addr)
+{
+	unordered_map<unsigned int, Client>::iterator it = m_clients.find(addr);
+	if (it == m_clients.end())
+	{
+		return;
+	}
+
+	m_conns--;
+	if (--it->second.m_conns <= 0 && it->second.m_inflight <= 0)
+	{
+		m_clients.erase(it);
+	}
+}
+
+/**
+ * @brief 请求到达时检查在途请求数和客户端的公平份额
+ * @param addr 客户端IPv4地址，网络字节序
+ * @return 允许返回true
+ */
+bool Admission::AdmitRequest(const unsigned int addr)
+{
+	if (m_max_inflight > 0 && m_inflight >= m_max_inflight)
+	{
+		g_rejected_inflight->Add();
+		return false;
+	}
+
+	Client &client = m_clients[addr];
+
+	// 在途请求超过上限的一半才按份额限制，空闲时一个客户端可以用满全部容量
+	if (m_max_inflight > 0 && m_inflight * 2 >= m_max_inflight)
+	{
+		int iclients = m_active_clients + (client.m_inflight == 0 ? 1 : 0);
+		int ishare = m_max_inflight / iclients;
+		if (ishare < 1)
+		{
+			ishare = 1;
+		}
+
+		if (client.m_inflight >= ishare)
+		{
+			g_rejected_client_inflight->Add();
+			return false;
+		}
+	}
+
+	if (client.m_inflight++ == 0)
+	{
+		m_active_clients++;
+	}
+	m_inflight++;
+	g_inflight->Add();
+
+	return true;
+}
+
+void Admission::ReleaseRequest(const unsigned int addr)
+{
+	unordered_map<unsigned int, Client>::iterator it = m_clients.find(addr);
+	if (it == m_clients.end())
+	{
+		return;
+	}
+
+	m_inflight--;
+	g_inflight->Sub();
+	if (--it->second.m_inflight == 0)
+	{
+		m_active_clients--;
+	}
+
+	if (it->second.m_conns <= 0 && it->second.m_inflight <= 0)
+	{
+		m_clients.erase(it);
+	}
+}
+
+/**
+ * @brief 按排队延迟判断是否拒绝
+ * @details 每个周期结束时，如果这个周期内的最小排队延迟超过目标值，说明队列
+ *          在整个周期内都没有排空，是持续的排队而不是突发，进入过载状态。
+ *          过载时排队超过目标值的请求被拒绝，否则只拒绝排队超过一个周期的请求。
+ * @param sojourn 排队时间，单位为纳秒
+ * @param now 当前时间，单位为纳秒
+ * @return 需要拒绝返回true
+ */
+bool Admission::ShedOnDequeue(const unsigned long sojourn, const unsigned long now)
+{
+	if (m_target <= 0)
+	{
+		return false;
+	}
+
+	if (now >= m_interval_end)
+	{
+		if (m_interval_end != 0)
+		{
+			m_boverloaded = (m_min_sojourn != ~0UL && m_min_sojourn > (unsigned long)m_target);
+			g_overloaded->Set(m_boverloaded ? 1 : 0);
+		}
+		m_min_sojourn = ~0UL;
+		m_interval_end = now + m_interval;
+	}
+
+	if (sojourn < m_min_sojourn)
+	{
+		m_min_sojourn = sojourn;
+	}
+
+	unsigned long timeout = m_boverloaded ? m_target : m_interval;
+	if (sojourn > timeout)
+	{
+		g_rejected_queue_delay->Add();
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,92 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+#include "public.h"
+
+/**
+ * @brief 服务端的准入控制
+ *
+ * 服务过载时，与其让请求在队列中越排越长、最后所有请求都超时，不如尽早
+ * 拒绝一部分请求，让其余的请求按正常的延迟完成。拒绝的请求立即收到一个
+ * "BUSY"应答，客户端可以换一台服务器重试。检查分为四层：
+ * - 连接数上限：总连接数和每个客户端IP的连接数
+ * - 在途请求数上限：排队中和处理中的请求总数
+ * - 按客户端公平分配：在途请求超过上限的一半时，每个客户端IP最多占用
+ *   上限除以活跃客户端数的份额，一个客户端发再多的请求也挤不掉其他客户端
+ * - 排队延迟：参考CoDel，一个周期内的最小排队延迟超过目标值说明队列
+ *   一直没有排空，进入过载状态，此后排队超过目标值的请求直接拒绝；
+ *   不过载时只拒绝排队超过一个周期的请求
+ *
+ * 过载时工作线程从队尾取请求（自适应LIFO），新请求优先，已经等了很久的
+ * 请求多半已经被客户端放弃，由排队延迟检查拒绝。
+ *
+ * 收到BUSY后立即重试的客户端会让服务端把所有时间都花在拒绝上，
+ * 所以被拒绝的连接要暂停m_reject_delay之后才继续读取。
+ *
+ * 本类不是线程安全的，由FrameServer在持有自己的锁时调用。
+ */
+class Admission
+{
+	public:
+		int  m_max_conns;              // 最大连接数，0表示不限制
+		int  m_max_conns_per_client;   // 每个客户端IP的最大连接数，0表示不限制
+		int  m_max_inflight;           // 最大在途请求数，0表示不限制
+		long m_target;                 // 排队延迟的目标值，单位为纳秒，0表示不按排队延迟拒绝
+		long m_interval;               // 计算最小排队延迟的周期，单位为纳秒
+		bool m_blifo;                  // 过载时是否先处理新请求
+		long m_reject_delay;           // 拒绝请求后暂停读取该连接的时间，单位为纳秒，0表示不暂停
+
+		Admission();
+
+		/*
+		 * 接受连接时调用，返回false时应该拒绝该连接
+		 * 返回true时连接被计入，关闭连接时必须调用ReleaseConn
+		 * */
+		bool AdmitConn(const unsigned int addr);
+
+		void ReleaseConn(const unsigned int addr);
+
+		/*
+		 * 连接上有请求到达时调用，返回false时应该拒绝该请求
+		 * 返回true时请求被计入，处理完成后必须调用ReleaseRequest
+		 * */
+		bool AdmitRequest(const unsigned int addr);
+
+		void ReleaseRequest(const unsigned int addr);
+
+		/*
+		 * 工作线程取出请求时调用，按排队延迟判断是否拒绝
+		 * sojourn 排队时间，now 当前时间，单位都为纳秒
+		 * */
+		bool ShedOnDequeue(const unsigned long sojourn, const unsigned long now);
+
+		/*
+		 * 是否处于排队延迟过载状态
+		 * */
+		bool Overloaded() const
+		{
+			return m_boverloaded;
+		}
+
+		int Inflight() const
+		{
+			return m_inflight;
+		}
+
+	private:
+		struct Client
+		{
+			int m_conns;
+			int m_inflight;
+		};
+
+		unordered_map<unsigned int, Client> m_clients;   // 按IPv4地址，只保存有连接的客户端
+		int  m_conns;
+		int  m_inflight;
+		int  m_active_clients;      // 有在途请求的客户端数
+
+		unsigned long m_interval_end;
+		unsigned long m_min_sojourn;
+		bool          m_boverloaded;
+};
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * 协程接口和每连接一个线程的阻塞接口的对比测试
+ *
+ * 同一进程内启动两套回显服务端：一套用TCPServer，每个连接一个线程；一套用CoListener，
+ * 连接分给--threads个调度器上的协程。客户端同样分两套，每个连接一问一答地发送报文，
+ * 阻塞版每个连接一个线程，协程版所有连接分布在--threads个调度器上。
+ *
+ * 用法：
+ *   bench_coro [选项]
+ *
+ * 选项：
+ *   --api thread,coro     要测试的接口
+ *   --sizes 64,4096       报文大小列表，单位为字节
+ *   --conns 16,256,1024   连接数列表
+ *   --threads 2           协程版服务端和客户端各自的调度器线程数
+ *   --duration 2          每组参数的测试时长，单位为秒
+ *   --output file         把JSON结果写到文件，缺省输出到标准输出
+ *
+ * 每组参数输出一行JSON，包括msgs/sec、p50/p99延迟（微秒）、测试进程的线程数和常驻内存。
+ * */
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+#include "coro.h"
+
+#define BENCH_MAX_SIZE (1024 * 1024)
+
+struct BenchOptions
+{
+	bool   m_bthread;
+	bool   m_bcoro;
+	vector<int> m_sizes;
+	vector<int> m_conns;
+	int    m_threads;
+	double m_duration;
+	char   m_output[301];
+};
+
+/*
+ * 每连接一个线程的服务端，和bench_tcp相同
+ * */
+static void *ThreadServerConn(void *arg)
+{
+	int fd = (int)(long)arg;
+	char *buffer = (char *)malloc(BENCH_MAX_SIZE);
+	int ilen;
+
+	while (buffer != 0 && TCPRead(fd, buffer, &ilen, 0, BENCH_MAX_SIZE) == true)
+	{
+		if (TCPWrite(fd, buffer, ilen) == false)
+		{
+			break;
+		}
+	}
+
+	close(fd);
+	free(buffer);
+
+	return 0;
+}
+
+static void *ThreadServerAccept(void *arg)
+{
+	TCPServer *server = (TCPServer *)arg;
+
+	while (server->Accept() == true)
+	{
+		long fd = server->m_clientfd;
+		server->m_clientfd = -1;
+
+		int sock_opt = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+
+		pthread_t tid;
+		if (pthread_create(&tid, 0, ThreadServerConn, (void *)fd) != 0)
+		{
+			close(fd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+
+	return 0;
+}
+
+/*
+ * 协程版服务端，接受连接的协程在第一个调度器上，连接轮流分给各个调度器
+ * */
+static CoTask<void> CoServerSession(int fd)
+{
+	CoConn conn;
+	if (conn.Attach(fd) == false)
+	{
+		close(fd);
+		co_return;
+	}
+
+	char *buffer = (char *)malloc(BENCH_MAX_SIZE);
+	int ilen;
+	while (buffer != 0 && co_await conn.ReadFrame(buffer, &ilen, BENCH_MAX_SIZE) == true)
+	{
+		if (co_await conn.WriteFrame(buffer, ilen) == false)
+		{
+			break;
+		}
+	}
+	free(buffer);
+}
+
+static CoTask<void> CoServerAccept(CoListener *listener, vector<CoScheduler *> *scheds)
+{
+	unsigned long next = 0;
+	while (true)
+	{
+		int fd = co_await listener->Accept();
+		if (fd == -1)
+		{
+			if (listener->m_listenfd == -1)
+			{
+				break;
+			}
+			co_await CoSleep(CoDeadline(10));
+			continue;
+		}
+
+		(*scheds)[next++ % scheds->size()]->Spawn(CoServerSession(fd));
+	}
+}
+
+/*
+ * 一组参数的客户端状态
+ * */
+struct ClientCase
+{
+	int              m_port;
+	int              m_size;
+	const char      *m_payload;
+	volatile bool    m_bgo;         // 所有连接建立之后才开始计时，连接风暴不计入结果
+	volatile bool    m_bstop;
+	int              m_connected;   // 已经建立的连接数，原子访问
+	unsigned long    m_msgs;        // 原子累加
+	int              m_running;     // 还在运行的连接数，原子访问
+	int              m_errors;
+	MetricHistogram *m_hist;
+};
+
+static void *ThreadClientConn(void *arg)
+{
+	ClientCase *pcase = (ClientCase *)arg;
+	TCPClient client;
+	char *buffer = (char *)malloc(pcase->m_size);
+	unsigned long msgs = 0;
+	int ilen;
+
+	if (buffer == 0 || client.NewTCPClient("127.0.0.1", pcase->m_port) == false)
+	{
+		__atomic_add_fetch(&pcase->m_errors, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		int sock_opt = 1;
+		setsockopt(client.m_connfd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+
+		__atomic_add_fetch(&pcase->m_connected, 1, __ATOMIC_RELEASE);
+		while (pcase->m_bgo == false && pcase->m_bstop == false)
+		{
+			usleep(1000);
+		}
+
+		while (pcase->m_bstop == false)
+		{
+			unsigned long start = MetricNow();
+			if (TCPWrite(client.m_connfd, pcase->m_payload, pcase->m_size) == false ||
+					TCPRead(client.m_connfd, buffer, &ilen, 0, pcase->m_size) == false)
+			{
+				__atomic_add_fetch(&pcase->m_errors, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			pcase->m_hist->Record(MetricNow() - start);
+			msgs++;
+		}
+	}
+
+	client.Close();
+	free(buffer);
+	__atomic_add_fetch(&pcase->m_msgs, msgs, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pcase->m_running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static CoTask<void> CoClientConn(ClientCase *pcase)
+{
+	CoConn conn;
+	char *buffer = (char *)malloc(pcase->m_size);
+	unsigned long msgs = 0;
+	int ilen;
+
+	if (buffer == 0 || co_await conn.Connect("127.0.0.1", pcase->m_port, CoDeadline(5000)) == false)
+	{
+		__atomic_add_fetch(&pcase->m_errors, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_add_fetch(&pcase->m_connected, 1, __ATOMIC_RELEASE);
+		while (pcase->m_bgo == false && pcase->m_bstop == false)
+		{
+			co_await CoSleep(CoDeadline(1));
+		}
+
+		while (pcase->m_bstop == false)
+		{
+			unsigned long start = MetricNow();
+			if (co_await conn.WriteFrame(pcase->m_payload, pcase->m_size) == false ||
+					co_await conn.ReadFrame(buffer, &ilen, pcase->m_size) == false)
+			{
+				__atomic_add_fetch(&pcase->m_errors, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			pcase->m_hist->Record(MetricNow() - start);
+			msgs++;
+		}
+	}
+
+	conn.Close();
+	free(buffer);
+	__atomic_add_fetch(&pcase->m_msgs, msgs, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pcase->m_running, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 从/proc/self/status读取一项，单位为kB或者个
+ * */
+static long ProcStatus(const char *key)
+{
+	FILE *fp = fopen("/proc/self/status", "r");
+	if (fp == 0)
+	{
+		return -1;
+	}
+
+	char line[256];
+	long value = -1;
+	size_t ikeylen = strlen(key);
+	while (fgets(line, sizeof(line), fp) != 0)
+	{
+		if (strncmp(line, key, ikeylen) == 0 && line[ikeylen] == ':')
+		{
+			value = atol(line + ikeylen + 1);
+			break;
+		}
+	}
+	fclose(fp);
+
+	return value;
+}
+
+/*
+ * 运行一组参数，输出一行JSON
+ * */
+static bool RunCase(const BenchOptions &opts, bool bcoro, int iport, vector<CoScheduler *> &client_scheds,
+		const char *payload, int isize, int iconns, FILE *out, bool bfirst)
+{
+	ClientCase ccase;
+	ccase.m_port = iport;
+	ccase.m_size = isize;
+	ccase.m_payload = payload;
+	ccase.m_bgo = false;
+	ccase.m_bstop = false;
+	ccase.m_connected = 0;
+	ccase.m_msgs = 0;
+	ccase.m_running = iconns;
+	ccase.m_errors = 0;
+	ccase.m_hist = new MetricHistogram;
+
+	for (int i = 0; i < iconns; i++)
+	{
+		if (bcoro == true)
+		{
+			client_scheds[i % client_scheds.size()]->Spawn(CoClientConn(&ccase));
+			continue;
+		}
+
+		pthread_t tid;
+		if (pthread_create(&tid, 0, ThreadClientConn, &ccase) != 0)
+		{
+			__atomic_add_fetch(&ccase.m_errors, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&ccase.m_running, 1, __ATOMIC_RELEASE);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+
+	// 等所有连接建立或者失败，最多30秒
+	unsigned long connect_deadline = MetricNow() + 30000000000UL;
+	while (__atomic_load_n(&ccase.m_connected, __ATOMIC_ACQUIRE) + __atomic_load_n(&ccase.m_errors, __ATOMIC_ACQUIRE) < iconns &&
+			MetricNow() < connect_deadline)
+	{
+		usleep(1000);
+	}
+
+	unsigned long start = MetricNow();
+	ccase.m_bgo = true;
+
+	// 测试进行到一半时采样线程数和内存
+	usleep((useconds_t)(opts.m_duration * 500000));
+	long threads = ProcStatus("Threads");
+	long rss_kb = ProcStatus("VmRSS");
+	usleep((useconds_t)(opts.m_duration * 500000));
+
+	ccase.m_bstop = true;
+	while (__atomic_load_n(&ccase.m_running, __ATOMIC_ACQUIRE) > 0)
+	{
+		usleep(1000);
+	}
+	double seconds = (MetricNow() - start) / 1e9;
+
+	// 等服务端的连接线程或者协程退出，下一组参数的线程数和内存不受影响
+	usleep(100000);
+
+	bool bok = ccase.m_errors == 0;
+	fprintf(out, "%s    {\"api\": \"%s\", \"size\": %d, \"conns\": %d, \"threads\": %ld, \"rss_kb\": %ld, "
+			"\"seconds\": %.3f, \"msgs\": %lu, \"msgs_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"errors\": %d, \"ok\": %s}",
+			bfirst ? "" : ",\n", bcoro ? "coro" : "thread", isize, iconns, threads, rss_kb,
+			seconds, ccase.m_msgs, ccase.m_msgs / seconds,
+			ccase.m_hist->Percentile(0.50) / 1e3, ccase.m_hist->Percentile(0.99) / 1e3,
+			ccase.m_errors, bok ? "true" : "false");
+	fflush(out);
+
+	delete ccase.m_hist;
+
+	return bok;
+}
+
+static void ParseList(const char *str, vector<int> &list)
+{
+	list.clear();
+	while (str != 0 && *str != 0)
+	{
+		list.push_back(atoi(str));
+		str = strchr(str, ',');
+		if (str != 0)
+		{
+			str++;
+		}
+	}
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--api thread,coro] [--sizes a,b] [--conns a,b] [--threads n] "
+			"[--duration sec] [--output file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	opts.m_bthread = true;
+	opts.m_bcoro = true;
+	ParseList("64,4096", opts.m_sizes);
+	ParseList("16,256,1024", opts.m_conns);
+	opts.m_threads = 2;
+	opts.m_duration = 2;
+	opts.m_output[0] = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--api") == 0)
+		{
+			i++;
+			opts.m_bthread = strstr(argv[i], "thread") != 0;
+			opts.m_bcoro = strstr(argv[i], "coro") != 0;
+		}
+		else if (strcmp(argv[i], "--sizes") == 0)
+		{
+			ParseList(argv[++i], opts.m_sizes);
+		}
+		else if (strcmp(argv[i], "--conns") == 0)
+		{
+			ParseList(argv[++i], opts.m_conns);
+		}
+		else if (strcmp(argv[i], "--threads") == 0)
+		{
+			opts.m_threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--duration") == 0)
+		{
+			opts.m_duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0)
+		{
+			snprintf(opts.m_output, sizeof(opts.m_output), "%s", argv[++i]);
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.m_threads <= 0)
+	{
+		opts.m_threads = 1;
+	}
+
+	int imax_size = 0;
+	for (size_t k = 0; k < opts.m_sizes.size(); k++)
+	{
+		if (opts.m_sizes[k] <= 0 || opts.m_sizes[k] > BENCH_MAX_SIZE)
+		{
+			fprintf(stderr, "message size must be between 1 and %d\n", BENCH_MAX_SIZE);
+			return 1;
+		}
+		imax_size = opts.m_sizes[k] > imax_size ? opts.m_sizes[k] : imax_size;
+	}
+
+	// 客户端和服务端在同一进程内，每个连接占两个fd
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// 阻塞版服务端
+	TCPServer server;
+	int ithread_port = 0;
+	for (int iport = 25000 + getpid() % 10000; ithread_port == 0 && iport < 65000; iport++)
+	{
+		if (server.NewServer(iport, 4096) == true)
+		{
+			ithread_port = iport;
+		}
+	}
+
+	// 协程版服务端和客户端
+	CoListener listener;
+	int icoro_port = 0;
+	for (int iport = ithread_port + 1; icoro_port == 0 && iport < 65000; iport++)
+	{
+		if (listener.Listen(iport, 4096) == true)
+		{
+			icoro_port = iport;
+		}
+	}
+
+	if (ithread_port == 0 || icoro_port == 0)
+	{
+		fprintf(stderr, "listen failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	pthread_t server_tid;
+	pthread_create(&server_tid, 0, ThreadServerAccept, &server);
+	pthread_detach(server_tid);
+
+	vector<CoScheduler *> server_scheds;
+	vector<CoScheduler *> client_scheds;
+	for (int i = 0; i < opts.m_threads; i++)
+	{
+		server_scheds.push_back(new CoScheduler);
+		client_scheds.push_back(new CoScheduler);
+		if (server_scheds.back()->Start() == false || client_scheds.back()->Start() == false)
+		{
+			fprintf(stderr, "start scheduler failed: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	server_scheds[0]->Spawn(CoServerAccept(&listener, &server_scheds));
+
+	FILE *out = stdout;
+	if (opts.m_output[0] != 0 && (out = fopen(opts.m_output, "w")) == 0)
+	{
+		fprintf(stderr, "open %s failed: %s\n", opts.m_output, strerror(errno));
+		return 1;
+	}
+
+	char *payload = (char *)malloc(imax_size);
+	for (int k = 0; k < imax_size; k++)
+	{
+		payload[k] = 'a' + k % 26;
+	}
+
+	time_t now = time(0);
+	char stime[21];
+	memset(stime, 0, sizeof(stime));
+	strftime(stime, sizeof(stime), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	fprintf(out, "{\n  \"benchmark\": \"coro_vs_thread\",\n  \"time\": \"%s\",\n  \"sched_threads\": %d,\n"
+			"  \"duration\": %.3f,\n  \"results\": [\n",
+			stime, opts.m_threads, opts.m_duration);
+
+	bool bok = true;
+	bool bfirst = true;
+	for (size_t a = 0; a < opts.m_sizes.size(); a++)
+	{
+		for (size_t b = 0; b < opts.m_conns.size(); b++)
+		{
+			for (int c = 0; c < 2; c++)
+			{
+				bool bcoro = (c == 1);
+				if ((bcoro == true && opts.m_bcoro == false) || (bcoro == false && opts.m_bthread == false))
+				{
+					continue;
+				}
+
+				if (RunCase(opts, bcoro, bcoro ? icoro_port : ithread_port, client_scheds,
+							payload, opts.m_sizes[a], opts.m_conns[b], out, bfirst) == false)
+				{
+					bok = false;
+				}
+				bfirst = false;
+			}
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+	free(payload);
+
+	// 协程版服务端的会话还挂在调度器上，直接退出进程
+	fflush(stderr);
+	_exit(bok ? 0 : 1);
+}
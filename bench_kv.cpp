@@ -0,0 +1,367 @@
+/*
+ * 键值缓存的压测客户端，连接到打开了kv的moserver
+ *
+ * 用法：
+ *   bench_kv [选项]
+ *
+ * 选项：
+ *   --host 127.0.0.1      服务端地址
+ *   --port 5005           服务端端口
+ *   --conns 4             连接数，每个连接一个线程，一问一答
+ *   --keys 100000         键的个数
+ *   --value-size 100      值的大小，单位为字节
+ *   --get-ratio 0.9       读操作的比例，其余为SET
+ *   --mget 0              大于0时读操作用MGET，一次读这么多个键
+ *   --skew 1              键的分布，1为均匀分布，越大越集中在编号小的键上
+ *   --fill 1              读没有命中时是否SET这个键（旁路缓存的用法），0为不SET
+ *   --duration 5          测试时长，单位为秒
+ *   --output file         把JSON结果写到文件，缺省输出到标准输出
+ *
+ * 输出一个JSON对象，包括ops/sec、命中率和p50/p99延迟（微秒），
+ * MGET的一次请求算一个操作，命中率按键计算。
+ * */
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+
+#define BENCH_MAX_REPLY (4 * 1024 * 1024)
+
+struct BenchOptions
+{
+	char   m_host[64];
+	int    m_port;
+	int    m_conns;
+	int    m_keys;
+	int    m_value_size;
+	double m_get_ratio;
+	int    m_mget;
+	double m_skew;
+	bool   m_bfill;
+	double m_duration;
+	char   m_output[301];
+};
+
+struct BenchConn
+{
+	const BenchOptions *m_opts;
+	MetricHistogram    *m_hist;
+	bool                m_bstop;
+	unsigned long       m_ops;
+	unsigned long       m_gets;     // 读的键数
+	unsigned long       m_hits;
+	unsigned long       m_sets;
+	int                 m_errors;
+};
+
+static unsigned long NextRand(unsigned long *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/*
+ * 按--skew选一个键，u在[0,1)上均匀分布，u的skew次方集中在0附近
+ * */
+static int PickKey(const BenchOptions *opts, unsigned long *state)
+{
+	double u = (NextRand(state) >> 11) * (1.0 / 9007199254740992.0);
+	if (opts->m_skew != 1)
+	{
+		u = pow(u, opts->m_skew);
+	}
+	int ikey = (int)(u * opts->m_keys);
+	return ikey < opts->m_keys ? ikey : opts->m_keys - 1;
+}
+
+static int FormatKey(char *buffer, const int ikey)
+{
+	return sprintf(buffer, "key:%08d", ikey);
+}
+
+static bool DoSet(TCPClient *client, const BenchOptions *opts, char *request, const int ikey)
+{
+	int ilen = sprintf(request, "SET ");
+	ilen += FormatKey(request + ilen, ikey);
+	request[ilen++] = ' ';
+	memset(request + ilen, 'v', opts->m_value_size);
+	ilen += opts->m_value_size;
+
+	return client->WriteBuffer(request, ilen) == true;
+}
+
+static void *ConnThread(void *arg)
+{
+	BenchConn *conn = (BenchConn *)arg;
+	const BenchOptions *opts = conn->m_opts;
+
+	TCPClient client;
+	client.m_profile.m_bnodelay = true;
+	if (client.NewTCPClient(opts->m_host, opts->m_port) == false)
+	{
+		conn->m_errors++;
+		return 0;
+	}
+
+	int imget = opts->m_mget > 0 ? opts->m_mget : 1;
+	char *request = (char *)malloc(16 + (size_t)imget * 16 + opts->m_value_size);
+	char *reply = (char *)malloc(BENCH_MAX_REPLY);
+	unsigned long state = 0x9e3779b97f4a7c15UL ^ ((unsigned long)pthread_self() * 0xff51afd7ed558ccdUL);
+	unsigned int get_threshold = (unsigned int)(opts->m_get_ratio * 4294967295.0);
+	vector<int> keys(imget);
+	vector<int> misses;
+
+	while (__atomic_load_n(&conn->m_bstop, __ATOMIC_RELAXED) == false)
+	{
+		unsigned long start = MetricNow();
+		bool bget = (unsigned int)NextRand(&state) <= get_threshold;
+
+		if (bget == false)
+		{
+			if (DoSet(&client, opts, request, PickKey(opts, &state)) == false || client.ReadBuffer(reply, 0, BENCH_MAX_REPLY) == false)
+			{
+				conn->m_errors++;
+				break;
+			}
+			conn->m_sets++;
+		}
+		else if (opts->m_mget > 0)
+		{
+			int ilen = sprintf(request, "MGET");
+			for (int i = 0; i < imget; i++)
+			{
+				keys[i] = PickKey(opts, &state);
+				request[ilen++] = ' ';
+				ilen += FormatKey(request + ilen, keys[i]);
+			}
+			if (client.WriteBuffer(request, ilen) == false || client.ReadBuffer(reply, 0, BENCH_MAX_REPLY) == false ||
+					client.m_buffer_len < 3 || memcmp(reply, "OK ", 3) != 0)
+			{
+				conn->m_errors++;
+				break;
+			}
+
+			// 依次是每个键的长度和值
+			int off = 3;
+			misses.clear();
+			for (int i = 0; i < imget && off + 4 <= client.m_buffer_len; i++)
+			{
+				unsigned int nlen;
+				memcpy(&nlen, reply + off, 4);
+				off += 4;
+				if (nlen == 0xffffffff)
+				{
+					misses.push_back(keys[i]);
+				}
+				else
+				{
+					off += ntohl(nlen);
+					conn->m_hits++;
+				}
+			}
+			conn->m_gets += imget;
+			conn->m_hist->Record(MetricNow() - start);
+			conn->m_ops++;
+
+			for (size_t i = 0; opts->m_bfill == true && i < misses.size(); i++)
+			{
+				if (DoSet(&client, opts, request, misses[i]) == false || client.ReadBuffer(reply, 0, BENCH_MAX_REPLY) == false)
+				{
+					conn->m_errors++;
+					break;
+				}
+				conn->m_sets++;
+				conn->m_ops++;
+			}
+			continue;
+		}
+		else
+		{
+			int ikey = PickKey(opts, &state);
+			int ilen = sprintf(request, "GET ");
+			ilen += FormatKey(request + ilen, ikey);
+			if (client.WriteBuffer(request, ilen) == false || client.ReadBuffer(reply, 0, BENCH_MAX_REPLY) == false)
+			{
+				conn->m_errors++;
+				break;
+			}
+			conn->m_gets++;
+
+			bool bhit = client.m_buffer_len >= 3 && memcmp(reply, "OK ", 3) == 0;
+			if (bhit == true)
+			{
+				conn->m_hits++;
+			}
+			else if (opts->m_bfill == true)
+			{
+				conn->m_hist->Record(MetricNow() - start);
+				conn->m_ops++;
+				start = MetricNow();
+				if (DoSet(&client, opts, request, ikey) == false || client.ReadBuffer(reply, 0, BENCH_MAX_REPLY) == false)
+				{
+					conn->m_errors++;
+					break;
+				}
+				conn->m_sets++;
+			}
+		}
+
+		conn->m_hist->Record(MetricNow() - start);
+		conn->m_ops++;
+	}
+
+	free(request);
+	free(reply);
+	client.Close();
+
+	return 0;
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--host addr] [--port n] [--conns n] [--keys n] [--value-size n] "
+			"[--get-ratio r] [--mget n] [--skew s] [--fill 0|1] [--duration sec] [--output file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	snprintf(opts.m_host, sizeof(opts.m_host), "127.0.0.1");
+	opts.m_port = 5005;
+	opts.m_conns = 4;
+	opts.m_keys = 100000;
+	opts.m_value_size = 100;
+	opts.m_get_ratio = 0.9;
+	opts.m_mget = 0;
+	opts.m_skew = 1;
+	opts.m_bfill = true;
+	opts.m_duration = 5;
+	opts.m_output[0] = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--host") == 0)
+		{
+			snprintf(opts.m_host, sizeof(opts.m_host), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--port") == 0)
+		{
+			opts.m_port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--conns") == 0)
+		{
+			opts.m_conns = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--keys") == 0)
+		{
+			opts.m_keys = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--value-size") == 0)
+		{
+			opts.m_value_size = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--get-ratio") == 0)
+		{
+			opts.m_get_ratio = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--mget") == 0)
+		{
+			opts.m_mget = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--skew") == 0)
+		{
+			opts.m_skew = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--fill") == 0)
+		{
+			opts.m_bfill = atoi(argv[++i]) != 0;
+		}
+		else if (strcmp(argv[i], "--duration") == 0)
+		{
+			opts.m_duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0)
+		{
+			snprintf(opts.m_output, sizeof(opts.m_output), "%s", argv[++i]);
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.m_conns <= 0 || opts.m_keys <= 0 || opts.m_value_size < 0 || opts.m_mget < 0 ||
+			opts.m_mget > 1024 || opts.m_skew <= 0 ||
+			(long)(opts.m_mget > 0 ? opts.m_mget : 1) * (opts.m_value_size + 4) + 3 > BENCH_MAX_REPLY)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	MetricHistogram hist;
+	vector<BenchConn> conns(opts.m_conns);
+	vector<pthread_t> tids(opts.m_conns);
+	for (int i = 0; i < opts.m_conns; i++)
+	{
+		memset(&conns[i], 0, sizeof(BenchConn));
+		conns[i].m_opts = &opts;
+		conns[i].m_hist = &hist;
+		pthread_create(&tids[i], 0, ConnThread, &conns[i]);
+	}
+
+	unsigned long start = MetricNow();
+	usleep((useconds_t)(opts.m_duration * 1000000));
+	for (int i = 0; i < opts.m_conns; i++)
+	{
+		__atomic_store_n(&conns[i].m_bstop, true, __ATOMIC_RELAXED);
+	}
+	for (int i = 0; i < opts.m_conns; i++)
+	{
+		pthread_join(tids[i], 0);
+	}
+	double seconds = (MetricNow() - start) / 1e9;
+
+	unsigned long ops = 0, gets = 0, hits = 0, sets = 0;
+	int errors = 0;
+	for (int i = 0; i < opts.m_conns; i++)
+	{
+		ops += conns[i].m_ops;
+		gets += conns[i].m_gets;
+		hits += conns[i].m_hits;
+		sets += conns[i].m_sets;
+		errors += conns[i].m_errors;
+	}
+
+	FILE *out = stdout;
+	if (opts.m_output[0] != 0 && (out = fopen(opts.m_output, "w")) == 0)
+	{
+		fprintf(stderr, "open %s failed: %s\n", opts.m_output, strerror(errno));
+		return 1;
+	}
+
+	fprintf(out, "{\"benchmark\": \"kv\", \"conns\": %d, \"keys\": %d, \"value_size\": %d, \"get_ratio\": %.3f, "
+			"\"mget\": %d, \"skew\": %.2f, \"fill\": %s, \"seconds\": %.3f, \"ops\": %lu, \"ops_per_sec\": %.1f, "
+			"\"gets\": %lu, \"hits\": %lu, \"hit_rate\": %.4f, \"sets\": %lu, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"errors\": %d}\n",
+			opts.m_conns, opts.m_keys, opts.m_value_size, opts.m_get_ratio, opts.m_mget, opts.m_skew,
+			opts.m_bfill ? "true" : "false", seconds, ops, ops / seconds, gets, hits,
+			gets > 0 ? (double)hits / gets : 0.0, sets,
+			hist.Percentile(0.50) / 1e3, hist.Percentile(0.99) / 1e3, errors);
+
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * 日志吞吐量测试程序
+ * 分别用1、2、4、8、16、32个线程同时写日志，比较Log::WriteLog和Logger的吞吐量
+ * 用法：bench_log [每个线程写入的行数] [日志目录]
+ * */
+#include "public.h"
+#include "log.h"
+#include "logger.h"
+
+struct BenchArg
+{
+	Log    *plog;
+	Logger *plogger;
+	long    lines;
+};
+
+static double NowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *LogWorker(void *arg)
+{
+	BenchArg *parg = (BenchArg *)arg;
+
+	for (long i = 0; i < parg->lines; i++)
+	{
+		parg->plog->WriteLog("bench line %ld value=%d name=%s\n", i, (int)(i * 7), "moserver");
+	}
+
+	return 0;
+}
+
+static void *LoggerWorker(void *arg)
+{
+	BenchArg *parg = (BenchArg *)arg;
+
+	for (long i = 0; i < parg->lines; i++)
+	{
+		LOG_INFO(*parg->plogger, "bench line %ld value=%d name=%s\n", i, (int)(i * 7), "moserver");
+	}
+
+	return 0;
+}
+
+static double RunThreads(void *(*worker)(void *), BenchArg *parg, int ithreads)
+{
+	pthread_t tids[32];
+
+	double start = NowSeconds();
+	for (int i = 0; i < ithreads; i++)
+	{
+		pthread_create(&tids[i], 0, worker, parg);
+	}
+	for (int i = 0; i < ithreads; i++)
+	{
+		pthread_join(tids[i], 0);
+	}
+
+	return NowSeconds() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	long lines = 200000;
+	const char *dir = "/tmp/moserver_bench_log";
+
+	if (argc > 1)
+	{
+		lines = atol(argv[1]);
+	}
+	if (argc > 2)
+	{
+		dir = argv[2];
+	}
+
+	int thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+
+	printf("[\n");
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+	{
+		int ithreads = thread_counts[i];
+		char filename[301];
+
+		// Log::WriteLog，所有线程共用一把锁，每条日志都刷新
+		snprintf(filename, sizeof(filename), "%s/log_%d.log", dir, ithreads);
+		unlink(filename);
+		Log log;
+		log.OpenFile(filename, "a+", false, true);
+		BenchArg arg_log = { &log, 0, lines };
+		double log_seconds = RunThreads(LogWorker, &arg_log, ithreads);
+		log.CloseLogFile();
+
+		// Logger，每个线程有自己的缓冲区
+		snprintf(filename, sizeof(filename), "%s/logger_%d.log", dir, ithreads);
+		unlink(filename);
+		FileLogSink filesink;
+		filesink.OpenFile(filename, false);
+		double logger_seconds;
+		{
+			Logger logger;
+			logger.AddSink(&filesink);
+			logger.Start(100);
+			BenchArg arg_logger = { 0, &logger, lines };
+			logger_seconds = RunThreads(LoggerWorker, &arg_logger, ithreads);
+			double stop_start = NowSeconds();
+			logger.Stop();
+			logger_seconds += NowSeconds() - stop_start;
+		}
+
+		double total = (double)lines * ithreads;
+		printf("  {\"threads\": %d, \"log_lines_per_sec\": %.0f, \"logger_lines_per_sec\": %.0f}%s\n",
+				ithreads, total / log_seconds, total / logger_seconds,
+				i + 1 < sizeof(thread_counts) / sizeof(thread_counts[0]) ? "," : "");
+		fflush(stdout);
+	}
+	printf("]\n");
+
+	return 0;
+}
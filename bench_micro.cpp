@@ -0,0 +1,318 @@
+/*
+ * utils.cpp、format.cpp和log.cpp中常用函数、目录缓存以及限流、键值缓存、发布订阅的微基准测试
+ * 用法：bench_micro [--filter 名字] [--runs n] [--save 基线文件] [--compare 基线文件] [--json 文件]
+ * */
+#include "public.h"
+#include "utils.h"
+#include "log.h"
+#include "ratelimit.h"
+#include "broker.h"
+#include "kvcache.h"
+#include "metrics.h"
+#include "microbench.h"
+
+static const char *g_short_str = "moserver";
+static const char *g_long_str = "2026-10-19 12:00:00 moserver ingest pipeline record with a reasonably long payload field";
+
+static void BenchStrCopyShort(long iters, void *)
+{
+	char dest[128];
+	for (long i = 0; i < iters; i++)
+	{
+		StrCopy(dest, sizeof(dest), g_short_str);
+		DoNotOptimize(dest[0]);
+	}
+}
+
+static void BenchStrCopyLong(long iters, void *)
+{
+	char dest[128];
+	for (long i = 0; i < iters; i++)
+	{
+		StrCopy(dest, sizeof(dest), g_long_str);
+		DoNotOptimize(dest[0]);
+	}
+}
+
+static void BenchStrCat(long iters, void *)
+{
+	char dest[256];
+	for (long i = 0; i < iters; i++)
+	{
+		dest[0] = 0;
+		StrCat(dest, sizeof(dest), g_short_str);
+		StrCat(dest, sizeof(dest), g_long_str);
+		DoNotOptimize(dest[0]);
+	}
+}
+
+static void BenchStrTrim(long iters, void *)
+{
+	char str[128];
+	for (long i = 0; i < iters; i++)
+	{
+		memcpy(str, "     moserver ingest record     ", 33);
+		StrTrim(str, ' ');
+		DoNotOptimize(str[0]);
+	}
+}
+
+static void BenchTime2Str(long iters, void *)
+{
+	char stime[21];
+	time_t ltime = 1760000000;
+	for (long i = 0; i < iters; i++)
+	{
+		time2str(ltime + i, stime, "yyyy-mm-dd hh24:mi:ss");
+		DoNotOptimize(stime[0]);
+	}
+}
+
+static void BenchStr2Time(long iters, void *)
+{
+	for (long i = 0; i < iters; i++)
+	{
+		time_t ltime = str2time("2026-10-19 12:34:56");
+		DoNotOptimize(ltime);
+	}
+}
+
+static void BenchSNPrintf(long iters, void *)
+{
+	char dest[256];
+	for (long i = 0; i < iters; i++)
+	{
+		SNPrintf(dest, sizeof(dest), 255, "%s %d %ld %s", g_short_str, (int)i, i * 31, "payload");
+		DoNotOptimize(dest[0]);
+	}
+}
+
+static void BenchFormatTo(long iters, void *)
+{
+	char dest[256];
+	for (long i = 0; i < iters; i++)
+	{
+		int len = FormatTo(dest, sizeof(dest), "{} {} {} {}", g_short_str, (int)i, i * 31, "payload");
+		DoNotOptimize(len);
+	}
+}
+
+static void BenchSNPrintfFloat(long iters, void *)
+{
+	char dest[256];
+	for (long i = 0; i < iters; i++)
+	{
+		SNPrintf(dest, sizeof(dest), 255, "latency=%.3f ratio=%.3f", i * 0.001, 1.0 / (i + 1));
+		DoNotOptimize(dest[0]);
+	}
+}
+
+static void BenchFormatToFloat(long iters, void *)
+{
+	char dest[256];
+	for (long i = 0; i < iters; i++)
+	{
+		int len = FormatTo(dest, sizeof(dest), "latency={:.3f} ratio={:.3f}", i * 0.001, 1.0 / (i + 1));
+		DoNotOptimize(len);
+	}
+}
+
+// 日期分区的深层路径，目录已经缓存，不需要系统调用
+static void BenchMKdirDeep(long iters, void *arg)
+{
+	const char *filename = (const char *)arg;
+	for (long i = 0; i < iters; i++)
+	{
+		bool bok = MKdir(filename);
+		DoNotOptimize(bok);
+	}
+}
+
+static void BenchWriteLog(long iters, void *arg)
+{
+	Log *plog = (Log *)arg;
+	for (long i = 0; i < iters; i++)
+	{
+		plog->WriteLog("ingest record %ld status=%d name=%s\n", i, (int)(i & 7), g_short_str);
+	}
+}
+
+static void BenchLogFormat(long iters, void *arg)
+{
+	Log *plog = (Log *)arg;
+	for (long i = 0; i < iters; i++)
+	{
+		plog->Format("ingest record {} status={} name={}\n", i, (int)(i & 7), g_short_str);
+	}
+}
+
+// 1024个客户端轮流访问，表中都能放下，测查找和令牌桶的开销，时间由调用者传入
+static void BenchRateLimitHit(long iters, void *arg)
+{
+	RateLimiter *limiter = (RateLimiter *)arg;
+	unsigned long now = MetricNow();
+	for (long i = 0; i < iters; i++)
+	{
+		bool ballow = limiter->Allow((unsigned long)(i & 1023) * 0x9e3779b97f4a7c15UL + 1, 64, now + i * 100);
+		DoNotOptimize(ballow);
+	}
+}
+
+// 每次都是新的客户端，每次查找都要淘汰一个
+static void BenchRateLimitEvict(long iters, void *arg)
+{
+	RateLimiter *limiter = (RateLimiter *)arg;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	static unsigned int ip = 0;
+	for (long i = 0; i < iters; i++)
+	{
+		addr.sin_addr.s_addr = htonl(++ip);
+		bool ballow = limiter->Allow((const struct sockaddr *)&addr, 64);
+		DoNotOptimize(ballow);
+	}
+}
+
+// 64个订阅者的对端都不读，socket和队列很快写满，测丢弃最旧消息的稳态下一次发布的开销
+static void BenchBrokerPublish(long iters, void *arg)
+{
+	Broker *broker = (Broker *)arg;
+	char payload[128];
+	memset(payload, 'q', sizeof(payload));
+	for (long i = 0; i < iters; i++)
+	{
+		int icount = broker->Publish("bench", payload, sizeof(payload));
+		DoNotOptimize(icount);
+	}
+}
+
+// 键事先格式化好，不计入snprintf的开销
+static char g_kv_keys[200000][13];
+
+// 10万个键都在缓存中，测散列、探测和拷贝值的开销
+static void BenchKVGet(long iters, void *arg)
+{
+	KVCache *cache = (KVCache *)arg;
+	string value;
+	for (long i = 0; i < iters; i++)
+	{
+		value.clear();
+		bool bhit = cache->Get(g_kv_keys[(i * 7919) % 100000], 12, value);
+		DoNotOptimize(bhit);
+	}
+}
+
+// 容量只够一半的键，稳态下每次写入都要淘汰
+static void BenchKVSetEvict(long iters, void *arg)
+{
+	KVCache *cache = (KVCache *)arg;
+	char value[100];
+	memset(value, 'v', sizeof(value));
+	static long next = 0;
+	for (long i = 0; i < iters; i++)
+	{
+		bool bok = cache->Set(g_kv_keys[next++ % 200000], 12, value, sizeof(value));
+		DoNotOptimize(bok);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char buffered_file[64];
+	char unbuffered_file[64];
+	snprintf(buffered_file, sizeof(buffered_file), "/tmp/bench_micro_%d_buffered.log", getpid());
+	snprintf(unbuffered_file, sizeof(unbuffered_file), "/tmp/bench_micro_%d_unbuffered.log", getpid());
+
+	// 关闭日志切换，只测写入本身
+	Log buffered_log;
+	buffered_log.OpenFile(buffered_file, "w", false, true);
+	Log unbuffered_log;
+	unbuffered_log.OpenFile(unbuffered_file, "w", false, false);
+
+	RateLimiter hit_limiter;
+	hit_limiter.Init(4096);
+	hit_limiter.SetFrameRate(1000000, 1000);
+	hit_limiter.SetByteRate(100000000, 1000000);
+	RateLimiter evict_limiter;
+	evict_limiter.Init(4096);
+	evict_limiter.SetFrameRate(1000000, 1000);
+
+	Broker broker;
+	broker.Start();
+	int peers[64];
+	for (int i = 0; i < 64; i++)
+	{
+		int sv[2];
+		peers[i] = -1;
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0)
+		{
+			broker.Attach(broker.NewSub("bench", BROKER_DROP_OLDEST, 1024), sv[0]);
+			peers[i] = sv[1];
+		}
+	}
+
+	for (int i = 0; i < 200000; i++)
+	{
+		snprintf(g_kv_keys[i], sizeof(g_kv_keys[i]), "key:%08d", i);
+	}
+	KVCache hit_cache;
+	hit_cache.Init(64 * 1024 * 1024, 4);
+	for (int i = 0; i < 100000; i++)
+	{
+		hit_cache.Set(g_kv_keys[i], 12, "0123456789abcdef0123456789abcdef", 32);
+	}
+	KVCache evict_cache;
+	evict_cache.Init(16 * 1024 * 1024, 4);
+
+	char deep_file[128];
+	snprintf(deep_file, sizeof(deep_file), "/tmp/bench_micro_%d/2026/10/19/12/part-00000.log", getpid());
+	MKdir(deep_file);
+
+	MicroBenchRunner runner;
+	runner.Add("StrCopy/short", BenchStrCopyShort);
+	runner.Add("StrCopy/long", BenchStrCopyLong);
+	runner.Add("StrCat", BenchStrCat);
+	runner.Add("StrTrim", BenchStrTrim);
+	runner.Add("time2str", BenchTime2Str);
+	runner.Add("str2time", BenchStr2Time);
+	runner.Add("SNPrintf", BenchSNPrintf);
+	runner.Add("FormatTo", BenchFormatTo);
+	runner.Add("SNPrintf/float", BenchSNPrintfFloat);
+	runner.Add("FormatTo/float", BenchFormatToFloat);
+	runner.Add("MKdir/deep", BenchMKdirDeep, deep_file);
+	runner.Add("RateLimiter::Allow/hit", BenchRateLimitHit, &hit_limiter);
+	runner.Add("RateLimiter::Allow/evict", BenchRateLimitEvict, &evict_limiter);
+	runner.Add("KVCache::Get/hit", BenchKVGet, &hit_cache);
+	runner.Add("KVCache::Set/evict", BenchKVSetEvict, &evict_cache);
+	runner.Add("Broker::Publish/64subs", BenchBrokerPublish, &broker);
+	runner.Add("Log::WriteLog/buffered", BenchWriteLog, &buffered_log);
+	runner.Add("Log::WriteLog/unbuffered", BenchWriteLog, &unbuffered_log);
+	runner.Add("Log::Format/buffered", BenchLogFormat, &buffered_log);
+
+	int iret = MicroBenchMain(runner, argc, argv);
+
+	broker.Stop();
+	for (int i = 0; i < 64; i++)
+	{
+		if (peers[i] != -1)
+		{
+			close(peers[i]);
+		}
+	}
+
+	buffered_log.CloseLogFile();
+	unbuffered_log.CloseLogFile();
+	unlink(buffered_file);
+	unlink(unbuffered_file);
+
+	// 从最深一级开始删掉MKdir/deep创建的目录，保留/tmp
+	char *slash;
+	while ((slash = strrchr(deep_file, '/')) != 0 && slash > deep_file + 4)
+	{
+		*slash = 0;
+		rmdir(deep_file);
+	}
+
+	return iret;
+}
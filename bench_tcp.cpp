@@ -0,0 +1,927 @@
+/*
+ * 套接字层回环测试程序，由回显/接收服务端和多线程压测客户端组成
+ *
+ * 用法：
+ *   bench_tcp server [选项]          只启动服务端
+ *   bench_tcp client [选项]          只启动客户端，连接到--host/--port
+ *   bench_tcp [选项]                 在同一进程内启动服务端和客户端
+ *
+ * 选项：
+ *   --host 127.0.0.1      服务端地址
+ *   --port 5005           服务端端口，0表示自动选择（仅同进程模式）
+ *   --mode echo|sink      echo为原样回显，sink为服务端只回1字节的确认
+ *   --sizes 16,4096,...   报文大小列表，单位为字节
+ *   --conns 1,4,16        连接数列表
+ *   --depth 1,16          每个连接的流水线深度（同时在途的报文个数）
+ *   --duration 2          每组参数的测试时长，单位为秒
+ *   --busy-poll 0,50      客户端忙轮询的空转预算列表，单位为微秒，0表示不空转
+ *   --so-busy-poll 0      客户端socket的SO_BUSY_POLL，单位为微秒
+ *   --profile name        服务端和客户端的socket选项：default、low_latency、bulk_throughput，
+ *                         不指定时两端都只设置TCP_NODELAY
+ *   --output file         把JSON结果写到文件，缺省输出到标准输出
+ *   --endpoints list|n    多后端模式，list为逗号分隔的"主机:端口"，同进程模式下也可以是后端的个数n，
+ *                         在n个端口上各启动一个服务端。每个连接数启动同样多的线程，每个线程用
+ *                         LBClient同步收发（流水线深度固定为1，忽略--depth和--busy-poll）
+ *   --lb p2c|ewma|jump|maglev  多后端模式的选择策略，缺省ewma
+ *   --keys 10000          jump和maglev策略下随机选择的键的个数
+ *   --hedge 0,1           多后端模式是否用CallHedged对冲请求的列表
+ *   --deadline-ms 0       CallHedged的截止时间，随请求发给服务端，0为没有截止时间
+ *   --delay pct:us        服务端的故障注入，pct%的请求在处理前随机停顿us/2到us微秒，
+ *                         停顿之后已经过了截止时间的请求应答EXPIRED，不再处理
+ *   --delay-servers n     同进程的多后端模式下只有前n个服务端注入停顿，缺省全部
+ *
+ * 每组参数输出一行JSON，包括msgs/sec、MB/sec和p50/p99/p99.9延迟（微秒），
+ * 延迟取自对数线性直方图，相对误差不超过12.5%。服务端过载时应答的BUSY单独计数，
+ * 不计入延迟和MB/sec，goodput为扣除BUSY之后的每秒报文数。
+ * cpu_pct为整个进程（同进程模式包括服务端）的CPU占用，read_cpu_pct为客户端所有接收线程
+ * 的CPU占用之和，都用getrusage统计，100表示一个核。
+ * 多后端模式另外输出每个后端的请求数、失败数和延迟的EWMA，用来检查请求的分布，
+ * 以及对冲请求的个数、对冲请求先到的次数和收到EXPIRED应答的个数。
+ * */
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+#include "lbclient.h"
+
+#define BENCH_MAX_SIZE (4 * 1024 * 1024)
+
+struct BenchOptions
+{
+	char   m_host[64];
+	int    m_port;
+	bool   m_bsink;
+	vector<int> m_sizes;
+	vector<int> m_conns;
+	vector<int> m_depths;
+	vector<int> m_spins;
+	int    m_so_busy_poll;
+	char   m_profile_name[32];   // 为空时两端只设置TCP_NODELAY
+	SocketProfile m_profile;
+	double m_duration;
+	char   m_output[301];
+	char   m_endpoints[1024];    // 为空时连接--host/--port
+	LBPolicy m_lb_policy;
+	int    m_keys;
+	vector<int> m_hedges;
+	int    m_deadline_ms;
+	double m_delay_pct;          // 服务端注入停顿的请求的百分比
+	int    m_delay_us;
+	int    m_delay_servers;      // 0为全部
+};
+
+/*
+ * 服务端
+ * */
+struct ServerConnArg
+{
+	int    m_fd;
+	bool   m_bsink;
+	double m_delay_pct;
+	int    m_delay_us;
+};
+
+/*
+ * 普通报文用普通报文应答，扩展报文用扩展报文应答并带回请求id
+ * */
+static void *ServerConnThread(void *arg)
+{
+	ServerConnArg *parg = (ServerConnArg *)arg;
+	char *buffer = (char *)malloc(BENCH_MAX_SIZE);
+	unsigned int seed = (unsigned int)(MetricNow() ^ parg->m_fd);
+	TCPFrameMeta meta;
+	int ilen;
+
+	while (buffer != 0 && TCPReadEx(parg->m_fd, buffer, &ilen, &meta, 0, BENCH_MAX_SIZE) == true)
+	{
+		// 模拟处理前的停顿，例如调度延迟或者GC
+		if (parg->m_delay_us > 0 && rand_r(&seed) % 1000000 < parg->m_delay_pct * 10000)
+		{
+			usleep(parg->m_delay_us / 2 + rand_r(&seed) % (parg->m_delay_us / 2 + 1));
+		}
+
+		const char *reply = buffer;
+		int ireply_len = ilen;
+		if (meta.m_deadline != 0 && MetricNow() >= meta.m_deadline)
+		{
+			reply = "EXPIRED";
+			ireply_len = 7;
+		}
+		else if (parg->m_bsink == true)
+		{
+			reply = "k";
+			ireply_len = 1;
+		}
+
+		bool bret;
+		if (meta.m_bext == true)
+		{
+			meta.m_deadline = 0;
+			bret = TCPWriteEx(parg->m_fd, reply, ireply_len, meta);
+		}
+		else
+		{
+			bret = TCPWrite(parg->m_fd, reply, ireply_len);
+		}
+
+		if (bret == false)
+		{
+			break;
+		}
+	}
+
+	close(parg->m_fd);
+	free(buffer);
+	delete parg;
+
+	return 0;
+}
+
+struct ServerArg
+{
+	TCPServer *m_server;
+	bool       m_bsink;
+	bool       m_bnodelay;   // 没有指定--profile时自己设置TCP_NODELAY
+	double     m_delay_pct;
+	int        m_delay_us;
+};
+
+static void *ServerAcceptThread(void *arg)
+{
+	ServerArg *parg = (ServerArg *)arg;
+
+	while (parg->m_server->Accept() == true)
+	{
+		ServerConnArg *pconn = new ServerConnArg;
+		pconn->m_fd = parg->m_server->m_clientfd;
+		pconn->m_bsink = parg->m_bsink;
+		pconn->m_delay_pct = parg->m_delay_pct;
+		pconn->m_delay_us = parg->m_delay_us;
+		parg->m_server->m_clientfd = -1;
+
+		if (parg->m_bnodelay == true)
+		{
+			int sock_opt = 1;
+			setsockopt(pconn->m_fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+		}
+
+		pthread_t tid;
+		if (pthread_create(&tid, 0, ServerConnThread, pconn) != 0)
+		{
+			close(pconn->m_fd);
+			delete pconn;
+			continue;
+		}
+		pthread_detach(tid);
+	}
+
+	return 0;
+}
+
+/*
+ * 客户端，每个连接一个发送线程和一个接收线程，最多depth个报文在途
+ * */
+struct ClientConn
+{
+	TCPClient        m_client;
+	int              m_size;
+	int              m_depth;
+	const char      *m_payload;
+	unsigned long   *m_send_ts;     // 在途报文的发送时间，按发送顺序循环使用
+	sem_t            m_window;
+	volatile bool    m_bstop;
+	volatile bool    m_bwriter_done;
+	volatile unsigned long m_sent;
+	volatile unsigned long m_received;
+	unsigned long    m_bytes;
+	unsigned long    m_busy;        // 服务端过载时拒绝请求的BUSY应答个数
+	bool             m_berror;
+	double           m_read_cpu;    // 接收线程的CPU时间，单位为秒
+	MetricHistogram *m_hist;
+};
+
+static double RusageSeconds(const int who)
+{
+	struct rusage ru;
+	if (getrusage(who, &ru) != 0)
+	{
+		return 0;
+	}
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *ClientWriterThread(void *arg)
+{
+	ClientConn *pconn = (ClientConn *)arg;
+
+	while (pconn->m_bstop == false)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (sem_timedwait(&pconn->m_window, &ts) != 0)
+		{
+			continue;
+		}
+
+		if (pconn->m_bstop == true)
+		{
+			break;
+		}
+
+		// 先计数再发送，否则回显可能在计数之前到达，接收线程会误以为没有在途报文
+		pconn->m_send_ts[pconn->m_sent % pconn->m_depth] = MetricNow();
+		__atomic_store_n(&pconn->m_sent, pconn->m_sent + 1, __ATOMIC_RELEASE);
+		if (TCPWrite(pconn->m_client.m_connfd, pconn->m_payload, pconn->m_size) == false)
+		{
+			pconn->m_berror = true;
+			break;
+		}
+	}
+
+	__atomic_store_n(&pconn->m_bwriter_done, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void *ClientReaderThread(void *arg)
+{
+	ClientConn *pconn = (ClientConn *)arg;
+	char *buffer = (char *)malloc(BENCH_MAX_SIZE);
+	int ilen;
+
+	while (buffer != 0)
+	{
+		unsigned long sent = __atomic_load_n(&pconn->m_sent, __ATOMIC_ACQUIRE);
+		if (pconn->m_received == sent)
+		{
+			if (__atomic_load_n(&pconn->m_bwriter_done, __ATOMIC_ACQUIRE) == true &&
+					__atomic_load_n(&pconn->m_sent, __ATOMIC_ACQUIRE) == pconn->m_received)
+			{
+				break;
+			}
+
+			// 没有在途报文，等一会再检查发送线程是否已经结束
+			struct pollfd pfd;
+			pfd.fd = pconn->m_client.m_connfd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 10) <= 0)
+			{
+				continue;
+			}
+		}
+
+		// 经过ReadBuffer，忙轮询模式下先空转等待
+		if (pconn->m_client.ReadBuffer(buffer, 0, BENCH_MAX_SIZE) == false)
+		{
+			pconn->m_berror = true;
+			break;
+		}
+		ilen = pconn->m_client.m_buffer_len;
+
+		if (ilen == 4 && pconn->m_size != 4 && memcmp(buffer, "BUSY", 4) == 0)
+		{
+			pconn->m_busy++;
+		}
+		else
+		{
+			pconn->m_hist->Record(MetricNow() - pconn->m_send_ts[pconn->m_received % pconn->m_depth]);
+			pconn->m_bytes += pconn->m_size;
+		}
+		__atomic_store_n(&pconn->m_received, pconn->m_received + 1, __ATOMIC_RELAXED);
+		sem_post(&pconn->m_window);
+	}
+
+	free(buffer);
+	pconn->m_read_cpu = RusageSeconds(RUSAGE_THREAD);
+
+	return 0;
+}
+
+/*
+ * 运行一组参数，输出一行JSON
+ * */
+static bool RunCase(const BenchOptions &opts, const char *payload, int isize, int iconns, int idepth, int ispin,
+		FILE *out, bool bfirst)
+{
+	vector<ClientConn *> conns;
+	MetricHistogram *hist = new MetricHistogram;
+	bool bok = true;
+
+	for (int i = 0; i < iconns; i++)
+	{
+		ClientConn *pconn = new ClientConn;
+		pconn->m_size = isize;
+		pconn->m_depth = idepth;
+		pconn->m_payload = payload;
+		pconn->m_send_ts = new unsigned long[idepth];
+		sem_init(&pconn->m_window, 0, idepth);
+		pconn->m_bstop = false;
+		pconn->m_bwriter_done = false;
+		pconn->m_sent = 0;
+		pconn->m_received = 0;
+		pconn->m_bytes = 0;
+		pconn->m_busy = 0;
+		pconn->m_berror = false;
+		pconn->m_read_cpu = 0;
+		pconn->m_hist = hist;
+		conns.push_back(pconn);
+
+		pconn->m_client.m_profile = opts.m_profile;
+		if (pconn->m_client.NewTCPClient(opts.m_host, opts.m_port) == false)
+		{
+			fprintf(stderr, "connect %s:%d failed: %s\n", opts.m_host, opts.m_port, strerror(errno));
+			bok = false;
+			break;
+		}
+
+		if (opts.m_profile_name[0] == 0)
+		{
+			int sock_opt = 1;
+			setsockopt(pconn->m_client.m_connfd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+		}
+
+		if ((ispin > 0 || opts.m_so_busy_poll > 0) &&
+				pconn->m_client.SetBusyPoll(ispin, opts.m_so_busy_poll) == false)
+		{
+			fprintf(stderr, "SO_BUSY_POLL %d failed: %s\n", opts.m_so_busy_poll, strerror(errno));
+		}
+	}
+
+	vector<pthread_t> tids;
+	unsigned long start = MetricNow();
+	double cpu_start = RusageSeconds(RUSAGE_SELF);
+	for (size_t i = 0; bok == true && i < conns.size(); i++)
+	{
+		pthread_t tid;
+		pthread_create(&tid, 0, ClientWriterThread, conns[i]);
+		tids.push_back(tid);
+		pthread_create(&tid, 0, ClientReaderThread, conns[i]);
+		tids.push_back(tid);
+	}
+
+	if (bok == true)
+	{
+		usleep((useconds_t)(opts.m_duration * 1000000));
+	}
+
+	for (size_t i = 0; i < conns.size(); i++)
+	{
+		conns[i]->m_bstop = true;
+		sem_post(&conns[i]->m_window);
+	}
+	for (size_t i = 0; i < tids.size(); i++)
+	{
+		pthread_join(tids[i], 0);
+	}
+	double seconds = (MetricNow() - start) / 1e9;
+	double cpu = RusageSeconds(RUSAGE_SELF) - cpu_start;
+
+	unsigned long msgs = 0;
+	double read_cpu = 0;
+	unsigned long bytes = 0;
+	unsigned long busy = 0;
+	for (size_t i = 0; i < conns.size(); i++)
+	{
+		msgs += conns[i]->m_received;
+		bytes += conns[i]->m_bytes;
+		busy += conns[i]->m_busy;
+		read_cpu += conns[i]->m_read_cpu;
+		if (conns[i]->m_berror == true)
+		{
+			bok = false;
+		}
+		conns[i]->m_client.Close();
+		sem_destroy(&conns[i]->m_window);
+		delete[] conns[i]->m_send_ts;
+		delete conns[i];
+	}
+
+	fprintf(out, "%s    {\"mode\": \"%s\", \"size\": %d, \"conns\": %d, \"depth\": %d, \"spin_us\": %d, "
+			"\"seconds\": %.3f, \"msgs\": %lu, \"msgs_per_sec\": %.1f, \"busy\": %lu, \"goodput_per_sec\": %.1f, "
+			"\"mb_per_sec\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, "
+			"\"cpu_pct\": %.1f, \"read_cpu_pct\": %.1f, \"ok\": %s}",
+			bfirst ? "" : ",\n", opts.m_bsink ? "sink" : "echo", isize, iconns, idepth, ispin,
+			seconds, msgs, msgs / seconds, busy, (msgs - busy) / seconds,
+			bytes / seconds / (1024.0 * 1024.0), hist->Percentile(0.50) / 1e3, hist->Percentile(0.99) / 1e3,
+			hist->Percentile(0.999) / 1e3, cpu / seconds * 100, read_cpu / seconds * 100, bok ? "true" : "false");
+	fflush(out);
+
+	delete hist;
+
+	return bok;
+}
+
+/*
+ * 多后端模式，每个线程用LBClient同步发送一个报文并等待应答
+ * */
+struct LBWorker
+{
+	LBClient        *m_lb;
+	const char      *m_payload;
+	int              m_size;
+	int              m_keys;
+	int              m_deadline_ms;
+	bool             m_bhedge;
+	volatile bool    m_bstop;
+	unsigned long    m_msgs;
+	unsigned long    m_errors;
+	unsigned long    m_expired;
+	MetricHistogram *m_hist;
+};
+
+static void *LBWorkerThread(void *arg)
+{
+	LBWorker *pworker = (LBWorker *)arg;
+	char *reply = (char *)malloc(BENCH_MAX_SIZE);
+	bool bkeyed = pworker->m_lb->m_policy == LB_JUMP_HASH || pworker->m_lb->m_policy == LB_MAGLEV;
+	unsigned int seed = (unsigned int)(MetricNow() ^ (unsigned long)pthread_self());
+	int ilen;
+
+	while (reply != 0 && pworker->m_bstop == false)
+	{
+		char key[32];
+		int klen = 0;
+		if (bkeyed == true)
+		{
+			klen = snprintf(key, sizeof(key), "key-%d", rand_r(&seed) % pworker->m_keys);
+		}
+
+		unsigned long start = MetricNow();
+		bool bok;
+		if (pworker->m_bhedge == true)
+		{
+			bok = pworker->m_lb->CallHedged(pworker->m_payload, pworker->m_size, reply, BENCH_MAX_SIZE, &ilen,
+					pworker->m_deadline_ms, bkeyed ? key : 0, klen);
+		}
+		else
+		{
+			bok = pworker->m_lb->Call(pworker->m_payload, pworker->m_size, reply, BENCH_MAX_SIZE, &ilen, bkeyed ? key : 0, klen);
+		}
+		if (bok == false)
+		{
+			pworker->m_errors++;
+			// 后端都不可用时不要空转
+			if (pworker->m_errors % 16 == 0)
+			{
+				usleep(1000);
+			}
+			continue;
+		}
+		if (ilen == 7 && pworker->m_size != 7 && memcmp(reply, "EXPIRED", 7) == 0)
+		{
+			pworker->m_expired++;
+			continue;
+		}
+		pworker->m_hist->Record(MetricNow() - start);
+		pworker->m_msgs++;
+	}
+
+	free(reply);
+
+	return 0;
+}
+
+static const char *LBPolicyName(const LBPolicy policy)
+{
+	switch (policy)
+	{
+		case LB_P2C_INFLIGHT:
+			return "p2c";
+		case LB_P2C_EWMA:
+			return "ewma";
+		case LB_JUMP_HASH:
+			return "jump";
+		case LB_MAGLEV:
+			return "maglev";
+	}
+
+	return "";
+}
+
+static bool RunLBCase(const BenchOptions &opts, const char *payload, int isize, int iconns, int ihedge, FILE *out,
+		bool bfirst)
+{
+	LBClient lb;
+	lb.m_policy = opts.m_lb_policy;
+	lb.m_profile = opts.m_profile;
+	if (opts.m_profile_name[0] == 0)
+	{
+		lb.m_profile.m_bnodelay = true;
+	}
+	if (lb.AddEndpoints(opts.m_endpoints) == false)
+	{
+		fprintf(stderr, "invalid endpoints: %s\n", opts.m_endpoints);
+		return false;
+	}
+
+	MetricHistogram *hist = new MetricHistogram;
+	vector<LBWorker> workers(iconns);
+	vector<pthread_t> tids(iconns);
+	unsigned long start = MetricNow();
+	for (int i = 0; i < iconns; i++)
+	{
+		workers[i].m_lb = &lb;
+		workers[i].m_payload = payload;
+		workers[i].m_size = isize;
+		workers[i].m_keys = opts.m_keys;
+		workers[i].m_deadline_ms = opts.m_deadline_ms;
+		workers[i].m_bhedge = ihedge != 0;
+		workers[i].m_expired = 0;
+		workers[i].m_bstop = false;
+		workers[i].m_msgs = 0;
+		workers[i].m_errors = 0;
+		workers[i].m_hist = hist;
+		pthread_create(&tids[i], 0, LBWorkerThread, &workers[i]);
+	}
+
+	usleep((useconds_t)(opts.m_duration * 1000000));
+	for (int i = 0; i < iconns; i++)
+	{
+		workers[i].m_bstop = true;
+	}
+	unsigned long msgs = 0;
+	unsigned long errors = 0;
+	unsigned long expired = 0;
+	for (int i = 0; i < iconns; i++)
+	{
+		pthread_join(tids[i], 0);
+		msgs += workers[i].m_msgs;
+		errors += workers[i].m_errors;
+		expired += workers[i].m_expired;
+	}
+	double seconds = (MetricNow() - start) / 1e9;
+
+	fprintf(out, "%s    {\"mode\": \"%s\", \"lb\": \"%s\", \"size\": %d, \"conns\": %d, \"hedge\": %d, "
+			"\"deadline_ms\": %d, \"seconds\": %.3f, \"msgs\": %lu, \"msgs_per_sec\": %.1f, \"errors\": %lu, "
+			"\"expired\": %lu, \"hedges\": %lu, \"hedge_wins\": %lu, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"p999_us\": %.3f, \"endpoints\": [",
+			bfirst ? "" : ",\n", opts.m_bsink ? "sink" : "echo", LBPolicyName(opts.m_lb_policy), isize, iconns, ihedge,
+			opts.m_deadline_ms, seconds, msgs, msgs / seconds, errors, expired, lb.Hedges(), lb.HedgeWins(),
+			hist->Percentile(0.50) / 1e3, hist->Percentile(0.99) / 1e3, hist->Percentile(0.999) / 1e3);
+	for (int i = 0; i < lb.Endpoints(); i++)
+	{
+		const LBEndpoint *endpoint = lb.Endpoint(i);
+		fprintf(out, "%s{\"endpoint\": \"%s:%d\", \"requests\": %lu, \"errors\": %lu, \"ewma_us\": %.3f}",
+				i == 0 ? "" : ", ", endpoint->m_host, endpoint->m_port, endpoint->m_requests, endpoint->m_errors,
+				endpoint->m_ewma_ns / 1e3);
+	}
+	fprintf(out, "], \"ok\": %s}", msgs > 0 ? "true" : "false");
+	fflush(out);
+
+	delete hist;
+
+	return msgs > 0;
+}
+
+static void ParseList(const char *str, vector<int> &list)
+{
+	list.clear();
+	while (str != 0 && *str != 0)
+	{
+		list.push_back(atoi(str));
+		str = strchr(str, ',');
+		if (str != 0)
+		{
+			str++;
+		}
+	}
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [server|client] [--host h] [--port p] [--mode echo|sink] "
+			"[--sizes a,b] [--conns a,b] [--depth a,b] [--duration sec] [--busy-poll a,b] [--so-busy-poll us] "
+			"[--profile name] [--output file] [--endpoints list|n] [--lb p2c|ewma|jump|maglev] [--keys n] "
+			"[--hedge a,b] [--deadline-ms ms] [--delay pct:us] [--delay-servers n]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	strcpy(opts.m_host, "127.0.0.1");
+	opts.m_port = 0;
+	opts.m_bsink = false;
+	ParseList("16,256,4096,65536,1048576,4194304", opts.m_sizes);
+	ParseList("1,4,16", opts.m_conns);
+	ParseList("1,16", opts.m_depths);
+	ParseList("0", opts.m_spins);
+	opts.m_so_busy_poll = 0;
+	opts.m_profile_name[0] = 0;
+	opts.m_duration = 1;
+	opts.m_output[0] = 0;
+	opts.m_endpoints[0] = 0;
+	opts.m_lb_policy = LB_P2C_EWMA;
+	opts.m_keys = 10000;
+	ParseList("0", opts.m_hedges);
+	opts.m_deadline_ms = 0;
+	opts.m_delay_pct = 0;
+	opts.m_delay_us = 0;
+	opts.m_delay_servers = 0;
+
+	const char *role = "all";
+	int i = 1;
+	if (argc > 1 && argv[1][0] != '-')
+	{
+		role = argv[1];
+		i = 2;
+	}
+
+	for (; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--host") == 0)
+		{
+			snprintf(opts.m_host, sizeof(opts.m_host), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--port") == 0)
+		{
+			opts.m_port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--mode") == 0)
+		{
+			opts.m_bsink = (strcmp(argv[++i], "sink") == 0);
+		}
+		else if (strcmp(argv[i], "--sizes") == 0)
+		{
+			ParseList(argv[++i], opts.m_sizes);
+		}
+		else if (strcmp(argv[i], "--conns") == 0)
+		{
+			ParseList(argv[++i], opts.m_conns);
+		}
+		else if (strcmp(argv[i], "--depth") == 0)
+		{
+			ParseList(argv[++i], opts.m_depths);
+		}
+		else if (strcmp(argv[i], "--duration") == 0)
+		{
+			opts.m_duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--busy-poll") == 0)
+		{
+			ParseList(argv[++i], opts.m_spins);
+		}
+		else if (strcmp(argv[i], "--so-busy-poll") == 0)
+		{
+			opts.m_so_busy_poll = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--profile") == 0)
+		{
+			snprintf(opts.m_profile_name, sizeof(opts.m_profile_name), "%s", argv[++i]);
+			if (SocketProfile::ByName(opts.m_profile_name, &opts.m_profile) == false)
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--output") == 0)
+		{
+			snprintf(opts.m_output, sizeof(opts.m_output), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--endpoints") == 0)
+		{
+			snprintf(opts.m_endpoints, sizeof(opts.m_endpoints), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--lb") == 0)
+		{
+			const char *name = argv[++i];
+			const LBPolicy policies[] = { LB_P2C_INFLIGHT, LB_P2C_EWMA, LB_JUMP_HASH, LB_MAGLEV };
+			size_t k = 0;
+			while (k < sizeof(policies) / sizeof(policies[0]) && strcmp(name, LBPolicyName(policies[k])) != 0)
+			{
+				k++;
+			}
+			if (k == sizeof(policies) / sizeof(policies[0]))
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+			opts.m_lb_policy = policies[k];
+		}
+		else if (strcmp(argv[i], "--keys") == 0)
+		{
+			opts.m_keys = atoi(argv[++i]);
+			if (opts.m_keys <= 0)
+			{
+				opts.m_keys = 1;
+			}
+		}
+		else if (strcmp(argv[i], "--hedge") == 0)
+		{
+			ParseList(argv[++i], opts.m_hedges);
+		}
+		else if (strcmp(argv[i], "--deadline-ms") == 0)
+		{
+			opts.m_deadline_ms = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--delay") == 0)
+		{
+			const char *spec = argv[++i];
+			const char *colon = strchr(spec, ':');
+			if (colon == 0)
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+			opts.m_delay_pct = atof(spec);
+			opts.m_delay_us = atoi(colon + 1);
+		}
+		else if (strcmp(argv[i], "--delay-servers") == 0)
+		{
+			opts.m_delay_servers = atoi(argv[++i]);
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	TCPServer server;
+	ServerArg server_arg;
+	pthread_t server_tid;
+	server.m_profile = opts.m_profile;
+
+	// 同进程的多后端模式，在连续的空闲端口上启动n个服务端
+	int iservers = (strcmp(role, "all") == 0 && opts.m_endpoints[0] != 0 && strchr(opts.m_endpoints, ':') == 0) ?
+		atoi(opts.m_endpoints) : 0;
+	vector<TCPServer *> lb_servers;
+	vector<ServerArg> lb_args(iservers > 0 ? iservers : 0);
+	if (iservers > 0)
+	{
+		string endpoints;
+		for (int iport = 25000 + getpid() % 10000; (int)lb_servers.size() < iservers && iport < 65000; iport++)
+		{
+			TCPServer *pserver = new TCPServer;
+			pserver->m_profile = opts.m_profile;
+			if (pserver->NewServer(iport) == false)
+			{
+				delete pserver;
+				continue;
+			}
+
+			ServerArg &arg = lb_args[lb_servers.size()];
+			arg.m_server = pserver;
+			arg.m_bsink = opts.m_bsink;
+			arg.m_bnodelay = opts.m_profile_name[0] == 0;
+			bool bdelay = opts.m_delay_servers == 0 || (int)lb_servers.size() < opts.m_delay_servers;
+			arg.m_delay_pct = bdelay ? opts.m_delay_pct : 0;
+			arg.m_delay_us = bdelay ? opts.m_delay_us : 0;
+			lb_servers.push_back(pserver);
+			pthread_create(&server_tid, 0, ServerAcceptThread, &arg);
+
+			endpoints += endpoints.empty() ? "" : ",";
+			endpoints += "127.0.0.1:" + to_string(iport);
+		}
+		if ((int)lb_servers.size() < iservers)
+		{
+			fprintf(stderr, "listen failed: %s\n", strerror(errno));
+			return 1;
+		}
+		snprintf(opts.m_endpoints, sizeof(opts.m_endpoints), "%s", endpoints.c_str());
+	}
+	else if (strcmp(role, "server") == 0 || strcmp(role, "all") == 0)
+	{
+		if (opts.m_port == 0 && strcmp(role, "all") == 0)
+		{
+			// 同进程模式在一个空闲端口上启动服务端
+			for (int iport = 25000 + getpid() % 10000; opts.m_port == 0 && iport < 65000; iport++)
+			{
+				if (server.NewServer(iport) == true)
+				{
+					opts.m_port = iport;
+				}
+			}
+		}
+		else if (server.NewServer(opts.m_port == 0 ? 5005 : opts.m_port) == true)
+		{
+			opts.m_port = opts.m_port == 0 ? 5005 : opts.m_port;
+		}
+		else
+		{
+			opts.m_port = 0;
+		}
+
+		if (opts.m_port == 0)
+		{
+			fprintf(stderr, "listen failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		server_arg.m_server = &server;
+		server_arg.m_bsink = opts.m_bsink;
+		server_arg.m_bnodelay = opts.m_profile_name[0] == 0;
+		server_arg.m_delay_pct = opts.m_delay_pct;
+		server_arg.m_delay_us = opts.m_delay_us;
+
+		if (strcmp(role, "server") == 0)
+		{
+			fprintf(stderr, "listening on port %d, mode %s\n", opts.m_port, opts.m_bsink ? "sink" : "echo");
+			ServerAcceptThread(&server_arg);
+			return 0;
+		}
+
+		pthread_create(&server_tid, 0, ServerAcceptThread, &server_arg);
+	}
+	else if (strcmp(role, "client") != 0)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+	else if (opts.m_port == 0)
+	{
+		opts.m_port = 5005;
+	}
+
+	FILE *out = stdout;
+	if (opts.m_output[0] != 0 && (out = fopen(opts.m_output, "w")) == 0)
+	{
+		fprintf(stderr, "open %s failed: %s\n", opts.m_output, strerror(errno));
+		return 1;
+	}
+
+	int imax_size = 0;
+	for (size_t k = 0; k < opts.m_sizes.size(); k++)
+	{
+		if (opts.m_sizes[k] <= 0 || opts.m_sizes[k] > BENCH_MAX_SIZE)
+		{
+			fprintf(stderr, "message size must be between 1 and %d\n", BENCH_MAX_SIZE);
+			return 1;
+		}
+		imax_size = opts.m_sizes[k] > imax_size ? opts.m_sizes[k] : imax_size;
+	}
+
+	char *payload = (char *)malloc(imax_size);
+	for (int k = 0; k < imax_size; k++)
+	{
+		payload[k] = 'a' + k % 26;
+	}
+
+	time_t now = time(0);
+	char stime[21];
+	memset(stime, 0, sizeof(stime));
+	strftime(stime, sizeof(stime), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+	fprintf(out, "{\n  \"benchmark\": \"tcp_loopback\",\n  \"time\": \"%s\",\n  \"host\": \"%s\",\n"
+			"  \"port\": %d,\n  \"profile\": \"%s\",\n  \"duration\": %.3f,\n",
+			stime, opts.m_host, opts.m_port, opts.m_profile_name[0] != 0 ? opts.m_profile_name : "nodelay", opts.m_duration);
+	if (opts.m_endpoints[0] != 0)
+	{
+		fprintf(out, "  \"endpoints\": \"%s\",\n", opts.m_endpoints);
+	}
+	fprintf(out, "  \"results\": [\n");
+
+	bool bok = true;
+	bool bfirst = true;
+	for (size_t a = 0; a < opts.m_sizes.size(); a++)
+	{
+		for (size_t b = 0; b < opts.m_conns.size() && opts.m_endpoints[0] != 0; b++)
+		{
+			for (size_t h = 0; h < opts.m_hedges.size(); h++)
+			{
+				if (RunLBCase(opts, payload, opts.m_sizes[a], opts.m_conns[b], opts.m_hedges[h], out, bfirst) == false)
+				{
+					bok = false;
+				}
+				bfirst = false;
+			}
+		}
+		for (size_t b = 0; b < opts.m_conns.size() && opts.m_endpoints[0] == 0; b++)
+		{
+			for (size_t c = 0; c < opts.m_depths.size(); c++)
+			{
+				for (size_t d = 0; d < opts.m_spins.size(); d++)
+				{
+					if (RunCase(opts, payload, opts.m_sizes[a], opts.m_conns[b], opts.m_depths[c], opts.m_spins[d],
+								out, bfirst) == false)
+					{
+						bok = false;
+					}
+					bfirst = false;
+				}
+			}
+		}
+	}
+
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+	free(payload);
+
+	return bok ? 0 : 1;
+}
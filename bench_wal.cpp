@@ -0,0 +1,299 @@
+/*
+ * 持久化消息队列的写入压测，比较WAL的组提交和每条消息一次fdatasync
+ *
+ * 用法：
+ *   bench_wal [选项]
+ *
+ * 选项：
+ *   --dir /tmp/bench_wal  日志目录，每个测试开始前清空
+ *   --threads 1,8,64      同时写入的线程数，逗号分隔，每个值测一次
+ *   --size 100            每条消息的大小，单位为字节
+ *   --duration 2          每个测试的时长，单位为秒
+ *   --mode group,fsync    group为WAL组提交，fsync为加锁后write加fdatasync，逗号分隔
+ *   --output file         把JSON结果写到文件，缺省输出到标准输出
+ *
+ * 每个测试输出一行JSON，包括每秒落盘的消息数、MB/s、fdatasync次数、平均批次大小
+ * 和p50/p99延迟（微秒）。消息数受磁盘fdatasync的延迟限制，要在目标磁盘上运行。
+ * */
+#include "public.h"
+#include "wal.h"
+#include "metrics.h"
+#include "utils.h"
+
+struct BenchOptions
+{
+	char   m_dir[256];
+	int    m_size;
+	double m_duration;
+};
+
+struct BenchShared
+{
+	const BenchOptions *m_opts;
+	bool                m_bgroup;
+	WAL                 m_wal;
+	int                 m_fd;          // fsync模式的文件
+	pthread_mutex_t     m_lock;        // fsync模式串行写
+	unsigned long       m_syncs;       // fsync模式的fdatasync次数
+	MetricHistogram     m_hist;
+	bool                m_bstop;
+};
+
+struct BenchWriter
+{
+	BenchShared  *m_shared;
+	unsigned long m_msgs;
+	int           m_errors;
+};
+
+/*
+ * 和WAL一样的记录格式，保证两种模式写的字节数相同
+ * */
+static bool AppendFsync(BenchShared *shared, const char *data, const int len)
+{
+	char header[WAL_HEADER_LEN];
+	unsigned int crc = Crc32c(0, data, len);
+	memcpy(header, &len, 4);
+	memcpy(header + 4, &crc, 4);
+	memset(header + 8, 0, 8);
+
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = WAL_HEADER_LEN;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+
+	pthread_mutex_lock(&shared->m_lock);
+	bool bok = writev(shared->m_fd, iov, 2) == (ssize_t)(WAL_HEADER_LEN + len) && fdatasync(shared->m_fd) == 0;
+	shared->m_syncs++;
+	pthread_mutex_unlock(&shared->m_lock);
+
+	return bok;
+}
+
+static void *WriterThread(void *arg)
+{
+	BenchWriter *writer = (BenchWriter *)arg;
+	BenchShared *shared = writer->m_shared;
+
+	vector<char> data(shared->m_opts->m_size, 'm');
+	while (__atomic_load_n(&shared->m_bstop, __ATOMIC_RELAXED) == false)
+	{
+		unsigned long start = MetricNow();
+		bool bok;
+		if (shared->m_bgroup == true)
+		{
+			bok = shared->m_wal.Append(data.data(), data.size());
+		}
+		else
+		{
+			bok = AppendFsync(shared, data.data(), data.size());
+		}
+		if (bok == false)
+		{
+			writer->m_errors++;
+			break;
+		}
+		shared->m_hist.Record(MetricNow() - start);
+		writer->m_msgs++;
+	}
+
+	return 0;
+}
+
+static void ClearDir(const char *dir)
+{
+	DIR *pdir = opendir(dir);
+	if (pdir == 0)
+	{
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(pdir)) != 0)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(pdir);
+}
+
+static bool RunCase(const BenchOptions *opts, const bool bgroup, const int ithreads, FILE *out)
+{
+	ClearDir(opts->m_dir);
+
+	BenchShared shared;
+	shared.m_opts = opts;
+	shared.m_bgroup = bgroup;
+	shared.m_fd = -1;
+	shared.m_syncs = 0;
+	shared.m_bstop = false;
+	pthread_mutex_init(&shared.m_lock, 0);
+
+	if (bgroup == true)
+	{
+		if (shared.m_wal.Open(opts->m_dir) == false)
+		{
+			fprintf(stderr, "open wal %s failed: %s\n", opts->m_dir, strerror(errno));
+			return false;
+		}
+	}
+	else
+	{
+		char path[512];
+		snprintf(path, sizeof(path), "%s/fsync.log", opts->m_dir);
+		if ((shared.m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1)
+		{
+			fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+			return false;
+		}
+	}
+
+	vector<BenchWriter> writers(ithreads);
+	vector<pthread_t> tids(ithreads);
+	unsigned long start = MetricNow();
+	for (int i = 0; i < ithreads; i++)
+	{
+		writers[i].m_shared = &shared;
+		writers[i].m_msgs = 0;
+		writers[i].m_errors = 0;
+		pthread_create(&tids[i], 0, WriterThread, &writers[i]);
+	}
+
+	usleep((useconds_t)(opts->m_duration * 1000000));
+	__atomic_store_n(&shared.m_bstop, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < ithreads; i++)
+	{
+		pthread_join(tids[i], 0);
+	}
+	double seconds = (MetricNow() - start) / 1e9;
+
+	unsigned long msgs = 0;
+	int errors = 0;
+	for (int i = 0; i < ithreads; i++)
+	{
+		msgs += writers[i].m_msgs;
+		errors += writers[i].m_errors;
+	}
+	unsigned long syncs = bgroup == true ? shared.m_wal.Syncs() : shared.m_syncs;
+
+	fprintf(out, "{\"benchmark\": \"wal\", \"mode\": \"%s\", \"threads\": %d, \"size\": %d, \"seconds\": %.3f, "
+			"\"msgs\": %lu, \"msgs_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"syncs\": %lu, \"avg_batch\": %.2f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, \"errors\": %d}\n",
+			bgroup ? "group" : "fsync", ithreads, opts->m_size, seconds, msgs, msgs / seconds,
+			msgs * (double)(opts->m_size + WAL_HEADER_LEN) / seconds / (1024 * 1024), syncs,
+			syncs > 0 ? (double)msgs / syncs : 0.0,
+			shared.m_hist.Percentile(0.50) / 1e3, shared.m_hist.Percentile(0.99) / 1e3, errors);
+	fflush(out);
+
+	shared.m_wal.Close();
+	if (shared.m_fd != -1)
+	{
+		close(shared.m_fd);
+	}
+	pthread_mutex_destroy(&shared.m_lock);
+	ClearDir(opts->m_dir);
+
+	return errors == 0;
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--dir path] [--threads n,n...] [--size n] [--duration sec] "
+			"[--mode group,fsync] [--output file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	snprintf(opts.m_dir, sizeof(opts.m_dir), "/tmp/bench_wal");
+	opts.m_size = 100;
+	opts.m_duration = 2;
+	const char *threads = "1,8,64";
+	const char *modes = "group,fsync";
+	const char *output = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--dir") == 0)
+		{
+			snprintf(opts.m_dir, sizeof(opts.m_dir), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0)
+		{
+			threads = argv[++i];
+		}
+		else if (strcmp(argv[i], "--size") == 0)
+		{
+			opts.m_size = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--duration") == 0)
+		{
+			opts.m_duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--mode") == 0)
+		{
+			modes = argv[++i];
+		}
+		else if (strcmp(argv[i], "--output") == 0)
+		{
+			output = argv[++i];
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.m_size < 0 || opts.m_size > WAL_MAX_RECORD || MKdir(opts.m_dir, false) == false)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+
+	FILE *out = stdout;
+	if (output != 0 && (out = fopen(output, "w")) == 0)
+	{
+		fprintf(stderr, "open %s failed: %s\n", output, strerror(errno));
+		return 1;
+	}
+
+	bool bok = true;
+	for (const char *mode = modes; *mode != 0; mode += strcspn(mode, ","), mode += (*mode == ',') ? 1 : 0)
+	{
+		bool bgroup = strncmp(mode, "group", 5) == 0;
+		if (bgroup == false && strncmp(mode, "fsync", 5) != 0)
+		{
+			fprintf(stderr, "unknown mode %.*s\n", (int)strcspn(mode, ","), mode);
+			bok = false;
+			continue;
+		}
+		for (const char *p = threads; *p != 0; p += strcspn(p, ","), p += (*p == ',') ? 1 : 0)
+		{
+			int ithreads = atoi(p);
+			if (ithreads > 0 && RunCase(&opts, bgroup, ithreads, out) == false)
+			{
+				bok = false;
+			}
+		}
+	}
+
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	return bok ? 0 : 1;
+}
@@ -0,0 +1,923 @@
+#include "public.h"
+#include "broker.h"
+#include "utils.h"
+
+#define BROKER_MAX_IOV     64      // 一次writev最多发送的消息数
+#define BROKER_MAX_ROUNDS  8       // 一次调度最多连续writev的次数，之后重新排队，不让一个订阅者占住发送线程
+#define BROKER_MAX_TOPIC   64      // 主题名的最大长度，包括结尾的0
+
+/*
+ * Offer的返回值
+ * */
+#define BROKER_QUEUED   0
+#define BROKER_DROPPED  1
+#define BROKER_WAIT     2          // 队列满，BROKER_BLOCK策略，需要在主题锁外面等待
+
+/*
+ * 一条发布的消息，m_data中是4字节网络字节序的长度头和消息内容，和TCPWrite的报文格式相同，
+ * 每个订阅者的队列持有一个引用，发送完或者被丢弃时释放
+ * */
+struct BrokerMsg
+{
+	int           m_refs;
+	int           m_len;       // m_data的长度，包括长度头
+	unsigned long m_time;      // 发布的时刻，单位为纳秒
+	char          m_data[4];
+};
+
+/*
+ * 一个主题的指标，超过m_metric_topics之后的主题共用"_other"
+ * */
+struct BrokerMetrics
+{
+	MetricCounter   *m_published;
+	MetricCounter   *m_delivered;
+	MetricCounter   *m_dropped;
+	MetricCounter   *m_disconnects;
+	MetricGauge     *m_subscribers;
+	MetricGauge     *m_queued;
+	MetricHistogram *m_delay;
+};
+
+/*
+ * 主题在第一次订阅时创建，数量由m_max_topics限制。m_refs由Broker::m_lock保护，
+ * 每个订阅者和每次查找各持有一个引用，最后一个引用释放时主题被回收，
+ * 这时已经没有订阅者，也就没有排队的消息
+ * */
+struct BrokerTopic
+{
+	char                m_name[BROKER_MAX_TOPIC];
+	int                 m_refs;
+	pthread_mutex_t     m_lock;     // 保护m_subs，持有时不能阻塞等待
+	vector<BrokerSub *> m_subs;
+	BrokerMetrics       m_metrics;
+};
+
+/*
+ * 一个订阅者，引用计数：订阅本身持有一个，由发送线程关闭时释放；在就绪列表中时持有一个；
+ * 每个等待队列空位的发布者持有一个
+ * */
+struct BrokerSub
+{
+	BrokerTopic       *m_topic;
+	BrokerPolicy       m_policy;
+	int                m_max_queue;
+	int                m_refs;
+	bool               m_bremoved;   // 已经从主题和epoll中移出，只由发送线程访问
+
+	pthread_mutex_t    m_lock;       // 保护下面的成员
+	pthread_cond_t     m_cond;       // 队列有空位或者订阅者关闭，BROKER_BLOCK策略的发布者等待
+	int                m_fd;         // Attach之前为-1，只排队不发送
+	deque<BrokerMsg *> m_queue;
+	int                m_head_off;   // 队首消息已经发送的字节数
+	int                m_inflight;   // 发送线程正在writev的消息数，这些消息不能丢弃
+	bool               m_bclosed;    // 不再接收消息，等待发送线程关闭
+	bool               m_bready;     // 已经在就绪列表中
+};
+
+static void InitMetrics(BrokerMetrics *metrics, const char *topic)
+{
+	char labels[BROKER_MAX_TOPIC + 16];
+	snprintf(labels, sizeof(labels), "topic=\"%s\"", topic);
+	metrics->m_published = NewMetricCounter("moserver_broker_published_total", "Messages published by topic", labels);
+	metrics->m_delivered = NewMetricCounter("moserver_broker_delivered_total", "Messages written to subscribers by topic", labels);
+	metrics->m_dropped = NewMetricCounter("moserver_broker_dropped_total", "Messages dropped from full subscriber queues by topic", labels);
+	metrics->m_disconnects = NewMetricCounter("moserver_broker_disconnects_total", "Subscribers disconnected for a full queue by topic", labels);
+	metrics->m_subscribers = NewMetricGauge("moserver_broker_subscribers", "Subscribers by topic", labels);
+	metrics->m_queued = NewMetricGauge("moserver_broker_queued_messages", "Messages queued to subscribers and not yet written by topic", labels);
+	metrics->m_delay = NewMetricHistogram("moserver_broker_delivery_seconds", "Time from publish to write by topic", labels);
+}
+
+static BrokerMetrics MakeOtherMetrics()
+{
+	BrokerMetrics metrics;
+	InitMetrics(&metrics, "_other");
+	return metrics;
+}
+
+// 启动时注册，指标表满时按主题注册的指标都退回到这一组
+static BrokerMetrics g_other_metrics = MakeOtherMetrics();
+
+static bool ValidTopic(const char *topic)
+{
+	size_t ilen = strlen(topic);
+	if (ilen == 0 || ilen >= BROKER_MAX_TOPIC)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < ilen; i++)
+	{
+		char c = topic[i];
+		if (isalnum((unsigned char)c) == 0 && c != '_' && c != '.' && c != '-' && c != ':' && c != '/')
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void ReleaseMsg(BrokerMsg *msg)
+{
+	if (__atomic_sub_fetch(&msg->m_refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		free(msg);
+	}
+}
+
+
+/**
+ * @brief 需要发送线程处理时放进就绪列表，调用者需要持有sub->m_lock
+ * @return true为调用者需要调用Schedule
+ */
+static bool MarkReadyLocked(BrokerSub *sub)
+{
+	if (sub->m_bready == true)
+	{
+		return false;
+	}
+
+	sub->m_bready = true;
+	__atomic_add_fetch(&sub->m_refs, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/**
+ * @brief 消息放进队列，调用者需要持有sub->m_lock并且队列还有空位
+ * @details 队列原来不空时发送线程正在发送或者在等待socket可写，发送完前面的消息后会接着发送，
+ *          不需要再调度
+ */
+static bool EnqueueLocked(BrokerSub *sub, BrokerMsg *msg)
+{
+	bool bempty = sub->m_queue.empty();
+	__atomic_add_fetch(&msg->m_refs, 1, __ATOMIC_RELAXED);
+	sub->m_queue.push_back(msg);
+	sub->m_topic->m_metrics.m_queued->Add();
+
+	return bempty == true && MarkReadyLocked(sub) == true;
+}
+
+Broker::Broker()
+{
+	m_max_topics = 1024;
+	m_metric_topics = 8;
+	m_block_timeout = 1000;
+	m_epfd = -1;
+	m_wakefd = -1;
+	m_brunning = false;
+	m_bstop = false;
+	pthread_mutex_init(&m_lock, 0);
+}
+
+bool Broker::Start()
+{
+	if (m_brunning == true)
+	{
+		return false;
+	}
+
+	if ((m_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		return false;
+	}
+	if ((m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		return false;
+	}
+
+	// eventfd用成员的地址作为标记，和订阅者的指针区分
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_wakefd;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) != 0)
+	{
+		return false;
+	}
+
+	m_bstop = false;
+	if (pthread_create(&m_tid, 0, SendThread, this) != 0)
+	{
+		return false;
+	}
+	m_brunning = true;
+
+	return true;
+}
+
+/**
+ * @brief 按名字查找主题
+ * @param bcreate 不存在时是否创建，主题数达到m_max_topics时不创建
+ */
+BrokerTopic *Broker::FindTopic(const char *topic, const bool bcreate)
+{
+	pthread_mutex_lock(&m_lock);
+
+	unordered_map<string, BrokerTopic *>::iterator it = m_topics.find(topic);
+	if (it != m_topics.end())
+	{
+		BrokerTopic *ptopic = it->second;
+		ptopic->m_refs++;
+		pthread_mutex_unlock(&m_lock);
+		return ptopic;
+	}
+
+	if (bcreate == false || (int)m_topics.size() >= m_max_topics)
+	{
+		pthread_mutex_unlock(&m_lock);
+		return 0;
+	}
+
+	BrokerTopic *ptopic = new BrokerTopic;
+	StrCopy(ptopic->m_name, sizeof(ptopic->m_name), topic);
+	ptopic->m_refs = 1;
+	pthread_mutex_init(&ptopic->m_lock, 0);
+
+	// 单独统计的名字只增不减，主题回收后再创建时沿用原来的指标，不断换新名字的主题不会占满指标表
+	ptopic->m_metrics = g_other_metrics;
+	bool bmetric = (m_metric_names.count(topic) != 0);
+	if (bmetric == false && (int)m_metric_names.size() < m_metric_topics)
+	{
+		m_metric_names.insert(topic);
+		bmetric = true;
+	}
+	if (bmetric == true)
+	{
+		BrokerMetrics metrics;
+		InitMetrics(&metrics, topic);
+		if (metrics.m_published != 0 && metrics.m_delivered != 0 && metrics.m_dropped != 0 &&
+				metrics.m_disconnects != 0 && metrics.m_subscribers != 0 && metrics.m_queued != 0 &&
+				metrics.m_delay != 0)
+		{
+			ptopic->m_metrics = metrics;
+		}
+	}
+
+	m_topics[topic] = ptopic;
+	pthread_mutex_unlock(&m_lock);
+
+	return ptopic;
+}
+
+/**
+ * @brief 释放FindTopic或者订阅者持有的主题引用，最后一个引用释放时回收主题
+ */
+void Broker::ReleaseTopic(BrokerTopic *ptopic)
+{
+	pthread_mutex_lock(&m_lock);
+	if (--ptopic->m_refs > 0)
+	{
+		pthread_mutex_unlock(&m_lock);
+		return;
+	}
+	m_topics.erase(ptopic->m_name);
+	pthread_mutex_unlock(&m_lock);
+
+	pthread_mutex_destroy(&ptopic->m_lock);
+	delete ptopic;
+}
+
+/**
+ * @brief 释放订阅者的一个引用，最后一个引用释放时删除订阅者并释放它持有的主题引用
+ */
+void Broker::ReleaseSub(BrokerSub *sub)
+{
+	if (__atomic_sub_fetch(&sub->m_refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		// 走到这里时订阅者已经被发送线程关闭，队列已经清空
+		BrokerTopic *ptopic = sub->m_topic;
+		pthread_mutex_destroy(&sub->m_lock);
+		pthread_cond_destroy(&sub->m_cond);
+		delete sub;
+		ReleaseTopic(ptopic);
+	}
+}
+
+BrokerSub *Broker::NewSub(const char *topic, const BrokerPolicy policy, const int max_queue)
+{
+	if (m_brunning == false || ValidTopic(topic) == false || max_queue <= 0)
+	{
+		return 0;
+	}
+
+	BrokerTopic *ptopic = FindTopic(topic, true);
+	if (ptopic == 0)
+	{
+		return 0;
+	}
+
+	BrokerSub *sub = new BrokerSub;
+	sub->m_topic = ptopic;
+	sub->m_policy = policy;
+	sub->m_max_queue = max_queue;
+	sub->m_refs = 1;
+	sub->m_bremoved = false;
+	pthread_mutex_init(&sub->m_lock, 0);
+	pthread_cond_init(&sub->m_cond, 0);
+	sub->m_fd = -1;
+	sub->m_head_off = 0;
+	sub->m_inflight = 0;
+	sub->m_bclosed = false;
+	sub->m_bready = false;
+
+	pthread_mutex_lock(&ptopic->m_lock);
+	ptopic->m_subs.push_back(sub);
+	pthread_mutex_unlock(&ptopic->m_lock);
+	ptopic->m_metrics.m_subscribers->Add();
+
+	return sub;
+}
+
+bool Broker::Attach(BrokerSub *sub, const int fd)
+{
+	bool bok = true;
+	if (fd != -1)
+	{
+		int flags = fcntl(fd, F_GETFL);
+		bok = (flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+	}
+
+	pthread_mutex_lock(&sub->m_lock);
+	if (fd != -1 && bok == true)
+	{
+		sub->m_fd = fd;
+	}
+	else
+	{
+		sub->m_bclosed = true;
+	}
+	bool bschedule = MarkReadyLocked(sub);
+	pthread_mutex_unlock(&sub->m_lock);
+
+	if (fd != -1 && bok == true)
+	{
+		// 边沿触发，socket从满变为可写时通知一次，对端发来数据或者关闭时通知
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = sub;
+		if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		{
+			pthread_mutex_lock(&sub->m_lock);
+			sub->m_bclosed = true;
+			pthread_mutex_unlock(&sub->m_lock);
+			bok = false;
+		}
+	}
+	else if (fd != -1)
+	{
+		close(fd);
+	}
+
+	// 在等待期间已经排队的消息和关闭都由发送线程处理
+	if (bschedule == true)
+	{
+		Schedule(&sub, 1);
+	}
+
+	return bok;
+}
+
+/**
+ * @brief 把订阅者交给发送线程处理
+ */
+void Broker::Schedule(BrokerSub **subs, const int n)
+{
+	pthread_mutex_lock(&m_lock);
+	bool bwake = m_ready.empty();
+	m_ready.insert(m_ready.end(), subs, subs + n);
+	pthread_mutex_unlock(&m_lock);
+
+	// 就绪列表原来不空时发送线程已经被唤醒过
+	if (bwake == true)
+	{
+		unsigned long one = 1;
+		if (write(m_wakefd, &one, sizeof(one)) != sizeof(one))
+		{
+			// eventfd计数已满时发送线程一定会被唤醒，忽略错误
+		}
+	}
+}
+
+/**
+ * @brief 把一条消息交给一个订阅者，调用者需要持有主题锁
+ * @param bschedule 返回是否需要调用Schedule
+ * @return BROKER_QUEUED、BROKER_DROPPED或者BROKER_WAIT
+ */
+int Broker::Offer(BrokerSub *sub, BrokerMsg *msg, bool *bschedule)
+{
+	BrokerMetrics *metrics = &sub->m_topic->m_metrics;
+	int iret = BROKER_QUEUED;
+	*bschedule = false;
+
+	pthread_mutex_lock(&sub->m_lock);
+	if (sub->m_bclosed == true)
+	{
+		iret = BROKER_DROPPED;
+	}
+	else if ((int)sub->m_queue.size() < sub->m_max_queue)
+	{
+		*bschedule = EnqueueLocked(sub, msg);
+	}
+	else if (sub->m_policy == BROKER_DROP_OLDEST)
+	{
+		// 正在发送和已经发出一部分的消息不能丢弃，否则对端收到的报文不完整
+		size_t first = sub->m_inflight;
+		if (first == 0 && sub->m_head_off > 0)
+		{
+			first = 1;
+		}
+
+		if (first < sub->m_queue.size())
+		{
+			BrokerMsg *old = sub->m_queue[first];
+			sub->m_queue.erase(sub->m_queue.begin() + first);
+			metrics->m_queued->Sub();
+			ReleaseMsg(old);
+			*bschedule = EnqueueLocked(sub, msg);
+		}
+		else
+		{
+			iret = BROKER_DROPPED;
+		}
+		metrics->m_dropped->Add();
+	}
+	else if (sub->m_policy == BROKER_DISCONNECT)
+	{
+		sub->m_bclosed = true;
+		*bschedule = MarkReadyLocked(sub);
+		metrics->m_disconnects->Add();
+		iret = BROKER_DROPPED;
+	}
+	else
+	{
+		iret = BROKER_WAIT;
+	}
+	pthread_mutex_unlock(&sub->m_lock);
+
+	return iret;
+}
+
+/**
+ * @brief 发布一条消息
+ * @details 消息只拷贝一次，按主题锁内的订阅者列表逐个放进队列；BROKER_BLOCK策略的订阅者
+ *          队列满时先记下来，释放主题锁之后再等待，一个慢的订阅者不会挡住同一主题的其他订阅者
+ *          和新订阅者，等待的总时间不超过m_block_timeout
+ */
+int Broker::Publish(const char *topic, const char *data, const int len)
+{
+	if (len < 0 || m_brunning == false || __atomic_load_n(&m_bstop, __ATOMIC_ACQUIRE) == true)
+	{
+		return 0;
+	}
+
+	BrokerTopic *ptopic = FindTopic(topic, false);
+	if (ptopic == 0)
+	{
+		return 0;
+	}
+
+	BrokerMsg *msg = (BrokerMsg *)malloc(offsetof(BrokerMsg, m_data) + 4 + len);
+	if (msg == 0)
+	{
+		ReleaseTopic(ptopic);
+		return 0;
+	}
+	msg->m_refs = 1;   // 发布者持有的引用，放完所有队列后释放
+	msg->m_len = 4 + len;
+	msg->m_time = MetricNow();
+	unsigned int nlen = htonl(len);
+	memcpy(msg->m_data, &nlen, 4);
+	memcpy(msg->m_data + 4, data, len);
+
+	ptopic->m_metrics.m_published->Add();
+
+	static thread_local vector<BrokerSub *> t_schedule;
+	static thread_local vector<BrokerSub *> t_wait;
+	t_schedule.clear();
+	t_wait.clear();
+
+	int icount = 0;
+	pthread_mutex_lock(&ptopic->m_lock);
+	for (size_t i = 0; i < ptopic->m_subs.size(); i++)
+	{
+		BrokerSub *sub = ptopic->m_subs[i];
+		bool bschedule = false;
+		int iret = Offer(sub, msg, &bschedule);
+		if (iret == BROKER_QUEUED)
+		{
+			icount++;
+		}
+		else if (iret == BROKER_WAIT)
+		{
+			__atomic_add_fetch(&sub->m_refs, 1, __ATOMIC_RELAXED);
+			t_wait.push_back(sub);
+		}
+		if (bschedule == true)
+		{
+			t_schedule.push_back(sub);
+		}
+	}
+	pthread_mutex_unlock(&ptopic->m_lock);
+
+	if (t_schedule.empty() == false)
+	{
+		Schedule(t_schedule.data(), t_schedule.size());
+	}
+
+	if (t_wait.empty() == false)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		long nsec = deadline.tv_nsec + (long)m_block_timeout * 1000000L;
+		deadline.tv_sec += nsec / 1000000000L;
+		deadline.tv_nsec = nsec % 1000000000L;
+
+		for (size_t i = 0; i < t_wait.size(); i++)
+		{
+			BrokerSub *sub = t_wait[i];
+			bool bschedule = false;
+
+			pthread_mutex_lock(&sub->m_lock);
+			while (sub->m_bclosed == false && (int)sub->m_queue.size() >= sub->m_max_queue)
+			{
+				if (pthread_cond_timedwait(&sub->m_cond, &sub->m_lock, &deadline) == ETIMEDOUT)
+				{
+					break;
+				}
+			}
+
+			if (sub->m_bclosed == false && (int)sub->m_queue.size() < sub->m_max_queue)
+			{
+				bschedule = EnqueueLocked(sub, msg);
+				icount++;
+			}
+			else if (sub->m_bclosed == false)
+			{
+				sub->m_bclosed = true;
+				bschedule = MarkReadyLocked(sub);
+				sub->m_topic->m_metrics.m_disconnects->Add();
+			}
+			pthread_mutex_unlock(&sub->m_lock);
+
+			if (bschedule == true)
+			{
+				Schedule(&sub, 1);
+			}
+			ReleaseSub(sub);
+		}
+	}
+
+	ReleaseMsg(msg);
+	ReleaseTopic(ptopic);
+
+	return icount;
+}
+
+int Broker::Subscribers(const char *topic)
+{
+	BrokerTopic *ptopic = FindTopic(topic, false);
+	if (ptopic == 0)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&ptopic->m_lock);
+	int icount = ptopic->m_subs.size();
+	pthread_mutex_unlock(&ptopic->m_lock);
+	ReleaseTopic(ptopic);
+
+	return icount;
+}
+
+/**
+ * @brief 把队列中的消息写到socket，只在发送线程中调用
+ * @details 一次writev发送队列前面最多BROKER_MAX_IOV个消息，消息的长度头和内容在同一块内存中，
+ *          每个消息一个iovec。发送期间不持有订阅者的锁，发布者可以继续排队，
+ *          m_inflight保护正在发送的消息不被丢弃
+ */
+void Broker::Flush(BrokerSub *sub)
+{
+	BrokerMetrics *metrics = &sub->m_topic->m_metrics;
+
+	for (int iround = 0; iround < BROKER_MAX_ROUNDS; iround++)
+	{
+		struct iovec iov[BROKER_MAX_IOV];
+
+		pthread_mutex_lock(&sub->m_lock);
+		if (sub->m_bclosed == true)
+		{
+			pthread_mutex_unlock(&sub->m_lock);
+			CloseSub(sub);
+			return;
+		}
+		if (sub->m_fd == -1 || sub->m_queue.empty() == true)
+		{
+			pthread_mutex_unlock(&sub->m_lock);
+			return;
+		}
+
+		int icnt = sub->m_queue.size() < BROKER_MAX_IOV ? sub->m_queue.size() : BROKER_MAX_IOV;
+		for (int i = 0; i < icnt; i++)
+		{
+			BrokerMsg *msg = sub->m_queue[i];
+			iov[i].iov_base = msg->m_data;
+			iov[i].iov_len = msg->m_len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + sub->m_head_off;
+		iov[0].iov_len -= sub->m_head_off;
+		sub->m_inflight = icnt;
+		int fd = sub->m_fd;
+		pthread_mutex_unlock(&sub->m_lock);
+
+		ssize_t n = writev(fd, iov, icnt);
+		int ierrno = errno;
+
+		BrokerMsg *done[BROKER_MAX_IOV];
+		int idone = 0;
+
+		pthread_mutex_lock(&sub->m_lock);
+		sub->m_inflight = 0;
+		size_t left = (n > 0) ? n : 0;
+		while (left > 0)
+		{
+			BrokerMsg *msg = sub->m_queue.front();
+			size_t rest = msg->m_len - sub->m_head_off;
+			if (left < rest)
+			{
+				sub->m_head_off += left;
+				break;
+			}
+			left -= rest;
+			sub->m_head_off = 0;
+			sub->m_queue.pop_front();
+			done[idone++] = msg;
+		}
+		if (idone > 0 && sub->m_policy == BROKER_BLOCK)
+		{
+			pthread_cond_broadcast(&sub->m_cond);
+		}
+		pthread_mutex_unlock(&sub->m_lock);
+
+		if (idone > 0)
+		{
+			unsigned long now = MetricNow();
+			for (int i = 0; i < idone; i++)
+			{
+				metrics->m_delay->Record(now - done[i]->m_time);
+				ReleaseMsg(done[i]);
+			}
+			metrics->m_delivered->Add(idone);
+			metrics->m_queued->Sub(idone);
+		}
+
+		if (n < 0)
+		{
+			if (ierrno == EINTR)
+			{
+				continue;
+			}
+			if (ierrno != EAGAIN && ierrno != EWOULDBLOCK)
+			{
+				CloseSub(sub);
+			}
+			// 发送缓冲区满，socket重新可写时epoll通知
+			return;
+		}
+
+		// 只写出一部分时也接着写，直到EAGAIN，边沿触发才能保证再次通知
+	}
+
+	// 预算用完还有消息，排到其他订阅者后面
+	pthread_mutex_lock(&sub->m_lock);
+	bool bschedule = (sub->m_queue.empty() == false && MarkReadyLocked(sub) == true);
+	pthread_mutex_unlock(&sub->m_lock);
+	if (bschedule == true)
+	{
+		Schedule(&sub, 1);
+	}
+}
+
+/**
+ * @brief 读走并丢弃订阅者发来的数据，对端关闭或者出错时关闭订阅者
+ */
+void Broker::Discard(BrokerSub *sub)
+{
+	char buffer[4096];
+	while (true)
+	{
+		ssize_t n = read(sub->m_fd, buffer, sizeof(buffer));
+		if (n > 0)
+		{
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		CloseSub(sub);
+		return;
+	}
+}
+
+/**
+ * @brief 关闭订阅者：移出主题和epoll，关闭socket，释放队列中的消息，唤醒等待的发布者
+ * @details 只在发送线程中调用，订阅本身的引用在本轮事件处理完之后释放，
+ *          同一轮epoll_wait返回的事件中可能还有这个订阅者
+ */
+void Broker::CloseSub(BrokerSub *sub)
+{
+	if (sub->m_bremoved == true)
+	{
+		return;
+	}
+	sub->m_bremoved = true;
+
+	BrokerTopic *ptopic = sub->m_topic;
+	pthread_mutex_lock(&ptopic->m_lock);
+	for (size_t i = 0; i < ptopic->m_subs.size(); i++)
+	{
+		if (ptopic->m_subs[i] == sub)
+		{
+			ptopic->m_subs[i] = ptopic->m_subs.back();
+			ptopic->m_subs.pop_back();
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ptopic->m_lock);
+
+	deque<BrokerMsg *> queue;
+	pthread_mutex_lock(&sub->m_lock);
+	sub->m_bclosed = true;
+	int fd = sub->m_fd;
+	sub->m_fd = -1;
+	queue.swap(sub->m_queue);
+	sub->m_head_off = 0;
+	pthread_cond_broadcast(&sub->m_cond);
+	pthread_mutex_unlock(&sub->m_lock);
+
+	if (fd != -1)
+	{
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, 0);
+		close(fd);
+	}
+
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		ReleaseMsg(queue[i]);
+	}
+	ptopic->m_metrics.m_queued->Sub(queue.size());
+	ptopic->m_metrics.m_subscribers->Sub();
+
+	m_closing.push_back(sub);
+}
+
+void *Broker::SendThread(void *arg)
+{
+	Broker *broker = (Broker *)arg;
+	struct epoll_event events[64];
+	vector<BrokerSub *> ready;
+
+	while (true)
+	{
+		int n = epoll_wait(broker->m_epfd, events, 64, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &broker->m_wakefd)
+			{
+				unsigned long value;
+				if (read(broker->m_wakefd, &value, sizeof(value)) != sizeof(value))
+				{
+					// 没有读到说明计数已经被读走，忽略
+				}
+				continue;
+			}
+
+			BrokerSub *sub = (BrokerSub *)events[i].data.ptr;
+			if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+			{
+				broker->CloseSub(sub);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) != 0)
+			{
+				broker->Discard(sub);
+			}
+			if ((events[i].events & EPOLLOUT) != 0)
+			{
+				broker->Flush(sub);
+			}
+		}
+
+		pthread_mutex_lock(&broker->m_lock);
+		bool bstop = broker->m_bstop;
+		ready.swap(broker->m_ready);
+		pthread_mutex_unlock(&broker->m_lock);
+
+		for (size_t i = 0; i < ready.size(); i++)
+		{
+			BrokerSub *sub = ready[i];
+			pthread_mutex_lock(&sub->m_lock);
+			sub->m_bready = false;
+			pthread_mutex_unlock(&sub->m_lock);
+
+			if (bstop == false)
+			{
+				broker->Flush(sub);
+			}
+			broker->ReleaseSub(sub);
+		}
+		ready.clear();
+
+		for (size_t i = 0; i < broker->m_closing.size(); i++)
+		{
+			broker->ReleaseSub(broker->m_closing[i]);
+		}
+		broker->m_closing.clear();
+
+		if (bstop == true)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void Broker::Stop()
+{
+	if (m_brunning == false)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	__atomic_store_n(&m_bstop, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m_lock);
+
+	unsigned long one = 1;
+	if (write(m_wakefd, &one, sizeof(one)) != sizeof(one))
+	{
+		// eventfd计数已满时发送线程一定会被唤醒，忽略错误
+	}
+	pthread_join(m_tid, 0);
+	m_brunning = false;
+
+	// 发送线程已经退出，在这里关闭剩下的订阅者
+	vector<BrokerSub *> subs;
+	pthread_mutex_lock(&m_lock);
+	for (unordered_map<string, BrokerTopic *>::iterator it = m_topics.begin(); it != m_topics.end(); ++it)
+	{
+		pthread_mutex_lock(&it->second->m_lock);
+		subs.insert(subs.end(), it->second->m_subs.begin(), it->second->m_subs.end());
+		pthread_mutex_unlock(&it->second->m_lock);
+	}
+	vector<BrokerSub *> ready;
+	ready.swap(m_ready);
+	pthread_mutex_unlock(&m_lock);
+
+	for (size_t i = 0; i < subs.size(); i++)
+	{
+		CloseSub(subs[i]);
+	}
+	for (size_t i = 0; i < ready.size(); i++)
+	{
+		ReleaseSub(ready[i]);
+	}
+	for (size_t i = 0; i < m_closing.size(); i++)
+	{
+		ReleaseSub(m_closing[i]);
+	}
+	m_closing.clear();
+}
+
+Broker::~Broker()
+{
+	Stop();
+
+	for (unordered_map<string, BrokerTopic *>::iterator it = m_topics.begin(); it != m_topics.end(); ++it)
+	{
+		pthread_mutex_destroy(&it->second->m_lock);
+		delete it->second;
+	}
+	m_topics.clear();
+
+	if (m_wakefd != -1)
+	{
+		close(m_wakefd);
+	}
+	if (m_epfd != -1)
+	{
+		close(m_epfd);
+	}
+	pthread_mutex_destroy(&m_lock);
+}
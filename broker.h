@@ -0,0 +1,126 @@
+#ifndef __BROKER_H__
+#define __BROKER_H__
+#include "public.h"
+#include "metrics.h"
+
+/*
+ * 订阅者的发送队列满时的处理方式
+ * */
+enum BrokerPolicy
+{
+	BROKER_DROP_OLDEST = 0,   // 丢弃最旧的还没有开始发送的消息
+	BROKER_DISCONNECT  = 1,   // 断开订阅者
+	BROKER_BLOCK       = 2    // 发布者等待队列有空位，超过m_block_timeout毫秒后断开订阅者
+};
+
+/**
+ * @brief 按主题的发布订阅转发
+ *
+ * 发布的消息连同4字节的长度头只存一份，放在带引用计数的缓冲区中，转发给每个订阅者
+ * 只是把指针放进它的发送队列并增加引用计数，不拷贝数据。所有订阅者的socket由一个
+ * 发送线程用边沿触发的epoll管理，一次writev把队列中的多个消息发出去，最后一个订阅者
+ * 发送完时释放缓冲区。
+ *
+ * 订阅者的连接只用于接收推送，对端发来的数据被丢弃，对端关闭或者出错时自动退订。
+ * 主题在第一次订阅时创建，最后一个订阅者退订后回收，没有订阅者的主题上发布的消息直接丢弃。
+ *
+ * 指标（topic标签为主题名，超过m_metric_topics个主题之后的主题合并为"_other"）：
+ *   moserver_broker_published_total      发布的消息数
+ *   moserver_broker_delivered_total      发给订阅者的消息数，每个订阅者算一次
+ *   moserver_broker_dropped_total        队列满时丢弃的消息数
+ *   moserver_broker_disconnects_total    因为队列满被断开的订阅者数
+ *   moserver_broker_subscribers          当前的订阅者数
+ *   moserver_broker_queued_messages      所有订阅者队列中还没有发送完的消息数，即积压
+ *   moserver_broker_delivery_seconds     从发布到交给内核的时间，即延迟
+ *
+ * 使用方法：
+ *   Broker broker;
+ *   broker.Start();
+ *   BrokerSub *sub = broker.NewSub("quotes", BROKER_DROP_OLDEST, 1024);
+ *   broker.Attach(sub, fd);         // fd从此由broker管理和关闭
+ *   broker.Publish("quotes", data, len);
+ */
+struct BrokerMsg;
+struct BrokerSub;
+struct BrokerTopic;
+
+class Broker
+{
+	public:
+		int m_max_topics;       // 同时存在的最多主题数，Start之前设置，没有订阅者的主题会被回收
+		int m_metric_topics;    // 单独统计指标的主题数，Start之前设置
+		int m_block_timeout;    // BROKER_BLOCK策略等待的最长时间，单位为毫秒，运行中可以修改
+
+		Broker();
+
+		/*
+		 * 启动发送线程
+		 * */
+		bool Start();
+
+		/*
+		 * 创建一个订阅者，之后发布的消息都放进它的队列，Attach之后开始发送
+		 * topic 主题名，最长63个字符，只能包含字母、数字和_.-:/
+		 * max_queue 发送队列最多容纳的消息数
+		 * 返回值 同时存在的主题数达到m_max_topics或者参数不合法时返回0
+		 * */
+		BrokerSub *NewSub(const char *topic, const BrokerPolicy policy, const int max_queue);
+
+		/*
+		 * 开始向订阅者发送消息，fd的所有权交给broker，设置为非阻塞
+		 * fd为-1时放弃这个订阅者，每个NewSub返回的订阅者都要调用一次
+		 * */
+		bool Attach(BrokerSub *sub, const int fd);
+
+		/*
+		 * 发布一条消息，data被拷贝一次
+		 * 返回值 放进了多少个订阅者的队列
+		 * */
+		int Publish(const char *topic, const char *data, const int len);
+
+		/*
+		 * 主题的订阅者数，主题不存在时返回0
+		 * */
+		int Subscribers(const char *topic);
+
+		/*
+		 * 停止发送线程，关闭所有订阅者
+		 * */
+		void Stop();
+
+		~Broker();
+
+	private:
+		int       m_epfd;
+		int       m_wakefd;                // 唤醒发送线程的eventfd
+		pthread_t m_tid;
+		bool      m_brunning;
+		bool      m_bstop;
+
+		pthread_mutex_t m_lock;            // 保护下面的成员
+		unordered_map<string, BrokerTopic *> m_topics;
+		unordered_set<string> m_metric_names;   // 单独统计指标的主题名，最多m_metric_topics个
+		vector<BrokerSub *> m_ready;       // 有消息要发送或者需要关闭的订阅者
+
+		vector<BrokerSub *> m_closing;     // 发送线程本轮关闭的订阅者，处理完本轮事件后释放
+
+		static void *SendThread(void *arg);
+
+		BrokerTopic *FindTopic(const char *topic, const bool bcreate);
+
+		void ReleaseTopic(BrokerTopic *ptopic);
+
+		void ReleaseSub(BrokerSub *sub);
+
+		int Offer(BrokerSub *sub, BrokerMsg *msg, bool *bschedule);
+
+		void Schedule(BrokerSub **subs, const int n);
+
+		void Flush(BrokerSub *sub);
+
+		void Discard(BrokerSub *sub);
+
+		void CloseSub(BrokerSub *sub);
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "public.h"
+#include "config.h"
+#include "utils.h"
+
+Config::Config()
+{
+	memset(m_filename, 0, sizeof(m_filename));
+}
+
+/**
+ * @brief 读取配置文件
+ * @details 先把整个文件解析到临时表中，全部成功后才替换当前配置，
+ *          SIGHUP时重新读取到一个写错的配置文件不会影响正在运行的服务
+ * @param filename 配置文件名
+ * @return 成功返回true，失败返回false
+ */
+bool Config::LoadFile(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	vector<pair<string, string> > items;
+	char line[1024];
+	bool bok = true;
+	while (fgets(line, sizeof(line), fp) != 0)
+	{
+		StrTrimR(line, '\n');
+		StrTrimR(line, '\r');
+		StrTrim(line, ' ');
+		StrTrim(line, '\t');
+
+		if (line[0] == 0 || line[0] == '#')
+		{
+			continue;
+		}
+
+		char *eq = strchr(line, '=');
+		if (eq == 0)
+		{
+			bok = false;
+			break;
+		}
+		*eq = 0;
+
+		char *key = line;
+		char *value = eq + 1;
+		StrTrim(key, ' ');
+		StrTrim(key, '\t');
+		StrTrim(value, ' ');
+		StrTrim(value, '\t');
+
+		if (key[0] == 0)
+		{
+			bok = false;
+			break;
+		}
+
+		items.push_back(make_pair(string(key), string(value)));
+	}
+	fclose(fp);
+
+	if (bok == false)
+	{
+		return false;
+	}
+
+	if (filename != m_filename)
+	{
+		StrCopy(m_filename, sizeof(m_filename), filename);
+	}
+	m_items.swap(items);
+
+	return true;
+}
+
+bool Config::Reload()
+{
+	if (m_filename[0] == 0)
+	{
+		return false;
+	}
+
+	return LoadFile(m_filename);
+}
+
+const char *Config::GetStr(const char *key, const char *def) const
+{
+	// 用Set设置的值优先，重新读取配置文件后仍然有效
+	for (size_t i = m_overrides.size(); i > 0; i--)
+	{
+		if (m_overrides[i - 1].first == key)
+		{
+			return m_overrides[i - 1].second.c_str();
+		}
+	}
+
+	// 从后往前找，同一个key以最后一次出现的为准
+	for (size_t i = m_items.size(); i > 0; i--)
+	{
+		if (m_items[i - 1].first == key)
+		{
+			return m_items[i - 1].second.c_str();
+		}
+	}
+
+	return def;
+}
+
+int Config::GetInt(const char *key, const int def) const
+{
+	const char *value = GetStr(key);
+	if (value == 0 || value[0] == 0)
+	{
+		return def;
+	}
+
+	return atoi(value);
+}
+
+long Config::GetLong(const char *key, const long def) const
+{
+	const char *value = GetStr(key);
+	if (value == 0 || value[0] == 0)
+	{
+		return def;
+	}
+
+	return atol(value);
+}
+
+double Config::GetDouble(const char *key, const double def) const
+{
+	const char *value = GetStr(key);
+	if (value == 0 || value[0] == 0)
+	{
+		return def;
+	}
+
+	return atof(value);
+}
+
+bool Config::GetBool(const char *key, const bool def) const
+{
+	const char *value = GetStr(key);
+	if (value == 0)
+	{
+		return def;
+	}
+
+	if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 ||
+			strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0)
+	{
+		return true;
+	}
+
+	if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0 ||
+			strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0)
+	{
+		return false;
+	}
+
+	return def;
+}
+
+void Config::Set(const char *key, const char *value)
+{
+	m_overrides.push_back(make_pair(string(key), string(value)));
+}
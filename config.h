@@ -0,0 +1,61 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+#include "public.h"
+
+/**
+ * @brief 配置文件类
+ *
+ * 配置文件每行一项，格式为 key = value，'#'开头的行为注释，
+ * key和value两边的空格会被去掉，同一个key出现多次时以最后一次为准。
+ *
+ * 例如：
+ *   # moserver.conf
+ *   port = 5005
+ *   workers = 4
+ *   log_file = /var/log/moserver/moserver.log
+ */
+class Config
+{
+	public:
+		char m_filename[301];
+
+		Config();
+
+		/*
+		 * 读取配置文件，成功时替换原来的全部配置项，失败时原来的配置项不变
+		 * 返回值 true为成功，false为文件打不开或者有格式错误的行
+		 * */
+		bool LoadFile(const char *filename);
+
+		/*
+		 * 用原来的文件名重新读取配置文件
+		 * */
+		bool Reload();
+
+		/*
+		 * 取配置项的值，配置项不存在时返回缺省值def
+		 * */
+		const char *GetStr(const char *key, const char *def = 0) const;
+
+		int GetInt(const char *key, const int def = 0) const;
+
+		long GetLong(const char *key, const long def = 0) const;
+
+		double GetDouble(const char *key, const double def = 0) const;
+
+		/*
+		 * true、yes、on、1为真，false、no、off、0为假，其他值返回缺省值
+		 * */
+		bool GetBool(const char *key, const bool def = false) const;
+
+		/*
+		 * 设置配置项，用于命令行参数覆盖配置文件中的值，重新读取配置文件后仍然有效
+		 * */
+		void Set(const char *key, const char *value);
+
+	private:
+		vector<pair<string, string> > m_items;
+		vector<pair<string, string> > m_overrides;
+};
+
+#endif
@@ -0,0 +1,928 @@
+#include "public.h"
+#include "coro.h"
+#include "metrics.h"
+
+#define CO_FRAME_CLASS   64       // 协程帧按64字节分档
+#define CO_FRAME_CLASSES 32       // 2KB以内的协程帧走空闲链表
+#define CO_FRAME_CACHE   256      // 每档最多缓存的空闲帧数
+#define CO_RBUF_SIZE     16384    // CoConn读缓冲区大小
+#define CO_MAX_EVENTS    256
+
+/*
+ * 每个线程一组空闲链表，空闲帧的前8个字节存放下一个空闲帧的地址
+ * 帧可以在一个线程中分配、在另一个线程中释放，释放的线程把它放进自己的链表
+ * */
+struct CoFrameCache
+{
+	void *m_free[CO_FRAME_CLASSES];
+	int   m_count[CO_FRAME_CLASSES];
+
+	CoFrameCache()
+	{
+		memset(m_free, 0, sizeof(m_free));
+		memset(m_count, 0, sizeof(m_count));
+	}
+
+	~CoFrameCache()
+	{
+		for (int i = 0; i < CO_FRAME_CLASSES; i++)
+		{
+			while (m_free[i] != 0)
+			{
+				void *next = *(void **)m_free[i];
+				free(m_free[i]);
+				m_free[i] = next;
+			}
+		}
+	}
+};
+
+static thread_local CoFrameCache t_frames;
+
+static thread_local CoScheduler *t_current = 0;
+
+void *CoFrameAlloc(size_t size)
+{
+	size_t iclass = (size + CO_FRAME_CLASS - 1) / CO_FRAME_CLASS;
+	if (iclass >= CO_FRAME_CLASSES)
+	{
+		void *ptr = malloc(size);
+		if (ptr == 0)
+		{
+			std::terminate();
+		}
+		return ptr;
+	}
+
+	void *ptr = t_frames.m_free[iclass];
+	if (ptr != 0)
+	{
+		t_frames.m_free[iclass] = *(void **)ptr;
+		t_frames.m_count[iclass]--;
+		return ptr;
+	}
+
+	ptr = malloc(iclass * CO_FRAME_CLASS);
+	if (ptr == 0)
+	{
+		std::terminate();
+	}
+	return ptr;
+}
+
+void CoFrameFree(void *ptr, size_t size)
+{
+	size_t iclass = (size + CO_FRAME_CLASS - 1) / CO_FRAME_CLASS;
+	if (iclass >= CO_FRAME_CLASSES || t_frames.m_count[iclass] >= CO_FRAME_CACHE)
+	{
+		free(ptr);
+		return;
+	}
+
+	*(void **)ptr = t_frames.m_free[iclass];
+	t_frames.m_free[iclass] = ptr;
+	t_frames.m_count[iclass]++;
+}
+
+unsigned long CoDeadline(const long itimeout_ms)
+{
+	return MetricNow() + (unsigned long)itimeout_ms * 1000000UL;
+}
+
+/*
+ * 函数功能：CoScheduler类构造函数
+ * */
+CoScheduler::CoScheduler()
+{
+	m_epfd = -1;
+	m_wakefd = -1;
+	m_bthread = false;
+	m_bstop = false;
+	pthread_mutex_init(&m_lock, 0);
+}
+
+bool CoScheduler::Init()
+{
+	// 对端关闭后继续写时不要因为SIGPIPE退出，和TCPClient、TCPServer相同
+	signal(SIGPIPE, SIG_IGN);
+
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd == -1)
+	{
+		return false;
+	}
+
+	m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakefd == -1)
+	{
+		close(m_epfd);
+		m_epfd = -1;
+		return false;
+	}
+
+	// data.ptr为0表示唤醒事件
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) != 0)
+	{
+		close(m_wakefd);
+		close(m_epfd);
+		m_wakefd = -1;
+		m_epfd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief 启动一个协程
+ * @details 在本调度器的线程中调用时直接放进就绪队列，否则放进加锁的队列并用eventfd唤醒
+ *          事件循环；队列原来不空时事件循环已经被唤醒过，不用再写eventfd
+ */
+void CoScheduler::Spawn(CoTask<void> &&task)
+{
+	std::coroutine_handle<> handle = task.Detach();
+	if (!handle)
+	{
+		return;
+	}
+
+	if (t_current == this)
+	{
+		m_ready.push_back(handle);
+		return;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	bool bwake = m_remote.empty();
+	m_remote.push_back(handle);
+	pthread_mutex_unlock(&m_lock);
+
+	if (bwake)
+	{
+		unsigned long one = 1;
+		if (write(m_wakefd, &one, sizeof(one)) < 0)
+		{
+			// eventfd计数溢出之前事件循环一定会读走，写失败也已经有未处理的唤醒
+		}
+	}
+}
+
+void CoScheduler::Run()
+{
+	t_current = this;
+
+	struct epoll_event events[CO_MAX_EVENTS];
+	vector<std::coroutine_handle<> > remote;
+
+	while (__atomic_load_n(&m_bstop, __ATOMIC_ACQUIRE) == false)
+	{
+		pthread_mutex_lock(&m_lock);
+		remote.swap(m_remote);
+		pthread_mutex_unlock(&m_lock);
+
+		for (size_t i = 0; i < remote.size(); i++)
+		{
+			m_ready.push_back(remote[i]);
+		}
+		remote.clear();
+
+		// 恢复的协程可能又唤醒其他协程，一直处理到就绪队列为空
+		while (m_ready.empty() == false)
+		{
+			std::coroutine_handle<> handle = m_ready.front();
+			m_ready.pop_front();
+			handle.resume();
+		}
+
+		int itimeout = -1;
+		if (m_timers.empty() == false)
+		{
+			unsigned long now = MetricNow();
+			unsigned long deadline = m_timers.begin()->first;
+			if (deadline <= now)
+			{
+				itimeout = 0;
+			}
+			else
+			{
+				unsigned long ms = (deadline - now + 999999) / 1000000;
+				itimeout = ms > INT_MAX ? INT_MAX : (int)ms;
+			}
+		}
+
+		int n = epoll_wait(m_epfd, events, CO_MAX_EVENTS, itimeout);
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == 0)
+			{
+				unsigned long count;
+				if (read(m_wakefd, &count, sizeof(count)) < 0)
+				{
+					// 多个唤醒合并成一次，读不到说明已经被读走
+				}
+				continue;
+			}
+
+			// 这里只把协程放进就绪队列，不恢复，处理完这一批事件之前CoConn不会被销毁
+			((CoConn *)events[i].data.ptr)->OnEvents(events[i].events);
+		}
+
+		ExpireTimers();
+	}
+
+	t_current = 0;
+}
+
+void *CoScheduler::ThreadMain(void *arg)
+{
+	((CoScheduler *)arg)->Run();
+	return 0;
+}
+
+bool CoScheduler::Start()
+{
+	if (m_epfd == -1 && Init() == false)
+	{
+		return false;
+	}
+
+	__atomic_store_n(&m_bstop, false, __ATOMIC_RELEASE);
+	if (pthread_create(&m_tid, 0, ThreadMain, this) != 0)
+	{
+		return false;
+	}
+	m_bthread = true;
+
+	return true;
+}
+
+void CoScheduler::Stop()
+{
+	__atomic_store_n(&m_bstop, true, __ATOMIC_RELEASE);
+
+	if (m_wakefd != -1)
+	{
+		unsigned long one = 1;
+		if (write(m_wakefd, &one, sizeof(one)) < 0)
+		{
+			// 同Spawn
+		}
+	}
+
+	if (m_bthread == true && pthread_equal(m_tid, pthread_self()) == 0)
+	{
+		pthread_join(m_tid, 0);
+		m_bthread = false;
+	}
+}
+
+CoScheduler *CoScheduler::Current()
+{
+	return t_current;
+}
+
+/*
+ * 边沿触发，同时关注读写，之后不用再调用epoll_ctl修改
+ * 协程总是先尝试读写，返回EAGAIN之后才等待，所以不会错过边沿
+ * */
+bool CoScheduler::Register(const int fd, CoConn *conn)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+
+	return epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void CoScheduler::Unregister(const int fd)
+{
+	epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, 0);
+}
+
+void CoScheduler::AddTimer(CoWaiter *waiter, const unsigned long deadline)
+{
+	waiter->m_timer = m_timers.insert(make_pair(deadline, waiter));
+	waiter->m_btimer = true;
+}
+
+void CoScheduler::Wake(CoWaiter *waiter)
+{
+	if (waiter->m_btimer == true)
+	{
+		m_timers.erase(waiter->m_timer);
+		waiter->m_btimer = false;
+	}
+
+	if (waiter->m_slot != 0)
+	{
+		*waiter->m_slot = 0;
+		waiter->m_slot = 0;
+	}
+
+	m_ready.push_back(waiter->m_handle);
+}
+
+void CoScheduler::ExpireTimers()
+{
+	if (m_timers.empty() == true)
+	{
+		return;
+	}
+
+	unsigned long now = MetricNow();
+	while (m_timers.empty() == false && m_timers.begin()->first <= now)
+	{
+		CoWaiter *waiter = m_timers.begin()->second;
+		m_timers.erase(m_timers.begin());
+		waiter->m_btimer = false;
+		waiter->m_btimeout = true;
+		Wake(waiter);
+	}
+}
+
+CoScheduler::~CoScheduler()
+{
+	Stop();
+
+	if (m_wakefd != -1)
+	{
+		close(m_wakefd);
+	}
+	if (m_epfd != -1)
+	{
+		close(m_epfd);
+	}
+	pthread_mutex_destroy(&m_lock);
+}
+
+/*
+ * 函数功能：CoConn类构造函数
+ * */
+CoConn::CoConn()
+{
+	m_fd = -1;
+	m_sched = 0;
+	m_reader = 0;
+	m_writer = 0;
+	m_rbuf = 0;
+	m_rbuf_begin = 0;
+	m_rbuf_end = 0;
+}
+
+bool CoConn::Attach(const int fd)
+{
+	Close();
+
+	m_sched = CoScheduler::Current();
+	if (m_sched == 0 || fd == -1)
+	{
+		return false;
+	}
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		return false;
+	}
+
+	if (m_sched->Register(fd, this) == false)
+	{
+		return false;
+	}
+	m_fd = fd;
+
+	return true;
+}
+
+/**
+ * @brief 非阻塞连接服务端
+ * @details IP地址直接转换，主机名用getaddrinfo解析，解析期间调度器线程是阻塞的；
+ *          connect返回EINPROGRESS后等待可写，再用SO_ERROR取连接结果
+ */
+CoTask<bool> CoConn::Connect(const char *host, const int port, const unsigned long deadline)
+{
+	Close();
+
+	m_sched = CoScheduler::Current();
+	if (m_sched == 0 || host == 0)
+	{
+		co_return false;
+	}
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen = 0;
+	memset(&addr, 0, sizeof(addr));
+
+	struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+	struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+	if (inet_pton(AF_INET, host, &addr4->sin_addr) == 1)
+	{
+		addr4->sin_family = AF_INET;
+		addr4->sin_port = htons(port);
+		addrlen = sizeof(*addr4);
+	}
+	else if (inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1)
+	{
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_port = htons(port);
+		addrlen = sizeof(*addr6);
+	}
+	else
+	{
+		struct addrinfo hints;
+		struct addrinfo *result = 0;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, 0, &hints, &result) != 0 || result == 0)
+		{
+			co_return false;
+		}
+		memcpy(&addr, result->ai_addr, result->ai_addrlen);
+		addrlen = result->ai_addrlen;
+		freeaddrinfo(result);
+
+		if (addr.ss_family == AF_INET)
+		{
+			addr4->sin_port = htons(port);
+		}
+		else
+		{
+			addr6->sin6_port = htons(port);
+		}
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		co_return false;
+	}
+
+	int sock_opt = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+
+	if (m_sched->Register(fd, this) == false)
+	{
+		close(fd);
+		co_return false;
+	}
+	m_fd = fd;
+
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) != 0)
+	{
+		if (errno != EINPROGRESS)
+		{
+			Close();
+			co_return false;
+		}
+
+		if (co_await WaitWritable(deadline) == false || m_fd == -1)
+		{
+			Close();
+			errno = ETIMEDOUT;
+			co_return false;
+		}
+
+		int ierror = 0;
+		socklen_t len = sizeof(ierror);
+		if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &ierror, &len) != 0 || ierror != 0)
+		{
+			Close();
+			errno = ierror;
+			co_return false;
+		}
+	}
+
+	co_return true;
+}
+
+/*
+ * 从socket补充读缓冲区
+ * 返回值 >0为读到的字节数，0为暂时没有数据，-1为连接关闭或者出错
+ * */
+int CoConn::FillBuffer()
+{
+	if (m_rbuf == 0)
+	{
+		m_rbuf = (char *)malloc(CO_RBUF_SIZE);
+		if (m_rbuf == 0)
+		{
+			return -1;
+		}
+	}
+
+	if (m_rbuf_begin == m_rbuf_end)
+	{
+		m_rbuf_begin = 0;
+		m_rbuf_end = 0;
+	}
+	else if (m_rbuf_end == CO_RBUF_SIZE)
+	{
+		memmove(m_rbuf, m_rbuf + m_rbuf_begin, m_rbuf_end - m_rbuf_begin);
+		m_rbuf_end -= m_rbuf_begin;
+		m_rbuf_begin = 0;
+	}
+
+	int iret = RecvDirect(m_rbuf + m_rbuf_end, CO_RBUF_SIZE - m_rbuf_end);
+	if (iret > 0)
+	{
+		m_rbuf_end += iret;
+	}
+
+	return iret;
+}
+
+/*
+ * 不经过读缓冲区直接读，返回值同FillBuffer
+ * */
+int CoConn::RecvDirect(char *buffer, const size_t n)
+{
+	if (m_fd == -1)
+	{
+		return -1;
+	}
+
+	while (true)
+	{
+		ssize_t rbytes = recv(m_fd, buffer, n, 0);
+		if (rbytes > 0)
+		{
+			return (int)rbytes;
+		}
+
+		if (rbytes == 0)
+		{
+			return -1;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+}
+
+/*
+ * 尽量发送iov中的数据，发送完的数据段从iov中去掉
+ * 返回值 1为全部发送完，0为socket缓冲区满，-1为出错
+ * */
+int CoConn::SendV(struct iovec **iov, int *iovcnt)
+{
+	while (*iovcnt > 0)
+	{
+		if (m_fd == -1)
+		{
+			return -1;
+		}
+
+		ssize_t wbytes = writev(m_fd, *iov, *iovcnt);
+		if (wbytes < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		// 跳过已经发送完的数据段，调整发送了一部分的数据段，和TCPWriteV相同
+		while (*iovcnt > 0 && wbytes >= (ssize_t)(*iov)->iov_len)
+		{
+			wbytes -= (*iov)->iov_len;
+			(*iov)++;
+			(*iovcnt)--;
+		}
+
+		if (*iovcnt > 0)
+		{
+			(*iov)->iov_base = (char *)(*iov)->iov_base + wbytes;
+			(*iov)->iov_len -= wbytes;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * @brief 读取一个报文
+ * @details 长度头和小报文从读缓冲区中取，一次recv可以读到多个报文；
+ *          报文剩下的部分超过缓冲区中已有的数据时直接读到调用者的缓冲区，不多拷贝一次
+ */
+CoTask<bool> CoConn::ReadFrame(char *buffer, int *ilen, const int imaxlen, const unsigned long deadline)
+{
+	(*ilen) = 0;
+
+	while (m_rbuf_end - m_rbuf_begin < 4)
+	{
+		int iret = FillBuffer();
+		if (iret < 0)
+		{
+			co_return false;
+		}
+
+		if (iret == 0 && co_await WaitReadable(deadline) == false)
+		{
+			co_return false;
+		}
+	}
+
+	int ibody;
+	memcpy(&ibody, m_rbuf + m_rbuf_begin, 4);
+	ibody = ntohl(ibody);
+
+	// 长度头来自对端，不可信，超过缓冲区大小时不能继续读
+	if (ibody < 0 || (imaxlen > 0 && ibody > imaxlen))
+	{
+		co_return false;
+	}
+	m_rbuf_begin += 4;
+
+	int icopy = m_rbuf_end - m_rbuf_begin < ibody ? m_rbuf_end - m_rbuf_begin : ibody;
+	memcpy(buffer, m_rbuf + m_rbuf_begin, icopy);
+	m_rbuf_begin += icopy;
+
+	int idone = icopy;
+	while (idone < ibody)
+	{
+		int iret = RecvDirect(buffer + idone, ibody - idone);
+		if (iret < 0)
+		{
+			co_return false;
+		}
+
+		if (iret == 0)
+		{
+			if (co_await WaitReadable(deadline) == false)
+			{
+				co_return false;
+			}
+			continue;
+		}
+
+		idone += iret;
+	}
+
+	(*ilen) = ibody;
+
+	co_return true;
+}
+
+CoTask<bool> CoConn::ReadN(char *buffer, const size_t n, const unsigned long deadline)
+{
+	size_t idone = (size_t)(m_rbuf_end - m_rbuf_begin) < n ? (size_t)(m_rbuf_end - m_rbuf_begin) : n;
+	if (idone > 0)
+	{
+		memcpy(buffer, m_rbuf + m_rbuf_begin, idone);
+		m_rbuf_begin += idone;
+	}
+
+	while (idone < n)
+	{
+		int iret = RecvDirect(buffer + idone, n - idone);
+		if (iret < 0)
+		{
+			co_return false;
+		}
+
+		if (iret == 0)
+		{
+			if (co_await WaitReadable(deadline) == false)
+			{
+				co_return false;
+			}
+			continue;
+		}
+
+		idone += iret;
+	}
+
+	co_return true;
+}
+
+/**
+ * @brief 发送一个报文
+ * @details 长度头和报文用一次writev发出；socket缓冲区满时才挂起等待可写
+ */
+CoTask<bool> CoConn::WriteFrame(const char *buffer, const int ilen, const unsigned long deadline)
+{
+	if (m_fd == -1)
+	{
+		co_return false;
+	}
+
+	int ibody = ilen == 0 ? strlen(buffer) : ilen;
+	int iheader = htonl(ibody);
+
+	struct iovec iovs[2];
+	iovs[0].iov_base = &iheader;
+	iovs[0].iov_len = 4;
+	iovs[1].iov_base = (void *)buffer;
+	iovs[1].iov_len = ibody;
+
+	struct iovec *iov = iovs;
+	int iovcnt = 2;
+	while (true)
+	{
+		int iret = SendV(&iov, &iovcnt);
+		if (iret != 0)
+		{
+			co_return iret > 0;
+		}
+
+		if (co_await WaitWritable(deadline) == false)
+		{
+			co_return false;
+		}
+	}
+}
+
+CoTask<bool> CoConn::WriteV(struct iovec *iov, int iovcnt, const unsigned long deadline)
+{
+	while (true)
+	{
+		int iret = SendV(&iov, &iovcnt);
+		if (iret != 0)
+		{
+			co_return iret > 0;
+		}
+
+		if (co_await WaitWritable(deadline) == false)
+		{
+			co_return false;
+		}
+	}
+}
+
+CoIoAwait CoConn::WaitReadable(const unsigned long deadline)
+{
+	return CoIoAwait{m_sched, &m_reader, deadline, CoWaiter()};
+}
+
+CoIoAwait CoConn::WaitWritable(const unsigned long deadline)
+{
+	return CoIoAwait{m_sched, &m_writer, deadline, CoWaiter()};
+}
+
+/*
+ * 出错和对端关闭时读写两个方向的等待者都唤醒，由它们的读写调用返回错误
+ * */
+void CoConn::OnEvents(const unsigned int events)
+{
+	if (m_reader != 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+	{
+		m_sched->Wake(m_reader);
+	}
+
+	if (m_writer != 0 && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+	{
+		m_sched->Wake(m_writer);
+	}
+}
+
+/*
+ * 关闭连接，正在等待这个连接的协程被唤醒，它们的读写返回false
+ * */
+void CoConn::Close()
+{
+	if (m_fd != -1)
+	{
+		if (m_sched != 0)
+		{
+			m_sched->Unregister(m_fd);
+		}
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	if (m_sched != 0)
+	{
+		if (m_reader != 0)
+		{
+			m_sched->Wake(m_reader);
+		}
+		if (m_writer != 0)
+		{
+			m_sched->Wake(m_writer);
+		}
+	}
+
+	m_rbuf_begin = 0;
+	m_rbuf_end = 0;
+}
+
+CoConn::~CoConn()
+{
+	Close();
+	free(m_rbuf);
+}
+
+/*
+ * 函数功能：CoListener类构造函数
+ * */
+CoListener::CoListener()
+{
+	m_listenfd = -1;
+}
+
+/*
+ * 创建监听socket，可以在任何线程中调用，第一次Accept时注册到当时的调度器
+ * */
+bool CoListener::Listen(const unsigned int port, const int backlog)
+{
+	Close();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	m_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listenfd == -1)
+	{
+		return false;
+	}
+
+	int sock_opt = 1;
+	setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt));
+
+	struct sockaddr_in servaddr;
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+
+	if (bind(m_listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0 || listen(m_listenfd, backlog) != 0)
+	{
+		close(m_listenfd);
+		m_listenfd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief 等待一个新连接
+ * @details 新连接设置了非阻塞和TCP_NODELAY，可以交给任何一个调度器上的协程Attach
+ */
+CoTask<int> CoListener::Accept(const unsigned long deadline)
+{
+	if (m_listenfd == -1)
+	{
+		co_return -1;
+	}
+
+	if (m_conn.m_fd == -1 && m_conn.Attach(m_listenfd) == false)
+	{
+		co_return -1;
+	}
+
+	while (true)
+	{
+		int fd = accept4(m_listenfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd != -1)
+		{
+			int sock_opt = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+			co_return fd;
+		}
+
+		if (errno == EINTR || errno == ECONNABORTED)
+		{
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			co_return -1;
+		}
+
+		if (co_await m_conn.WaitReadable(deadline) == false || m_listenfd == -1)
+		{
+			co_return -1;
+		}
+	}
+}
+
+void CoListener::Close()
+{
+	if (m_conn.m_fd != -1)
+	{
+		// 监听socket由m_conn关闭
+		m_conn.Close();
+	}
+	else if (m_listenfd != -1)
+	{
+		close(m_listenfd);
+	}
+	m_listenfd = -1;
+}
+
+CoListener::~CoListener()
+{
+	Close();
+}
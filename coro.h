@@ -0,0 +1,507 @@
+#ifndef __CORO_H__
+#define __CORO_H__
+#include "public.h"
+#include <coroutine>
+
+/**
+ * 基于C++20协程和epoll的异步网络接口
+ *
+ * 每个CoScheduler是一个线程上的事件循环，协程在哪个调度器上启动就一直在那个线程上运行，
+ * 协程之间不用加锁。几个调度器就可以承载成千上万个连接，每个连接的处理逻辑仍然是
+ * 顺序的代码：
+ *
+ *   CoTask<void> Session(int fd)
+ *   {
+ *       CoConn conn;
+ *       conn.Attach(fd);
+ *       char buffer[4096];
+ *       int ilen;
+ *       while (co_await conn.ReadFrame(buffer, &ilen, sizeof(buffer)))
+ *       {
+ *           if (!co_await conn.WriteFrame(buffer, ilen)) break;
+ *       }
+ *   }
+ *
+ *   CoScheduler sched;
+ *   sched.Start();
+ *   sched.Spawn(Session(fd));
+ *
+ * 报文格式和TCPRead/TCPWrite相同，可以和阻塞接口的一端互通。
+ * 超时都用绝对时间deadline表示，单位为纳秒，和MetricNow()同一个时钟，0表示不超时，
+ * 可以用CoDeadline(毫秒数)计算。
+ */
+
+class CoScheduler;
+class CoConn;
+
+/*
+ * 协程帧的内存从每个线程的空闲链表中分配，短小的协程反复创建时不用每次调用malloc
+ * */
+void *CoFrameAlloc(size_t size);
+
+void CoFrameFree(void *ptr, size_t size);
+
+/*
+ * 从现在起itimeout_ms毫秒之后的deadline
+ * */
+unsigned long CoDeadline(const long itimeout_ms);
+
+template <typename T> class CoTask;
+
+struct CoPromiseBase
+{
+	std::coroutine_handle<> m_continuation;   // co_await这个任务的协程，完成时恢复它
+	bool                    m_bdetached;      // 由调度器启动，完成时自己销毁
+
+	CoPromiseBase() : m_bdetached(false)
+	{
+	}
+
+	static void *operator new(size_t size)
+	{
+		return CoFrameAlloc(size);
+	}
+
+	static void operator delete(void *ptr, size_t size)
+	{
+		CoFrameFree(ptr, size);
+	}
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return std::suspend_always();
+	}
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+		{
+			CoPromiseBase &promise = handle.promise();
+			if (promise.m_continuation)
+			{
+				return promise.m_continuation;
+			}
+
+			if (promise.m_bdetached == true)
+			{
+				handle.destroy();
+			}
+
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	FinalAwaiter final_suspend() noexcept
+	{
+		return FinalAwaiter();
+	}
+
+	// 本库不使用异常，协程中抛出异常和普通函数中未捕获的异常一样终止程序
+	void unhandled_exception()
+	{
+		std::terminate();
+	}
+};
+
+template <typename T>
+struct CoPromise : public CoPromiseBase
+{
+	T m_value;
+
+	CoTask<T> get_return_object();
+
+	void return_value(T value)
+	{
+		m_value = std::move(value);
+	}
+
+	T Result()
+	{
+		return std::move(m_value);
+	}
+};
+
+template <>
+struct CoPromise<void> : public CoPromiseBase
+{
+	CoTask<void> get_return_object();
+
+	void return_void()
+	{
+	}
+
+	void Result()
+	{
+	}
+};
+
+/**
+ * @brief 协程任务，创建后不立即运行，被co_await或者交给CoScheduler::Spawn时才开始运行
+ */
+template <typename T>
+class CoTask
+{
+	public:
+		typedef CoPromise<T> promise_type;
+		typedef std::coroutine_handle<promise_type> Handle;
+
+		CoTask() : m_handle()
+		{
+		}
+
+		explicit CoTask(Handle handle) : m_handle(handle)
+		{
+		}
+
+		CoTask(CoTask &&other) noexcept : m_handle(other.m_handle)
+		{
+			other.m_handle = Handle();
+		}
+
+		CoTask &operator=(CoTask &&other) noexcept
+		{
+			if (this != &other)
+			{
+				if (m_handle)
+				{
+					m_handle.destroy();
+				}
+				m_handle = other.m_handle;
+				other.m_handle = Handle();
+			}
+			return *this;
+		}
+
+		CoTask(const CoTask &) = delete;
+		CoTask &operator=(const CoTask &) = delete;
+
+		~CoTask()
+		{
+			if (m_handle)
+			{
+				m_handle.destroy();
+			}
+		}
+
+		/*
+		 * 交出协程的所有权，完成时协程自己销毁，由CoScheduler::Spawn调用
+		 * */
+		std::coroutine_handle<> Detach()
+		{
+			Handle handle = m_handle;
+			m_handle = Handle();
+			if (handle)
+			{
+				handle.promise().m_bdetached = true;
+			}
+			return handle;
+		}
+
+		struct Awaiter
+		{
+			Handle m_handle;
+
+			bool await_ready() noexcept
+			{
+				return !m_handle || m_handle.done();
+			}
+
+			// 对称转移：直接切换到被等待的协程，不经过调度器，也不会加深调用栈
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				m_handle.promise().m_continuation = caller;
+				return m_handle;
+			}
+
+			T await_resume()
+			{
+				return m_handle.promise().Result();
+			}
+		};
+
+		Awaiter operator co_await() const & noexcept
+		{
+			return Awaiter{m_handle};
+		}
+
+		Awaiter operator co_await() const && noexcept
+		{
+			return Awaiter{m_handle};
+		}
+
+	private:
+		Handle m_handle;
+};
+
+template <typename T>
+inline CoTask<T> CoPromise<T>::get_return_object()
+{
+	return CoTask<T>(CoTask<T>::Handle::from_promise(*this));
+}
+
+inline CoTask<void> CoPromise<void>::get_return_object()
+{
+	return CoTask<void>(CoTask<void>::Handle::from_promise(*this));
+}
+
+/**
+ * @brief 一个挂起等待IO或者定时器的协程
+ */
+struct CoWaiter
+{
+	std::coroutine_handle<> m_handle;
+	bool                    m_btimeout;   // 因为超时被唤醒
+	bool                    m_btimer;     // 是否在定时器表中
+	struct CoWaiter       **m_slot;       // 等待IO时指向CoConn中的读或者写等待者，唤醒时清空
+	multimap<unsigned long, CoWaiter *>::iterator m_timer;
+};
+
+/**
+ * @brief 一个线程上的epoll事件循环
+ */
+class CoScheduler
+{
+	public:
+		CoScheduler();
+
+		/*
+		 * 创建epoll，Start或者Run之前调用
+		 * */
+		bool Init();
+
+		/*
+		 * 启动一个协程，可以在任何线程中调用，协程在本调度器的线程上运行
+		 * */
+		void Spawn(CoTask<void> &&task);
+
+		/*
+		 * 在当前线程中运行事件循环，直到Stop
+		 * */
+		void Run();
+
+		/*
+		 * 创建一个线程运行事件循环
+		 * */
+		bool Start();
+
+		/*
+		 * 停止事件循环并等待线程结束，可以在任何线程中调用
+		 * 还在等待IO的协程不会被恢复，也不会被销毁
+		 * */
+		void Stop();
+
+		/*
+		 * 当前线程上运行的调度器，不在调度器线程上时返回0
+		 * */
+		static CoScheduler *Current();
+
+		/*
+		 * 以下供CoConn等可等待对象使用
+		 * */
+		bool Register(const int fd, CoConn *conn);
+
+		void Unregister(const int fd);
+
+		void AddTimer(CoWaiter *waiter, const unsigned long deadline);
+
+		/*
+		 * 唤醒一个等待中的协程，取消它的定时器，协程在本轮事件处理完后恢复
+		 * */
+		void Wake(CoWaiter *waiter);
+
+		~CoScheduler();
+
+	private:
+		int       m_epfd;
+		int       m_wakefd;
+		pthread_t m_tid;
+		bool      m_bthread;
+		bool      m_bstop;
+
+		deque<std::coroutine_handle<> > m_ready;     // 可以恢复的协程，只在调度器线程中访问
+		multimap<unsigned long, CoWaiter *> m_timers;
+
+		pthread_mutex_t m_lock;
+		vector<std::coroutine_handle<> > m_remote;   // 其他线程Spawn的协程
+
+		static void *ThreadMain(void *arg);
+
+		void ExpireTimers();
+};
+
+/**
+ * @brief 等待fd可读或者可写的可等待对象，co_await的结果为false表示超时
+ */
+struct CoIoAwait
+{
+	CoScheduler   *m_sched;
+	CoWaiter     **m_slot;       // CoConn中读或者写的等待者
+	unsigned long  m_deadline;
+	CoWaiter       m_waiter;
+
+	bool await_ready() noexcept
+	{
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		m_waiter.m_handle = handle;
+		m_waiter.m_btimeout = false;
+		m_waiter.m_btimer = false;
+		m_waiter.m_slot = m_slot;
+		*m_slot = &m_waiter;
+		if (m_deadline != 0)
+		{
+			m_sched->AddTimer(&m_waiter, m_deadline);
+		}
+	}
+
+	bool await_resume() noexcept
+	{
+		return m_waiter.m_btimeout == false;
+	}
+};
+
+/**
+ * @brief 等待到deadline的可等待对象
+ */
+struct CoSleep
+{
+	unsigned long m_deadline;
+	CoWaiter      m_waiter;
+
+	explicit CoSleep(const unsigned long deadline) : m_deadline(deadline)
+	{
+	}
+
+	bool await_ready() noexcept
+	{
+		return CoScheduler::Current() == 0;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		m_waiter.m_handle = handle;
+		m_waiter.m_btimeout = false;
+		m_waiter.m_btimer = false;
+		m_waiter.m_slot = 0;
+		CoScheduler::Current()->AddTimer(&m_waiter, m_deadline);
+	}
+
+	void await_resume() noexcept
+	{
+	}
+};
+
+/**
+ * @brief 协程中使用的TCP连接，对应阻塞接口的TCPClient
+ *
+ * 必须在调度器线程上创建和使用。同一时刻最多一个协程在读、一个协程在写，
+ * 读写可以在两个协程中同时进行。
+ */
+class CoConn
+{
+	public:
+		int m_fd;
+
+		CoConn();
+
+		/*
+		 * 接管一个已经连接的socket，设置为非阻塞并注册到当前线程的调度器
+		 * */
+		bool Attach(const int fd);
+
+		/*
+		 * 连接服务端，host为IP地址或者主机名（主机名的解析是阻塞的）
+		 * */
+		CoTask<bool> Connect(const char *host, const int port, const unsigned long deadline = 0);
+
+		/*
+		 * 读取一个报文，ilen返回报文长度，imaxlen为缓冲区大小，0表示不检查
+		 * */
+		CoTask<bool> ReadFrame(char *buffer, int *ilen, const int imaxlen = 0, const unsigned long deadline = 0);
+
+		/*
+		 * 读取n个字节
+		 * */
+		CoTask<bool> ReadN(char *buffer, const size_t n, const unsigned long deadline = 0);
+
+		/*
+		 * 发送一个报文，ilen为0时按字符串处理
+		 * */
+		CoTask<bool> WriteFrame(const char *buffer, const int ilen, const unsigned long deadline = 0);
+
+		/*
+		 * 发送多段数据，不加长度头，iov在发送过程中会被修改
+		 * */
+		CoTask<bool> WriteV(struct iovec *iov, int iovcnt, const unsigned long deadline = 0);
+
+		CoIoAwait WaitReadable(const unsigned long deadline = 0);
+
+		CoIoAwait WaitWritable(const unsigned long deadline = 0);
+
+		/*
+		 * 有事件时由调度器调用
+		 * */
+		void OnEvents(const unsigned int events);
+
+		void Close();
+
+		~CoConn();
+
+	private:
+		CoScheduler *m_sched;
+		CoWaiter    *m_reader;
+		CoWaiter    *m_writer;
+
+		char *m_rbuf;          // 读缓冲区，小报文一次recv可以读到多个
+		int   m_rbuf_begin;
+		int   m_rbuf_end;
+
+		int FillBuffer();
+
+		int RecvDirect(char *buffer, const size_t n);
+
+		int SendV(struct iovec **iov, int *iovcnt);
+
+		CoConn(const CoConn &) = delete;
+		CoConn &operator=(const CoConn &) = delete;
+};
+
+/**
+ * @brief 协程中使用的监听socket，对应阻塞接口的TCPServer
+ */
+class CoListener
+{
+	public:
+		int m_listenfd;
+
+		CoListener();
+
+		bool Listen(const unsigned int port, const int backlog = 1024);
+
+		/*
+		 * 等待一个新连接，返回非阻塞的socket，失败或者超时返回-1
+		 * */
+		CoTask<int> Accept(const unsigned long deadline = 0);
+
+		void Close();
+
+		~CoListener();
+
+	private:
+		CoConn m_conn;   // 借用CoConn的等待机制，m_conn.m_fd就是监听socket
+};
+
+#endif
@@ -0,0 +1,335 @@
+#include "public.h"
+#include "dircache.h"
+#include "metrics.h"
+
+static MetricCounter *g_dircache_misses = NewMetricCounter("moserver_dircache_misses_total", "Directory lookups that had to open or create the directory");
+static MetricCounter *g_dircache_stale = NewMetricCounter("moserver_dircache_stale_total", "Times the directory cache was cleared because a cached directory disappeared");
+
+/*
+ * 去掉结尾的'/'，根目录保留
+ * */
+static size_t DirLen(const char *dir, size_t len)
+{
+	while (len > 1 && dir[len - 1] == '/')
+	{
+		len--;
+	}
+
+	return len;
+}
+
+/*
+ * 打开目录，不存在时先创建，name相对于base
+ * */
+static int OpenDir(const int base, const char *name)
+{
+	int fd = openat(base, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 && errno == ENOENT)
+	{
+		if (mkdirat(base, name, 0755) != 0 && errno != EEXIST)
+		{
+			return -1;
+		}
+		fd = openat(base, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	return fd;
+}
+
+DirCache::DirCache()
+{
+	m_max_dirs = 64;
+	m_max_paths = 4096;
+	pthread_rwlock_init(&m_lock, 0);
+}
+
+int DirCache::FindLocked(const char *dir, const size_t len)
+{
+	auto it = m_dirs.find(string_view(dir, len));
+	return it == m_dirs.end() ? -1 : it->second;
+}
+
+/**
+ * @brief 打开并缓存目录，需要持有写锁
+ * @details 先找最长的已缓存的上级目录，剩下的部分一次openat能打开就只缓存目录本身，
+ *          否则从这个上级目录开始逐级打开或者创建，每一级都缓存
+ * @return 目录的fd，失败时返回-1
+ */
+int DirCache::CreateLocked(const char *dir, const size_t len)
+{
+	int fd = FindLocked(dir, len);
+	if (fd != -1)
+	{
+		return fd;
+	}
+
+	g_dircache_misses->Add();
+	if ((int)m_dirs.size() >= m_max_dirs)
+	{
+		ClearLocked();
+	}
+
+	int base = AT_FDCWD;
+	size_t start = 0;
+	for (size_t i = len - 1; i > 0 && base == AT_FDCWD; i--)
+	{
+		if (dir[i] == '/' && (fd = FindLocked(dir, i)) != -1)
+		{
+			base = fd;
+			start = i + 1;
+		}
+	}
+
+	// 相对于AT_FDCWD时用从头开始的路径
+	string path(dir, len);
+	const char *rest = path.c_str() + start;
+	if ((fd = openat(base, rest, O_PATH | O_DIRECTORY | O_CLOEXEC)) != -1)
+	{
+		m_dirs.emplace(path, fd);
+		return fd;
+	}
+	if (errno != ENOENT)
+	{
+		return -1;
+	}
+
+	while (start < len)
+	{
+		size_t end = start;
+		while (end < len && path[end] != '/')
+		{
+			end++;
+		}
+		if (end == start)
+		{
+			// 开头的'/'或者连续的'/'
+			start = end + 1;
+			continue;
+		}
+
+		path[end] = 0;
+		fd = OpenDir(base, base == AT_FDCWD ? path.c_str() : path.c_str() + start);
+		if (fd == -1)
+		{
+			return -1;
+		}
+		m_dirs.emplace(string(path.c_str(), end), fd);
+		if (end < len)
+		{
+			path[end] = '/';
+		}
+
+		base = fd;
+		start = end + 1;
+	}
+
+	return fd;
+}
+
+/**
+ * @brief 加锁并取得目录的fd，不存在时创建
+ * @param bstale 缓存的目录已经不存在，先清空缓存
+ * @return 目录的fd，失败时返回-1，无论成败返回时都持有锁，由调用者解锁
+ */
+int DirCache::LockDir(const char *dir, const size_t len, const bool bstale)
+{
+	if (bstale == false)
+	{
+		pthread_rwlock_rdlock(&m_lock);
+		int fd = FindLocked(dir, len);
+		if (fd != -1)
+		{
+			return fd;
+		}
+		pthread_rwlock_unlock(&m_lock);
+	}
+
+	pthread_rwlock_wrlock(&m_lock);
+	if (bstale == true)
+	{
+		g_dircache_stale->Add();
+		ClearLocked();
+	}
+
+	return CreateLocked(dir, len);
+}
+
+/**
+ * @brief 逐级创建目录并记录路径，不打开fd，需要持有写锁
+ * @details 多数情况下上级目录已经存在，先直接mkdir整个路径；上级目录不存在时从最长的
+ *          已知存在的上级目录开始逐级mkdir
+ */
+bool DirCache::MakePathLocked(const char *dir, const size_t len)
+{
+	if (m_paths.find(string_view(dir, len)) != m_paths.end())
+	{
+		return true;
+	}
+
+	g_dircache_misses->Add();
+	if ((int)m_paths.size() >= m_max_paths)
+	{
+		m_paths.clear();
+	}
+
+	string path(dir, len);
+	struct stat st;
+	if (mkdir(path.c_str(), 0755) == 0 || (errno == EEXIST && stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)))
+	{
+		m_paths.emplace(path);
+		return true;
+	}
+	if (errno != ENOENT)
+	{
+		return false;
+	}
+
+	size_t start = 0;
+	for (size_t i = len - 1; i > 0 && start == 0; i--)
+	{
+		if (dir[i] == '/' && (m_paths.find(string_view(dir, i)) != m_paths.end() || FindLocked(dir, i) != -1))
+		{
+			start = i + 1;
+		}
+	}
+
+	while (start < len)
+	{
+		size_t end = start;
+		while (end < len && path[end] != '/')
+		{
+			end++;
+		}
+		if (end > start)
+		{
+			// 开头的'/'或者连续的'/'跳过；已经存在的不是目录时下一级的mkdir返回ENOTDIR
+			path[end] = 0;
+			if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+			{
+				return false;
+			}
+			m_paths.emplace(path.c_str(), end);
+			if (end < len)
+			{
+				path[end] = '/';
+			}
+		}
+		start = end + 1;
+	}
+
+	return true;
+}
+
+bool DirCache::MakeDirs(const char *dir, const size_t len)
+{
+	size_t ilen = DirLen(dir, len);
+	if (ilen == 0)
+	{
+		return true;
+	}
+
+	pthread_rwlock_rdlock(&m_lock);
+	bool bfound = m_paths.find(string_view(dir, ilen)) != m_paths.end() || FindLocked(dir, ilen) != -1;
+	pthread_rwlock_unlock(&m_lock);
+	if (bfound == true)
+	{
+		return true;
+	}
+
+	pthread_rwlock_wrlock(&m_lock);
+	bool bok = MakePathLocked(dir, ilen);
+	pthread_rwlock_unlock(&m_lock);
+
+	return bok;
+}
+
+bool DirCache::MakeDirs(const char *dir)
+{
+	return MakeDirs(dir, strlen(dir));
+}
+
+int DirCache::Open(const char *filename, const int flags, const mode_t mode)
+{
+	const char *slash = strrchr(filename, '/');
+	if (slash == 0 || slash == filename)
+	{
+		return open(filename, flags, mode);
+	}
+
+	// 命中时只有一次openat，创建文件时返回ENOENT说明缓存的目录已经被删除，重建后再试一次
+	size_t len = DirLen(filename, slash - filename);
+	for (int itry = 0; ; itry++)
+	{
+		int dirfd = LockDir(filename, len, itry > 0);
+		int fd = (dirfd == -1) ? -1 : openat(dirfd, slash + 1, flags, mode);
+		int err = errno;
+		pthread_rwlock_unlock(&m_lock);
+
+		if (fd != -1 || dirfd == -1 || err != ENOENT || (flags & O_CREAT) == 0 || itry > 0)
+		{
+			errno = err;
+			return fd;
+		}
+	}
+}
+
+int DirCache::OpenFiles(const char *dir, const vector<string> &names, const int flags, vector<int> &fds, const mode_t mode)
+{
+	fds.assign(names.size(), -1);
+
+	size_t len = DirLen(dir, strlen(dir));
+	int icount = 0;
+	bool bstale = false;
+	int dirfd = LockDir(dir, len, false);
+	for (size_t i = 0; i < names.size() && dirfd != -1; i++)
+	{
+		fds[i] = openat(dirfd, names[i].c_str(), flags, mode);
+		if (fds[i] == -1 && errno == ENOENT && (flags & O_CREAT) != 0 && bstale == false)
+		{
+			// 目录在外部被删除了，只重建一次
+			pthread_rwlock_unlock(&m_lock);
+			bstale = true;
+			if ((dirfd = LockDir(dir, len, true)) != -1)
+			{
+				fds[i] = openat(dirfd, names[i].c_str(), flags, mode);
+			}
+		}
+		if (fds[i] != -1)
+		{
+			icount++;
+		}
+	}
+	pthread_rwlock_unlock(&m_lock);
+
+	return icount;
+}
+
+void DirCache::ClearLocked()
+{
+	for (auto &it : m_dirs)
+	{
+		close(it.second);
+	}
+	m_dirs.clear();
+	m_paths.clear();
+}
+
+void DirCache::Clear()
+{
+	pthread_rwlock_wrlock(&m_lock);
+	ClearLocked();
+	pthread_rwlock_unlock(&m_lock);
+}
+
+DirCache::~DirCache()
+{
+	Clear();
+	pthread_rwlock_destroy(&m_lock);
+}
+
+DirCache &DefaultDirCache()
+{
+	// 第一次使用时构造，静态初始化阶段调用FOpen也是安全的；不析构，退出时后台线程还可能在写日志
+	static DirCache *cache = new DirCache();
+	return *cache;
+}
@@ -0,0 +1,87 @@
+#ifndef __DIRCACHE_H__
+#define __DIRCACHE_H__
+#include "public.h"
+#include <string_view>
+
+/**
+ * @brief 已经存在的目录的缓存
+ *
+ * Open和OpenFiles记录目录的fd（O_PATH打开，不占用读写权限），在目录下创建文件只需要一次
+ * 相对于目录fd的openat，内核不用再从根目录逐级查找路径。没有命中时从最长的已缓存的上级目录开始，
+ * 用mkdirat/openat逐级创建和打开，每一级只做一次。每个缓存的目录占用一个fd，
+ * 所以最多缓存m_max_dirs个，不会因为按日期分区的深层目录用光进程的fd。
+ *
+ * MakeDirs只记录确认存在的目录路径，不打开fd，命中时不需要系统调用；没有命中时从最长的
+ * 已知存在的上级目录开始逐级mkdir。
+ *
+ * 缓存不会发现目录在外部被删除或者改名：删除之后openat返回ENOENT，
+ * Open会清空缓存重新创建目录再试一次；用MakeDirs的调用者遇到ENOENT时应该调用Clear后重试。
+ * 目录被改名时相对于旧fd创建的文件会跟着目录走，需要改名目录的程序应该调用Clear。
+ * 相对路径按照缓存时的当前目录解析，改变当前目录后也应该调用Clear。
+ *
+ * 所有方法都是线程安全的，命中时只加读锁。
+ */
+class DirCache
+{
+	public:
+		int m_max_dirs;    // 最多缓存fd的目录数，超过时清空，缺省64
+		int m_max_paths;   // MakeDirs最多记录的目录路径数，超过时清空，缺省4096
+
+		DirCache();
+
+		/*
+		 * 确保目录存在，不存在时逐级创建
+		 * */
+		bool MakeDirs(const char *dir);
+
+		bool MakeDirs(const char *dir, const size_t len);
+
+		/*
+		 * 打开文件，flags和mode同open，上级目录不存在时先创建
+		 * 返回值 文件描述符，失败时返回-1
+		 * */
+		int Open(const char *filename, const int flags, const mode_t mode = 0644);
+
+		/*
+		 * 在同一个目录下批量打开文件，目录只查找一次，每个文件一次openat
+		 * fds 返回每个文件的描述符，失败的为-1
+		 * 返回值 成功打开的文件数
+		 * */
+		int OpenFiles(const char *dir, const vector<string> &names, const int flags, vector<int> &fds, const mode_t mode = 0644);
+
+		/*
+		 * 关闭所有目录的fd，清空缓存
+		 * */
+		void Clear();
+
+		~DirCache();
+
+	private:
+		// 用string_view查找，命中时不需要构造string
+		struct PathHash
+		{
+			typedef void is_transparent;
+			size_t operator()(const string_view path) const { return hash<string_view>()(path); }
+		};
+
+		pthread_rwlock_t                                  m_lock;
+		unordered_map<string, int, PathHash, equal_to<>>  m_dirs;   // 目录路径，不带结尾的'/' -> O_PATH的fd
+		unordered_set<string, PathHash, equal_to<>>       m_paths;  // MakeDirs确认存在的目录路径，不带结尾的'/'
+
+		int LockDir(const char *dir, const size_t len, const bool bstale);
+
+		int FindLocked(const char *dir, const size_t len);
+
+		int CreateLocked(const char *dir, const size_t len);
+
+		bool MakePathLocked(const char *dir, const size_t len);
+
+		void ClearLocked();
+};
+
+/*
+ * MKdir和FOpen使用的全局缓存
+ * */
+DirCache &DefaultDirCache();
+
+#endif
@@ -0,0 +1,510 @@
+#include "public.h"
+#include "dirscan.h"
+#include "utils.h"
+
+/*
+ * getdents64返回的目录项，glibc的头文件中没有导出
+ * */
+struct LinuxDirent64
+{
+	unsigned long  d_ino;
+	long           d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[];
+};
+
+#define DIRSCAN_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | \
+		IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define DIRSCAN_CHECK_MS 1000   // Poll每次最多等待的毫秒数，醒来时检查目录是否已经删除
+
+DirScanner::DirScanner()
+{
+	m_buffer_size = 1024 * 1024;
+	m_bfiles_only = true;
+	m_bstat = false;
+	m_buffer = 0;
+	m_bregex = false;
+	m_dir[0] = 0;
+	m_dirfd = -1;
+	m_inotify = -1;
+	m_wd = -1;
+}
+
+bool DirScanner::SetGlob(const char *pattern)
+{
+	m_glob = (pattern != 0) ? pattern : "";
+	return true;
+}
+
+bool DirScanner::SetRegex(const char *pattern)
+{
+	if (m_bregex == true)
+	{
+		regfree(&m_regex);
+		m_bregex = false;
+	}
+	if (pattern == 0 || pattern[0] == 0)
+	{
+		return true;
+	}
+
+	m_bregex = regcomp(&m_regex, pattern, REG_EXTENDED | REG_NOSUB) == 0;
+	return m_bregex;
+}
+
+/*
+ * type为DT_UNKNOWN时不按类型过滤，由调用者stat之后再判断
+ * */
+bool DirScanner::Match(const char *name, const unsigned char type) const
+{
+	if (name[0] == '.')
+	{
+		return false;
+	}
+	if (m_bfiles_only == true && type != DT_REG && type != DT_UNKNOWN)
+	{
+		return false;
+	}
+	if (m_glob.empty() == false && fnmatch(m_glob.c_str(), name, 0) != 0)
+	{
+		return false;
+	}
+	if (m_bregex == true && regexec(&m_regex, name, 0, 0, 0) != 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool DirScanner::Stat(const int dirfd, DirEntry &entry) const
+{
+	struct stat st;
+	if (fstatat(dirfd, entry.m_name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+	{
+		return false;
+	}
+
+	entry.m_type = IFTODT(st.st_mode);
+	entry.m_ino = st.st_ino;
+	entry.m_size = st.st_size;
+	entry.m_mtime_ns = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+
+	return true;
+}
+
+/**
+ * @brief 用getdents64读出整个目录
+ * @param bstat 是否对每个文件调用fstatat，为false时只有d_type为DT_UNKNOWN的文件才stat
+ */
+bool DirScanner::ScanFd(const int dirfd, vector<DirEntry> &entries, const bool bstat)
+{
+	entries.clear();
+	if (m_buffer == 0 && (m_buffer = (char *)malloc(m_buffer_size)) == 0)
+	{
+		return false;
+	}
+	if (lseek(dirfd, 0, SEEK_SET) != 0)
+	{
+		return false;
+	}
+
+	while (true)
+	{
+		long n = syscall(SYS_getdents64, dirfd, m_buffer, m_buffer_size);
+		if (n < 0)
+		{
+			return false;
+		}
+		if (n == 0)
+		{
+			break;
+		}
+
+		for (long off = 0; off < n; )
+		{
+			LinuxDirent64 *dent = (LinuxDirent64 *)(m_buffer + off);
+			off += dent->d_reclen;
+			if (Match(dent->d_name, dent->d_type) == false)
+			{
+				continue;
+			}
+
+			entries.emplace_back();
+			DirEntry &entry = entries.back();
+			entry.m_name = dent->d_name;
+			entry.m_type = dent->d_type;
+			entry.m_ino = dent->d_ino;
+			entry.m_size = -1;
+			entry.m_mtime_ns = 0;
+
+			// 读目录之后被删除的文件直接跳过
+			if ((bstat == true || dent->d_type == DT_UNKNOWN) && Stat(dirfd, entry) == false)
+			{
+				entries.pop_back();
+			}
+			else if (m_bfiles_only == true && entry.m_type != DT_REG)
+			{
+				entries.pop_back();
+			}
+		}
+	}
+
+	return true;
+}
+
+bool DirScanner::Scan(const char *dir, vector<DirEntry> &entries, const DirSortKey sort, const bool bdesc)
+{
+	int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+	{
+		return false;
+	}
+
+	bool bok = ScanFd(dirfd, entries, m_bstat == true || sort == DIRSCAN_SORT_MTIME || sort == DIRSCAN_SORT_SIZE);
+	close(dirfd);
+
+	SortDirEntries(entries, sort, bdesc);
+
+	return bok;
+}
+
+/**
+ * @brief 文件是否还被别的进程打开写
+ * @details 有写者时拿不到读租约（F_SETLEASE返回EAGAIN），拿到后马上释放。
+ *          租约只能加在自己拥有的文件上（或者有CAP_LEASE），判断不了时按没有写者处理。
+ *          持有租约的短暂时间里有写者打开文件时内核会通知租约持有者，缺省的SIGIO会终止进程，
+ *          所以先用F_SETSIG改成缺省动作为忽略的SIGURG
+ */
+static bool OpenForWrite(const int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	bool bwriting = false;
+	if (fcntl(fd, F_SETSIG, SIGURG) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	if (fcntl(fd, F_SETLEASE, F_RDLCK) == 0)
+	{
+		fcntl(fd, F_SETLEASE, F_UNLCK);
+	}
+	else if (errno == EAGAIN)
+	{
+		bwriting = true;
+	}
+	close(fd);
+
+	return bwriting;
+}
+
+bool DirScanner::Watch(const char *dir, vector<DirEntry> &entries, const DirSortKey sort)
+{
+	Close();
+	StrCopy(m_dir, sizeof(m_dir), dir);
+
+	if ((m_dirfd = open(m_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+			(m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+	{
+		Close();
+		return false;
+	}
+
+	// 先监视再扫描，扫描期间写完的文件会在之后的Poll中作为MODIFIED再报一次，不会漏掉
+	if ((m_wd = inotify_add_watch(m_inotify, m_dir, DIRSCAN_WATCH_MASK)) == -1)
+	{
+		Close();
+		return false;
+	}
+
+	// 记录大小和修改时间，队列溢出重新扫描时用来判断文件是否变化
+	if (ScanFd(m_dirfd, entries, true) == false)
+	{
+		Close();
+		return false;
+	}
+
+	// 还在写的文件不算已有的文件，等写完关闭时作为ADDED报告
+	size_t ikeep = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].m_type == DT_REG && OpenForWrite(m_dirfd, entries[i].m_name.c_str()) == true)
+		{
+			continue;
+		}
+		if (ikeep != i)
+		{
+			entries[ikeep] = std::move(entries[i]);
+		}
+		ikeep++;
+	}
+	entries.resize(ikeep);
+
+	m_known.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		m_known[entries[i].m_name] = entries[i];
+	}
+
+	SortDirEntries(entries, sort);
+
+	return true;
+}
+
+/**
+ * @brief inotify队列溢出后重新全量扫描，和记录的文件列表比较
+ * @details 新增或者变化的普通文件如果还有进程打开写，这次不报告，也不更新记录，
+ *          等写完关闭时的IN_CLOSE_WRITE再报告，和不溢出时一样拿不到写了一半的文件
+ */
+bool DirScanner::Rescan(vector<DirChange> &changes)
+{
+	vector<DirEntry> entries;
+	if (ScanFd(m_dirfd, entries, true) == false)
+	{
+		return false;
+	}
+
+	unordered_map<string, DirEntry> current;
+	current.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		DirEntry &entry = entries[i];
+		auto it = m_known.find(entry.m_name);
+		bool bnew = (it == m_known.end());
+		if (bnew == false && it->second.m_ino == entry.m_ino && it->second.m_size == entry.m_size &&
+				it->second.m_mtime_ns == entry.m_mtime_ns)
+		{
+			current.emplace(entry.m_name, std::move(entry));
+			continue;
+		}
+
+		if (entry.m_type == DT_REG && OpenForWrite(m_dirfd, entry.m_name.c_str()) == true)
+		{
+			if (bnew == false)
+			{
+				current.emplace(it->first, it->second);
+			}
+			continue;
+		}
+
+		changes.push_back({ bnew == true ? DIRSCAN_ADDED : DIRSCAN_MODIFIED, entry });
+		current.emplace(entry.m_name, std::move(entry));
+	}
+
+	for (auto &it : m_known)
+	{
+		if (current.find(it.first) == current.end())
+		{
+			changes.push_back({ DIRSCAN_REMOVED, it.second });
+		}
+	}
+	m_known.swap(current);
+
+	return true;
+}
+
+/**
+ * @brief 打开着的目录是否已经被删除
+ * @details 增量模式一直打开着目录，目录项被引用时删除目录不会马上发IN_DELETE_SELF，
+ *          内核要等最后一个引用释放，也就是Close之后，所以用链接数判断
+ */
+static bool DirRemoved(const int dirfd)
+{
+	struct stat st;
+	return fstat(dirfd, &st) == 0 && st.st_nlink == 0;
+}
+
+bool DirScanner::Poll(vector<DirChange> &changes, const int timeout_ms)
+{
+	changes.clear();
+	if (m_inotify == -1)
+	{
+		return false;
+	}
+
+	// 分段等待，超时或者每隔DIRSCAN_CHECK_MS检查一次目录是否已经删除
+	struct pollfd pfd;
+	pfd.fd = m_inotify;
+	pfd.events = POLLIN;
+	int iwaited = 0;
+	int iret;
+	while (true)
+	{
+		int iwait = (timeout_ms < 0 || timeout_ms - iwaited > DIRSCAN_CHECK_MS) ? DIRSCAN_CHECK_MS : timeout_ms - iwaited;
+		if ((iret = poll(&pfd, 1, iwait)) != 0)
+		{
+			break;
+		}
+		if (DirRemoved(m_dirfd) == true)
+		{
+			Close();
+			return false;
+		}
+		iwaited += iwait;
+		if (timeout_ms >= 0 && iwaited >= timeout_ms)
+		{
+			return true;
+		}
+	}
+	if (iret < 0)
+	{
+		return errno == EINTR;
+	}
+
+	// 事件的name按4字节对齐，缓冲区至少要能放下一个最长的事件
+	if (m_buffer == 0 && (m_buffer = (char *)malloc(m_buffer_size)) == 0)
+	{
+		return false;
+	}
+
+	bool boverflow = false;
+	bool bgone = false;
+	ssize_t n;
+	while ((n = read(m_inotify, m_buffer, m_buffer_size)) > 0)
+	{
+		for (ssize_t off = 0; off < n; )
+		{
+			struct inotify_event *event = (struct inotify_event *)(m_buffer + off);
+			off += sizeof(struct inotify_event) + event->len;
+
+			if ((event->mask & IN_Q_OVERFLOW) != 0)
+			{
+				boverflow = true;
+				continue;
+			}
+			if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) != 0)
+			{
+				bgone = true;
+				continue;
+			}
+			if (event->len == 0)
+			{
+				continue;
+			}
+
+			bool bdir = (event->mask & IN_ISDIR) != 0;
+			if (Match(event->name, bdir ? DT_DIR : DT_REG) == false)
+			{
+				continue;
+			}
+
+			// 普通文件等写完关闭或者移入再报告，目录创建时就报告
+			if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0 || (bdir == true && (event->mask & IN_CREATE) != 0))
+			{
+				DirEntry entry;
+				entry.m_name = event->name;
+				if (Stat(m_dirfd, entry) == false || (m_bfiles_only == true && entry.m_type != DT_REG))
+				{
+					continue;
+				}
+
+				auto it = m_known.find(entry.m_name);
+				if (it == m_known.end())
+				{
+					changes.push_back({ DIRSCAN_ADDED, entry });
+					m_known.emplace(entry.m_name, entry);
+				}
+				else
+				{
+					changes.push_back({ DIRSCAN_MODIFIED, entry });
+					it->second = entry;
+				}
+			}
+			else if ((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+			{
+				auto it = m_known.find(event->name);
+				if (it != m_known.end())
+				{
+					changes.push_back({ DIRSCAN_REMOVED, it->second });
+					m_known.erase(it);
+				}
+			}
+		}
+	}
+	if (n < 0 && errno != EAGAIN && errno != EINTR)
+	{
+		return false;
+	}
+
+	if (bgone == true)
+	{
+		Close();
+		return false;
+	}
+	if (boverflow == true)
+	{
+		return Rescan(changes);
+	}
+
+	return true;
+}
+
+int DirScanner::Fd() const
+{
+	return m_inotify;
+}
+
+size_t DirScanner::Known() const
+{
+	return m_known.size();
+}
+
+void DirScanner::Close()
+{
+	if (m_inotify != -1)
+	{
+		close(m_inotify);
+		m_inotify = -1;
+	}
+	if (m_dirfd != -1)
+	{
+		close(m_dirfd);
+		m_dirfd = -1;
+	}
+	m_wd = -1;
+	m_known.clear();
+}
+
+DirScanner::~DirScanner()
+{
+	Close();
+	SetRegex(0);
+	free(m_buffer);
+}
+
+void SortDirEntries(vector<DirEntry> &entries, const DirSortKey sort, const bool bdesc)
+{
+	if (sort == DIRSCAN_SORT_NONE)
+	{
+		return;
+	}
+
+	auto less = [sort](const DirEntry &a, const DirEntry &b)
+	{
+		if (sort == DIRSCAN_SORT_MTIME && a.m_mtime_ns != b.m_mtime_ns)
+		{
+			return a.m_mtime_ns < b.m_mtime_ns;
+		}
+		if (sort == DIRSCAN_SORT_SIZE && a.m_size != b.m_size)
+		{
+			return a.m_size < b.m_size;
+		}
+		return a.m_name < b.m_name;
+	};
+
+	if (bdesc == true)
+	{
+		std::sort(entries.begin(), entries.end(), [&less](const DirEntry &a, const DirEntry &b) { return less(b, a); });
+	}
+	else
+	{
+		std::sort(entries.begin(), entries.end(), less);
+	}
+}
@@ -0,0 +1,146 @@
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+#include "public.h"
+
+/*
+ * 扫描结果的排序方式
+ * */
+enum DirSortKey
+{
+	DIRSCAN_SORT_NONE  = 0,   // 按目录中的顺序，最快
+	DIRSCAN_SORT_NAME  = 1,
+	DIRSCAN_SORT_MTIME = 2,   // 修改时间，相同时按文件名
+	DIRSCAN_SORT_SIZE  = 3    // 文件大小，相同时按文件名
+};
+
+/*
+ * 增量模式下目录的变化
+ * */
+enum DirChangeType
+{
+	DIRSCAN_ADDED    = 0,   // 新文件写完关闭或者改名移入
+	DIRSCAN_MODIFIED = 1,   // 已知的文件再次写完关闭或者被改名覆盖
+	DIRSCAN_REMOVED  = 2    // 删除或者改名移出
+};
+
+struct DirEntry
+{
+	string        m_name;
+	unsigned char m_type;       // DT_REG、DT_DIR等
+	unsigned long m_ino;
+	long          m_size;       // 没有stat时为-1
+	long          m_mtime_ns;   // 没有stat时为0
+};
+
+struct DirChange
+{
+	DirChangeType m_type;
+	DirEntry      m_entry;      // REMOVED时只有m_name有效
+};
+
+/**
+ * @brief 目录扫描
+ *
+ * 全量扫描直接用getdents64系统调用，缓冲区缺省1MB，几万个文件的目录通常一两次系统调用就能读完，
+ * readdir每次只读32KB。文件类型用目录项中的d_type，只有按大小或者修改时间排序、
+ * 设置了m_bstat或者文件系统不提供d_type时才对每个文件调用fstatat（相对于目录fd，不用重新解析路径）。
+ * 可以用通配符（fnmatch）或者扩展正则表达式过滤文件名，以'.'开头的文件名总是跳过。
+ *
+ * 增量模式：Watch做一次全量扫描并用inotify监视目录，之后Poll只返回变化的文件，
+ * 不需要每个周期重新扫描。普通文件在写完关闭（IN_CLOSE_WRITE）或者改名移入（IN_MOVED_TO）
+ * 时才算新增，不会拿到写了一半的文件。inotify队列溢出时自动重新全量扫描，
+ * 和记录的文件列表比较得出变化，变化不会丢失。Watch的初始扫描和溢出后的重新扫描都用读租约
+ * （F_SETLEASE）判断文件是否还在写，还在写的文件不返回，等关闭时再报告；租约只能加在
+ * 本进程用户拥有的文件上（或者有CAP_LEASE），其他用户正在写的文件这时可能被提前报告。
+ * 持有租约期间有写者打开文件时内核发来的通知信号用F_SETSIG改成了SIGURG，它的缺省动作是忽略，
+ * 使用者不要给SIGURG设置会出问题的处理函数。目录本身被删除或者改名后Poll返回false；
+ * 打开着的目录被删除时内核不马上通知，由Poll在没有事件时检查链接数发现，一直等待的Poll最迟1秒后返回false。
+ *
+ * fanotify需要CAP_SYS_ADMIN，这里只用inotify，只监视一级目录，不递归。
+ *
+ * 不是线程安全的，每个线程使用自己的对象。
+ *
+ * 使用方法：
+ *   DirScanner scanner;
+ *   scanner.SetGlob("*.log");
+ *   scanner.Watch("/data/incoming", files);      // files是已有的文件
+ *   while (scanner.Poll(changes, 1000) == true) ...
+ */
+class DirScanner
+{
+	public:
+		int  m_buffer_size;   // getdents64的缓冲区大小，缺省1MB
+		bool m_bfiles_only;   // 只返回普通文件，缺省true
+		bool m_bstat;         // 总是取文件大小和修改时间，缺省false
+
+		DirScanner();
+
+		/*
+		 * 按fnmatch通配符过滤文件名，为空时不过滤
+		 * */
+		bool SetGlob(const char *pattern);
+
+		/*
+		 * 按POSIX扩展正则表达式过滤文件名，为空时不过滤，和通配符同时设置时两个都要匹配
+		 * */
+		bool SetRegex(const char *pattern);
+
+		/*
+		 * 全量扫描目录
+		 * bdesc 是否从大到小排序
+		 * */
+		bool Scan(const char *dir, vector<DirEntry> &entries, const DirSortKey sort = DIRSCAN_SORT_NONE, const bool bdesc = false);
+
+		/*
+		 * 开始增量模式，entries返回当前已有的文件，按sort排序
+		 * */
+		bool Watch(const char *dir, vector<DirEntry> &entries, const DirSortKey sort = DIRSCAN_SORT_NONE);
+
+		/*
+		 * 取目录的变化，按发生的顺序
+		 * timeout_ms 没有变化时最多等待的毫秒数，0为不等待，-1为一直等待
+		 * 返回值 目录被删除、改名或者出错时返回false，Fd放在epoll中使用时目录被删除不会变为可读，
+		 *        需要定期调用Poll(changes, 0)检查
+		 * */
+		bool Poll(vector<DirChange> &changes, const int timeout_ms);
+
+		/*
+		 * inotify的描述符，可以放到epoll中，可读时调用Poll(changes, 0)
+		 * */
+		int Fd() const;
+
+		/*
+		 * 增量模式下记录的文件数
+		 * */
+		size_t Known() const;
+
+		void Close();
+
+		~DirScanner();
+
+	private:
+		char     *m_buffer;
+		string    m_glob;
+		regex_t   m_regex;
+		bool      m_bregex;
+		char      m_dir[301];
+		int       m_dirfd;      // 增量模式下打开的目录
+		int       m_inotify;
+		int       m_wd;
+		unordered_map<string, DirEntry> m_known;   // 增量模式下已知的文件
+
+		bool Match(const char *name, const unsigned char type) const;
+
+		bool Stat(const int dirfd, DirEntry &entry) const;
+
+		bool ScanFd(const int dirfd, vector<DirEntry> &entries, const bool bstat);
+
+		bool Rescan(vector<DirChange> &changes);
+};
+
+/*
+ * 按key排序
+ * */
+void SortDirEntries(vector<DirEntry> &entries, const DirSortKey sort, const bool bdesc = false);
+
+#endif
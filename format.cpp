@@ -0,0 +1,186 @@
+#include "public.h"
+#include "format.h"
+
+/**
+ * @brief 按宽度和对齐方式输出，数字的0填充在符号和0x之后
+ * @param prefix 符号或者0x，可以为空
+ * @param bnumber 是否为数字，缺省右对齐
+ */
+void FormatWriter::Pad(const FormatSpec &spec, const char *prefix, const size_t prefix_len, const char *digits, const size_t len, const bool bnumber)
+{
+	size_t total = prefix_len + len;
+	size_t fill = (spec.m_width > 0 && (size_t)spec.m_width > total) ? spec.m_width - total : 0;
+	if (fill == 0)
+	{
+		Append(prefix, prefix_len);
+		Append(digits, len);
+		return;
+	}
+
+	char spaces[256];
+	bool bzero = bnumber == true && spec.m_bzero == true && spec.m_align == 0;
+	memset(spaces, bzero ? '0' : ' ', fill);
+
+	bool bleft = spec.m_align == '<' || (spec.m_align == 0 && bnumber == false);
+	if (bzero == true)
+	{
+		Append(prefix, prefix_len);
+		Append(spaces, fill);
+		Append(digits, len);
+	}
+	else if (bleft == true)
+	{
+		Append(prefix, prefix_len);
+		Append(digits, len);
+		Append(spaces, fill);
+	}
+	else
+	{
+		Append(spaces, fill);
+		Append(prefix, prefix_len);
+		Append(digits, len);
+	}
+}
+
+void FormatWriter::Unescape(const char *data, const size_t len)
+{
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		// 格式串已经在编译期检查过，花括号总是成对出现
+		if (data[i] == '{' || data[i] == '}')
+		{
+			Append(data + start, i + 1 - start);
+			start = ++i + 1;
+		}
+	}
+	Append(data + start, len - start);
+}
+
+/*
+ * 无符号数按类型转换成字符，不带前缀
+ * */
+static size_t FormatDigits(char *buffer, const size_t len, const unsigned long value, const char type)
+{
+	int base = (type == 'x' || type == 'X') ? 16 : (type == 'o' ? 8 : 10);
+	char *end = to_chars(buffer, buffer + len, value, base).ptr;
+	if (type == 'X')
+	{
+		for (char *p = buffer; p < end; p++)
+		{
+			*p = toupper(*p);
+		}
+	}
+
+	return end - buffer;
+}
+
+void FormatWriter::Int(const FormatSpec &spec, const long value)
+{
+	if (spec.m_type == 'c')
+	{
+		Char(spec, (char)value);
+		return;
+	}
+
+	// 最常见的{}，缓冲区够大时直接写进去
+	if (spec.m_width == 0 && spec.m_type == 0 && m_out == 0 && m_len < m_cap && m_cap - m_len >= 24)
+	{
+		m_len = to_chars(m_dest + m_len, m_dest + m_cap, value).ptr - m_dest;
+		return;
+	}
+
+	char digits[72];
+	unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+	size_t len = FormatDigits(digits, sizeof(digits), magnitude, spec.m_type);
+	Pad(spec, "-", value < 0 ? 1 : 0, digits, len, true);
+}
+
+void FormatWriter::UInt(const FormatSpec &spec, const unsigned long value)
+{
+	if (spec.m_type == 'c')
+	{
+		Char(spec, (char)value);
+		return;
+	}
+
+	if (spec.m_width == 0 && spec.m_type == 0 && m_out == 0 && m_len < m_cap && m_cap - m_len >= 24)
+	{
+		m_len = to_chars(m_dest + m_len, m_dest + m_cap, value).ptr - m_dest;
+		return;
+	}
+
+	char digits[72];
+	size_t len = FormatDigits(digits, sizeof(digits), value, spec.m_type);
+	Pad(spec, "", 0, digits, len, true);
+}
+
+void FormatWriter::Char(const FormatSpec &spec, const char value)
+{
+	if (spec.m_type == 'd' || spec.m_type == 'x' || spec.m_type == 'X')
+	{
+		char digits[8];
+		size_t len = FormatDigits(digits, sizeof(digits), (unsigned char)value, spec.m_type);
+		Pad(spec, "", 0, digits, len, true);
+		return;
+	}
+
+	Pad(spec, "", 0, &value, 1, false);
+}
+
+/**
+ * @details 用to_chars，不受locale影响，没有指定精度时输出能精确还原的最短形式
+ */
+void FormatWriter::Float(const FormatSpec &spec, const double value)
+{
+	// 精度最多60，定点格式最长为309位整数部分加小数部分
+	char digits[400];
+	char *begin = digits;
+	to_chars_result result;
+	chars_format format = spec.m_type == 'e' ? chars_format::scientific :
+		(spec.m_type == 'g' ? chars_format::general : chars_format::fixed);
+	if (spec.m_precision >= 0)
+	{
+		result = to_chars(digits, digits + sizeof(digits), value, format, spec.m_precision);
+	}
+	else if (spec.m_type == 0)
+	{
+		result = to_chars(digits, digits + sizeof(digits), value);
+	}
+	else
+	{
+		// 和printf一样缺省6位
+		result = to_chars(digits, digits + sizeof(digits), value, format, 6);
+	}
+	size_t len = result.ptr - digits;
+
+	bool bneg = len > 0 && digits[0] == '-';
+	if (bneg == true)
+	{
+		begin++;
+		len--;
+	}
+	Pad(spec, "-", bneg ? 1 : 0, begin, len, true);
+}
+
+void FormatWriter::String(const FormatSpec &spec, const char *data, size_t len)
+{
+	if (spec.m_precision >= 0 && len > (size_t)spec.m_precision)
+	{
+		len = spec.m_precision;
+	}
+	if (spec.m_width == 0)
+	{
+		Append(data, len);
+		return;
+	}
+
+	Pad(spec, "", 0, data, len, false);
+}
+
+void FormatWriter::Pointer(const FormatSpec &spec, const void *value)
+{
+	char digits[24];
+	size_t len = FormatDigits(digits, sizeof(digits), (unsigned long)value, 'x');
+	Pad(spec, "0x", 2, digits, len, true);
+}
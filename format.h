@@ -0,0 +1,398 @@
+#ifndef __FORMAT_H__
+#define __FORMAT_H__
+#include "public.h"
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+/*
+ * 参数的类别，决定允许的格式和输出方式
+ * */
+enum FormatArgKind
+{
+	FORMAT_INT     = 0,   // 有符号整数和枚举
+	FORMAT_UINT    = 1,
+	FORMAT_CHAR    = 2,
+	FORMAT_BOOL    = 3,
+	FORMAT_FLOAT   = 4,
+	FORMAT_STRING  = 5,   // const char *、string、string_view、字符数组
+	FORMAT_POINTER = 6
+};
+
+/*
+ * 一个占位符，以及它前面的字面文本在格式串中的位置，编译期解析得到
+ * */
+struct FormatSpec
+{
+	unsigned short m_begin = 0;       // 字面文本的起始位置
+	unsigned short m_len = 0;         // 字面文本的长度
+	short          m_width = 0;       // 最小宽度，0为不限制
+	short          m_precision = -1;  // 浮点数的小数位数或者字符串的最大长度，-1为没有指定
+	char           m_type = 0;        // 0或者d x X o f e g s c p
+	char           m_align = 0;       // 0为缺省（数字右对齐，其他左对齐），'<'或者'>'
+	bool           m_bzero = false;   // 数字用0填充宽度
+	bool           m_bescaped = false; // 字面文本中有{{或者}}
+};
+
+/*
+ * 没有定义，格式串不合法时在编译期调用它，编译错误中能看到reason
+ * */
+void FormatStringError(const char *reason);
+
+template <typename T>
+consteval FormatArgKind FormatKindOf()
+{
+	typedef decay_t<remove_cvref_t<T>> U;
+	if constexpr (is_same_v<U, bool>)
+	{
+		return FORMAT_BOOL;
+	}
+	else if constexpr (is_same_v<U, char>)
+	{
+		return FORMAT_CHAR;
+	}
+	else if constexpr (is_integral_v<U> || is_enum_v<U>)
+	{
+		if constexpr (is_enum_v<U>)
+		{
+			return is_signed_v<underlying_type_t<U>> ? FORMAT_INT : FORMAT_UINT;
+		}
+		else
+		{
+			return is_signed_v<U> ? FORMAT_INT : FORMAT_UINT;
+		}
+	}
+	else if constexpr (is_floating_point_v<U>)
+	{
+		return FORMAT_FLOAT;
+	}
+	else if constexpr (is_same_v<U, const char *> || is_same_v<U, char *> || is_same_v<U, string> || is_same_v<U, string_view>)
+	{
+		return FORMAT_STRING;
+	}
+	else if constexpr (is_pointer_v<U> || is_same_v<U, nullptr_t>)
+	{
+		return FORMAT_POINTER;
+	}
+	else
+	{
+		static_assert(sizeof(T) == 0, "type is not supported by FormatTo");
+		return FORMAT_INT;
+	}
+}
+
+/**
+ * @brief 编译期解析的格式串
+ *
+ * 语法是std::format的子集：{}为一个参数，{{和}}输出花括号本身，占位符可以带格式
+ *   {:[<|>][0][宽度][.精度][类型]}
+ * 类型：整数d x X o，字符c，浮点数f e g，字符串s，指针p，不写时按参数的类型输出，
+ * 浮点数不写精度时输出能精确还原的最短形式。
+ * 占位符的个数和参数的个数不一样、格式和参数的类型不匹配时编译报错。
+ */
+template <typename... Args>
+class FormatString
+{
+	public:
+		const char *m_fmt;
+		FormatSpec  m_specs[sizeof...(Args) + 1];   // 最后一个只用m_begin、m_len、m_bescaped，是结尾的字面文本
+
+		consteval FormatString(const char *fmt) : m_fmt(fmt), m_specs()
+		{
+			const FormatArgKind kinds[] = { FormatKindOf<Args>()..., FORMAT_INT };
+			size_t pos = 0;
+			size_t begin = 0;
+			size_t iarg = 0;
+			bool bescaped = false;
+
+			while (fmt[pos] != 0)
+			{
+				if (pos >= 65535)
+				{
+					FormatStringError("format string longer than 65535");
+				}
+
+				char c = fmt[pos];
+				if ((c == '{' || c == '}') && fmt[pos + 1] == c)
+				{
+					bescaped = true;
+					pos += 2;
+					continue;
+				}
+				if (c == '}')
+				{
+					FormatStringError("unmatched '}' in format string");
+				}
+				if (c != '{')
+				{
+					pos++;
+					continue;
+				}
+
+				if (iarg >= sizeof...(Args))
+				{
+					FormatStringError("more placeholders than arguments");
+				}
+				FormatSpec &spec = m_specs[iarg];
+				spec.m_begin = begin;
+				spec.m_len = pos - begin;
+				spec.m_bescaped = bescaped;
+				pos = ParseSpec(fmt, pos + 1, spec);
+				CheckSpec(spec, kinds[iarg]);
+
+				iarg++;
+				begin = pos;
+				bescaped = false;
+			}
+
+			if (iarg != sizeof...(Args))
+			{
+				FormatStringError("fewer placeholders than arguments");
+			}
+			m_specs[iarg].m_begin = begin;
+			m_specs[iarg].m_len = pos - begin;
+			m_specs[iarg].m_bescaped = bescaped;
+		}
+
+	private:
+		static consteval size_t ParseSpec(const char *fmt, size_t pos, FormatSpec &spec)
+		{
+			if (fmt[pos] == ':')
+			{
+				pos++;
+				if (fmt[pos] == '<' || fmt[pos] == '>')
+				{
+					spec.m_align = fmt[pos++];
+				}
+				if (fmt[pos] == '0')
+				{
+					spec.m_bzero = true;
+					pos++;
+				}
+				while (fmt[pos] >= '0' && fmt[pos] <= '9')
+				{
+					spec.m_width = spec.m_width * 10 + (fmt[pos++] - '0');
+					if (spec.m_width > 255)
+					{
+						FormatStringError("width larger than 255");
+					}
+				}
+				if (fmt[pos] == '.')
+				{
+					pos++;
+					spec.m_precision = 0;
+					if (fmt[pos] < '0' || fmt[pos] > '9')
+					{
+						FormatStringError("missing precision after '.'");
+					}
+					while (fmt[pos] >= '0' && fmt[pos] <= '9')
+					{
+						spec.m_precision = spec.m_precision * 10 + (fmt[pos++] - '0');
+						if (spec.m_precision > 60)
+						{
+							FormatStringError("precision larger than 60");
+						}
+					}
+				}
+				if (fmt[pos] != 0 && fmt[pos] != '}')
+				{
+					spec.m_type = fmt[pos++];
+				}
+			}
+			if (fmt[pos] != '}')
+			{
+				FormatStringError("placeholder is not closed by '}'");
+			}
+
+			return pos + 1;
+		}
+
+		static consteval void CheckSpec(const FormatSpec &spec, const FormatArgKind kind)
+		{
+			const char type = spec.m_type;
+			bool bok = false;
+			switch (kind)
+			{
+				case FORMAT_INT:
+				case FORMAT_UINT:
+					bok = type == 0 || type == 'd' || type == 'x' || type == 'X' || type == 'o' || type == 'c';
+					break;
+				case FORMAT_CHAR:
+					bok = type == 0 || type == 'c' || type == 'd' || type == 'x' || type == 'X';
+					break;
+				case FORMAT_BOOL:
+					bok = type == 0 || type == 's';
+					break;
+				case FORMAT_FLOAT:
+					bok = type == 0 || type == 'f' || type == 'e' || type == 'g';
+					break;
+				case FORMAT_STRING:
+					bok = type == 0 || type == 's';
+					break;
+				case FORMAT_POINTER:
+					bok = type == 0 || type == 'p';
+					break;
+			}
+			if (bok == false)
+			{
+				FormatStringError("format type does not match the argument type");
+			}
+			if (spec.m_precision >= 0 && kind != FORMAT_FLOAT && kind != FORMAT_STRING)
+			{
+				FormatStringError("precision is only allowed for floating point and strings");
+			}
+			if (spec.m_bzero == true && (kind == FORMAT_STRING || kind == FORMAT_BOOL))
+			{
+				FormatStringError("zero padding is only allowed for numbers");
+			}
+		}
+};
+
+/**
+ * @brief 格式化的输出目标
+ *
+ * 写到调用者的缓冲区时超出的部分丢弃，但仍然计算总长度，和snprintf一样；
+ * 写到string时追加在后面。不会预先清零缓冲区。
+ */
+class FormatWriter
+{
+	public:
+		FormatWriter(char *dest, const size_t cap) : m_dest(dest), m_cap(cap), m_len(0), m_out(0) {}
+
+		FormatWriter(string &out) : m_dest(0), m_cap(0), m_len(0), m_out(&out) {}
+
+		void Append(const char *data, const size_t len)
+		{
+			if (m_out != 0)
+			{
+				m_out->append(data, len);
+			}
+			else if (m_len < m_cap)
+			{
+				memcpy(m_dest + m_len, data, len < m_cap - m_len ? len : m_cap - m_len);
+			}
+			m_len += len;
+		}
+
+		void Literal(const char *data, const size_t len, const bool bescaped)
+		{
+			if (bescaped == false)
+			{
+				Append(data, len);
+			}
+			else
+			{
+				Unescape(data, len);
+			}
+		}
+
+		void Int(const FormatSpec &spec, const long value);
+
+		void UInt(const FormatSpec &spec, const unsigned long value);
+
+		void Char(const FormatSpec &spec, const char value);
+
+		void Float(const FormatSpec &spec, const double value);
+
+		void String(const FormatSpec &spec, const char *data, size_t len);
+
+		void Pointer(const FormatSpec &spec, const void *value);
+
+		/*
+		 * 写到缓冲区时在结尾加0，超长时截断，返回不截断时的长度
+		 * */
+		size_t Finish()
+		{
+			if (m_out == 0 && m_cap > 0)
+			{
+				m_dest[m_len < m_cap ? m_len : m_cap - 1] = 0;
+			}
+			return m_len;
+		}
+
+	private:
+		char   *m_dest;
+		size_t  m_cap;
+		size_t  m_len;
+		string *m_out;
+
+		void Unescape(const char *data, const size_t len);
+
+		void Pad(const FormatSpec &spec, const char *prefix, const size_t prefix_len, const char *digits, const size_t len, const bool bnumber);
+};
+
+template <typename T>
+inline void FormatArg(FormatWriter &writer, const FormatSpec &spec, const T &value)
+{
+	constexpr FormatArgKind kind = FormatKindOf<T>();
+	if constexpr (kind == FORMAT_INT)
+	{
+		writer.Int(spec, (long)value);
+	}
+	else if constexpr (kind == FORMAT_UINT)
+	{
+		writer.UInt(spec, (unsigned long)value);
+	}
+	else if constexpr (kind == FORMAT_CHAR)
+	{
+		writer.Char(spec, value);
+	}
+	else if constexpr (kind == FORMAT_BOOL)
+	{
+		writer.String(spec, value ? "true" : "false", value ? 4 : 5);
+	}
+	else if constexpr (kind == FORMAT_FLOAT)
+	{
+		writer.Float(spec, (double)value);
+	}
+	else if constexpr (kind == FORMAT_POINTER)
+	{
+		writer.Pointer(spec, (const void *)value);
+	}
+	else if constexpr (is_same_v<decay_t<T>, string> || is_same_v<decay_t<T>, string_view>)
+	{
+		writer.String(spec, value.data(), value.size());
+	}
+	else
+	{
+		const char *str = value;
+		writer.String(spec, str != 0 ? str : "(null)", str != 0 ? strlen(str) : 6);
+	}
+}
+
+template <typename... Args>
+inline void FormatArgs(FormatWriter &writer, const FormatString<Args...> &fmt, const Args &...args)
+{
+	size_t i = 0;
+	((writer.Literal(fmt.m_fmt + fmt.m_specs[i].m_begin, fmt.m_specs[i].m_len, fmt.m_specs[i].m_bescaped),
+		FormatArg(writer, fmt.m_specs[i], args), i++), ...);
+	writer.Literal(fmt.m_fmt + fmt.m_specs[i].m_begin, fmt.m_specs[i].m_len, fmt.m_specs[i].m_bescaped);
+}
+
+/*
+ * 格式化到dest，超长时截断，destlen大于0时总是以0结尾，不清零缓冲区的其他部分
+ * 返回值 不截断时的长度，不包括结尾的0，和snprintf一样
+ * 例如 FormatTo(buf, sizeof(buf), "{}:{:04x} {:.3f}", name, id, ratio);
+ * */
+template <typename... Args>
+inline int FormatTo(char *dest, const size_t destlen, FormatString<type_identity_t<Args>...> fmt, const Args &...args)
+{
+	FormatWriter writer(dest, destlen);
+	FormatArgs<Args...>(writer, fmt, args...);
+	return writer.Finish();
+}
+
+/*
+ * 格式化后追加到out后面
+ * 返回值 追加的长度
+ * */
+template <typename... Args>
+inline size_t FormatAppend(string &out, FormatString<type_identity_t<Args>...> fmt, const Args &...args)
+{
+	size_t before = out.size();
+	FormatWriter writer(out);
+	FormatArgs<Args...>(writer, fmt, args...);
+	return out.size() - before;
+}
+
+#endif
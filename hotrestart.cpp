@@ -0,0 +1,302 @@
+#include "public.h"
+#include "hotrestart.h"
+#include "utils.h"
+
+extern char **environ;
+
+#define HOTRESTART_MAX_FDS 16
+
+HotRestart::HotRestart()
+{
+	memset(m_path, 0, sizeof(m_path));
+	m_listenfd = -1;
+	m_peerfd = -1;
+	m_bowner = false;
+}
+
+static bool MakeUnixAddr(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		return false;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	return true;
+}
+
+/**
+ * @brief 连接旧进程并取得监听socket
+ * @param path 旧进程等待的unix域套接字路径
+ * @param fds 返回取得的socket
+ * @return 成功返回true，没有旧进程时返回false
+ */
+bool HotRestart::Inherit(const char *path, vector<int> &fds)
+{
+	struct sockaddr_un addr;
+	if (MakeUnixAddr(path, &addr) == false)
+	{
+		return false;
+	}
+	StrCopy(m_path, sizeof(m_path), path);
+
+	// 不是旧进程Spawn出来的，路径上即使有进程在等待也不能去接管
+	const char *env = getenv(HOTRESTART_ENV);
+	if (env == 0 || strcmp(env, path) != 0)
+	{
+		return false;
+	}
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd == -1)
+	{
+		return false;
+	}
+
+	// 路径不存在或者旧进程已经退出时连接失败，由调用者自己监听
+	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(sockfd);
+		return false;
+	}
+
+	struct pollfd pfd;
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 10000) <= 0)
+	{
+		close(sockfd);
+		return false;
+	}
+
+	char flag = 0;
+	struct iovec iov;
+	iov.iov_base = &flag;
+	iov.iov_len = 1;
+
+	char control[CMSG_SPACE(sizeof(int) * HOTRESTART_MAX_FDS)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != 1 || flag != 'F')
+	{
+		close(sockfd);
+		return false;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		{
+			continue;
+		}
+
+		int icount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *pfds = (int *)CMSG_DATA(cmsg);
+		for (int i = 0; i < icount; i++)
+		{
+			fds.push_back(pfds[i]);
+		}
+	}
+
+	if (fds.empty() == true)
+	{
+		close(sockfd);
+		return false;
+	}
+
+	m_peerfd = sockfd;
+
+	return true;
+}
+
+/**
+ * @brief 通知旧进程新进程已经开始服务
+ * @return 成功返回true
+ */
+bool HotRestart::NotifyReady()
+{
+	if (m_peerfd == -1)
+	{
+		return false;
+	}
+
+	bool bret = (send(m_peerfd, "R", 1, MSG_NOSIGNAL) == 1);
+	close(m_peerfd);
+	m_peerfd = -1;
+
+	return bret;
+}
+
+/**
+ * @brief 在path上等待以后的新进程
+ * @param path unix域套接字路径
+ * @return 成功返回true
+ */
+bool HotRestart::Listen(const char *path)
+{
+	struct sockaddr_un addr;
+	if (MakeUnixAddr(path, &addr) == false)
+	{
+		return false;
+	}
+
+	if (m_listenfd != -1)
+	{
+		close(m_listenfd);
+		m_listenfd = -1;
+	}
+	StrCopy(m_path, sizeof(m_path), path);
+
+	if ((m_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	{
+		return false;
+	}
+
+	// 旧进程交接之后不再删除这个路径，这里删除的是旧进程留下的文件
+	unlink(m_path);
+	if (bind(m_listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(m_listenfd, 1) != 0)
+	{
+		close(m_listenfd);
+		m_listenfd = -1;
+		return false;
+	}
+	m_bowner = true;
+
+	return true;
+}
+
+int HotRestart::ListenFd() const
+{
+	return m_listenfd;
+}
+
+/**
+ * @brief 把fds交给新进程并等待它就绪
+ * @param fds 要交出的socket，旧进程中仍然保持打开
+ * @param itimeout 等待新进程就绪的时间，单位为秒
+ * @return 新进程已经接管返回true
+ */
+bool HotRestart::Handoff(const vector<int> &fds, const int itimeout)
+{
+	if (m_listenfd == -1 || fds.empty() == true || fds.size() > HOTRESTART_MAX_FDS)
+	{
+		return false;
+	}
+
+	int peerfd = accept4(m_listenfd, 0, 0, SOCK_CLOEXEC);
+	if (peerfd == -1)
+	{
+		return false;
+	}
+
+	char flag = 'F';
+	struct iovec iov;
+	iov.iov_base = &flag;
+	iov.iov_len = 1;
+
+	char control[CMSG_SPACE(sizeof(int) * HOTRESTART_MAX_FDS)];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+	memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+
+	if (sendmsg(peerfd, &msg, MSG_NOSIGNAL) != 1)
+	{
+		close(peerfd);
+		return false;
+	}
+
+	// 新进程初始化失败或者退出时连接被关闭，旧进程继续服务
+	struct pollfd pfd;
+	pfd.fd = peerfd;
+	pfd.events = POLLIN;
+	char ready = 0;
+	bool bret = (poll(&pfd, 1, itimeout * 1000) == 1 && recv(peerfd, &ready, 1, 0) == 1 && ready == 'R');
+	close(peerfd);
+
+	if (bret == true)
+	{
+		m_bowner = false;
+	}
+
+	return bret;
+}
+
+/**
+ * @brief 启动新版本的程序
+ * @param argv 命令行参数，argv[0]为程序名，按PATH查找
+ * @return 启动成功返回true
+ */
+bool HotRestart::Spawn(char *const argv[])
+{
+	// 调用者一般屏蔽了信号改用signalfd处理，新进程从空的信号屏蔽字开始
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	// 复制当前的环境变量，换上HOTRESTART_ENV，新进程据此知道自己是来接管的
+	string entry = string(HOTRESTART_ENV) + "=" + m_path;
+	size_t iprefix_len = strlen(HOTRESTART_ENV) + 1;
+	vector<char *> envp;
+	for (char **env = environ; *env != 0; env++)
+	{
+		if (strncmp(*env, entry.c_str(), iprefix_len) != 0)
+		{
+			envp.push_back(*env);
+		}
+	}
+	envp.push_back((char *)entry.c_str());
+	envp.push_back(0);
+
+	pid_t pid;
+	int iret = posix_spawnp(&pid, argv[0], 0, &attr, argv, envp.data());
+	posix_spawnattr_destroy(&attr);
+
+	return iret == 0;
+}
+
+void HotRestart::Close()
+{
+	if (m_listenfd != -1)
+	{
+		close(m_listenfd);
+		m_listenfd = -1;
+		if (m_bowner == true)
+		{
+			unlink(m_path);
+		}
+	}
+
+	if (m_peerfd != -1)
+	{
+		close(m_peerfd);
+		m_peerfd = -1;
+	}
+
+	m_bowner = false;
+}
+
+HotRestart::~HotRestart()
+{
+	Close();
+}
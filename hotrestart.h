@@ -0,0 +1,78 @@
+#ifndef __HOTRESTART_H__
+#define __HOTRESTART_H__
+#include "public.h"
+
+#define HOTRESTART_ENV "HOTRESTART_PATH"   // Spawn启动的新进程从这个环境变量得知要接管的路径
+
+/**
+ * @brief 热重启，把监听socket从旧进程交给新进程
+ *
+ * 旧进程在一个unix域套接字上等待新进程。新进程启动时先连接这个套接字，
+ * 旧进程用SCM_RIGHTS把监听socket发给新进程，新进程在同一个socket上开始
+ * Accept之后通知旧进程，旧进程再停止接受新连接并排空已有的连接。
+ * 整个过程中监听socket一直处于打开状态，客户端的连接请求不会被拒绝。
+ *
+ * 只有旧进程用Spawn启动的新进程才会接管：Spawn在新进程的环境变量HOTRESTART_ENV中
+ * 放入路径，Inherit只在这个环境变量和path相同时才连接旧进程。手工再启动一个程序
+ * 不会抢走正在运行的进程的监听socket。
+ *
+ * 新进程：
+ *   HotRestart hr;
+ *   vector<int> fds;
+ *   if (hr.Inherit(path, fds) == true) server.Attach(fds[0]); else server.Listen(port);
+ *   server.Start();
+ *   hr.NotifyReady();
+ *   hr.Listen(path);
+ *
+ * 旧进程在ListenFd()可读时调用Handoff，返回true后排空连接并退出。
+ */
+class HotRestart
+{
+	public:
+		char m_path[108];   // unix域套接字的路径
+
+		HotRestart();
+
+		/*
+		 * 新进程调用，连接旧进程并取得监听socket
+		 * 返回值 true为成功，false为不是Spawn启动的、没有旧进程或者旧进程没有发送socket
+		 * */
+		bool Inherit(const char *path, vector<int> &fds);
+
+		/*
+		 * 新进程调用，已经开始服务，通知旧进程退出
+		 * */
+		bool NotifyReady();
+
+		/*
+		 * 在path上等待以后的新进程，已经存在的同名文件会被删除
+		 * */
+		bool Listen(const char *path);
+
+		int ListenFd() const;
+
+		/*
+		 * 旧进程调用，接受新进程的连接，把fds发给它并等待它就绪
+		 * itimeout 等待新进程就绪的时间，单位为秒
+		 * 返回值 true为新进程已经接管，false为新进程失败，旧进程应该继续服务
+		 * */
+		bool Handoff(const vector<int> &fds, const int itimeout);
+
+		/*
+		 * 旧进程调用，用同样的命令行启动新版本的程序，环境变量HOTRESTART_ENV设为m_path，
+		 * 新进程会连接m_path完成接管
+		 * 返回值 true为启动成功
+		 * */
+		bool Spawn(char *const argv[]);
+
+		void Close();
+
+		~HotRestart();
+
+	private:
+		int  m_listenfd;    // 等待新进程的unix域套接字
+		int  m_peerfd;      // 新进程中为到旧进程的连接
+		bool m_bowner;      // 关闭时是否删除m_path，交接之后路径属于新进程
+};
+
+#endif
@@ -0,0 +1,560 @@
+#include "public.h"
+#include "kvcache.h"
+#include "metrics.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define KV_EMPTY    0x80   // 控制字节：空槽位
+#define KV_DELETED  0xfe   // 控制字节：已删除，查找时要越过，插入时可以复用
+                           // 有条目的槽位的控制字节是散列值的低7位，最高位为0
+
+static MetricCounter *g_kv_gets = NewMetricCounter("moserver_kv_ops_total", "Cache operations by type", "op=\"get\"");
+static MetricCounter *g_kv_sets = NewMetricCounter("moserver_kv_ops_total", "Cache operations by type", "op=\"set\"");
+static MetricCounter *g_kv_dels = NewMetricCounter("moserver_kv_ops_total", "Cache operations by type", "op=\"del\"");
+static MetricCounter *g_kv_hits = NewMetricCounter("moserver_kv_hits_total", "Cache lookups that found the key");
+static MetricCounter *g_kv_misses = NewMetricCounter("moserver_kv_misses_total", "Cache lookups that missed");
+static MetricCounter *g_kv_evictions = NewMetricCounter("moserver_kv_evictions_total", "Entries evicted to stay under the memory cap");
+static MetricGauge *g_kv_items = NewMetricGauge("moserver_kv_items", "Entries in the cache");
+static MetricGauge *g_kv_bytes = NewMetricGauge("moserver_kv_bytes", "Bytes used by cache entries and tables");
+
+/*
+ * 一个条目，键和值连续存放在m_data中，整个条目一次malloc
+ * */
+struct KVEntry
+{
+	unsigned long m_hash;
+	int           m_klen;
+	int           m_vlen;
+	bool          m_bref;      // CLOCK访问位
+	char          m_data[1];
+};
+
+/*
+ * 条目按malloc的实际占用计算：按16字节取整，另加分配器的头部
+ * */
+static inline size_t EntrySize(const int klen, const int vlen)
+{
+	return ((offsetof(KVEntry, m_data) + klen + vlen + 15) & ~(size_t)15) + 16;
+}
+
+static inline size_t TableSize(const size_t cap)
+{
+	return cap * (1 + sizeof(KVEntry *));
+}
+
+/**
+ * @brief 键的64位散列值
+ * @details 一次处理8个字节，最后用和ratelimit.cpp相同的Mix64打散，
+ *          低7位作为控制字节，中间的位选组，高位选分片
+ */
+static unsigned long HashKey(const char *key, const int klen)
+{
+	unsigned long h = 0x9e3779b97f4a7c15UL ^ ((unsigned long)klen * 0xc2b2ae3d27d4eb4fUL);
+	int i = 0;
+	for (; i + 8 <= klen; i += 8)
+	{
+		unsigned long w;
+		memcpy(&w, key + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdUL;
+		h = (h << 29) | (h >> 35);
+	}
+	if (i < klen)
+	{
+		unsigned long w = 0;
+		memcpy(&w, key + i, klen - i);
+		h = (h ^ w) * 0xff51afd7ed558ccdUL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * @brief 一组控制字节中等于c的位置，第i位为1表示第i个槽位
+ */
+static inline unsigned int MatchByte(const unsigned char *ctrl, const unsigned char c)
+{
+#if defined(__SSE2__)
+	__m128i group = _mm_load_si128((const __m128i *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+	unsigned int mask = 0;
+	for (int i = 0; i < KV_GROUP; i++)
+	{
+		if (ctrl[i] == c)
+		{
+			mask |= 1U << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+/**
+ * @brief 一组控制字节中空或者已删除的位置，两种标记的最高位都是1
+ */
+static inline unsigned int MatchFree(const unsigned char *ctrl)
+{
+#if defined(__SSE2__)
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+	unsigned int mask = 0;
+	for (int i = 0; i < KV_GROUP; i++)
+	{
+		if ((ctrl[i] & 0x80) != 0)
+		{
+			mask |= 1U << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+KVCache::KVCache()
+{
+	m_shards = 0;
+	m_nshards = 0;
+	m_shard_shift = 0;
+}
+
+bool KVCache::InitShard(Shard *shard, const size_t cap)
+{
+	void *ctrl = 0;
+	if (posix_memalign(&ctrl, 64, cap) != 0)
+	{
+		return false;
+	}
+	shard->m_slots = (KVEntry **)calloc(cap, sizeof(KVEntry *));
+	if (shard->m_slots == 0)
+	{
+		free(ctrl);
+		return false;
+	}
+	shard->m_ctrl = (unsigned char *)ctrl;
+	memset(shard->m_ctrl, KV_EMPTY, cap);
+	shard->m_cap = cap;
+	shard->m_used = 0;
+	shard->m_deleted = 0;
+	shard->m_hand = 0;
+
+	return true;
+}
+
+bool KVCache::Init(const size_t max_bytes, const int ishards)
+{
+	Free();
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nwant = ishards > 0 ? ishards : (ncpu > 0 ? (int)ncpu : 1);
+	m_nshards = 1;
+	m_shard_shift = 0;
+	while (m_nshards < nwant && m_nshards < 4096)
+	{
+		m_nshards <<= 1;
+		m_shard_shift++;
+	}
+
+	m_shards = new Shard[m_nshards];
+	for (int i = 0; i < m_nshards; i++)
+	{
+		Shard *shard = &m_shards[i];
+		pthread_mutex_init(&shard->m_lock, 0);
+		shard->m_max_bytes = max_bytes / m_nshards;
+		if (InitShard(shard, KV_GROUP) == false)
+		{
+			shard->m_ctrl = 0;
+			shard->m_slots = 0;
+			m_nshards = i + 1;
+			Free();
+			return false;
+		}
+		shard->m_bytes = TableSize(shard->m_cap);
+		g_kv_bytes->Add(shard->m_bytes);
+	}
+
+	return true;
+}
+
+/**
+ * @brief 在分片中查找键
+ * @return 槽位号，没有找到时返回-1
+ */
+long KVCache::Find(Shard *shard, const unsigned long hash, const char *key, const int klen)
+{
+	size_t mask = shard->m_cap / KV_GROUP - 1;
+	size_t group = (hash >> 7) & mask;
+	unsigned char tag = hash & 0x7f;
+
+	for (size_t i = 1; ; i++)
+	{
+		const unsigned char *ctrl = shard->m_ctrl + group * KV_GROUP;
+		unsigned int match = MatchByte(ctrl, tag);
+		while (match != 0)
+		{
+			size_t slot = group * KV_GROUP + __builtin_ctz(match);
+			const KVEntry *entry = shard->m_slots[slot];
+			if (entry->m_hash == hash && entry->m_klen == klen && memcmp(entry->m_data, key, klen) == 0)
+			{
+				return slot;
+			}
+			match &= match - 1;
+		}
+
+		// 插入时在第一个有空位的组停下，组里有空槽位说明键不会在后面的组
+		if (MatchByte(ctrl, KV_EMPTY) != 0 || i > mask)
+		{
+			return -1;
+		}
+
+		// 三角数序列，组数是2的幂时能遍历所有组
+		group = (group + i) & mask;
+	}
+}
+
+/**
+ * @brief 插入一个确定不存在的条目，调用者保证还有空位
+ */
+void KVCache::Insert(Shard *shard, const unsigned long hash, KVEntry *entry)
+{
+	size_t mask = shard->m_cap / KV_GROUP - 1;
+	size_t group = (hash >> 7) & mask;
+
+	for (size_t i = 1; ; i++)
+	{
+		unsigned int match = MatchFree(shard->m_ctrl + group * KV_GROUP);
+		if (match != 0)
+		{
+			size_t slot = group * KV_GROUP + __builtin_ctz(match);
+			if (shard->m_ctrl[slot] == KV_DELETED)
+			{
+				shard->m_deleted--;
+			}
+			shard->m_ctrl[slot] = hash & 0x7f;
+			shard->m_slots[slot] = entry;
+			shard->m_used++;
+			return;
+		}
+		group = (group + i) & mask;
+	}
+}
+
+/**
+ * @brief 删除槽位上的条目并释放
+ * @details 组里还有空槽位时这个组从来没有满过，没有查找会越过它，可以直接标成空；
+ *          否则标成已删除，查找时继续越过
+ */
+void KVCache::Erase(Shard *shard, const size_t slot)
+{
+	KVEntry *entry = shard->m_slots[slot];
+	const unsigned char *ctrl = shard->m_ctrl + (slot & ~(size_t)(KV_GROUP - 1));
+	if (MatchByte(ctrl, KV_EMPTY) != 0)
+	{
+		shard->m_ctrl[slot] = KV_EMPTY;
+	}
+	else
+	{
+		shard->m_ctrl[slot] = KV_DELETED;
+		shard->m_deleted++;
+	}
+	shard->m_slots[slot] = 0;
+	shard->m_used--;
+
+	size_t size = EntrySize(entry->m_klen, entry->m_vlen);
+	shard->m_bytes -= size;
+	g_kv_bytes->Sub(size);
+	g_kv_items->Sub();
+	free(entry);
+}
+
+/**
+ * @brief 已删除的槽位多时原地重建，否则扩大一倍
+ * @return 扩大后超过内存上限或者分配失败时返回false，调用者先淘汰条目
+ */
+bool KVCache::Grow(Shard *shard)
+{
+	size_t cap = shard->m_cap;
+	if (shard->m_deleted < cap / 8)
+	{
+		cap *= 2;
+		if (shard->m_bytes - TableSize(shard->m_cap) + TableSize(cap) > shard->m_max_bytes)
+		{
+			return false;
+		}
+	}
+
+	unsigned char *old_ctrl = shard->m_ctrl;
+	KVEntry **old_slots = shard->m_slots;
+	size_t old_cap = shard->m_cap;
+	size_t old_used = shard->m_used;
+	size_t old_deleted = shard->m_deleted;
+	size_t old_hand = shard->m_hand;
+	if (InitShard(shard, cap) == false)
+	{
+		shard->m_ctrl = old_ctrl;
+		shard->m_slots = old_slots;
+		shard->m_cap = old_cap;
+		shard->m_used = old_used;
+		shard->m_deleted = old_deleted;
+		shard->m_hand = old_hand;
+		return false;
+	}
+
+	for (size_t i = 0; i < old_cap; i++)
+	{
+		if ((old_ctrl[i] & 0x80) == 0)
+		{
+			Insert(shard, old_slots[i]->m_hash, old_slots[i]);
+		}
+	}
+
+	long delta = (long)TableSize(cap) - (long)TableSize(old_cap);
+	shard->m_bytes += delta;
+	g_kv_bytes->Add(delta);
+	free(old_ctrl);
+	free(old_slots);
+
+	return true;
+}
+
+/**
+ * @brief 按CLOCK算法淘汰一个条目
+ * @return 分片已经空了时返回false
+ */
+bool KVCache::Evict(Shard *shard)
+{
+	if (shard->m_used == 0)
+	{
+		return false;
+	}
+
+	// 有条目时最多转两圈：第一圈清除访问位，第二圈一定能找到
+	while (true)
+	{
+		size_t slot = shard->m_hand;
+		shard->m_hand = (shard->m_hand + 1) & (shard->m_cap - 1);
+		if ((shard->m_ctrl[slot] & 0x80) != 0)
+		{
+			continue;
+		}
+
+		KVEntry *entry = shard->m_slots[slot];
+		if (entry->m_bref == true)
+		{
+			entry->m_bref = false;
+			continue;
+		}
+
+		Erase(shard, slot);
+		g_kv_evictions->Add();
+		return true;
+	}
+}
+
+bool KVCache::Get(const char *key, const int klen, string &value)
+{
+	g_kv_gets->Add();
+	if (m_nshards == 0 || klen <= 0 || klen > KV_MAX_KEY)
+	{
+		g_kv_misses->Add();
+		return false;
+	}
+
+	unsigned long hash = HashKey(key, klen);
+	Shard *shard = &m_shards[m_shard_shift == 0 ? 0 : hash >> (64 - m_shard_shift)];
+
+	pthread_mutex_lock(&shard->m_lock);
+	long slot = Find(shard, hash, key, klen);
+	if (slot >= 0)
+	{
+		KVEntry *entry = shard->m_slots[slot];
+		// 已经置位时不再写，读多的热点键不会反复弄脏缓存行
+		if (entry->m_bref == false)
+		{
+			entry->m_bref = true;
+		}
+		value.append(entry->m_data + entry->m_klen, entry->m_vlen);
+	}
+	pthread_mutex_unlock(&shard->m_lock);
+
+	if (slot >= 0)
+	{
+		g_kv_hits->Add();
+	}
+	else
+	{
+		g_kv_misses->Add();
+	}
+
+	return slot >= 0;
+}
+
+bool KVCache::Set(const char *key, const int klen, const char *value, const int vlen)
+{
+	g_kv_sets->Add();
+	if (m_nshards == 0 || klen <= 0 || klen > KV_MAX_KEY || vlen < 0)
+	{
+		return false;
+	}
+
+	unsigned long hash = HashKey(key, klen);
+	Shard *shard = &m_shards[m_shard_shift == 0 ? 0 : hash >> (64 - m_shard_shift)];
+	size_t size = EntrySize(klen, vlen);
+	if (size > shard->m_max_bytes / 2)
+	{
+		return false;
+	}
+
+	// 在锁外分配和拷贝
+	KVEntry *entry = (KVEntry *)malloc(offsetof(KVEntry, m_data) + klen + vlen);
+	if (entry == 0)
+	{
+		return false;
+	}
+	entry->m_hash = hash;
+	entry->m_klen = klen;
+	entry->m_vlen = vlen;
+	entry->m_bref = false;
+	memcpy(entry->m_data, key, klen);
+	memcpy(entry->m_data + klen, value, vlen);
+
+	KVEntry *old = 0;
+	pthread_mutex_lock(&shard->m_lock);
+	long slot = Find(shard, hash, key, klen);
+	if (slot >= 0)
+	{
+		old = shard->m_slots[slot];
+		shard->m_slots[slot] = entry;
+		shard->m_bytes -= EntrySize(old->m_klen, old->m_vlen);
+		g_kv_bytes->Sub(EntrySize(old->m_klen, old->m_vlen));
+		g_kv_items->Sub();
+	}
+	else
+	{
+		while (shard->m_bytes + size > shard->m_max_bytes && Evict(shard) == true)
+		{
+		}
+
+		// 装载因子不超过7/8，保证查找时总能遇到空槽位。内存上限不允许扩大时把现在的大小
+		// 当作已满，每插入一个只淘汰一个：淘汰留下的已删除标记不降低装载因子，循环淘汰
+		// 会在锁内一次淘汰多达m_cap/8个条目，等已删除的槽位累积够了由Grow原地重建
+		bool bevicted = false;
+		while ((shard->m_used + shard->m_deleted + 1) * 8 > shard->m_cap * 7)
+		{
+			if (Grow(shard) == true)
+			{
+				continue;
+			}
+			if (bevicted == true || Evict(shard) == false)
+			{
+				break;
+			}
+			bevicted = true;
+		}
+		Insert(shard, hash, entry);
+	}
+	shard->m_bytes += size;
+	g_kv_bytes->Add(size);
+	g_kv_items->Add();
+
+	// 替换成更大的值时可能超过上限
+	while (shard->m_bytes > shard->m_max_bytes && Evict(shard) == true)
+	{
+	}
+	pthread_mutex_unlock(&shard->m_lock);
+
+	free(old);
+
+	return true;
+}
+
+bool KVCache::Del(const char *key, const int klen)
+{
+	g_kv_dels->Add();
+	if (m_nshards == 0 || klen <= 0 || klen > KV_MAX_KEY)
+	{
+		return false;
+	}
+
+	unsigned long hash = HashKey(key, klen);
+	Shard *shard = &m_shards[m_shard_shift == 0 ? 0 : hash >> (64 - m_shard_shift)];
+
+	pthread_mutex_lock(&shard->m_lock);
+	long slot = Find(shard, hash, key, klen);
+	if (slot >= 0)
+	{
+		Erase(shard, slot);
+	}
+	pthread_mutex_unlock(&shard->m_lock);
+
+	return slot >= 0;
+}
+
+size_t KVCache::Items()
+{
+	size_t items = 0;
+	for (int i = 0; i < m_nshards; i++)
+	{
+		pthread_mutex_lock(&m_shards[i].m_lock);
+		items += m_shards[i].m_used;
+		pthread_mutex_unlock(&m_shards[i].m_lock);
+	}
+
+	return items;
+}
+
+size_t KVCache::Bytes()
+{
+	size_t bytes = 0;
+	for (int i = 0; i < m_nshards; i++)
+	{
+		pthread_mutex_lock(&m_shards[i].m_lock);
+		bytes += m_shards[i].m_bytes;
+		pthread_mutex_unlock(&m_shards[i].m_lock);
+	}
+
+	return bytes;
+}
+
+int KVCache::Shards() const
+{
+	return m_nshards;
+}
+
+void KVCache::Free()
+{
+	for (int i = 0; i < m_nshards; i++)
+	{
+		Shard *shard = &m_shards[i];
+		if (shard->m_ctrl != 0)
+		{
+			for (size_t j = 0; j < shard->m_cap; j++)
+			{
+				if ((shard->m_ctrl[j] & 0x80) == 0)
+				{
+					free(shard->m_slots[j]);
+				}
+			}
+			g_kv_items->Sub(shard->m_used);
+			g_kv_bytes->Sub(shard->m_bytes);
+		}
+		free(shard->m_ctrl);
+		free(shard->m_slots);
+		pthread_mutex_destroy(&shard->m_lock);
+	}
+
+	delete[] m_shards;
+	m_shards = 0;
+	m_nshards = 0;
+	m_shard_shift = 0;
+}
+
+KVCache::~KVCache()
+{
+	Free();
+}
@@ -0,0 +1,100 @@
+#ifndef __KVCACHE_H__
+#define __KVCACHE_H__
+#include "public.h"
+
+#define KV_GROUP    16     // 一组的槽位数，控制字节正好是一个SSE2寄存器
+#define KV_MAX_KEY  250    // 键的最大长度
+
+struct KVEntry;
+
+/**
+ * @brief 内存键值缓存
+ *
+ * 按键的散列值分成若干个分片，每个分片一把锁，缺省每个CPU一个分片。
+ * 分片内是开放寻址的散列表，和SwissTable一样每个槽位有一个控制字节，保存散列值的低7位
+ * 或者空、已删除的标记，查找时一次比较一组KV_GROUP个控制字节（有SSE2时用一条
+ * _mm_cmpeq_epi8），只有控制字节相同的槽位才去读条目比较键，一次查找通常只访问
+ * 一个缓存行的控制字节和一个条目。组按三角数序列探测，组里有空槽位时停止。
+ *
+ * 内存上限是硬性的：每个分片最多使用max_bytes/分片数字节，包括条目（按malloc的
+ * 实际占用估算）和散列表本身。写入需要空间时按CLOCK算法淘汰：指针在槽位上循环，
+ * 最近被访问过的条目清除访问位后跳过，没有访问过的被淘汰，近似LRU，
+ * 访问只是设置一个标记，不需要像LRU那样移动链表。
+ *
+ * 所有方法都是线程安全的。
+ */
+class KVCache
+{
+	public:
+		KVCache();
+
+		/*
+		 * 分配分片，之前的内容全部丢弃
+		 * max_bytes 内存上限，单位为字节
+		 * ishards 分片数，向上取整到2的幂，0表示按CPU数
+		 * */
+		bool Init(const size_t max_bytes, const int ishards = 0);
+
+		/*
+		 * 查找键，找到时把值追加到value后面
+		 * 返回值 true为命中
+		 * */
+		bool Get(const char *key, const int klen, string &value);
+
+		/*
+		 * 写入键值，已经存在时替换，空间不够时淘汰其他条目
+		 * 返回值 键太长或者条目超过一个分片容量的一半时返回false
+		 * */
+		bool Set(const char *key, const int klen, const char *value, const int vlen);
+
+		/*
+		 * 删除键
+		 * 返回值 true为键存在
+		 * */
+		bool Del(const char *key, const int klen);
+
+		/*
+		 * 条目数和占用的字节数，遍历所有分片，只用于统计
+		 * */
+		size_t Items();
+
+		size_t Bytes();
+
+		int Shards() const;
+
+		~KVCache();
+
+	private:
+		struct Shard
+		{
+			pthread_mutex_t m_lock;
+			unsigned char  *m_ctrl;     // m_cap个控制字节
+			KVEntry       **m_slots;    // m_cap个槽位
+			size_t          m_cap;      // 槽位数，KV_GROUP的2的幂倍
+			size_t          m_used;     // 有条目的槽位数
+			size_t          m_deleted;  // 标记为已删除的槽位数
+			size_t          m_bytes;    // 条目和散列表占用的字节数
+			size_t          m_max_bytes;
+			size_t          m_hand;     // CLOCK指针
+		} __attribute__((aligned(64)));
+
+		Shard *m_shards;
+		int    m_nshards;
+		int    m_shard_shift;           // 散列值右移多少位得到分片号
+
+		void Free();
+
+		static bool InitShard(Shard *shard, const size_t cap);
+
+		static long Find(Shard *shard, const unsigned long hash, const char *key, const int klen);
+
+		static void Insert(Shard *shard, const unsigned long hash, KVEntry *entry);
+
+		static void Erase(Shard *shard, const size_t slot);
+
+		static bool Grow(Shard *shard);
+
+		static bool Evict(Shard *shard);
+};
+
+#endif
@@ -0,0 +1,1001 @@
+#include "public.h"
+#include "lbclient.h"
+#include "metrics.h"
+
+#include <string_view>
+
+static MetricCounter *g_lb_eject_failures = NewMetricCounter("moserver_lb_ejections_total",
+		"Backends ejected by the load-balancing client", "reason=\"failures\"");
+static MetricCounter *g_lb_eject_latency = NewMetricCounter("moserver_lb_ejections_total",
+		"Backends ejected by the load-balancing client", "reason=\"latency\"");
+static MetricCounter *g_lb_readmits = NewMetricCounter("moserver_lb_readmits_total",
+		"Ejected backends added back after the ejection expired");
+
+#define LB_SLOW_START_MIN_WEIGHT 0.1   // 刚恢复的后端的权重
+
+static __thread unsigned long t_lb_seed = 0;
+
+static inline unsigned long Mix64(unsigned long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdUL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53UL;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+ * 每个线程一个xorshift64*，不需要加锁
+ * */
+static inline unsigned long LBRandom()
+{
+	if (t_lb_seed == 0)
+	{
+		t_lb_seed = Mix64(MetricNow() ^ (unsigned long)pthread_self()) | 1;
+	}
+	t_lb_seed ^= t_lb_seed >> 12;
+	t_lb_seed ^= t_lb_seed << 25;
+	t_lb_seed ^= t_lb_seed >> 27;
+	return t_lb_seed * 0x2545f4914f6cdd1dUL;
+}
+
+/**
+ * @brief Lamping和Veach的jump consistent hash
+ * @details 桶数从n增加到n+1时，只有1/(n+1)的键移到新桶，其他键不动
+ */
+int JumpHash(unsigned long hash, const int buckets)
+{
+	long b = -1;
+	long j = 0;
+	while (j < buckets)
+	{
+		b = j;
+		hash = hash * 2862933555777941757UL + 1;
+		j = (long)((b + 1) * ((double)(1L << 31) / (double)((hash >> 33) + 1)));
+	}
+
+	return (int)b;
+}
+
+LBClient::LBClient()
+{
+	m_policy = LB_P2C_EWMA;
+	m_timeout = 5;
+	m_max_idle = 16;
+	m_eject_failures = 5;
+	m_eject_base_ms = 1000;
+	m_eject_max_ms = 30000;
+	m_max_eject_pct = 50;
+	m_slow_start_ms = 10000;
+	m_latency_factor = 5;
+	m_latency_min_us = 10000;
+	m_ewma_alpha = 0.2;
+	m_ewma_decay_ms = 1000;
+	m_maglev_size = 65537;
+	m_hedge_pct = 95;
+	m_hedge_min_us = 200;
+	m_hedge_max_pct = 10;
+	m_ejected = 0;
+	m_completions = 0;
+	m_health_gen = 1;
+	m_bsweeping = false;
+	m_calls = 0;
+	m_hedges = 0;
+	m_hedge_wins = 0;
+	m_hedge_delay = 0;
+	m_request_id = Mix64(MetricNow() ^ getpid()) & 0xffffffff00000000UL;
+	m_table_gen = 0;
+	pthread_rwlock_init(&m_table_lock, 0);
+}
+
+bool LBClient::AddEndpoint(const char *host, const int port)
+{
+	if (host == 0 || strlen(host) >= sizeof(((LBEndpoint *)0)->m_host) || port <= 0 || port > 65535)
+	{
+		return false;
+	}
+
+	LBEndpoint *endpoint = new LBEndpoint;
+	strcpy(endpoint->m_host, host);
+	endpoint->m_port = port;
+	endpoint->m_inflight = 0;
+	endpoint->m_ewma_ns = 0;
+	endpoint->m_ewma_at = 0;
+	endpoint->m_failures = 0;
+	endpoint->m_ejections = 0;
+	endpoint->m_ejected_until = 0;
+	endpoint->m_readmit_at = 0;
+	endpoint->m_requests = 0;
+	endpoint->m_errors = 0;
+	pthread_mutex_init(&endpoint->m_lock, 0);
+	m_endpoints.push_back(endpoint);
+
+	return true;
+}
+
+bool LBClient::AddEndpoints(const char *list)
+{
+	while (list != 0 && *list != 0)
+	{
+		const char *end = strchr(list, ',');
+		size_t len = (end != 0) ? (size_t)(end - list) : strlen(list);
+
+		// 主机名中不会有冒号，取最后一个冒号后面的端口
+		char item[64];
+		if (len == 0 || len >= sizeof(item))
+		{
+			return false;
+		}
+		memcpy(item, list, len);
+		item[len] = 0;
+		char *colon = strrchr(item, ':');
+		if (colon == 0)
+		{
+			return false;
+		}
+		*colon = 0;
+		if (AddEndpoint(item, atoi(colon + 1)) == false)
+		{
+			return false;
+		}
+
+		list = (end != 0) ? end + 1 : 0;
+	}
+
+	return m_endpoints.empty() == false;
+}
+
+int LBClient::Endpoints() const
+{
+	return m_endpoints.size();
+}
+
+const LBEndpoint *LBClient::Endpoint(const int index) const
+{
+	return (index >= 0 && index < (int)m_endpoints.size()) ? m_endpoints[index] : 0;
+}
+
+bool LBClient::Healthy(const LBEndpoint *endpoint, const unsigned long now) const
+{
+	unsigned long until = __atomic_load_n(&endpoint->m_ejected_until, __ATOMIC_RELAXED);
+	return until == 0 || now >= until;
+}
+
+/*
+ * 按距离上一次更新的时间衰减后的EWMA
+ * */
+double LBClient::Ewma(const LBEndpoint *endpoint, const unsigned long now) const
+{
+	double ewma = __atomic_load_n(&endpoint->m_ewma_ns, __ATOMIC_RELAXED);
+	unsigned long at = __atomic_load_n(&endpoint->m_ewma_at, __ATOMIC_RELAXED);
+	if (m_ewma_decay_ms > 0 && now > at)
+	{
+		ewma *= exp(-(double)(now - at) / (m_ewma_decay_ms * 1e6));
+	}
+
+	return ewma;
+}
+
+/*
+ * 慢启动的权重，恢复后在m_slow_start_ms内从LB_SLOW_START_MIN_WEIGHT线性增加到1
+ * */
+double LBClient::Weight(const LBEndpoint *endpoint, const unsigned long now) const
+{
+	unsigned long readmit = __atomic_load_n(&endpoint->m_readmit_at, __ATOMIC_RELAXED);
+	unsigned long ramp = m_slow_start_ms * 1000000UL;
+	if (readmit != 0 && now >= readmit && now - readmit < ramp)
+	{
+		return LB_SLOW_START_MIN_WEIGHT + (1 - LB_SLOW_START_MIN_WEIGHT) * (now - readmit) / (double)ramp;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief 按键选中的后端是否接收这个键
+ * @details 慢启动期间把键散列成[0, 1)之间的数，小于权重的键才回到这个后端，其余的键
+ *          和摘除时一样重新散列。权重增加时接收的键只增不减，同一个键不会来回移动。
+ * @param key 键的散列值，不随重新散列改变
+ */
+bool LBClient::Admit(const LBEndpoint *endpoint, const unsigned long key, const unsigned long now) const
+{
+	if (Healthy(endpoint, now) == false)
+	{
+		return false;
+	}
+
+	double weight = Weight(endpoint, now);
+	if (weight >= 1)
+	{
+		return true;
+	}
+
+	return (Mix64(key ^ 0xc2b2ae3d27d4eb4fUL) >> 11) * (1.0 / (1UL << 53)) < weight;
+}
+
+/**
+ * @brief 后端的负载，越小越好
+ * @details 慢启动期间除以权重，权重小的后端看起来负载更高，分到的请求更少
+ */
+double LBClient::Cost(const LBEndpoint *endpoint, const unsigned long now) const
+{
+	double cost = __atomic_load_n(&endpoint->m_inflight, __ATOMIC_RELAXED) + 1;
+	if (m_policy != LB_P2C_INFLIGHT)
+	{
+		// 还没有样本的后端按1纳秒计算，先给它一个请求得到延迟
+		double ewma = Ewma(endpoint, now);
+		cost *= (ewma >= 1) ? ewma : 1;
+	}
+
+	return cost / Weight(endpoint, now);
+}
+
+/**
+ * @brief 二选一：随机取两个不同的健康后端，选负载小的
+ * @details 摘除的后端不超过一半，随机取四次都落在摘除的后端上的概率不超过1/16，
+ *          这时再从随机位置开始顺序找
+ * @param exclude 不选这个后端，用于对冲请求，没有其他后端时返回-1
+ */
+int LBClient::PickP2C(const unsigned long now, const int exclude)
+{
+	int n = m_endpoints.size();
+	if (n <= 1)
+	{
+		return exclude == 0 ? -1 : n - 1;
+	}
+
+	int choices[2] = { -1, -1 };
+	for (int k = 0; k < 2; k++)
+	{
+		for (int tries = 0; tries < 4 && choices[k] == -1; tries++)
+		{
+			int i = LBRandom() % n;
+			if (i != choices[0] && i != exclude && Healthy(m_endpoints[i], now) == true)
+			{
+				choices[k] = i;
+			}
+		}
+		for (int j = 0, start = LBRandom() % n; j < n && choices[k] == -1; j++)
+		{
+			int i = (start + j) % n;
+			if (i != choices[0] && i != exclude && Healthy(m_endpoints[i], now) == true)
+			{
+				choices[k] = i;
+			}
+		}
+	}
+
+	if (choices[0] == -1)
+	{
+		// 全部摘除时随便选一个，不让请求直接失败
+		int i = LBRandom() % n;
+		return (i != exclude) ? i : (i + 1) % n;
+	}
+	if (choices[1] == -1)
+	{
+		return choices[0];
+	}
+
+	return Cost(m_endpoints[choices[0]], now) <= Cost(m_endpoints[choices[1]], now) ? choices[0] : choices[1];
+}
+
+/*
+ * 落在摘除或者慢启动中不接收这个键的后端上时重新散列再选，同一个键在摘除期间总是改到同一个后端
+ * */
+int LBClient::PickJump(unsigned long hash, const unsigned long now)
+{
+	const unsigned long key = hash;
+	int n = m_endpoints.size();
+	int first = JumpHash(hash, n);
+	int index = first;
+	for (int attempt = 1; attempt <= n; attempt++)
+	{
+		if (Admit(m_endpoints[index], key, now) == true)
+		{
+			return index;
+		}
+		hash = Mix64(hash + attempt);
+		index = JumpHash(hash, n);
+	}
+
+	return first;
+}
+
+int LBClient::PickMaglev(const unsigned long hash, const unsigned long now)
+{
+	unsigned long gen = __atomic_load_n(&m_health_gen, __ATOMIC_ACQUIRE);
+	pthread_rwlock_rdlock(&m_table_lock);
+	if (m_table_gen != gen || m_maglev.empty() == true)
+	{
+		pthread_rwlock_unlock(&m_table_lock);
+		pthread_rwlock_wrlock(&m_table_lock);
+		if (m_table_gen != gen || m_maglev.empty() == true)
+		{
+			BuildMaglev(now);
+			m_table_gen = gen;
+		}
+	}
+	// 表里只有健康的后端，慢启动中的后端只接收一部分键，其余的键重新散列到别的位置
+	size_t size = m_maglev.size();
+	int first = m_maglev[hash % size];
+	int index = first;
+	unsigned long h = hash;
+	for (int attempt = 1; attempt <= (int)m_endpoints.size(); attempt++)
+	{
+		if (Admit(m_endpoints[index], hash, now) == true)
+		{
+			pthread_rwlock_unlock(&m_table_lock);
+			return index;
+		}
+		h = Mix64(h + attempt);
+		index = m_maglev[h % size];
+	}
+	pthread_rwlock_unlock(&m_table_lock);
+
+	return first;
+}
+
+/**
+ * @brief 用健康的后端建Maglev表，加写锁后调用
+ * @details 每个后端按自己的offset和skip生成一个表位置的排列，各后端轮流取排列中
+ *          下一个还空着的位置，直到填满。摘除一个后端时其他后端的位置大部分不变，
+ *          只有原来属于它的位置分给别的后端。
+ */
+void LBClient::BuildMaglev(const unsigned long now)
+{
+	vector<int> members;
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		if (Healthy(m_endpoints[i], now) == true)
+		{
+			members.push_back(i);
+		}
+	}
+	if (members.empty() == true)
+	{
+		for (size_t i = 0; i < m_endpoints.size(); i++)
+		{
+			members.push_back(i);
+		}
+	}
+
+	unsigned long size = m_maglev_size > 0 ? m_maglev_size : 65537;
+	vector<unsigned long> offsets(members.size());
+	vector<unsigned long> skips(members.size());
+	vector<unsigned long> next(members.size(), 0);
+	for (size_t k = 0; k < members.size(); k++)
+	{
+		LBEndpoint *endpoint = m_endpoints[members[k]];
+		char name[64];
+		int ilen = snprintf(name, sizeof(name), "%s:%d", endpoint->m_host, endpoint->m_port);
+		unsigned long h = hash<string_view>()(string_view(name, ilen));
+		offsets[k] = Mix64(h) % size;
+		skips[k] = Mix64(h ^ 0x9e3779b97f4a7c15UL) % (size - 1) + 1;
+	}
+
+	m_maglev.assign(size, -1);
+	unsigned long filled = 0;
+	while (filled < size)
+	{
+		for (size_t k = 0; k < members.size() && filled < size; k++)
+		{
+			unsigned long c = (offsets[k] + next[k] * skips[k]) % size;
+			while (m_maglev[c] >= 0)
+			{
+				next[k]++;
+				c = (offsets[k] + next[k] * skips[k]) % size;
+			}
+			m_maglev[c] = members[k];
+			next[k]++;
+			filled++;
+		}
+	}
+}
+
+int LBClient::Pick()
+{
+	if (m_endpoints.empty() == true)
+	{
+		return -1;
+	}
+
+	return PickP2C(MetricNow());
+}
+
+int LBClient::PickKey(const char *key, const int klen)
+{
+	return PickHash(Mix64(hash<string_view>()(string_view(key, klen))));
+}
+
+int LBClient::PickHash(const unsigned long hash)
+{
+	if (m_endpoints.empty() == true)
+	{
+		return -1;
+	}
+
+	unsigned long now = MetricNow();
+	if (m_policy == LB_JUMP_HASH)
+	{
+		return PickJump(hash, now);
+	}
+	if (m_policy == LB_MAGLEV)
+	{
+		return PickMaglev(hash, now);
+	}
+
+	return PickP2C(now);
+}
+
+unsigned long LBClient::Begin(const int index)
+{
+	__atomic_add_fetch(&m_endpoints[index]->m_inflight, 1, __ATOMIC_RELAXED);
+	return MetricNow();
+}
+
+/**
+ * @brief 请求结束，更新延迟的EWMA和连续失败次数
+ * @details 只用成功的请求更新EWMA，否则很快失败的后端延迟最低，二选一会把请求都发给它。
+ *          EWMA的读-改-写没有加锁，并发时偶尔丢掉一个样本，不影响选择。
+ */
+void LBClient::End(const int index, const unsigned long start_ns, const bool bok)
+{
+	LBEndpoint *endpoint = m_endpoints[index];
+	unsigned long now = MetricNow();
+	__atomic_sub_fetch(&endpoint->m_inflight, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&endpoint->m_requests, 1, __ATOMIC_RELAXED);
+
+	if (bok == true)
+	{
+		__atomic_store_n(&endpoint->m_failures, 0, __ATOMIC_RELAXED);
+		double latency = now - start_ns;
+		double ewma = Ewma(endpoint, now);
+		ewma = (__atomic_load_n(&endpoint->m_ewma_ns, __ATOMIC_RELAXED) == 0) ? latency : ewma + m_ewma_alpha * (latency - ewma);
+		__atomic_store_n(&endpoint->m_ewma_ns, ewma >= 1 ? (unsigned long)ewma : 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&endpoint->m_ewma_at, now, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_add_fetch(&endpoint->m_errors, 1, __ATOMIC_RELAXED);
+		if (__atomic_add_fetch(&endpoint->m_failures, 1, __ATOMIC_RELAXED) >= m_eject_failures)
+		{
+			Eject(index, now, false);
+		}
+	}
+
+	if ((__atomic_add_fetch(&m_completions, 1, __ATOMIC_RELAXED) & 63) == 0)
+	{
+		Sweep(now);
+	}
+}
+
+/**
+ * @brief 摘除一个后端，时长按连续摘除的次数翻倍
+ * @return 已经被摘除或者摘除的后端已经达到上限时返回false
+ */
+bool LBClient::Eject(const int index, const unsigned long now, const bool blatency)
+{
+	LBEndpoint *endpoint = m_endpoints[index];
+	unsigned long old = __atomic_load_n(&endpoint->m_ejected_until, __ATOMIC_RELAXED);
+	if (old != 0 && now < old)
+	{
+		return false;
+	}
+
+	// 摘除到期但是Sweep还没有恢复的后端仍然计在m_ejected中
+	if (old == 0)
+	{
+		int ejected = __atomic_load_n(&m_ejected, __ATOMIC_RELAXED);
+		do
+		{
+			if ((ejected + 1) * 100 > m_max_eject_pct * (int)m_endpoints.size())
+			{
+				return false;
+			}
+		} while (__atomic_compare_exchange_n(&m_ejected, &ejected, ejected + 1, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED) == false);
+	}
+
+	int ejections = __atomic_add_fetch(&endpoint->m_ejections, 1, __ATOMIC_RELAXED);
+	unsigned long ms = (unsigned long)m_eject_base_ms << (ejections - 1 < 16 ? ejections - 1 : 16);
+	ms = ms < (unsigned long)m_eject_max_ms ? ms : m_eject_max_ms;
+	if (__atomic_compare_exchange_n(&endpoint->m_ejected_until, &old, now + ms * 1000000, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED) == false)
+	{
+		// 另一个线程同时摘除了它
+		__atomic_sub_fetch(&endpoint->m_ejections, 1, __ATOMIC_RELAXED);
+		if (old == 0)
+		{
+			__atomic_sub_fetch(&m_ejected, 1, __ATOMIC_RELAXED);
+		}
+		return false;
+	}
+
+	__atomic_store_n(&endpoint->m_failures, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m_health_gen, 1, __ATOMIC_RELEASE);
+	(blatency ? g_lb_eject_latency : g_lb_eject_failures)->Add();
+
+	return true;
+}
+
+/**
+ * @brief 恢复摘除到期的后端，摘除延迟离群的后端
+ * @details 延迟和没有被摘除的后端的EWMA中位数比较，至少三个后端有样本时才比较。
+ *          恢复的后端的EWMA重置为中位数，否则摘除前的高延迟会让它一直分不到请求。
+ */
+void LBClient::Sweep(const unsigned long now)
+{
+	if (__atomic_exchange_n(&m_bsweeping, true, __ATOMIC_ACQUIRE) == true)
+	{
+		return;
+	}
+
+	vector<unsigned long> samples;
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		LBEndpoint *endpoint = m_endpoints[i];
+		unsigned long ewma = Ewma(endpoint, now);
+		if (__atomic_load_n(&endpoint->m_ejected_until, __ATOMIC_RELAXED) == 0 && ewma != 0)
+		{
+			samples.push_back(ewma);
+		}
+	}
+	unsigned long median = 0;
+	if (samples.empty() == false)
+	{
+		nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		median = samples[samples.size() / 2];
+	}
+
+	unsigned long settle = (unsigned long)(m_slow_start_ms > m_eject_max_ms ? m_slow_start_ms : m_eject_max_ms) * 1000000;
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		LBEndpoint *endpoint = m_endpoints[i];
+		unsigned long until = __atomic_load_n(&endpoint->m_ejected_until, __ATOMIC_RELAXED);
+		if (until != 0)
+		{
+			if (now >= until && __atomic_compare_exchange_n(&endpoint->m_ejected_until, &until, 0, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED) == true)
+			{
+				__atomic_store_n(&endpoint->m_readmit_at, now, __ATOMIC_RELAXED);
+				__atomic_store_n(&endpoint->m_ewma_ns, median, __ATOMIC_RELAXED);
+				__atomic_store_n(&endpoint->m_ewma_at, now, __ATOMIC_RELAXED);
+				__atomic_sub_fetch(&m_ejected, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&m_health_gen, 1, __ATOMIC_RELEASE);
+				g_lb_readmits->Add();
+			}
+			continue;
+		}
+
+		// 恢复后稳定运行了足够长的时间，下一次摘除重新从m_eject_base_ms开始
+		unsigned long readmit = __atomic_load_n(&endpoint->m_readmit_at, __ATOMIC_RELAXED);
+		if (readmit != 0 && now - readmit >= settle)
+		{
+			__atomic_store_n(&endpoint->m_ejections, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&endpoint->m_readmit_at, 0, __ATOMIC_RELAXED);
+		}
+
+		unsigned long ewma = Ewma(endpoint, now);
+		if (m_latency_factor > 0 && samples.size() >= 3 && ewma > m_latency_factor * median &&
+				ewma - median > m_latency_min_us * 1000UL)
+		{
+			Eject(i, now, true);
+		}
+	}
+
+	__atomic_store_n(&m_bsweeping, false, __ATOMIC_RELEASE);
+}
+
+TCPClient *LBClient::Acquire(LBEndpoint *endpoint)
+{
+	TCPClient *client = 0;
+	pthread_mutex_lock(&endpoint->m_lock);
+	if (endpoint->m_idle.empty() == false)
+	{
+		client = endpoint->m_idle.back();
+		endpoint->m_idle.pop_back();
+	}
+	pthread_mutex_unlock(&endpoint->m_lock);
+	if (client != 0)
+	{
+		return client;
+	}
+
+	client = new TCPClient;
+	client->m_profile = m_profile;
+	if (client->NewTCPClient(endpoint->m_host, endpoint->m_port) == false)
+	{
+		delete client;
+		return 0;
+	}
+
+	return client;
+}
+
+/*
+ * 失败的连接上可能还有没读完的应答，直接关闭
+ * */
+void LBClient::Release(LBEndpoint *endpoint, TCPClient *client, const bool bok)
+{
+	if (bok == true)
+	{
+		pthread_mutex_lock(&endpoint->m_lock);
+		if ((int)endpoint->m_idle.size() < m_max_idle)
+		{
+			endpoint->m_idle.push_back(client);
+			client = 0;
+		}
+		pthread_mutex_unlock(&endpoint->m_lock);
+	}
+
+	delete client;
+}
+
+/**
+ * @brief 选一个后端并取得连接，连接失败时换一个后端，最多试三次
+ * @param exclude 大于等于0时按二选一选择这个后端以外的后端，忽略key
+ * @return 后端的下标，已经调用了Begin，start为连接之后的时间，建立连接的时间不计入延迟；失败时返回-1
+ */
+int LBClient::Connect(const char *key, const int klen, const int exclude, TCPClient **client, unsigned long *start)
+{
+	for (int attempt = 0; attempt < 3; attempt++)
+	{
+		int index;
+		if (exclude >= 0)
+		{
+			index = m_endpoints.empty() ? -1 : PickP2C(MetricNow(), exclude);
+		}
+		else
+		{
+			index = (key != 0) ? PickKey(key, klen) : Pick();
+		}
+		if (index < 0)
+		{
+			return -1;
+		}
+
+		*start = Begin(index);
+		if ((*client = Acquire(m_endpoints[index])) == 0)
+		{
+			End(index, *start, false);
+			continue;
+		}
+		*start = MetricNow();
+
+		return index;
+	}
+
+	return -1;
+}
+
+bool LBClient::Call(const char *request, const int ilen, char *reply, const int ireply_cap, int *ireply_len,
+		const char *key, const int klen)
+{
+	TCPClient *client;
+	unsigned long start;
+	int index = Connect(key, klen, -1, &client, &start);
+	if (index < 0)
+	{
+		return false;
+	}
+
+	bool bok = client->WriteBuffer(request, ilen) == true && client->ReadBuffer(reply, m_timeout, ireply_cap) == true;
+	*ireply_len = bok ? client->m_buffer_len : 0;
+	Release(m_endpoints[index], client, bok);
+	End(index, start, bok);
+
+	return bok;
+}
+
+/**
+ * @brief 对冲延迟，前100次请求没有足够的样本，不对冲
+ */
+unsigned long LBClient::HedgeDelay(const unsigned long calls)
+{
+	if (m_hedge_pct <= 0 || calls < 100)
+	{
+		return 0;
+	}
+
+	// 求分位数要合并直方图的所有分片，不必每次都算
+	unsigned long delay = __atomic_load_n(&m_hedge_delay, __ATOMIC_RELAXED);
+	if (delay == 0 || (calls & 255) == 0)
+	{
+		delay = m_latency.Percentile(m_hedge_pct / 100.0);
+		if (delay < m_hedge_min_us * 1000UL)
+		{
+			delay = m_hedge_min_us * 1000UL;
+		}
+		__atomic_store_n(&m_hedge_delay, delay, __ATOMIC_RELAXED);
+	}
+
+	return delay;
+}
+
+/*
+ * CallHedged中一个连接上的应答，用非阻塞读逐步读入，后端只发了半个报文时不会阻塞，
+ * 仍然受截止时间和对冲的控制
+ * */
+struct HedgedReply
+{
+	unsigned int m_header[1 + TCP_FRAME_EXT_LEN / 4];   // 长度头和扩展头
+	int          m_header_got;
+	int          m_header_len;   // 4，扩展报文为4加上扩展头的长度
+	char        *m_body;         // 原请求直接读到调用者的缓冲区，对冲请求读到m_spare
+	int          m_len;          // 报文内容的长度，读完长度头和扩展头之前为-1
+	int          m_got;
+	string       m_spare;
+};
+
+static void ResetHedgedReply(HedgedReply *r, char *body)
+{
+	r->m_header_got = 0;
+	r->m_header_len = 4;
+	r->m_body = body;
+	r->m_len = -1;
+	r->m_got = 0;
+}
+
+/**
+ * @brief 读入连接上已经到达的数据
+ * @return 1为读完一个请求id匹配的报文，0为还要等待，-1为连接出错、报文超过icap或者请求id不匹配
+ */
+static int ReadHedgedReply(const int fd, HedgedReply *r, const int icap, const unsigned long request_id)
+{
+	while (r->m_len < 0)
+	{
+		ssize_t n = recv(fd, (char *)r->m_header + r->m_header_got, r->m_header_len - r->m_header_got, MSG_DONTWAIT);
+		if (n <= 0)
+		{
+			return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? 0 : -1;
+		}
+		r->m_header_got += n;
+		if (r->m_header_got < r->m_header_len)
+		{
+			continue;
+		}
+
+		unsigned int header = ntohl(r->m_header[0]);
+		if ((header & TCP_FRAME_EXT) != 0 && r->m_header_len == 4)
+		{
+			r->m_header_len = 4 + TCP_FRAME_EXT_LEN;
+			continue;
+		}
+
+		// 长度头来自后端，不可信；普通报文是不支持扩展报文的旧服务端的应答
+		int ilen = header & ~TCP_FRAME_EXT;
+		if (ilen > icap)
+		{
+			return -1;
+		}
+		if (r->m_header_len > 4 &&
+				(((unsigned long)ntohl(r->m_header[1]) << 32) | ntohl(r->m_header[2])) != request_id)
+		{
+			return -1;
+		}
+		if (r->m_body == 0)
+		{
+			r->m_spare.resize(ilen);
+			r->m_body = r->m_spare.data();
+		}
+		r->m_len = ilen;
+	}
+
+	while (r->m_got < r->m_len)
+	{
+		ssize_t n = recv(fd, r->m_body + r->m_got, r->m_len - r->m_got, MSG_DONTWAIT);
+		if (n <= 0)
+		{
+			return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? 0 : -1;
+		}
+		r->m_got += n;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief 发送扩展报文，等待应答，超过对冲延迟时再发给另一个后端
+ * @details 两个请求带同样的请求id，应答的id不同时（连接上残留的旧应答）当作失败。
+ *          输掉的连接上还有一个没有读的应答，不能放回连接池，直接关闭；
+ *          慢的原请求按已经等待的时间更新延迟，这是它真实延迟的下限。
+ */
+bool LBClient::CallHedged(const char *request, const int ilen, char *reply, const int ireply_cap, int *ireply_len,
+		const int itimeout_ms, const char *key, const int klen)
+{
+	*ireply_len = 0;
+	long wait_ms = itimeout_ms > 0 ? itimeout_ms : m_timeout * 1000L;
+	unsigned long deadline = wait_ms > 0 ? MetricNow() + wait_ms * 1000000UL : ~0UL;
+
+	TCPFrameMeta meta;
+	meta.m_request_id = __atomic_add_fetch(&m_request_id, 1, __ATOMIC_RELAXED);
+	meta.m_deadline = itimeout_ms > 0 ? deadline : 0;
+	meta.m_budget_us = 0;
+	meta.m_bext = true;
+
+	int index[2] = { -1, -1 };
+	TCPClient *client[2] = { 0, 0 };
+	unsigned long start[2] = { 0, 0 };
+	HedgedReply replies[2];
+	ResetHedgedReply(&replies[0], reply);
+	ResetHedgedReply(&replies[1], 0);
+	if ((index[0] = Connect(key, klen, -1, &client[0], &start[0])) < 0)
+	{
+		return false;
+	}
+	if (TCPWriteEx(client[0]->m_connfd, request, ilen, meta) == false)
+	{
+		Release(m_endpoints[index[0]], client[0], false);
+		End(index[0], start[0], false);
+		return false;
+	}
+
+	unsigned long calls = __atomic_add_fetch(&m_calls, 1, __ATOMIC_RELAXED);
+	unsigned long delay = HedgeDelay(calls);
+	bool bhedge = delay > 0 && m_endpoints.size() > 1 &&
+		__atomic_load_n(&m_hedges, __ATOMIC_RELAXED) * 100 < calls * m_hedge_max_pct;
+	unsigned long hedge_at = bhedge ? start[0] + delay : deadline;
+
+	int iwinner = -1;
+	int nactive = 1;
+	while (iwinner == -1 && nactive > 0)
+	{
+		unsigned long now = MetricNow();
+		if (now >= deadline)
+		{
+			break;
+		}
+		if (client[1] == 0 && bhedge == true && now >= hedge_at)
+		{
+			// 对冲只发一次，第二个后端连不上时继续等原请求
+			bhedge = false;
+			if ((index[1] = Connect(0, 0, index[0], &client[1], &start[1])) >= 0)
+			{
+				if (TCPWriteEx(client[1]->m_connfd, request, ilen, meta) == true)
+				{
+					__atomic_add_fetch(&m_hedges, 1, __ATOMIC_RELAXED);
+					nactive++;
+				}
+				else
+				{
+					Release(m_endpoints[index[1]], client[1], false);
+					End(index[1], start[1], false);
+					client[1] = 0;
+				}
+			}
+		}
+
+		struct pollfd pfds[2];
+		int slots[2];
+		int nfds = 0;
+		for (int k = 0; k < 2; k++)
+		{
+			if (client[k] != 0)
+			{
+				pfds[nfds].fd = client[k]->m_connfd;
+				pfds[nfds].events = POLLIN;
+				slots[nfds++] = k;
+			}
+		}
+		// 对冲延迟是微秒级的，用ppoll，poll只能精确到毫秒
+		unsigned long until = (client[1] == 0 && bhedge == true && hedge_at < deadline) ? hedge_at : deadline;
+		struct timespec wait;
+		wait.tv_sec = (until - now) / 1000000000;
+		wait.tv_nsec = (until - now) % 1000000000;
+		int iret = ppoll(pfds, nfds, &wait, 0);
+		if (iret < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		for (int j = 0; j < nfds && iret > 0 && iwinner == -1; j++)
+		{
+			if (pfds[j].revents == 0)
+			{
+				continue;
+			}
+
+			int k = slots[j];
+			int iread = ReadHedgedReply(client[k]->m_connfd, &replies[k], ireply_cap, meta.m_request_id);
+			if (iread == 0)
+			{
+				continue;
+			}
+			if (iread > 0)
+			{
+				iwinner = k;
+				continue;
+			}
+
+			// 这个连接坏了，继续等另一个
+			Release(m_endpoints[index[k]], client[k], false);
+			End(index[k], start[k], false);
+			client[k] = 0;
+			nactive--;
+		}
+	}
+
+	unsigned long now = MetricNow();
+	for (int k = 0; k < 2; k++)
+	{
+		if (client[k] == 0)
+		{
+			continue;
+		}
+
+		if (k == iwinner)
+		{
+			Release(m_endpoints[index[k]], client[k], true);
+			End(index[k], start[k], true);
+			m_latency.Record(now - start[0]);
+			if (k == 1)
+			{
+				__atomic_add_fetch(&m_hedge_wins, 1, __ATOMIC_RELAXED);
+			}
+		}
+		else
+		{
+			// 输掉的对冲请求不计延迟，输掉的原请求按已经等待的时间计算；都超时时算失败
+			Release(m_endpoints[index[k]], client[k], false);
+			if (iwinner == -1 || k == 0)
+			{
+				End(index[k], start[k], iwinner != -1);
+			}
+			else
+			{
+				__atomic_sub_fetch(&m_endpoints[index[k]]->m_inflight, 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	if (iwinner == -1)
+	{
+		*ireply_len = 0;
+		return false;
+	}
+
+	if (iwinner == 1)
+	{
+		memcpy(reply, replies[1].m_body, replies[1].m_len);
+	}
+	*ireply_len = replies[iwinner].m_len;
+
+	return true;
+}
+
+unsigned long LBClient::Hedges() const
+{
+	return __atomic_load_n(&m_hedges, __ATOMIC_RELAXED);
+}
+
+unsigned long LBClient::HedgeWins() const
+{
+	return __atomic_load_n(&m_hedge_wins, __ATOMIC_RELAXED);
+}
+
+void LBClient::Close()
+{
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		LBEndpoint *endpoint = m_endpoints[i];
+		pthread_mutex_lock(&endpoint->m_lock);
+		for (size_t k = 0; k < endpoint->m_idle.size(); k++)
+		{
+			delete endpoint->m_idle[k];
+		}
+		endpoint->m_idle.clear();
+		pthread_mutex_unlock(&endpoint->m_lock);
+	}
+}
+
+LBClient::~LBClient()
+{
+	Close();
+	for (size_t i = 0; i < m_endpoints.size(); i++)
+	{
+		pthread_mutex_destroy(&m_endpoints[i]->m_lock);
+		delete m_endpoints[i];
+	}
+	pthread_rwlock_destroy(&m_table_lock);
+}
@@ -0,0 +1,216 @@
+#ifndef __LBCLIENT_H__
+#define __LBCLIENT_H__
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+
+/*
+ * 选择后端的策略
+ * */
+enum LBPolicy
+{
+	LB_P2C_INFLIGHT = 0,   // 随机取两个后端，选在途请求少的
+	LB_P2C_EWMA     = 1,   // 随机取两个后端，选延迟的EWMA乘以(在途请求数+1)小的
+	LB_JUMP_HASH    = 2,   // 按键的jump一致性散列选后端，后端只能追加在后面
+	LB_MAGLEV       = 3    // 按键查Maglev表，后端的顺序可以任意
+};
+
+/*
+ * 一个后端的状态，除了连接池以外的字段都用原子操作读写
+ * */
+struct LBEndpoint
+{
+	char          m_host[32];
+	int           m_port;
+	long          m_inflight;        // 在途请求数
+	unsigned long m_ewma_ns;         // 延迟的EWMA，单位为纳秒，0为还没有样本
+	unsigned long m_ewma_at;         // 最近一次更新EWMA的时间
+	int           m_failures;        // 连续失败的次数
+	int           m_ejections;       // 连续被摘除的次数，决定下一次摘除的时长，恢复正常后清零
+	unsigned long m_ejected_until;   // 摘除到这个时间（MetricNow），0为没有摘除
+	unsigned long m_readmit_at;      // 最近一次恢复的时间，之后m_slow_start_ms内逐渐加大权重
+	unsigned long m_requests;
+	unsigned long m_errors;
+
+	pthread_mutex_t    m_lock;       // 保护m_idle
+	vector<TCPClient *> m_idle;      // 空闲的连接
+};
+
+/**
+ * @brief 连接多个后端的客户端
+ *
+ * 不带键的请求用二选一（power of two choices）：随机取两个健康的后端，选负载小的，
+ * 不需要全局的负载信息，又能避开忙的后端，比轮询和纯随机的尾延迟低。
+ * 延迟的EWMA在没有新样本时随时间衰减，一度变慢而分不到请求的后端过一会儿会重新被试探。
+ * 带键的请求用一致性散列，同一个键总是到同一个后端，后端增减时只有少部分键会移动：
+ * jump hash不占内存，但后端只能追加在后面；Maglev查一张m_maglev_size大小的表，
+ * 各个后端分到的键数几乎相同。
+ *
+ * 连续失败m_eject_failures次，或者延迟的EWMA超过健康后端中位数的m_latency_factor倍并且
+ * 高出m_latency_min_us时，摘除这个后端，时长从m_eject_base_ms开始，每次连续摘除翻倍，
+ * 最长m_eject_max_ms。
+ * 同时被摘除的后端不超过m_max_eject_pct百分比，避免全部摘除。摘除到期后自动恢复，
+ * 在m_slow_start_ms内权重从10%线性增加到100%，恢复的后端不会马上被打满。
+ * 按键选择时跳过摘除的后端，这些键临时改到其他后端，恢复后在慢启动期间按权重的比例逐渐回来。
+ *
+ * CallHedged用扩展报文带上请求id和截止时间，超过最近请求延迟的m_hedge_pct分位数还没有应答时，
+ * 把同一个请求再发给另一个后端，用先到的应答，慢的那个连接直接关闭。对冲的请求不超过
+ * 全部请求的m_hedge_max_pct百分比，后端整体变慢时不会把负载翻倍。
+ *
+ * 后端在使用前用AddEndpoint添加，之后不能再增减。Call和Pick等方法都是线程安全的。
+ *
+ * 使用方法：
+ *   LBClient lb;
+ *   lb.AddEndpoints("10.0.0.1:5005,10.0.0.2:5005,10.0.0.3:5005");
+ *   lb.m_policy = LB_P2C_EWMA;
+ *   lb.Call(request, ilen, reply, sizeof(reply), &ireply_len);
+ *   lb.Call(request, ilen, reply, sizeof(reply), &ireply_len, key, klen);   // m_policy为LB_JUMP_HASH或者LB_MAGLEV时按键选择
+ */
+class LBClient
+{
+	public:
+		LBPolicy m_policy;          // 缺省LB_P2C_EWMA，散列策略下不带键的请求用LB_P2C_EWMA
+		int      m_timeout;         // 等待应答的超时时间，单位为秒，0为无限等待，缺省5
+		int      m_max_idle;        // 每个后端最多保留的空闲连接数，缺省16
+		int      m_eject_failures;  // 连续失败多少次摘除，缺省5
+		int      m_eject_base_ms;   // 第一次摘除的时长，缺省1000
+		int      m_eject_max_ms;    // 摘除的最长时间，缺省30000
+		int      m_max_eject_pct;   // 最多同时摘除的后端的百分比，缺省50
+		int      m_slow_start_ms;   // 恢复后权重增加到100%的时间，0为不慢启动，缺省10000
+		double   m_latency_factor;  // 延迟的EWMA超过中位数的多少倍时摘除，0为不按延迟摘除，缺省5
+		int      m_latency_min_us;  // 同时还要比中位数高出这么多才摘除，避免微秒级的抖动被当作离群，缺省10000
+		double   m_ewma_alpha;      // 新样本在EWMA中的权重，缺省0.2
+		int      m_ewma_decay_ms;   // 没有新样本时EWMA按这个时间常数指数衰减，缺省1000
+		int      m_maglev_size;     // Maglev表的大小，必须是质数，至少是后端数的100倍，缺省65537
+		int      m_hedge_pct;       // 对冲延迟取请求延迟的这个百分位，0为不对冲，缺省95
+		int      m_hedge_min_us;    // 对冲延迟的下限，缺省200
+		int      m_hedge_max_pct;   // 最多对冲的请求的百分比，缺省10
+		SocketProfile m_profile;    // 新建连接使用的socket选项
+
+		LBClient();
+
+		/*
+		 * 添加一个后端，必须在第一次选择之前调用
+		 * */
+		bool AddEndpoint(const char *host, const int port);
+
+		/*
+		 * 添加逗号分隔的"主机:端口"列表
+		 * */
+		bool AddEndpoints(const char *list);
+
+		int Endpoints() const;
+
+		const LBEndpoint *Endpoint(const int index) const;
+
+		/*
+		 * 按m_policy选一个健康的后端，全部摘除时仍然返回一个
+		 * 返回值 后端的下标，没有后端时返回-1
+		 * */
+		int Pick();
+
+		/*
+		 * 按键选后端，m_policy不是散列策略时和Pick一样
+		 * */
+		int PickKey(const char *key, const int klen);
+
+		int PickHash(const unsigned long hash);
+
+		/*
+		 * 自己管理连接的调用者在发请求前后调用，用来统计在途请求、延迟和失败
+		 * start_ns Begin返回的时间
+		 * */
+		unsigned long Begin(const int index);
+
+		void End(const int index, const unsigned long start_ns, const bool bok);
+
+		/*
+		 * 选一个后端，发送请求并等待应答，使用后端的连接池
+		 * reply 应答的缓冲区，ireply_cap为它的大小，应答超过ireply_cap时当作失败并关闭连接，
+		 *       ireply_len返回应答的长度
+		 * key 不为0时按键选择后端
+		 * 建立连接失败时换一个后端再试，最多试三次；请求已经发出后失败不重试，由调用者决定
+		 * 返回值 true为成功，false为失败
+		 * */
+		bool Call(const char *request, const int ilen, char *reply, const int ireply_cap, int *ireply_len,
+				const char *key = 0, const int klen = 0);
+
+		/*
+		 * 和Call一样，但是用扩展报文发送，超过对冲延迟没有应答时发给第二个后端，用先到的应答
+		 * itimeout_ms 截止时间，随请求发给服务端，服务端取出请求时已经过期就不处理，
+		 *             0为没有截止时间，这时最多等待m_timeout秒，m_timeout也为0时一直等待
+		 * 服务端必须支持扩展报文，例如FrameServer；过期的请求收到"EXPIRED"应答，返回true
+		 * 应答用非阻塞读逐步读入，后端只发了半个报文时也不会超过截止时间，应答超过ireply_cap时当作失败
+		 * */
+		bool CallHedged(const char *request, const int ilen, char *reply, const int ireply_cap, int *ireply_len,
+				const int itimeout_ms, const char *key = 0, const int klen = 0);
+
+		/*
+		 * 已经发出的对冲请求数，以及对冲请求先于原请求应答的次数
+		 * */
+		unsigned long Hedges() const;
+
+		unsigned long HedgeWins() const;
+
+		/*
+		 * 关闭所有空闲连接
+		 * */
+		void Close();
+
+		~LBClient();
+
+	private:
+		vector<LBEndpoint *> m_endpoints;
+		int                  m_ejected;        // 正在摘除中的后端数
+		unsigned long        m_completions;    // 完成的请求数，每64个检查一次延迟离群和恢复
+		unsigned long        m_health_gen;     // 摘除或者恢复时加一，Maglev表据此重建
+		bool                 m_bsweeping;      // 同一时间只有一个线程执行Sweep
+
+		MetricHistogram      m_latency;        // CallHedged成功的请求的延迟
+		unsigned long        m_calls;          // CallHedged的次数
+		unsigned long        m_hedges;
+		unsigned long        m_hedge_wins;
+		unsigned long        m_hedge_delay;    // 缓存的对冲延迟，单位为纳秒，每256次请求重新计算
+		unsigned long        m_request_id;
+
+		pthread_rwlock_t     m_table_lock;     // 保护下面两个字段
+		vector<int>          m_maglev;         // Maglev表，值为后端的下标
+		unsigned long        m_table_gen;      // 建表时的m_health_gen
+
+		bool Healthy(const LBEndpoint *endpoint, const unsigned long now) const;
+
+		double Ewma(const LBEndpoint *endpoint, const unsigned long now) const;
+
+		double Weight(const LBEndpoint *endpoint, const unsigned long now) const;
+
+		bool Admit(const LBEndpoint *endpoint, const unsigned long key, const unsigned long now) const;
+
+		double Cost(const LBEndpoint *endpoint, const unsigned long now) const;
+
+		int PickP2C(const unsigned long now, const int exclude = -1);
+
+		int PickJump(unsigned long hash, const unsigned long now);
+
+		int PickMaglev(const unsigned long hash, const unsigned long now);
+
+		void BuildMaglev(const unsigned long now);
+
+		bool Eject(const int index, const unsigned long now, const bool blatency);
+
+		void Sweep(const unsigned long now);
+
+		TCPClient *Acquire(LBEndpoint *endpoint);
+
+		void Release(LBEndpoint *endpoint, TCPClient *client, const bool bok);
+
+		int Connect(const char *key, const int klen, const int exclude, TCPClient **client, unsigned long *start);
+
+		unsigned long HedgeDelay(const unsigned long calls);
+};
+
+/*
+ * jump一致性散列，把hash映射到[0, buckets)
+ * */
+int JumpHash(unsigned long hash, const int buckets);
+
+#endif
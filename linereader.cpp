@@ -0,0 +1,473 @@
+#include "public.h"
+#include "linereader.h"
+
+/*
+ * Parallel中的一个块
+ * */
+struct LineSlot
+{
+	char       *m_buffer;     // 不用mmap时块自己的缓冲区，处理完之后复用
+	size_t      m_cap;
+	const char *m_data;
+	size_t      m_len;
+	void       *m_result;
+	bool        m_bdone;
+};
+
+struct LineParallel
+{
+	LineChunkProcess m_process;
+	void            *m_arg;
+	LineSlot        *m_slots;
+	int              m_window;
+	unsigned long    m_next_produce;   // 下一个读入的块
+	unsigned long    m_next_process;   // 下一个交给工作线程的块
+	bool             m_bstop;
+	pthread_mutex_t  m_lock;
+	pthread_cond_t   m_work;           // 有新的块可以处理
+	pthread_cond_t   m_done;           // 有块处理完
+};
+
+LineReader::LineReader()
+{
+	m_chunk_size = 4 * 1024 * 1024;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	m_threads = ncpu > 0 ? ncpu : 1;
+	m_bmmap = true;
+	m_fd = -1;
+	m_bclose_fd = false;
+	m_bregular = false;
+	m_map = 0;
+	m_map_len = 0;
+	m_off = 0;
+	m_buffer = 0;
+	m_buffer_cap = 0;
+	m_carry = 0;
+	m_beof = false;
+	m_berror = false;
+	m_chunk = 0;
+	m_chunk_len = 0;
+	m_chunk_pos = 0;
+}
+
+bool LineReader::Open(const char *filename)
+{
+	Close();
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+	if (Init(fd) == false)
+	{
+		close(fd);
+		return false;
+	}
+	m_bclose_fd = true;
+
+	return true;
+}
+
+bool LineReader::OpenFd(const int fd)
+{
+	Close();
+	return Init(fd);
+}
+
+bool LineReader::Init(const int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return false;
+	}
+
+	m_fd = fd;
+	m_bregular = S_ISREG(st.st_mode);
+	m_off = 0;
+	m_carry = 0;
+	m_beof = false;
+	m_berror = false;
+	m_chunk_len = 0;
+	m_chunk_pos = 0;
+
+	if (m_bregular == true && m_bmmap == true && st.st_size > 0)
+	{
+		void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			m_map = (char *)map;
+			m_map_len = st.st_size;
+			madvise(m_map, m_map_len, MADV_SEQUENTIAL);
+			return true;
+		}
+	}
+
+	// 映射失败时退回到read，不算错误
+	if (m_bregular == true)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	return true;
+}
+
+/**
+ * @brief 不用mmap时读入一个块
+ * @details 调用者已经把上一个块末尾不完整的行（carry个字节）放在buffer的开头，这里再读满m_chunk_size，
+ *          块在最后一个换行符之后结束，剩下的部分留在块的后面，carry返回它的长度。
+ *          一行比块还长时扩大缓冲区继续读
+ * @param buffer 块的缓冲区，可以是m_buffer本身，不够时重新分配
+ */
+bool LineReader::ReadChunk(char **buffer, size_t *cap, size_t *carry, const char **data, size_t *len)
+{
+	size_t used = *carry;
+	size_t want = *carry + m_chunk_size;
+	while (true)
+	{
+		if (*cap < want)
+		{
+			char *grown = (char *)realloc(*buffer, want);
+			if (grown == 0)
+			{
+				m_berror = true;
+				return false;
+			}
+			*buffer = grown;
+			*cap = want;
+		}
+
+		// 读满want个字节或者读到文件末尾，缓冲区因为长行变大之后也不多读
+		size_t start = used;
+		while (used < want && m_beof == false)
+		{
+			ssize_t n = m_bregular ? pread(m_fd, *buffer + used, want - used, m_off) : read(m_fd, *buffer + used, want - used);
+			if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (n < 0)
+			{
+				m_berror = true;
+				return false;
+			}
+			if (n == 0)
+			{
+				m_beof = true;
+				break;
+			}
+			used += n;
+			m_off += n;
+		}
+
+		if (m_beof == true)
+		{
+			*carry = 0;
+			*data = *buffer;
+			*len = used;
+			return used > 0;
+		}
+
+		// 只在新读入的部分找换行符，之前的部分已经找过
+		const char *nl = (const char *)memrchr(*buffer + start, '\n', used - start);
+		if (nl != 0)
+		{
+			*data = *buffer;
+			*len = nl + 1 - *buffer;
+			*carry = used - *len;
+			return true;
+		}
+		want *= 2;
+	}
+}
+
+bool LineReader::NextChunk(const char **data, size_t *len)
+{
+	if (m_map != 0)
+	{
+		if (m_off >= m_map_len)
+		{
+			return false;
+		}
+
+		const char *start = m_map + m_off;
+		size_t ilen = m_map_len - m_off;
+		if (ilen > m_chunk_size)
+		{
+			const char *nl = (const char *)memrchr(start, '\n', m_chunk_size);
+			if (nl == 0)
+			{
+				nl = (const char *)memchr(start + m_chunk_size, '\n', ilen - m_chunk_size);
+			}
+			if (nl != 0)
+			{
+				ilen = nl + 1 - start;
+			}
+		}
+		m_off += ilen;
+		*data = start;
+		*len = ilen;
+		return true;
+	}
+
+	if (m_fd == -1)
+	{
+		return false;
+	}
+
+	// 不完整的行在上一个块之后，先搬到开头
+	if (m_carry > 0)
+	{
+		memmove(m_buffer, m_buffer + m_chunk_len, m_carry);
+	}
+	m_chunk_len = 0;
+
+	return ReadChunk(&m_buffer, &m_buffer_cap, &m_carry, data, len);
+}
+
+bool LineReader::Next(const char **line, int *len)
+{
+	while (m_chunk_pos >= m_chunk_len)
+	{
+		m_chunk_pos = 0;
+		if (NextChunk(&m_chunk, &m_chunk_len) == false)
+		{
+			m_chunk_len = 0;
+			return false;
+		}
+	}
+
+	const char *p = m_chunk + m_chunk_pos;
+	NextLine(&p, m_chunk + m_chunk_len, line, len);
+	m_chunk_pos = p - m_chunk;
+
+	return true;
+}
+
+static void *LineWorker(void *arg)
+{
+	LineParallel *par = (LineParallel *)arg;
+
+	pthread_mutex_lock(&par->m_lock);
+	while (true)
+	{
+		while (par->m_bstop == false && par->m_next_process == par->m_next_produce)
+		{
+			pthread_cond_wait(&par->m_work, &par->m_lock);
+		}
+		if (par->m_next_process == par->m_next_produce)
+		{
+			break;
+		}
+
+		LineSlot *slot = &par->m_slots[par->m_next_process++ % par->m_window];
+		pthread_mutex_unlock(&par->m_lock);
+
+		void *result = par->m_process(slot->m_data, slot->m_len, par->m_arg);
+
+		pthread_mutex_lock(&par->m_lock);
+		slot->m_result = result;
+		slot->m_bdone = true;
+		pthread_cond_signal(&par->m_done);
+	}
+	pthread_mutex_unlock(&par->m_lock);
+
+	return 0;
+}
+
+/**
+ * @details 调用的线程负责读入块和按顺序交给consume，工作线程只做process。
+ *          mmap时块只是映射中的一段，缺页发生在工作线程中，多个线程同时读盘
+ */
+bool LineReader::Parallel(LineChunkProcess process, LineChunkConsume consume, void *arg)
+{
+	if (m_fd == -1)
+	{
+		return false;
+	}
+	int ithreads = m_threads > 0 ? m_threads : 1;
+
+	LineParallel par;
+	par.m_process = process;
+	par.m_arg = arg;
+	par.m_window = ithreads * 2;
+	par.m_slots = (LineSlot *)calloc(par.m_window, sizeof(LineSlot));
+	par.m_next_produce = 0;
+	par.m_next_process = 0;
+	par.m_bstop = false;
+	pthread_mutex_init(&par.m_lock, 0);
+	pthread_cond_init(&par.m_work, 0);
+	pthread_cond_init(&par.m_done, 0);
+
+	// 之前用Next读了一部分时，当前块剩下的行作为第一个块。不用mmap时Next的缓冲区m_buffer
+	// 在这里不再写入，剩下的行和后面不完整的行都可以直接引用
+	const char *rest = m_chunk + m_chunk_pos;
+	size_t rest_len = m_chunk_len - m_chunk_pos;
+	m_chunk_pos = m_chunk_len;
+	const char *carry_src = m_buffer + m_chunk_len;
+	size_t carry = m_carry;
+	m_carry = 0;
+
+	// 创建失败的线程不计入，一个都没有启动时由调用的线程自己按顺序处理每个块
+	vector<pthread_t> tids;
+	tids.reserve(ithreads);
+	for (int i = 0; i < ithreads; i++)
+	{
+		pthread_t tid;
+		if (pthread_create(&tid, 0, LineWorker, &par) == 0)
+		{
+			tids.push_back(tid);
+		}
+	}
+
+	bool bok = true;
+	bool bproduce = true;
+	unsigned long next_consume = 0;
+
+	pthread_mutex_lock(&par.m_lock);
+	while (true)
+	{
+		while (bproduce == true && par.m_next_produce - next_consume < (unsigned long)par.m_window)
+		{
+			LineSlot *slot = &par.m_slots[par.m_next_produce % par.m_window];
+			pthread_mutex_unlock(&par.m_lock);
+
+			bool bchunk = true;
+			if (rest_len > 0)
+			{
+				slot->m_data = rest;
+				slot->m_len = rest_len;
+				rest_len = 0;
+			}
+			else if (m_map != 0)
+			{
+				// 提前发起这个块的预读，工作线程访问时不用逐页等待
+				bchunk = NextChunk(&slot->m_data, &slot->m_len);
+				if (bchunk == true)
+				{
+					size_t page = (size_t)(slot->m_data - m_map) & ~(size_t)(getpagesize() - 1);
+					madvise(m_map + page, slot->m_data + slot->m_len - (m_map + page), MADV_WILLNEED);
+				}
+			}
+			else
+			{
+				// 上一个块后面不完整的行拷贝到这个块的开头
+				if (carry > 0 && slot->m_cap < carry)
+				{
+					char *grown = (char *)realloc(slot->m_buffer, carry);
+					bchunk = grown != 0;
+					if (bchunk == true)
+					{
+						slot->m_buffer = grown;
+						slot->m_cap = carry;
+					}
+					else
+					{
+						m_berror = true;
+					}
+				}
+				if (bchunk == true)
+				{
+					if (carry > 0)
+					{
+						memcpy(slot->m_buffer, carry_src, carry);
+					}
+					bchunk = ReadChunk(&slot->m_buffer, &slot->m_cap, &carry, &slot->m_data, &slot->m_len);
+					carry_src = slot->m_buffer + slot->m_len;
+				}
+			}
+
+			pthread_mutex_lock(&par.m_lock);
+			if (bchunk == false)
+			{
+				bproduce = false;
+				break;
+			}
+			slot->m_bdone = false;
+			par.m_next_produce++;
+			pthread_cond_signal(&par.m_work);
+		}
+
+		if (next_consume == par.m_next_produce)
+		{
+			break;
+		}
+
+		LineSlot *slot = &par.m_slots[next_consume % par.m_window];
+		if (tids.empty() == true && slot->m_bdone == false)
+		{
+			par.m_next_process++;
+			pthread_mutex_unlock(&par.m_lock);
+			slot->m_result = process(slot->m_data, slot->m_len, arg);
+			pthread_mutex_lock(&par.m_lock);
+			slot->m_bdone = true;
+		}
+		while (slot->m_bdone == false)
+		{
+			pthread_cond_wait(&par.m_done, &par.m_lock);
+		}
+		pthread_mutex_unlock(&par.m_lock);
+
+		// consume返回false之后不再读入新的块，已经在处理的块仍然交给consume释放结果
+		if (consume(slot->m_result, arg) == false)
+		{
+			bok = false;
+			bproduce = false;
+		}
+
+		pthread_mutex_lock(&par.m_lock);
+		next_consume++;
+	}
+	par.m_bstop = true;
+	pthread_cond_broadcast(&par.m_work);
+	pthread_mutex_unlock(&par.m_lock);
+
+	for (size_t i = 0; i < tids.size(); i++)
+	{
+		pthread_join(tids[i], 0);
+	}
+	for (int i = 0; i < par.m_window; i++)
+	{
+		free(par.m_slots[i].m_buffer);
+	}
+	free(par.m_slots);
+	pthread_mutex_destroy(&par.m_lock);
+	pthread_cond_destroy(&par.m_work);
+	pthread_cond_destroy(&par.m_done);
+
+	return bok == true && m_berror == false;
+}
+
+bool LineReader::Error() const
+{
+	return m_berror;
+}
+
+void LineReader::Close()
+{
+	if (m_map != 0)
+	{
+		munmap(m_map, m_map_len);
+		m_map = 0;
+		m_map_len = 0;
+	}
+	if (m_fd != -1 && m_bclose_fd == true)
+	{
+		close(m_fd);
+	}
+	m_fd = -1;
+	m_bclose_fd = false;
+	free(m_buffer);
+	m_buffer = 0;
+	m_buffer_cap = 0;
+	m_carry = 0;
+	m_chunk = 0;
+	m_chunk_len = 0;
+	m_chunk_pos = 0;
+}
+
+LineReader::~LineReader()
+{
+	Close();
+}
@@ -0,0 +1,128 @@
+#ifndef __LINEREADER_H__
+#define __LINEREADER_H__
+#include "public.h"
+
+/*
+ * 并行处理一个块，在工作线程中调用，data是若干完整的行，len不为0
+ * 返回值 交给LineChunkConsume的结果
+ * */
+typedef void *(*LineChunkProcess)(const char *data, const size_t len, void *arg);
+
+/*
+ * 按块在文件中的顺序依次处理结果，在调用Parallel的线程中调用，需要释放result
+ * 返回值 返回false时停止读取
+ * */
+typedef bool (*LineChunkConsume)(void *result, void *arg);
+
+/**
+ * @brief 大文件的按行读取
+ *
+ * 普通文件用mmap映射整个文件，Next返回的行直接指向映射的内存，不拷贝；管道、设备文件、
+ * 映射失败或者m_bmmap为false（例如NFS上的文件）时，用m_chunk_size大小的pread/read读入缓冲区，
+ * 并用posix_fadvise告诉内核顺序读取。行的边界用memchr查找，glibc的memchr用SIMD指令
+ * 一次比较16或32个字节，比stdio逐个字节拷贝到用户缓冲区快得多。
+ *
+ * 文件按m_chunk_size切成块，块的边界对齐到换行符，每个块都是完整的行。
+ * Parallel把块分给m_threads个线程并行处理，处理的结果仍然按块的顺序交给调用者，
+ * 同时在处理中的块不超过线程数的两倍，内存占用和文件大小无关。
+ *
+ * 行不包括结尾的"\n"或者"\r\n"，最后一行没有换行符时也会返回。
+ *
+ * 使用方法：
+ *   LineReader reader;
+ *   reader.Open("/data/input.log");
+ *   const char *line;
+ *   int len;
+ *   while (reader.Next(&line, &len) == true) ...
+ *
+ *   reader.Parallel(ParseChunk, MergeResult, &ctx);
+ */
+class LineReader
+{
+	public:
+		size_t m_chunk_size;   // 块的大小，缺省4MB，比最长的行小时按行的长度扩大
+		int    m_threads;      // Parallel的线程数，缺省为CPU数
+		bool   m_bmmap;        // 普通文件是否使用mmap，缺省true
+
+		LineReader();
+
+		bool Open(const char *filename);
+
+		/*
+		 * 从标准输入等已经打开的描述符读取，fd由调用者关闭
+		 * */
+		bool OpenFd(const int fd);
+
+		/*
+		 * 取下一行，返回的指针在下一次调用Next之前有效
+		 * 返回值 读完或者出错时返回false，用Error区分
+		 * */
+		bool Next(const char **line, int *len);
+
+		/*
+		 * 取下一个块，由若干完整的行组成，返回的指针在下一次调用NextChunk之前有效
+		 * */
+		bool NextChunk(const char **data, size_t *len);
+
+		/*
+		 * 并行处理剩下的所有块，见LineChunkProcess和LineChunkConsume
+		 * 返回值 读取出错或者consume返回false时返回false
+		 * */
+		bool Parallel(LineChunkProcess process, LineChunkConsume consume, void *arg);
+
+		/*
+		 * 是否发生了读取错误
+		 * */
+		bool Error() const;
+
+		void Close();
+
+		~LineReader();
+
+	private:
+		int     m_fd;
+		bool    m_bclose_fd;
+		bool    m_bregular;   // 普通文件用pread，否则用read
+		char   *m_map;
+		size_t  m_map_len;
+		size_t  m_off;        // 映射中或者文件中下一个块的位置
+		char   *m_buffer;     // 不用mmap时的读缓冲区
+		size_t  m_buffer_cap;
+		size_t  m_carry;      // 上一个块末尾没有换行符的部分，已经搬到缓冲区开头
+		bool    m_beof;
+		bool    m_berror;
+		const char *m_chunk;  // Next正在读的块
+		size_t  m_chunk_len;
+		size_t  m_chunk_pos;
+
+		bool Init(const int fd);
+
+		bool ReadChunk(char **buffer, size_t *cap, size_t *carry, const char **data, size_t *len);
+};
+
+/*
+ * 从p开始取一行，p移到下一行的开头
+ * 返回值 p已经到end时返回false
+ * */
+static inline bool NextLine(const char **p, const char *end, const char **line, int *len)
+{
+	if (*p >= end)
+	{
+		return false;
+	}
+
+	const char *start = *p;
+	const char *nl = (const char *)memchr(start, '\n', end - start);
+	const char *stop = (nl != 0) ? nl : end;
+	*p = (nl != 0) ? nl + 1 : end;
+	if (stop > start && stop[-1] == '\r')
+	{
+		stop--;
+	}
+	*line = start;
+	*len = stop - start;
+
+	return true;
+}
+
+#endif
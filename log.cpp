@@ -1,6 +1,16 @@
 #include "public.h"
 #include "log.h"
 #include "utils.h"
+#include "metrics.h"
+
+static MetricCounter *g_log_lines = NewMetricCounter("moserver_log_writes_total",
+		"Write calls on Log objects");
+static MetricCounter *g_log_bytes = NewMetricCounter("moserver_log_bytes_total",
+		"Bytes written to log files");
+static MetricCounter *g_log_rotations = NewMetricCounter("moserver_log_rotations_total",
+		"Log file rotations");
+static MetricHistogram *g_log_write_latency = NewMetricHistogram("moserver_log_write_seconds",
+		"Time spent in Log::Write including lock wait");
 
 /**
  * @brief 构造函数，初始化日志对象
@@ -9,7 +19,8 @@
  * - 文件描述符设为0
  * - 清空文件名和打开模式缓冲区
  * - 设置默认的备份和缓冲标志
- * - 设置默认的最大日志文件大小
+ * - 设置默认的最大日志文件大小（100MB）和切换策略
+ * - 初始化后台切换线程使用的锁和条件变量
  */
 Log::Log()
 {
@@ -19,11 +30,46 @@ Log::Log()
 
 	m_bis_backup = true;
 	m_bis_buffer = false;
-	m_max_log_size = 1024;
-	if (m_max_log_size < 10)
+	m_max_log_size = 100;
+	m_rotate_interval = 0;
+	m_keep_count = 0;
+	m_keep_total_size = 0;
+	m_bis_compress = false;
+
+	m_nextfd = 0;
+	memset(m_next_filename, 0, sizeof(m_next_filename));
+	m_cur_size = 0;
+	m_next_rotate_time = 0;
+	m_retired_count = 0;
+
+	pthread_mutex_init(&m_write_lock, 0);
+	pthread_mutex_init(&m_rotate_lock, 0);
+	pthread_cond_init(&m_rotate_cond, 0);
+	m_brotate_running = false;
+	m_brotate_stop = false;
+}
+
+/**
+ * @brief 设置日志切换和保留策略
+ *
+ * @param max_log_size 单个日志文件的最大大小，单位为MB，0表示不按大小切换
+ * @param rotate_interval 按时间切换的周期，单位为秒，0表示不按时间切换
+ * @param keep_count 保留的备份文件个数，0表示不限制
+ * @param keep_total_size 备份文件总大小上限，单位为MB，0表示不限制
+ * @param bis_compress 是否用gzip压缩备份文件
+ */
+void Log::SetRotate(long max_log_size, int rotate_interval, int keep_count, long keep_total_size, bool bis_compress)
+{
+	m_max_log_size = max_log_size;
+	if (m_max_log_size < 0)
 	{
-		m_max_log_size = 10;
+		m_max_log_size = 0;
 	}
+
+	m_rotate_interval = rotate_interval > 0 ? rotate_interval : 0;
+	m_keep_count = keep_count > 0 ? keep_count : 0;
+	m_keep_total_size = keep_total_size > 0 ? keep_total_size : 0;
+	m_bis_compress = bis_compress;
 }
 
 /**
@@ -40,10 +86,10 @@ bool Log::OpenFile(const char *filename, const char *open_mode, bool bis_backup,
 {
 	CloseLogFile();
 
-	strcpy(m_log_filename, filename);
+	StrCopy(m_log_filename, sizeof(m_log_filename), filename);
 	m_bis_buffer = bis_buffer;
 	m_bis_backup = bis_backup;
-	
+
 	if (open_mode == 0)
 	{
 		StrCopy(m_open_mode, sizeof(m_open_mode), "a+");
@@ -53,22 +99,83 @@ bool Log::OpenFile(const char *filename, const char *open_mode, bool bis_backup,
 		StrCopy(m_open_mode, sizeof(m_open_mode), open_mode);
 	}
 
-	if ((m_tracefd = FOpen(m_log_filename, open_mode)) == 0)
+	if ((m_tracefd = FOpen(m_log_filename, m_open_mode)) == 0)
 	{
 		return false;
 	}
 
+	struct stat st;
+	m_cur_size = 0;
+	if (fstat(fileno(m_tracefd), &st) == 0)
+	{
+		m_cur_size = st.st_size;
+	}
+
+	if (m_bis_backup == false)
+	{
+		return true;
+	}
+
+	FormatTo(m_next_filename, sizeof(m_next_filename), "{}.next", m_log_filename);
+	CalcNextRotateTime(time(0));
+
+	// 进程在换下旧文件之后、改名之前退出时会留下写过内容的".next"文件，
+	// 先把它改名为备份，避免后台线程打开时接着往里追加
+	if (stat(m_next_filename, &st) == 0)
+	{
+		if (st.st_size > 0)
+		{
+			char bak_filename[331];
+			BackupFileName(st.st_mtime, bak_filename, sizeof(bak_filename));
+			rename(m_next_filename, bak_filename);
+		}
+		else
+		{
+			unlink(m_next_filename);
+		}
+	}
+
+	// 启动后台切换线程，由它预先打开下一个日志文件
+	m_brotate_stop = false;
+	if (pthread_create(&m_rotate_tid, 0, RotateThread, this) == 0)
+	{
+		m_brotate_running = true;
+	}
+
 	return true;
 }
 
 /**
- * @brief 检查并备份日志文件
- * 
- * 当日志文件大小超过设定的最大值时，将当前日志文件重命名为带时间戳的备份文件，
- * 并创建新的日志文件继续写入。
- * 
- * @return true 备份成功或无需备份
- * @return false 备份过程中出现错误
+ * @brief 计算下一次按时间切换的时刻
+ *
+ * 切换时刻按本地时间对齐到周期的整数倍，例如周期为86400时在每天零点切换。
+ *
+ * @param now 当前时间
+ */
+void Log::CalcNextRotateTime(time_t now)
+{
+	if (m_rotate_interval <= 0)
+	{
+		m_next_rotate_time = 0;
+		return;
+	}
+
+	struct tm sttm;
+	localtime_r(&now, &sttm);
+	time_t local = now + sttm.tm_gmtoff;
+	m_next_rotate_time = (local / m_rotate_interval + 1) * m_rotate_interval - sttm.tm_gmtoff;
+}
+
+/**
+ * @brief 检查并切换日志文件
+ *
+ * 当日志文件大小超过设定的最大值或到达按时间切换的时刻时，把当前文件指针
+ * 交给后台线程，并换成后台线程预先打开的下一个文件，整个过程为O(1)，
+ * 不在写日志的线程上做任何文件操作。改名、压缩和清理由后台线程完成。
+ * 如果下一个文件还没有准备好，则继续写当前文件，下次写入时再尝试切换。
+ *
+ * @return true 切换成功或无需切换
+ * @return false 日志文件未打开
  */
 bool Log::WriteBackupLogFile()
 {
@@ -77,29 +184,442 @@ bool Log::WriteBackupLogFile()
 		return false;
 	}
 
-	if (m_bis_backup == false) {
+	if (m_bis_backup == false || m_brotate_running == false)
+	{
 		return true;
 	}
 
-	if (ftell(m_tracefd) > m_max_log_size * 1024 * 1024)
+	bool bneed = false;
+	if (m_max_log_size > 0 && m_cur_size > m_max_log_size * 1024 * 1024)
 	{
-		fclose(m_tracefd);
-		m_tracefd = 0;
+		bneed = true;
+	}
+
+	time_t now = 0;
+	if (m_next_rotate_time > 0)
+	{
+		now = time(0);
+		if (now >= m_next_rotate_time)
+		{
+			bneed = true;
+		}
+	}
+
+	if (bneed == false)
+	{
+		return true;
+	}
+
+	pthread_mutex_lock(&m_rotate_lock);
+	if (m_nextfd != 0 && m_retired_count < (int)(sizeof(m_retired_fd) / sizeof(m_retired_fd[0])))
+	{
+		m_retired_fd[m_retired_count] = m_tracefd;
+		m_retired_time[m_retired_count] = now != 0 ? now : time(0);
+		m_retired_count++;
+		m_tracefd = m_nextfd;
+		m_nextfd = 0;
+		m_cur_size = 0;
+		if (m_next_rotate_time > 0)
+		{
+			CalcNextRotateTime(now);
+		}
+		pthread_cond_signal(&m_rotate_cond);
+		g_log_rotations->Add();
+	}
+	pthread_mutex_unlock(&m_rotate_lock);
+
+	return true;
+}
+
+/**
+ * @brief 后台切换线程
+ *
+ * 预先打开下一个日志文件，等待写日志的线程换下旧文件，然后在后台完成
+ * 关闭、改名、压缩和清理，再预先打开新的下一个文件。
+ *
+ * @param arg Log对象指针
+ * @return 0
+ */
+void *Log::RotateThread(void *arg)
+{
+	Log *plog = (Log *)arg;
 
-		char str_local_time[21];
-		memset(str_local_time, 0, sizeof(str_local_time));
-		LocalTime(str_local_time, "yyy-mm-dd-hh24-mi-ss");
+	FILE *fp = FOpen(plog->m_next_filename, plog->m_open_mode);
+	pthread_mutex_lock(&plog->m_rotate_lock);
+	plog->m_nextfd = fp;
 
-		char bak_filename[301];
-		SNPrintf(bak_filename, sizeof(bak_filename), 300, "%s.%s", m_log_filename, str_local_time);
-		rename(m_log_filename, bak_filename);
+	while (true)
+	{
+		while (plog->m_retired_count == 0 && plog->m_brotate_stop == false)
+		{
+			pthread_cond_wait(&plog->m_rotate_cond, &plog->m_rotate_lock);
+		}
+
+		if (plog->m_retired_count == 0)
+		{
+			break;
+		}
+
+		FILE *retired = plog->m_retired_fd[0];
+		time_t retired_time = plog->m_retired_time[0];
+		bool bstop = plog->m_brotate_stop;
+		plog->m_retired_count--;
+		memmove(plog->m_retired_fd, plog->m_retired_fd + 1, sizeof(FILE *) * plog->m_retired_count);
+		memmove(plog->m_retired_time, plog->m_retired_time + 1, sizeof(time_t) * plog->m_retired_count);
+		pthread_mutex_unlock(&plog->m_rotate_lock);
+
+		plog->RotateRetired(retired, retired_time);
+
+		fp = 0;
+		if (bstop == false)
+		{
+			fp = FOpen(plog->m_next_filename, plog->m_open_mode);
+		}
+
+		pthread_mutex_lock(&plog->m_rotate_lock);
+		if (fp != 0)
+		{
+			plog->m_nextfd = fp;
+		}
+	}
+
+	pthread_mutex_unlock(&plog->m_rotate_lock);
 
-		if((m_tracefd= FOpen(m_log_filename, m_open_mode)) == 0)
+	return 0;
+}
+
+/**
+ * @brief 生成一个还不存在的备份文件名
+ *
+ * 备份文件名为"日志文件名.yyyy-mm-dd-hh24-mi-ss"，同一秒内多次切换时追加
+ * ".序号"，压缩后再加上".gz"，PurgeBackups只认这种格式的文件名。
+ *
+ * @param t 备份的时刻
+ * @param bak_filename 输出的备份文件名
+ * @param ilen bak_filename的长度
+ */
+void Log::BackupFileName(time_t t, char *bak_filename, size_t ilen)
+{
+	char str_local_time[21];
+	memset(str_local_time, 0, sizeof(str_local_time));
+	time2str(t, str_local_time, "yyyy-mm-dd-hh24-mi-ss");
+
+	FormatTo(bak_filename, ilen, "{}.{}", m_log_filename, str_local_time);
+
+	// 同一秒内多次切换时追加序号，避免覆盖已有的备份
+	char gz_filename[335];
+	for (int iseq = 1; iseq < 1000; iseq++)
+	{
+		FormatTo(gz_filename, sizeof(gz_filename), "{}.gz", bak_filename);
+		if (access(bak_filename, F_OK) != 0 && access(gz_filename, F_OK) != 0)
+		{
+			break;
+		}
+		FormatTo(bak_filename, ilen, "{}.{}.{}", m_log_filename, str_local_time, iseq);
+	}
+}
+
+/**
+ * @brief 判断文件名去掉"日志文件名"之后的部分是否为备份文件的后缀
+ *
+ * 只接受BackupFileName生成的".yyyy-mm-dd-hh24-mi-ss[.序号][.gz]"，
+ * 避免误删同目录下其他以相同前缀开头的文件，例如"foo.log.err"。
+ *
+ * @param suffix 文件名去掉日志文件名之后的部分
+ * @return true 是备份文件
+ */
+static bool IsBackupSuffix(const char *suffix)
+{
+	static const char pattern[] = ".9999-99-99-99-99-99";
+	for (size_t i = 0; i < sizeof(pattern) - 1; i++)
+	{
+		if (pattern[i] == '9' ? isdigit((unsigned char)suffix[i]) == 0 : suffix[i] != pattern[i])
 		{
 			return false;
 		}
 	}
 
+	const char *p = suffix + sizeof(pattern) - 1;
+	if (p[0] == '.' && isdigit((unsigned char)p[1]) != 0)
+	{
+		p++;
+		while (isdigit((unsigned char)*p) != 0)
+		{
+			p++;
+		}
+	}
+
+	if (strcmp(p, ".gz") == 0)
+	{
+		p += 3;
+	}
+
+	return *p == 0;
+}
+
+/**
+ * @brief 处理被换下的旧日志文件
+ *
+ * 关闭旧文件，把它改名为带时间戳的备份文件，把正在写入的".next"文件改名为
+ * 正式的日志文件名，然后按需压缩备份文件并清理过期的备份。
+ *
+ * @param fp 被换下的旧文件
+ * @param retired_time 旧文件被换下的时刻
+ */
+void Log::RotateRetired(FILE *fp, time_t retired_time)
+{
+	fclose(fp);
+
+	char bak_filename[331];
+	BackupFileName(retired_time, bak_filename, sizeof(bak_filename));
+
+	rename(m_log_filename, bak_filename);
+	rename(m_next_filename, m_log_filename);
+
+	if (m_bis_compress == true)
+	{
+		char *argv[] = { (char *)"gzip", (char *)"-f", bak_filename, 0 };
+		pid_t pid;
+		if (posix_spawnp(&pid, "gzip", 0, 0, argv, environ) == 0)
+		{
+			int status;
+			waitpid(pid, &status, 0);
+		}
+	}
+
+	PurgeBackups();
+}
+
+/**
+ * @brief 按保留个数和总大小清理过期的备份文件
+ *
+ * 备份文件名为"日志文件名.时间戳[.序号][.gz]"，按修改时间从最旧的开始删除。
+ */
+void Log::PurgeBackups()
+{
+	if (m_keep_count <= 0 && m_keep_total_size <= 0)
+	{
+		return;
+	}
+
+	char dirname[301];
+	const char *basename = strrchr(m_log_filename, '/');
+	if (basename == 0)
+	{
+		StrCopy(dirname, sizeof(dirname), ".");
+		basename = m_log_filename;
+	}
+	else
+	{
+		StrNCopy(dirname, sizeof(dirname), m_log_filename, basename - m_log_filename);
+		if (dirname[0] == 0)
+		{
+			StrCopy(dirname, sizeof(dirname), "/");
+		}
+		basename++;
+	}
+
+	DIR *dir = opendir(dirname);
+	if (dir == 0)
+	{
+		return;
+	}
+
+	size_t ibaselen = strlen(basename);
+	vector<string> backups;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != 0)
+	{
+		if (strncmp(ent->d_name, basename, ibaselen) != 0 || IsBackupSuffix(ent->d_name + ibaselen) == false)
+		{
+			continue;
+		}
+
+		backups.push_back(string(dirname) + "/" + ent->d_name);
+	}
+	closedir(dir);
+
+	// 按修改时间从旧到新排序，修改时间相同的按文件名排序
+	vector<pair<pair<time_t, string>, long long> > items;
+	for (size_t i = 0; i < backups.size(); i++)
+	{
+		struct stat st;
+		if (stat(backups[i].c_str(), &st) == 0)
+		{
+			items.push_back(make_pair(make_pair(st.st_mtime, backups[i]), (long long)st.st_size));
+		}
+	}
+	sort(items.begin(), items.end());
+
+	long long total = 0;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		total += items[i].second;
+	}
+
+	size_t ileft = items.size();
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		bool bover_count = (m_keep_count > 0 && (int)ileft > m_keep_count);
+		bool bover_size = (m_keep_total_size > 0 && total > m_keep_total_size * 1024 * 1024);
+		if (bover_count == false && bover_size == false)
+		{
+			break;
+		}
+
+		unlink(items[i].first.second.c_str());
+		total -= items[i].second;
+		ileft--;
+	}
+}
+
+/**
+ * @brief 把格式化后的日志内容放到缓冲区中
+ *
+ * 内容不超过stack_buffer时直接使用调用者提供的栈上缓冲区，否则申请堆内存，
+ * 调用者需要在*out不等于stack_buffer时释放它。
+ *
+ * @param stack_buffer 调用者提供的缓冲区
+ * @param ibuffer_len 缓冲区大小
+ * @param out 输出的缓冲区地址
+ * @param prefix 写在内容前面的前缀，可以为0
+ * @param fmt 格式化字符串
+ * @param ap 可变参数列表
+ * @return 格式化后的字节数，失败返回-1
+ */
+static int VFormatLog(char *stack_buffer, int ibuffer_len, char **out, const char *prefix, const char *fmt, va_list ap)
+{
+	int iprefix_len = 0;
+	if (prefix != 0)
+	{
+		iprefix_len = strlen(prefix);
+		if (iprefix_len >= ibuffer_len)
+		{
+			iprefix_len = ibuffer_len - 1;
+		}
+		memcpy(stack_buffer, prefix, iprefix_len);
+	}
+
+	va_list aq;
+	va_copy(aq, ap);
+	int ilen = vsnprintf(stack_buffer + iprefix_len, ibuffer_len - iprefix_len, fmt, aq);
+	va_end(aq);
+	if (ilen < 0)
+	{
+		return -1;
+	}
+
+	*out = stack_buffer;
+	if (ilen < ibuffer_len - iprefix_len)
+	{
+		return iprefix_len + ilen;
+	}
+
+	char *heap_buffer = (char *)malloc(iprefix_len + ilen + 1);
+	if (heap_buffer == 0)
+	{
+		return ibuffer_len - 1;
+	}
+	memcpy(heap_buffer, stack_buffer, iprefix_len);
+	vsnprintf(heap_buffer + iprefix_len, ilen + 1, fmt, ap);
+	*out = heap_buffer;
+
+	return iprefix_len + ilen;
+}
+
+/**
+ * @brief 写入一段已经格式化好的日志内容
+ *
+ * 写入和切换检查在同一把锁内完成，多个线程同时写日志时每次写入的内容
+ * 都是完整的一段，不会互相穿插，也不会和日志切换交错。
+ *
+ * @param buffer 日志内容
+ * @param ibuffer_len 日志内容的长度
+ * @return true 写入成功
+ * @return false 写入失败
+ */
+bool Log::Write(const char *buffer, const int ibuffer_len)
+{
+	unsigned long start = MetricNow();
+	pthread_mutex_lock(&m_write_lock);
+
+	if (m_tracefd == 0 || WriteBackupLogFile() == false)
+	{
+		pthread_mutex_unlock(&m_write_lock);
+		return false;
+	}
+
+	size_t iret = fwrite(buffer, 1, ibuffer_len, m_tracefd);
+	m_cur_size += iret;
+
+	if (m_bis_buffer == false)
+	{
+		fflush(m_tracefd);
+	}
+
+	pthread_mutex_unlock(&m_write_lock);
+
+	g_log_lines->Add();
+	g_log_bytes->Add(iret);
+	g_log_write_latency->Record(MetricNow() - start);
+
+	return iret == (size_t)ibuffer_len;
+}
+
+/**
+ * @brief 把缓冲区中的日志内容刷新到文件
+ */
+void Log::Flush()
+{
+	pthread_mutex_lock(&m_write_lock);
+	if (m_tracefd != 0)
+	{
+		fflush(m_tracefd);
+	}
+	pthread_mutex_unlock(&m_write_lock);
+}
+
+/**
+ * @brief 重新打开日志文件
+ *
+ * 日志文件被外部工具（例如logrotate）改名或删除后，按原来的文件名重新打开，
+ * 新文件打开成功后才替换当前文件，替换过程中其他线程的写入不会丢失。
+ * 一般在收到SIGHUP时调用。
+ *
+ * @return true 重新打开成功
+ * @return false 日志文件未打开或新文件打开失败，此时继续写原来的文件
+ */
+bool Log::ReopenFile()
+{
+	if (m_log_filename[0] == 0)
+	{
+		return false;
+	}
+
+	FILE *fp = FOpen(m_log_filename, m_open_mode);
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	long size = 0;
+	if (fstat(fileno(fp), &st) == 0)
+	{
+		size = st.st_size;
+	}
+
+	pthread_mutex_lock(&m_write_lock);
+	FILE *old = m_tracefd;
+	m_tracefd = fp;
+	m_cur_size = size;
+	pthread_mutex_unlock(&m_write_lock);
+
+	if (old != 0)
+	{
+		fclose(old);
+	}
+
 	return true;
 }
 
@@ -121,25 +641,38 @@ bool Log::WriteLog(const char *fmt, ...)
 		return false;
 	}
 
-	if (WriteBackupLogFile() == false)
-	{
-		return false;
-	}
+	char strtime[21];
+	TimePrefix(strtime);
 
-	char strtime[20];
-	LocalTime(strtime);
+	char line[1024];
+	char *out = 0;
 	va_list ap;
 	va_start(ap, fmt);
-	fprintf(m_tracefd, "%s ", strtime);
-	vfprintf(m_tracefd, fmt, ap);
+	int ilen = VFormatLog(line, sizeof(line), &out, strtime, fmt, ap);
 	va_end(ap);
 
-	if (m_bis_buffer == false)
+	if (ilen < 0)
 	{
-		fflush(m_tracefd);
+		return false;
 	}
 
-	return true;
+	bool bret = Write(out, ilen);
+	if (out != line)
+	{
+		free(out);
+	}
+
+	return bret;
+}
+
+int Log::TimePrefix(char *buffer)
+{
+	LocalTime(buffer);
+	int ilen = strlen(buffer);
+	buffer[ilen++] = ' ';
+	buffer[ilen] = 0;
+
+	return ilen;
 }
 
 /**
@@ -160,37 +693,68 @@ bool Log::WriteLogEx(const char *fmt, ...)
 		return false;
 	}
 
+	char line[1024];
+	char *out = 0;
 	va_list ap;
 	va_start(ap, fmt);
-	vfprintf(m_tracefd, fmt, ap);
+	int ilen = VFormatLog(line, sizeof(line), &out, 0, fmt, ap);
 	va_end(ap);
 
-	if (m_bis_buffer == false)
+	if (ilen < 0)
 	{
-		fflush(m_tracefd);
+		return false;
 	}
 
-	return true;
+	bool bret = Write(out, ilen);
+	if (out != line)
+	{
+		free(out);
+	}
+
+	return bret;
 }
 
 /**
  * @brief 关闭日志文件
  * 
- * 关闭文件描述符，清空文件名和打开模式缓冲区，
- * 重置备份和缓冲标志为默认值。
+ * 停止后台切换线程，关闭文件描述符，删除未使用的预打开文件，
+ * 清空文件名和打开模式缓冲区，重置备份和缓冲标志为默认值。
  */
 void Log::CloseLogFile()
 {
+	// 先停止后台线程，它会处理完所有已换下的旧文件后退出
+	if (m_brotate_running == true)
+	{
+		pthread_mutex_lock(&m_rotate_lock);
+		m_brotate_stop = true;
+		pthread_cond_signal(&m_rotate_cond);
+		pthread_mutex_unlock(&m_rotate_lock);
+		pthread_join(m_rotate_tid, 0);
+		m_brotate_running = false;
+	}
+
+	if (m_nextfd != 0)
+	{
+		fclose(m_nextfd);
+		m_nextfd = 0;
+		unlink(m_next_filename);
+	}
+
+	pthread_mutex_lock(&m_write_lock);
 	if (m_tracefd != 0)
 	{
 		fclose(m_tracefd);
 		m_tracefd = 0;
 	}
+	pthread_mutex_unlock(&m_write_lock);
 
 	memset(m_log_filename, 0, sizeof(m_log_filename));
+	memset(m_next_filename, 0, sizeof(m_next_filename));
 	memset(m_open_mode, 0, sizeof(m_open_mode));
 	m_bis_backup = true;
 	m_bis_buffer = false;
+	m_cur_size = 0;
+	m_next_rotate_time = 0;
 }
 
 /**
@@ -201,4 +765,7 @@ void Log::CloseLogFile()
 Log::~Log()
 {
 	CloseLogFile();
+	pthread_mutex_destroy(&m_write_lock);
+	pthread_mutex_destroy(&m_rotate_lock);
+	pthread_cond_destroy(&m_rotate_cond);
 }
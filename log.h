@@ -1,15 +1,20 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 #include "public.h"
+#include "format.h"
 
 /**
  * @brief 日志处理类，用于管理日志文件的创建、写入和备份
- * 
+ *
  * 该类提供了日志文件的基本操作功能，包括：
  * - 日志文件的打开和关闭
  * - 日志内容的写入（支持格式化输出）
- * - 日志文件的自动备份
+ * - 日志文件的自动备份（按大小或按时间切换）
  * - 缓冲区控制
+ *
+ * 写日志是线程安全的，每次写入的内容作为一个整体写到文件中。
+ * 日志切换是异步的：写日志的线程只把当前文件指针换成预先打开好的下一个文件，
+ * 旧文件的关闭、改名、压缩以及过期备份的清理都由后台线程完成。
  */
 
 class Log
@@ -20,21 +25,126 @@ class Log
 		char m_open_mode[12];
 		bool m_bis_buffer;
 		bool m_bis_backup;
-		long m_max_log_size;
+		long m_max_log_size;      // 单个日志文件的最大大小，单位为MB，0表示不按大小切换
+		int  m_rotate_interval;   // 按时间切换的周期，单位为秒，0表示不按时间切换
+		int  m_keep_count;        // 保留的备份文件个数，0表示不限制
+		long m_keep_total_size;   // 备份文件占用的总大小上限，单位为MB，0表示不限制
+		bool m_bis_compress;      // 备份文件是否用gzip压缩
 
 		Log();
 
 		bool OpenFile(const char *filename, const char *open_mode = 0, bool bis_backup = true, bool bis_buffer = false);
 
+		/*
+		 * 设置日志切换和保留策略，需要在OpenFile之前调用
+		 * max_log_size    单个文件的最大大小，单位为MB
+		 * rotate_interval 按时间切换的周期，单位为秒，例如86400为每天切换
+		 * keep_count      保留的备份个数
+		 * keep_total_size 备份总大小上限，单位为MB
+		 * bis_compress    是否压缩备份文件
+		 * */
+		void SetRotate(long max_log_size, int rotate_interval = 0, int keep_count = 0, long keep_total_size = 0, bool bis_compress = false);
+
 		bool WriteBackupLogFile();
 
 		bool WriteLog(const char *fmt, ...);
 
 		bool WriteLogEx(const char *fmt, ...);
 
+		/*
+		 * 和WriteLog一样在前面加时间戳，格式串用format.h的语法，在编译期解析和检查参数类型，
+		 * 例如 log.Format("recv {} bytes from {}\n", ilen, ip);
+		 * */
+		template <typename... Args>
+		bool Format(FormatString<type_identity_t<Args>...> fmt, const Args &...args)
+		{
+			return FormatLine(true, fmt, args...);
+		}
+
+		/*
+		 * 不带时间戳的Format
+		 * */
+		template <typename... Args>
+		bool FormatEx(FormatString<type_identity_t<Args>...> fmt, const Args &...args)
+		{
+			return FormatLine(false, fmt, args...);
+		}
+
+		/*
+		 * 写入一段已经格式化好的日志内容，线程安全
+		 * buffer      日志内容
+		 * ibuffer_len 日志内容的长度，单位为字节
+		 * */
+		bool Write(const char *buffer, const int ibuffer_len);
+
+		void Flush();
+
+		/*
+		 * 按原来的文件名重新打开日志文件，用于日志文件被外部改名或删除之后
+		 * */
+		bool ReopenFile();
+
 		void CloseLogFile();
 
 		~Log();
+
+	private:
+		FILE  *m_nextfd;               // 后台线程预先打开的下一个日志文件
+		char   m_next_filename[310];   // 预先打开的文件名，为m_log_filename加上".next"
+		long   m_cur_size;             // 当前日志文件已写入的字节数
+		time_t m_next_rotate_time;     // 下一次按时间切换的时刻
+
+		FILE  *m_retired_fd[8];        // 等待后台线程处理的旧文件
+		time_t m_retired_time[8];      // 旧文件被换下的时刻，用于生成备份文件名
+		int    m_retired_count;
+
+		pthread_mutex_t m_write_lock;    // 保护m_tracefd的写入和切换
+
+		pthread_t       m_rotate_tid;
+		pthread_mutex_t m_rotate_lock;
+		pthread_cond_t  m_rotate_cond;
+		bool            m_brotate_running;
+		bool            m_brotate_stop;
+
+		static void *RotateThread(void *arg);
+
+		void RotateRetired(FILE *fp, time_t retired_time);
+
+		void PurgeBackups();
+
+		void BackupFileName(time_t t, char *bak_filename, size_t ilen);
+
+		void CalcNextRotateTime(time_t now);
+
+		/*
+		 * 把"yyyy-mm-dd hh24:mi:ss "写到buffer，返回长度
+		 * */
+		static int TimePrefix(char *buffer);
+
+		template <typename... Args>
+		bool FormatLine(const bool btime, const FormatString<Args...> &fmt, const Args &...args)
+		{
+			if (m_tracefd == 0)
+			{
+				return false;
+			}
+
+			// 和WriteLog一样先用栈上的缓冲区，放不下时再格式化一次到堆上
+			char line[1024];
+			int iprefix = btime ? TimePrefix(line) : 0;
+			FormatWriter writer(line + iprefix, sizeof(line) - iprefix);
+			FormatArgs<Args...>(writer, fmt, args...);
+			size_t ilen = iprefix + writer.Finish();
+			if (ilen < sizeof(line))
+			{
+				return Write(line, ilen);
+			}
+
+			string heap(line, iprefix);
+			FormatWriter heap_writer(heap);
+			FormatArgs<Args...>(heap_writer, fmt, args...);
+			return Write(heap.data(), heap.size());
+		}
 };
 
 #endif
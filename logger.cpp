@@ -0,0 +1,597 @@
+#include "public.h"
+#include "logger.h"
+#include "utils.h"
+#include "logsample.h"
+
+#include <sys/syscall.h>
+
+static const char *g_level_names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR", "FATAL" };
+
+/**
+ * @brief 打开日志文件
+ * @param filename 日志文件名
+ * @param bis_backup 是否启用日志切换和备份
+ * @return 成功返回true，失败返回false
+ */
+bool FileLogSink::OpenFile(const char *filename, bool bis_backup)
+{
+	// 由Logger负责批量写入和定时刷新，这里使用带缓冲的方式打开
+	return m_log.OpenFile(filename, "a+", bis_backup, true);
+}
+
+void FileLogSink::Write(const char *buffer, const int ibuffer_len)
+{
+	m_log.Write(buffer, ibuffer_len);
+}
+
+void FileLogSink::Flush()
+{
+	m_log.Flush();
+}
+
+StderrLogSink::StderrLogSink()
+{
+	pthread_mutex_init(&m_lock, 0);
+}
+
+/**
+ * @brief 写到标准错误输出，保证一次调用的内容不和其他线程的内容穿插
+ */
+void StderrLogSink::Write(const char *buffer, const int ibuffer_len)
+{
+	pthread_mutex_lock(&m_lock);
+
+	int ileft = ibuffer_len;
+	while (ileft > 0)
+	{
+		int iret = write(STDERR_FILENO, buffer + ibuffer_len - ileft, ileft);
+		if (iret <= 0)
+		{
+			if (iret < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		ileft -= iret;
+	}
+
+	pthread_mutex_unlock(&m_lock);
+}
+
+StderrLogSink::~StderrLogSink()
+{
+	pthread_mutex_destroy(&m_lock);
+}
+
+/**
+ * @brief 构造函数
+ * @param capacity 环形缓冲区的大小，单位为字节
+ */
+RingLogSink::RingLogSink(const size_t capacity)
+{
+	m_capacity = capacity > 0 ? capacity : 1024;
+	m_buffer = (char *)malloc(m_capacity);
+	m_written = 0;
+	m_lock = 0;
+}
+
+/**
+ * @brief 把日志内容追加到环形缓冲区，覆盖最旧的内容
+ *
+ * 用自旋锁而不是互斥锁保护，拷贝的时间很短，而且转储时可以在信号处理函数中
+ * 尝试获取它。
+ */
+void RingLogSink::Write(const char *buffer, const int ibuffer_len)
+{
+	if (m_buffer == 0 || ibuffer_len <= 0)
+	{
+		return;
+	}
+
+	const char *src = buffer;
+	size_t n = ibuffer_len;
+	if (n > m_capacity)
+	{
+		src += n - m_capacity;
+		n = m_capacity;
+	}
+
+	while (__atomic_exchange_n(&m_lock, 1, __ATOMIC_ACQUIRE) != 0)
+	{
+	}
+
+	size_t ipos = m_written % m_capacity;
+	size_t ifirst = m_capacity - ipos;
+	if (ifirst > n)
+	{
+		ifirst = n;
+	}
+	memcpy(m_buffer + ipos, src, ifirst);
+	memcpy(m_buffer, src + ifirst, n - ifirst);
+	m_written += n;
+
+	__atomic_store_n(&m_lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 按从旧到新的顺序把环形缓冲区的内容写到fd
+ *
+ * 不加锁，在崩溃时调用可能得到正在被覆盖的一小段内容，但不会死锁。
+ *
+ * @param fd 输出的文件描述符
+ */
+void RingLogSink::Dump(const int fd)
+{
+	if (m_buffer == 0)
+	{
+		return;
+	}
+
+	size_t written = m_written;
+	if (written <= m_capacity)
+	{
+		if (write(fd, m_buffer, written) < 0)
+		{
+			return;
+		}
+		return;
+	}
+
+	size_t ipos = written % m_capacity;
+	if (write(fd, m_buffer + ipos, m_capacity - ipos) < 0)
+	{
+		return;
+	}
+	if (write(fd, m_buffer, ipos) < 0)
+	{
+		return;
+	}
+}
+
+static RingLogSink *g_crash_ring = 0;
+static char g_crash_filename[301];
+
+/**
+ * @brief 崩溃信号处理函数，转储环形缓冲区后恢复默认处理并重新触发信号
+ */
+static void CrashDumpHandler(int sig)
+{
+	int fd = open(g_crash_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0)
+	{
+		g_crash_ring->Dump(fd);
+		close(fd);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/**
+ * @brief 安装崩溃时转储环形缓冲区的信号处理函数
+ * @param filename 转储文件名
+ * @return 成功返回true，失败返回false
+ */
+bool RingLogSink::InstallCrashDump(const char *filename)
+{
+	if (filename == 0 || MKdir(filename) == false)
+	{
+		return false;
+	}
+
+	StrCopy(g_crash_filename, sizeof(g_crash_filename), filename);
+	g_crash_ring = this;
+
+	int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+	{
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = CrashDumpHandler;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESETHAND;
+		if (sigaction(sigs[i], &sa, 0) != 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+RingLogSink::~RingLogSink()
+{
+	if (g_crash_ring == this)
+	{
+		g_crash_ring = 0;
+	}
+
+	free(m_buffer);
+	m_buffer = 0;
+}
+
+/**
+ * @brief 构造函数，初始化各成员变量
+ */
+Logger::Logger()
+{
+	m_level = LOG_LEVEL_INFO;
+	m_report_interval = 10;
+	memset(m_sinks, 0, sizeof(m_sinks));
+	m_sink_count = 0;
+	m_buffer_size = 64 * 1024;
+	m_flush_interval_ms = 0;
+
+	pthread_key_create(&m_key, ThreadExit);
+	pthread_mutex_init(&m_list_lock, 0);
+	m_buffers = 0;
+
+	pthread_mutex_init(&m_flush_lock, 0);
+	pthread_cond_init(&m_flush_cond, 0);
+	m_brunning = false;
+	m_bstop = false;
+}
+
+/**
+ * @brief 添加输出目标
+ * @param sink 输出目标
+ * @return 成功返回true，输出目标已满返回false
+ */
+bool Logger::AddSink(LogSink *sink)
+{
+	if (sink == 0 || m_sink_count >= (int)(sizeof(m_sinks) / sizeof(m_sinks[0])))
+	{
+		return false;
+	}
+
+	m_sinks[m_sink_count++] = sink;
+
+	return true;
+}
+
+void Logger::SetLevel(const int level)
+{
+	m_level = level;
+}
+
+/**
+ * @brief 启动后台刷新线程
+ * @param flush_interval_ms 刷新周期，单位为毫秒，0表示每条日志都直接写出
+ * @param buffer_size 每个线程缓冲区的大小，单位为字节
+ * @return 成功返回true，失败返回false
+ */
+bool Logger::Start(const int flush_interval_ms, const int buffer_size)
+{
+	if (m_brunning == true)
+	{
+		return true;
+	}
+
+	m_buffer_size = buffer_size < 4096 ? 4096 : buffer_size;
+	m_flush_interval_ms = flush_interval_ms > 0 ? flush_interval_ms : 0;
+
+	if (m_flush_interval_ms == 0)
+	{
+		return true;
+	}
+
+	m_bstop = false;
+	if (pthread_create(&m_flush_tid, 0, FlushThread, this) != 0)
+	{
+		m_flush_interval_ms = 0;
+		return false;
+	}
+	m_brunning = true;
+
+	return true;
+}
+
+/**
+ * @brief 取得当前线程的日志缓冲区，第一次调用时创建并加入链表
+ * @return 当前线程的日志缓冲区，内存不足时返回0
+ */
+Logger::ThreadBuffer *Logger::GetThreadBuffer()
+{
+	ThreadBuffer *tb = (ThreadBuffer *)pthread_getspecific(m_key);
+	if (tb != 0)
+	{
+		return tb;
+	}
+
+	tb = new ThreadBuffer;
+	tb->m_data = (char *)malloc(m_buffer_size);
+	if (tb->m_data == 0)
+	{
+		delete tb;
+		return 0;
+	}
+
+	pthread_mutex_init(&tb->m_lock, 0);
+	tb->m_len = 0;
+	tb->m_tid = (int)syscall(SYS_gettid);
+	tb->m_last_sec = 0;
+	memset(tb->m_stime, 0, sizeof(tb->m_stime));
+	tb->m_bexited = false;
+	tb->m_logger = this;
+
+	pthread_mutex_lock(&m_list_lock);
+	tb->m_next = m_buffers;
+	m_buffers = tb;
+	pthread_mutex_unlock(&m_list_lock);
+
+	pthread_setspecific(m_key, tb);
+
+	return tb;
+}
+
+/**
+ * @brief 线程退出时调用，把缓冲区写出并标记为已退出，由后台线程或Stop释放
+ */
+void Logger::ThreadExit(void *arg)
+{
+	ThreadBuffer *tb = (ThreadBuffer *)arg;
+
+	pthread_mutex_lock(&tb->m_lock);
+	tb->m_logger->FlushBuffer(tb);
+	tb->m_bexited = true;
+	pthread_mutex_unlock(&tb->m_lock);
+}
+
+/**
+ * @brief 把一个线程缓冲区中的日志交给所有输出目标，调用者需要持有tb->m_lock
+ */
+void Logger::FlushBuffer(ThreadBuffer *tb)
+{
+	if (tb->m_len == 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < m_sink_count; i++)
+	{
+		m_sinks[i]->Write(tb->m_data, tb->m_len);
+	}
+
+	tb->m_len = 0;
+}
+
+/**
+ * @brief 格式化一条日志并追加到当前线程的缓冲区
+ *
+ * 日志格式为：时间 级别 [线程号] 文件名:行号 内容。
+ * 超过缓冲区大小的单条日志会被截断。
+ */
+void Logger::VWrite(const int level, const char *file, const int line, const char *fmt, va_list ap)
+{
+	ThreadBuffer *tb = GetThreadBuffer();
+	if (tb == 0)
+	{
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+	const char *basename = strrchr(file, '/');
+	basename = (basename == 0) ? file : basename + 1;
+
+	int ilevel = level;
+	if (ilevel < LOG_LEVEL_TRACE)
+	{
+		ilevel = LOG_LEVEL_TRACE;
+	}
+	if (ilevel > LOG_LEVEL_FATAL)
+	{
+		ilevel = LOG_LEVEL_FATAL;
+	}
+
+	pthread_mutex_lock(&tb->m_lock);
+
+	if (tb->m_last_sec != ts.tv_sec)
+	{
+		time2str(ts.tv_sec, tb->m_stime);
+		tb->m_last_sec = ts.tv_sec;
+	}
+
+	for (int itry = 0; itry < 2; itry++)
+	{
+		int ileft = m_buffer_size - tb->m_len;
+		char *pos = tb->m_data + tb->m_len;
+
+		int ihead = snprintf(pos, ileft, "%s.%03ld %s [%d] %s:%d ", tb->m_stime, ts.tv_nsec / 1000000,
+				g_level_names[ilevel], tb->m_tid, basename, line);
+		int ibody = -1;
+		if (ihead >= 0 && ihead < ileft)
+		{
+			va_list aq;
+			va_copy(aq, ap);
+			ibody = vsnprintf(pos + ihead, ileft - ihead, fmt, aq);
+			va_end(aq);
+		}
+
+		if (ibody >= 0 && ihead + ibody < ileft)
+		{
+			tb->m_len += ihead + ibody;
+			break;
+		}
+
+		// 缓冲区放不下这条日志，先写出已有的内容再重试一次，仍放不下则截断
+		if (tb->m_len > 0 && itry == 0)
+		{
+			FlushBuffer(tb);
+			continue;
+		}
+
+		tb->m_len = m_buffer_size - 1;
+		tb->m_data[tb->m_len - 1] = '\n';
+		break;
+	}
+
+	if (m_flush_interval_ms == 0 || level >= LOG_LEVEL_ERROR)
+	{
+		FlushBuffer(tb);
+	}
+
+	pthread_mutex_unlock(&tb->m_lock);
+}
+
+/**
+ * @brief 写一条日志
+ * @param level 日志级别
+ * @param file 源文件名
+ * @param line 源文件行号
+ * @param fmt 格式化字符串
+ */
+void Logger::Write(const int level, const char *file, const int line, const char *fmt, ...)
+{
+	if (level < m_level)
+	{
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	VWrite(level, file, line, fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * @brief 兼容Log::WriteLog，以INFO级别写一条日志
+ * @param fmt 格式化字符串
+ * @return 总是返回true
+ */
+bool Logger::WriteLog(const char *fmt, ...)
+{
+	if (LOG_LEVEL_INFO < m_level)
+	{
+		return true;
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	VWrite(LOG_LEVEL_INFO, "", 0, fmt, ap);
+	va_end(ap);
+
+	return true;
+}
+
+/**
+ * @brief 把所有线程缓冲区中的日志写到输出目标，并释放已退出线程的缓冲区
+ */
+void Logger::Flush()
+{
+	pthread_mutex_lock(&m_list_lock);
+
+	ThreadBuffer **pprev = &m_buffers;
+	while (*pprev != 0)
+	{
+		ThreadBuffer *tb = *pprev;
+
+		pthread_mutex_lock(&tb->m_lock);
+		FlushBuffer(tb);
+		bool bexited = tb->m_bexited;
+		pthread_mutex_unlock(&tb->m_lock);
+
+		if (bexited == true)
+		{
+			*pprev = tb->m_next;
+			pthread_mutex_destroy(&tb->m_lock);
+			free(tb->m_data);
+			delete tb;
+			continue;
+		}
+
+		pprev = &tb->m_next;
+	}
+
+	pthread_mutex_unlock(&m_list_lock);
+
+	for (int i = 0; i < m_sink_count; i++)
+	{
+		m_sinks[i]->Flush();
+	}
+}
+
+/**
+ * @brief 后台刷新线程，按m_flush_interval_ms周期调用Flush，
+ *        按m_report_interval周期输出LOG_RATELIMIT/LOG_EVERY_N的丢弃计数
+ */
+void *Logger::FlushThread(void *arg)
+{
+	Logger *plogger = (Logger *)arg;
+	time_t last_report = time(0);
+
+	pthread_mutex_lock(&plogger->m_flush_lock);
+	while (plogger->m_bstop == false)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += plogger->m_flush_interval_ms / 1000;
+		ts.tv_nsec += (long)(plogger->m_flush_interval_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&plogger->m_flush_cond, &plogger->m_flush_lock, &ts);
+
+		pthread_mutex_unlock(&plogger->m_flush_lock);
+		if (plogger->m_report_interval > 0 && time(0) - last_report >= plogger->m_report_interval)
+		{
+			LogSiteReport(*plogger);
+			last_report = time(0);
+		}
+		plogger->Flush();
+		pthread_mutex_lock(&plogger->m_flush_lock);
+	}
+	pthread_mutex_unlock(&plogger->m_flush_lock);
+
+	return 0;
+}
+
+/**
+ * @brief 停止后台刷新线程并写出所有缓冲区中的日志
+ */
+void Logger::Stop()
+{
+	if (m_brunning == true)
+	{
+		pthread_mutex_lock(&m_flush_lock);
+		m_bstop = true;
+		pthread_cond_signal(&m_flush_cond);
+		pthread_mutex_unlock(&m_flush_lock);
+		pthread_join(m_flush_tid, 0);
+		m_brunning = false;
+	}
+
+	m_flush_interval_ms = 0;
+	Flush();
+}
+
+/**
+ * @brief 析构函数，写出剩余日志并释放所有线程缓冲区
+ *
+ * 调用前其他线程不能再使用该对象写日志。
+ */
+Logger::~Logger()
+{
+	Stop();
+
+	pthread_key_delete(m_key);
+
+	ThreadBuffer *tb = m_buffers;
+	while (tb != 0)
+	{
+		ThreadBuffer *next = tb->m_next;
+		pthread_mutex_destroy(&tb->m_lock);
+		free(tb->m_data);
+		delete tb;
+		tb = next;
+	}
+	m_buffers = 0;
+
+	pthread_mutex_destroy(&m_list_lock);
+	pthread_mutex_destroy(&m_flush_lock);
+	pthread_cond_destroy(&m_flush_cond);
+}
@@ -0,0 +1,214 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+#include "public.h"
+#include "log.h"
+
+/*
+ * 日志级别，用宏定义以便在编译时通过 -DLOG_MIN_LEVEL=n 设置最低级别
+ * */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_FATAL 5
+#define LOG_LEVEL_OFF   6
+
+/*
+ * 编译时的最低日志级别，低于该级别的日志调用在编译时就被整个去掉，
+ * 参数表达式也不会被求值
+ * */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOGGER_WRITE(logger, level, ...) \
+	do \
+	{ \
+		if ((level) >= LOG_MIN_LEVEL && (level) >= (logger).m_level) \
+		{ \
+			(logger).Write((level), __FILE__, __LINE__, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LOG_TRACE(logger, ...) LOGGER_WRITE(logger, LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(logger, ...) LOGGER_WRITE(logger, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(logger, ...)  LOGGER_WRITE(logger, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(logger, ...)  LOGGER_WRITE(logger, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(logger, ...) LOGGER_WRITE(logger, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_FATAL(logger, ...) LOGGER_WRITE(logger, LOG_LEVEL_FATAL, __VA_ARGS__)
+
+/**
+ * @brief 日志输出目标的基类
+ *
+ * Write会被多个线程同时调用，子类需要自己保证线程安全。
+ * 每次Write传入的是若干条完整的日志行。
+ */
+class LogSink
+{
+	public:
+		virtual ~LogSink() {}
+
+		virtual void Write(const char *buffer, const int ibuffer_len) = 0;
+
+		virtual void Flush() {}
+};
+
+/**
+ * @brief 写到日志文件的输出目标，使用Log类完成写入、切换和备份
+ */
+class FileLogSink : public LogSink
+{
+	public:
+		Log m_log;
+
+		bool OpenFile(const char *filename, bool bis_backup = true);
+
+		void Write(const char *buffer, const int ibuffer_len);
+
+		void Flush();
+};
+
+/**
+ * @brief 写到标准错误输出的输出目标
+ */
+class StderrLogSink : public LogSink
+{
+	public:
+		StderrLogSink();
+
+		void Write(const char *buffer, const int ibuffer_len);
+
+		~StderrLogSink();
+
+	private:
+		pthread_mutex_t m_lock;
+};
+
+/**
+ * @brief 内存环形缓冲区输出目标，保存最近的日志，用于程序崩溃时转储
+ */
+class RingLogSink : public LogSink
+{
+	public:
+		char  *m_buffer;
+		size_t m_capacity;
+		size_t m_written;     // 累计写入的字节数，m_written % m_capacity为下一个写入位置
+
+		RingLogSink(const size_t capacity = 1024 * 1024);
+
+		void Write(const char *buffer, const int ibuffer_len);
+
+		/*
+		 * 把环形缓冲区的内容按从旧到新的顺序写到fd中
+		 * 只调用write，可以在信号处理函数中使用
+		 * */
+		void Dump(const int fd);
+
+		/*
+		 * 安装SIGSEGV/SIGBUS/SIGFPE/SIGILL/SIGABRT的处理函数，
+		 * 程序崩溃时把环形缓冲区的内容转储到filename，然后按默认方式终止
+		 * */
+		bool InstallCrashDump(const char *filename);
+
+		~RingLogSink();
+
+	private:
+		volatile int m_lock;
+};
+
+/**
+ * @brief 多线程日志类
+ *
+ * 每个线程有自己的日志缓冲区，缓冲区有自己的锁，写日志时只锁当前线程的缓冲区，
+ * 线程之间没有竞争。缓冲区满、写入ERROR及以上级别的日志或者后台刷新线程定时
+ * 刷新时，把缓冲区中的整行日志一次交给所有输出目标。
+ *
+ * 使用方法：
+ *   Logger logger;
+ *   logger.AddSink(&filesink);
+ *   logger.Start();
+ *   LOG_INFO(logger, "recv %d bytes\n", ilen);
+ */
+class Logger
+{
+	public:
+		int m_level;               // 运行时的最低日志级别
+		int m_report_interval;     // 后台线程输出限流丢弃计数的周期，单位为秒，0表示不输出
+
+		Logger();
+
+		/*
+		 * 添加输出目标，需要在Start之前调用，Logger不负责释放sink
+		 * */
+		bool AddSink(LogSink *sink);
+
+		void SetLevel(const int level);
+
+		/*
+		 * 启动后台刷新线程
+		 * flush_interval_ms 刷新周期，单位为毫秒，0表示不启动后台线程，每条日志都直接写出
+		 * buffer_size       每个线程缓冲区的大小，单位为字节
+		 * */
+		bool Start(const int flush_interval_ms = 100, const int buffer_size = 64 * 1024);
+
+		/*
+		 * 写一条日志，一般通过LOG_INFO等宏调用
+		 * */
+		void Write(const int level, const char *file, const int line, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+		/*
+		 * 兼容Log::WriteLog，以INFO级别写一条日志
+		 * */
+		bool WriteLog(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+		/*
+		 * 把所有线程缓冲区中的日志写到输出目标
+		 * */
+		void Flush();
+
+		void Stop();
+
+		~Logger();
+
+	private:
+		struct ThreadBuffer
+		{
+			pthread_mutex_t m_lock;
+			char   *m_data;
+			int     m_len;
+			int     m_tid;
+			time_t  m_last_sec;       // m_stime对应的秒数，同一秒内不重复格式化时间
+			char    m_stime[20];
+			bool    m_bexited;        // 线程已退出，由后台线程刷新后释放
+			Logger *m_logger;
+			ThreadBuffer *m_next;
+		};
+
+		LogSink *m_sinks[8];
+		int      m_sink_count;
+		int      m_buffer_size;
+		int      m_flush_interval_ms;
+
+		pthread_key_t   m_key;
+		pthread_mutex_t m_list_lock;  // 保护m_buffers链表
+		ThreadBuffer   *m_buffers;
+
+		pthread_t       m_flush_tid;
+		pthread_mutex_t m_flush_lock;
+		pthread_cond_t  m_flush_cond;
+		bool            m_brunning;
+		bool            m_bstop;
+
+		ThreadBuffer *GetThreadBuffer();
+
+		void FlushBuffer(ThreadBuffer *tb);
+
+		void VWrite(const int level, const char *file, const int line, const char *fmt, va_list ap);
+
+		static void ThreadExit(void *arg);
+
+		static void *FlushThread(void *arg);
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "public.h"
+#include "logsample.h"
+#include "log.h"
+#include "logger.h"
+
+// 丢弃过日志的调用点链表，只增不减，用CAS插入表头
+static LogSite *g_log_sites = 0;
+
+/**
+ * @brief 把调用点加入全局链表
+ * @details 多个线程同时调用时只有一个线程能把m_bregistered从0改为1并完成插入
+ * @param site 调用点
+ * @param owner 调用点输出到的日志对象，在插入链表之前设置，遍历链表时一定能看到
+ */
+void LogSiteRegister(LogSite *site, const void *owner)
+{
+	int expected = 0;
+	if (__atomic_compare_exchange_n(&site->m_bregistered, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) == false)
+	{
+		return;
+	}
+
+	site->m_owner = owner;
+	LogSite *head = __atomic_load_n(&g_log_sites, __ATOMIC_ACQUIRE);
+	do
+	{
+		site->m_next = head;
+	} while (__atomic_compare_exchange_n(&g_log_sites, &head, site, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) == false);
+}
+
+/**
+ * @brief 遍历调用点，输出并清零丢弃计数
+ * @param func 输出函数
+ * @param arg 传给输出函数的参数
+ * @param owner 只处理输出到这个日志对象的调用点，为0时处理所有调用点
+ * @return 有丢弃计数的调用点个数
+ */
+int LogSiteReport(LogSiteReportFunc func, void *arg, const void *owner)
+{
+	int icount = 0;
+
+	for (LogSite *site = __atomic_load_n(&g_log_sites, __ATOMIC_ACQUIRE); site != 0; site = site->m_next)
+	{
+		if (owner != 0 && site->m_owner != owner)
+		{
+			continue;
+		}
+
+		unsigned long suppressed = LogSiteTakeSuppressed(site);
+		if (suppressed == 0)
+		{
+			continue;
+		}
+
+		func(site->m_file, site->m_line, suppressed, arg);
+		icount++;
+	}
+
+	return icount;
+}
+
+static void ReportToLog(const char *file, const int line, const unsigned long suppressed, void *arg)
+{
+	((Log *)arg)->WriteLog("suppressed %lu similar messages (%s:%d)\n", suppressed, file, line);
+}
+
+static void ReportToLogger(const char *file, const int line, const unsigned long suppressed, void *arg)
+{
+	((Logger *)arg)->Write(LOG_LEVEL_WARN, file, line, "suppressed %lu similar messages\n", suppressed);
+}
+
+/**
+ * @brief 把丢弃计数写到Log中
+ * @param log 日志对象
+ * @return 有丢弃计数的调用点个数
+ */
+int LogSiteReport(Log &log)
+{
+	return LogSiteReport(ReportToLog, &log, &log);
+}
+
+/**
+ * @brief 把丢弃计数写到Logger中
+ * @param logger 日志对象
+ * @return 有丢弃计数的调用点个数
+ */
+int LogSiteReport(Logger &logger)
+{
+	return LogSiteReport(ReportToLogger, &logger, &logger);
+}
@@ -0,0 +1,159 @@
+#ifndef __LOGSAMPLE_H__
+#define __LOGSAMPLE_H__
+#include "public.h"
+
+class Log;
+class Logger;
+
+/**
+ * @brief 日志调用点的限流和采样状态
+ *
+ * 每个使用LOG_RATELIMIT/LOG_EVERY_N的调用点有一个静态的LogSite，
+ * 判断是否输出只需要一两次原子操作，不做任何格式化和写入。
+ * 被丢弃的日志只计数，在该调用点下一次输出时或者由LogSiteReport定期输出
+ * "suppressed N similar messages"。调用点在第一次丢弃时记下输出到的日志对象，
+ * LogSiteReport只输出属于给定日志对象的调用点，多个日志对象不会互相取走丢弃计数。
+ */
+struct LogSite
+{
+	const char *m_file;
+	int         m_line;
+	long        m_interval_ns;   // 令牌桶每产生一个令牌的间隔，0表示不限流
+	long        m_tolerance_ns;  // 允许的突发量换算成的时间，为(burst-1)*m_interval_ns
+	long        m_every_n;       // 每N条输出1条，0或1表示不采样
+
+	long          m_tat;         // 令牌桶的理论到达时间（GCRA算法），单位为纳秒
+	unsigned long m_counter;     // 采样计数
+	unsigned long m_suppressed;  // 被丢弃的条数
+	int           m_bregistered; // 是否已加入全局链表
+	const void   *m_owner;       // 输出到的Log或者Logger对象，加入链表时设置
+	LogSite      *m_next;
+};
+
+/*
+ * 静态初始化LogSite，rate为每秒允许的条数，burst为允许的突发条数，n为采样间隔
+ * */
+#define LOGSITE_INIT(rate, burst, n) \
+	{ __FILE__, __LINE__, (rate) > 0 ? 1000000000L / (rate) : 0, \
+	  (rate) > 0 ? ((burst) > 1 ? (burst) - 1 : 0) * (1000000000L / (rate)) : 0, \
+	  (n), 0, 0, 0, 0, 0, 0 }
+
+/*
+ * 把调用点加入全局链表，供LogSiteReport遍历，只在第一次丢弃日志时调用
+ * owner 调用点输出到的日志对象
+ * */
+void LogSiteRegister(LogSite *site, const void *owner);
+
+/*
+ * 判断该调用点的这条日志是否应该输出，不输出时累加丢弃计数
+ * owner 调用点输出到的日志对象
+ * 返回值 true为输出，false为丢弃
+ * */
+static inline bool LogSiteAllow(LogSite *site, const void *owner)
+{
+	if (site->m_every_n > 1)
+	{
+		if (__atomic_fetch_add(&site->m_counter, 1, __ATOMIC_RELAXED) % site->m_every_n != 0)
+		{
+			goto suppressed;
+		}
+	}
+
+	if (site->m_interval_ns > 0)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		long now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+
+		long tat = __atomic_load_n(&site->m_tat, __ATOMIC_RELAXED);
+		while (true)
+		{
+			long base = tat > now ? tat : now;
+			if (base - now > site->m_tolerance_ns)
+			{
+				goto suppressed;
+			}
+
+			if (__atomic_compare_exchange_n(&site->m_tat, &tat, base + site->m_interval_ns,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+	}
+
+	return true;
+
+suppressed:
+	__atomic_fetch_add(&site->m_suppressed, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&site->m_bregistered, __ATOMIC_RELAXED) == 0)
+	{
+		LogSiteRegister(site, owner);
+	}
+	return false;
+}
+
+/*
+ * 取出并清零该调用点的丢弃计数
+ * */
+static inline unsigned long LogSiteTakeSuppressed(LogSite *site)
+{
+	if (__atomic_load_n(&site->m_suppressed, __ATOMIC_RELAXED) == 0)
+	{
+		return 0;
+	}
+
+	return __atomic_exchange_n(&site->m_suppressed, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * 遍历丢弃过日志的调用点，把丢弃计数写到日志中并清零
+ * owner 只处理输出到这个日志对象的调用点，为0时处理所有调用点
+ * 返回值为输出的调用点个数
+ * */
+typedef void (*LogSiteReportFunc)(const char *file, const int line, const unsigned long suppressed, void *arg);
+
+int LogSiteReport(LogSiteReportFunc func, void *arg, const void *owner = 0);
+
+int LogSiteReport(Log &log);
+
+int LogSiteReport(Logger &logger);
+
+/*
+ * 限流输出日志，每秒最多rate条，允许burst条的突发
+ * logger 为Log或Logger对象，调用它的WriteLog方法
+ * */
+#define LOG_RATELIMIT(logger, rate, burst, ...) \
+	do \
+	{ \
+		static LogSite _log_site = LOGSITE_INIT(rate, burst, 0); \
+		if (LogSiteAllow(&_log_site, &(logger))) \
+		{ \
+			(logger).WriteLog(__VA_ARGS__); \
+			unsigned long _suppressed = LogSiteTakeSuppressed(&_log_site); \
+			if (_suppressed > 0) \
+			{ \
+				(logger).WriteLog("suppressed %lu similar messages (%s:%d)\n", _suppressed, __FILE__, __LINE__); \
+			} \
+		} \
+	} while (0)
+
+/*
+ * 采样输出日志，每n条输出1条
+ * */
+#define LOG_EVERY_N(logger, n, ...) \
+	do \
+	{ \
+		static LogSite _log_site = LOGSITE_INIT(0, 0, n); \
+		if (LogSiteAllow(&_log_site, &(logger))) \
+		{ \
+			(logger).WriteLog(__VA_ARGS__); \
+			unsigned long _suppressed = LogSiteTakeSuppressed(&_log_site); \
+			if (_suppressed > 0) \
+			{ \
+				(logger).WriteLog("suppressed %lu similar messages (%s:%d)\n", _suppressed, __FILE__, __LINE__); \
+			} \
+		} \
+	} while (0)
+
+#endif
@@ -0,0 +1,771 @@
+/*
+ * moserver 服务端程序
+ *
+ * 用法：moserver [-c 配置文件] [-p 端口]
+ *
+ * 配置项（括号中为缺省值）：
+ *   port          监听端口(5005)
+ *   workers       工作线程数(4)
+ *   max_frame     报文最大长度，单位为字节(4194304)
+ *   idle_timeout  连接空闲超时，单位为秒，0表示不限制(0)
+ *   read_timeout  读取一个报文的超时时间，单位为秒(30)
+ *   drain_timeout 退出时等待连接排空的时间，单位为秒(30)
+ *   max_conns            最大连接数，0表示不限制(0)
+ *   max_conns_per_client 每个客户端IP的最大连接数，0表示不限制(0)
+ *   max_inflight         最大在途请求数，超过一半后按客户端IP平均分配，0表示不限制(0)
+ *   queue_target_ms      排队延迟目标值，单位为毫秒，0表示不按排队延迟拒绝(5)
+ *   queue_interval_ms    计算最小排队延迟的周期，单位为毫秒(100)
+ *   adaptive_lifo        过载时是否先处理新请求(true)
+ *   reject_delay_ms      拒绝请求后暂停读取该连接的时间，单位为毫秒(10)
+ *   rate_frames          每个客户端每秒的报文数，0表示不限制(0)
+ *   rate_frames_burst    每个客户端允许突发的报文数(rate_frames)
+ *   rate_bytes           每个客户端每秒的字节数，0表示不限制(0)
+ *   rate_bytes_burst     每个客户端允许突发的字节数(rate_bytes)
+ *   rate_v4_prefix       IPv4地址按多长的前缀算作一个客户端(32)
+ *   rate_v6_prefix       IPv6地址按多长的前缀算作一个客户端(64)
+ *   rate_clients         限流表最多记录的客户端数，超过时淘汰最近不活跃的(65536)
+ *   socket_profile       socket选项：default只设置TCP_NODELAY，low_latency、bulk_throughput见sockopt.h(default)
+ *   broker               是否打开发布订阅命令SUB和PUB(false)
+ *   broker_policy        订阅者队列满时的缺省处理：drop_oldest、disconnect、block(drop_oldest)
+ *   broker_max_queue     订阅者队列缺省最多容纳的消息数(1024)
+ *   broker_block_timeout_ms block策略下发布者最多等待的时间，单位为毫秒(1000)
+ *   broker_max_topics    最多的主题数(1024)
+ *   kv                   是否打开键值缓存命令GET、SET、DEL和MGET(false)
+ *   kv_max_mb            键值缓存的内存上限，单位为MB，包括散列表本身(64)
+ *   kv_shards            键值缓存的分片数，0表示每个CPU一个(0)
+ *   wal_dir              持久化消息队列的目录，打开命令QPUT和QGET，为空时不打开()
+ *   wal_segment_mb       消息队列每个段文件的大小，单位为MB(64)
+ *   tls_cert      PEM格式的证书链，和tls_key都设置时所有连接使用TLS，需要WITH_TLS=1编译()
+ *   tls_key       PEM格式的私钥()
+ *   tls_ktls      是否尝试把TLS记录层的加解密交给内核(true)
+ *   log_file      日志文件名，为空时写到标准错误输出()
+ *   log_level     trace、debug、info、warn、error(info)
+ *   admin         指标管理端口，以'/'开头为unix域套接字路径，为空时不启动()
+ *   hot_restart   热重启使用的unix域套接字路径，为空时不支持热重启。同一台机器上的多个实例
+ *                 要用不同的路径，只有SIGUSR2启动的新进程才会接管()
+ *
+ * 信号：
+ *   SIGTERM/SIGINT 停止接受新连接，处理完已经收到的请求后退出
+ *   SIGHUP         重新读取配置文件，重新打开日志文件
+ *   SIGUSR2        热重启，用同样的命令行启动新的程序，新程序接管监听socket后本进程排空退出
+ *
+ * 报文命令：
+ *   PING           应答PONG
+ *   ECHO 内容      应答内容
+ *   STATS          应答Prometheus文本格式的指标
+ *   SUB 主题 [策略] [队列长度]  应答OK，之后这个连接只接收该主题的消息，每个消息一个报文，不再处理请求
+ *   PUB 主题 内容  把内容发给主题的所有订阅者，应答"OK 订阅者数"
+ *   SET 键 值      应答OK
+ *   GET 键         命中时应答"OK 值"，没有命中时应答MISS
+ *   DEL 键         应答"OK 1"，键不存在时应答"OK 0"
+ *   MGET 键 键...  应答"OK "后面依次是每个键的4字节网络字节序长度和值，没有命中的键长度为0xffffffff
+ *   QPUT 内容      把内容追加到消息队列，落盘后应答"OK 序号"，并发的QPUT合并成一次fdatasync
+ *   QGET 序号 [条数] 从序号开始读最多条数(1)条消息，应答"OK "后面依次是每条消息的8字节网络字节序序号、
+ *                  4字节网络字节序长度和内容，一次最多1024条、1MB，只返回已经落盘的消息
+ *   其他           原样发回整个报文
+ * */
+#include "public.h"
+#include "config.h"
+#include "logger.h"
+#include "metrics.h"
+#include "server.h"
+#include "hotrestart.h"
+#include "broker.h"
+#include "kvcache.h"
+#include "wal.h"
+#include "tls.h"
+#include "utils.h"
+
+static Config        g_config;
+static Logger        g_logger;
+static FileLogSink   g_filesink;
+static StderrLogSink g_stderrsink;
+static FrameServer   g_server;
+static HotRestart    g_hotrestart;
+static TLSContext    g_tls;
+static Broker        g_broker;
+static KVCache       g_kvcache;
+static WAL           g_wal;
+static char          g_wal_dir[256];
+static BrokerPolicy  g_broker_policy = BROKER_DROP_OLDEST;
+static int           g_broker_max_queue = 1024;
+static int           g_port;
+
+static bool HandlePing(FrameRequest *req, void *)
+{
+	req->Reply("PONG", 4);
+	return true;
+}
+
+static bool HandleEcho(FrameRequest *req, void *)
+{
+	req->Reply(req->m_args, req->m_args_len);
+	return true;
+}
+
+static bool HandleStats(FrameRequest *req, void *)
+{
+	string out;
+	MetricsDump(out);
+	req->Reply(out);
+	return true;
+}
+
+static bool ParseBrokerPolicy(const char *name, BrokerPolicy *policy)
+{
+	if (strcmp(name, "drop_oldest") == 0)
+	{
+		*policy = BROKER_DROP_OLDEST;
+	}
+	else if (strcmp(name, "disconnect") == 0)
+	{
+		*policy = BROKER_DISCONNECT;
+	}
+	else if (strcmp(name, "block") == 0)
+	{
+		*policy = BROKER_BLOCK;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static void AttachSub(int fd, void *arg)
+{
+	g_broker.Attach((BrokerSub *)arg, fd);
+}
+
+static bool HandleSub(FrameRequest *req, void *)
+{
+	char topic[128];
+	char policy_name[32];
+	int max_queue = g_broker_max_queue;
+	BrokerPolicy policy = g_broker_policy;
+
+	policy_name[0] = 0;
+	int n = sscanf(req->m_args, "%127s %31s %d", topic, policy_name, &max_queue);
+	if (n < 1 || (n >= 2 && ParseBrokerPolicy(policy_name, &policy) == false))
+	{
+		req->Reply("ERR usage: SUB topic [drop_oldest|disconnect|block] [max_queue]");
+		return true;
+	}
+
+	// 订阅连接要交给Broker直接写socket，TLS的连接不能交出去
+	if (req->m_btls == true)
+	{
+		req->Reply("ERR SUB is not supported over TLS");
+		return true;
+	}
+
+	BrokerSub *sub = g_broker.NewSub(topic, policy, max_queue);
+	if (sub == 0)
+	{
+		req->Reply("ERR bad topic or too many topics");
+		return true;
+	}
+
+	req->Reply("OK", 2);
+	req->Detach(AttachSub, sub);
+	return true;
+}
+
+static bool HandlePub(FrameRequest *req, void *)
+{
+	// 主题后面跟一个空格，之后到报文末尾都是内容，可以是二进制
+	const char *end = req->m_args + req->m_args_len;
+	const char *sep = req->m_args;
+	while (sep < end && *sep != ' ')
+	{
+		sep++;
+	}
+	if (sep == req->m_args || sep - req->m_args >= 128)
+	{
+		req->Reply("ERR usage: PUB topic payload");
+		return true;
+	}
+
+	char topic[128];
+	memcpy(topic, req->m_args, sep - req->m_args);
+	topic[sep - req->m_args] = 0;
+	const char *payload = (sep < end) ? sep + 1 : end;
+
+	char reply[32];
+	int ilen = snprintf(reply, sizeof(reply), "OK %d", g_broker.Publish(topic, payload, end - payload));
+	req->Reply(reply, ilen);
+	return true;
+}
+
+/*
+ * 取出参数中的下一个键，键以空格分隔
+ * */
+static bool NextKey(const char **pos, const char *end, const char **key, int *klen)
+{
+	const char *p = *pos;
+	while (p < end && *p == ' ')
+	{
+		p++;
+	}
+	*key = p;
+	while (p < end && *p != ' ')
+	{
+		p++;
+	}
+	*klen = p - *key;
+	*pos = p;
+
+	return *klen > 0;
+}
+
+static bool HandleGet(FrameRequest *req, void *)
+{
+	req->m_reply.assign("OK ", 3);
+	if (g_kvcache.Get(req->m_args, req->m_args_len, req->m_reply) == false)
+	{
+		req->m_reply.assign("MISS", 4);
+	}
+	req->m_breply = true;
+	return true;
+}
+
+static bool HandleSet(FrameRequest *req, void *)
+{
+	// 键后面跟一个空格，之后到报文末尾都是值，可以是二进制
+	const char *end = req->m_args + req->m_args_len;
+	const char *sep = req->m_args;
+	while (sep < end && *sep != ' ')
+	{
+		sep++;
+	}
+	const char *value = (sep < end) ? sep + 1 : end;
+
+	if (g_kvcache.Set(req->m_args, sep - req->m_args, value, end - value) == true)
+	{
+		req->Reply("OK", 2);
+	}
+	else
+	{
+		req->Reply("ERR bad key or value too large");
+	}
+	return true;
+}
+
+static bool HandleDel(FrameRequest *req, void *)
+{
+	if (g_kvcache.Del(req->m_args, req->m_args_len) == true)
+	{
+		req->Reply("OK 1", 4);
+	}
+	else
+	{
+		req->Reply("OK 0", 4);
+	}
+	return true;
+}
+
+static bool HandleMGet(FrameRequest *req, void *)
+{
+	const char *pos = req->m_args;
+	const char *end = req->m_args + req->m_args_len;
+	const char *key;
+	int klen;
+
+	req->m_reply.assign("OK ", 3);
+	while (NextKey(&pos, end, &key, &klen) == true)
+	{
+		// 先占住长度的位置，值直接追加到应答后面，不经过临时缓冲区
+		size_t off = req->m_reply.size();
+		req->m_reply.append(4, 0);
+		unsigned int nlen = 0xffffffff;
+		if (g_kvcache.Get(key, klen, req->m_reply) == true)
+		{
+			nlen = htonl(req->m_reply.size() - off - 4);
+		}
+		memcpy(&req->m_reply[off], &nlen, 4);
+	}
+	req->m_breply = true;
+	return true;
+}
+
+static bool HandleQPut(FrameRequest *req, void *)
+{
+	// 返回时已经落盘，工作线程在这里等待组提交，同时到达的QPUT共用一次fdatasync
+	unsigned long seq;
+	if (g_wal.Append(req->m_args, req->m_args_len, &seq) == false)
+	{
+		req->Reply("ERR write failed");
+		return true;
+	}
+
+	char reply[32];
+	int ilen = snprintf(reply, sizeof(reply), "OK %lu", seq);
+	req->Reply(reply, ilen);
+	return true;
+}
+
+static bool HandleQGet(FrameRequest *req, void *)
+{
+	char *end;
+	unsigned long seq = strtoul(req->m_args, &end, 10);
+	long count = 1;
+	if (end < req->m_args + req->m_args_len && *end == ' ')
+	{
+		count = strtol(end + 1, 0, 10);
+	}
+	if (seq == 0 || count <= 0)
+	{
+		req->Reply("ERR usage: QGET seq [count]");
+		return true;
+	}
+	if (count > 1024)
+	{
+		count = 1024;
+	}
+
+	// 只返回已经落盘的记录：页缓存中还没有fdatasync的记录，以及fdatasync失败的批次，
+	// 崩溃后序号会被重新使用，内容不同
+	unsigned long durable = g_wal.Durable();
+	req->m_reply.assign("OK ", 3);
+	req->m_breply = true;
+	if (seq > durable)
+	{
+		return true;
+	}
+
+	// 每次请求打开一个读取器，从索引中最近的位置开始找，段文件只映射不拷贝，内容直接追加到应答
+	WALPosition hint;
+	WALReader reader;
+	if (reader.Open(g_wal_dir, seq, g_wal.Locate(seq, &hint) ? &hint : 0) == false)
+	{
+		req->Reply("ERR read failed");
+		return true;
+	}
+
+	const char *data;
+	int ilen;
+	unsigned long rseq;
+	while (count-- > 0 && req->m_reply.size() < 1024 * 1024 && reader.Next(&data, &ilen, &rseq) == true &&
+			rseq <= durable)
+	{
+		unsigned int nseq[2] = { htonl(rseq >> 32), htonl(rseq & 0xffffffff) };
+		unsigned int nlen = htonl(ilen);
+		req->m_reply.append((const char *)nseq, 8);
+		req->m_reply.append((const char *)&nlen, 4);
+		req->m_reply.append(data, ilen);
+	}
+	return true;
+}
+
+static bool HandleDefault(FrameRequest *req, void *)
+{
+	req->Reply(req->m_data, req->m_len);
+	return true;
+}
+
+static int ParseLogLevel(const char *level)
+{
+	static const char *names[] = { "trace", "debug", "info", "warn", "error", "fatal", "off" };
+	for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+	{
+		if (strcasecmp(level, names[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return LOG_LEVEL_INFO;
+}
+
+/*
+ * 应用可以在运行中修改的配置项，启动和收到SIGHUP时调用
+ * 端口、工作线程数、报文最大长度、准入控制、限流表大小、socket选项、TLS、是否打开broker、键值缓存和消息队列以及键值缓存的容量需要重启才能生效
+ * */
+static void ApplyConfig(bool breload)
+{
+	g_logger.SetLevel(ParseLogLevel(g_config.GetStr("log_level", "info")));
+	g_server.m_idle_timeout = g_config.GetInt("idle_timeout", 0);
+	g_server.m_read_timeout = g_config.GetInt("read_timeout", 30);
+
+	long rate_frames = g_config.GetLong("rate_frames", 0);
+	long rate_bytes = g_config.GetLong("rate_bytes", 0);
+	g_server.m_ratelimit.SetFrameRate(rate_frames, g_config.GetLong("rate_frames_burst", rate_frames));
+	g_server.m_ratelimit.SetByteRate(rate_bytes, g_config.GetLong("rate_bytes_burst", rate_bytes));
+
+	g_broker.m_block_timeout = g_config.GetInt("broker_block_timeout_ms", 1000);
+	g_broker_max_queue = g_config.GetInt("broker_max_queue", 1024);
+	const char *broker_policy = g_config.GetStr("broker_policy", "drop_oldest");
+	if (ParseBrokerPolicy(broker_policy, &g_broker_policy) == false)
+	{
+		LOG_WARN(g_logger, "unknown broker_policy %s, using drop_oldest\n", broker_policy);
+		g_broker_policy = BROKER_DROP_OLDEST;
+	}
+
+	if (breload == false)
+	{
+		return;
+	}
+
+	// 日志文件名没变时重新打开，配合logrotate使用；文件名变了时切换到新文件
+	const char *log_file = g_config.GetStr("log_file", "");
+	if (g_filesink.m_log.m_log_filename[0] != 0)
+	{
+		if (log_file[0] != 0 && strcmp(log_file, g_filesink.m_log.m_log_filename) != 0)
+		{
+			if (g_filesink.OpenFile(log_file) == false)
+			{
+				LOG_ERROR(g_logger, "open log file %s failed: %s\n", log_file, strerror(errno));
+			}
+		}
+		else if (g_filesink.m_log.ReopenFile() == false)
+		{
+			LOG_ERROR(g_logger, "reopen log file %s failed: %s\n", g_filesink.m_log.m_log_filename, strerror(errno));
+		}
+	}
+	else if (log_file[0] != 0)
+	{
+		LOG_WARN(g_logger, "log_file changed from stderr to %s, restart to take effect\n", log_file);
+	}
+
+	if (g_config.GetInt("port", 5005) != g_port ||
+			g_config.GetInt("workers", 4) != g_server.m_workers)
+	{
+		LOG_WARN(g_logger, "port or workers changed, restart to take effect\n");
+	}
+}
+
+/*
+ * 监听socket实际绑定的端口，取不到时返回-1
+ * */
+static int ListenPort(const int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (fd == -1 || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+	{
+		return -1;
+	}
+
+	if (addr.ss_family == AF_INET)
+	{
+		return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	}
+	if (addr.ss_family == AF_INET6)
+	{
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	}
+
+	return -1;
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c config] [-p port]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *config_file = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+		{
+			config_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+		{
+			g_config.Set("port", argv[++i]);
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (config_file != 0 && g_config.LoadFile(config_file) == false)
+	{
+		fprintf(stderr, "load config %s failed\n", config_file);
+		return 1;
+	}
+
+	// 信号在所有线程中屏蔽，由主线程通过signalfd处理，必须在创建任何线程之前设置
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sigfd == -1)
+	{
+		fprintf(stderr, "signalfd failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	const char *log_file = g_config.GetStr("log_file", "");
+	if (log_file[0] != 0)
+	{
+		if (g_filesink.OpenFile(log_file) == false)
+		{
+			fprintf(stderr, "open log file %s failed: %s\n", log_file, strerror(errno));
+			return 1;
+		}
+		g_logger.AddSink(&g_filesink);
+	}
+	else
+	{
+		g_logger.AddSink(&g_stderrsink);
+	}
+	g_logger.Start();
+
+	g_port = g_config.GetInt("port", 5005);
+
+	g_server.m_workers = g_config.GetInt("workers", 4);
+	g_server.m_max_frame = g_config.GetInt("max_frame", 4 * 1024 * 1024);
+
+	Admission &admission = g_server.m_admission;
+	admission.m_max_conns = g_config.GetInt("max_conns", 0);
+	admission.m_max_conns_per_client = g_config.GetInt("max_conns_per_client", 0);
+	admission.m_max_inflight = g_config.GetInt("max_inflight", 0);
+	admission.m_target = (long)(g_config.GetDouble("queue_target_ms", 5) * 1000000);
+	admission.m_interval = (long)(g_config.GetDouble("queue_interval_ms", 100) * 1000000);
+	admission.m_blifo = g_config.GetBool("adaptive_lifo", true);
+	admission.m_reject_delay = (long)(g_config.GetDouble("reject_delay_ms", 10) * 1000000);
+
+	g_server.m_ratelimit.m_v4_prefix = g_config.GetInt("rate_v4_prefix", 32);
+	g_server.m_ratelimit.m_v6_prefix = g_config.GetInt("rate_v6_prefix", 64);
+	if (g_server.m_ratelimit.Init(g_config.GetInt("rate_clients", 65536)) == false)
+	{
+		LOG_FATAL(g_logger, "init rate limiter failed\n");
+		g_logger.Stop();
+		return 1;
+	}
+
+	// default保持FrameServer原来的选项（只设置TCP_NODELAY），监听队列仍由m_backlog决定
+	const char *socket_profile = g_config.GetStr("socket_profile", "default");
+	if (strcmp(socket_profile, "default") != 0 && SocketProfile::ByName(socket_profile, &g_server.m_profile) == false)
+	{
+		LOG_FATAL(g_logger, "unknown socket_profile %s\n", socket_profile);
+		g_logger.Stop();
+		return 1;
+	}
+
+	const char *tls_cert = g_config.GetStr("tls_cert", "");
+	const char *tls_key = g_config.GetStr("tls_key", "");
+	if (tls_cert[0] != 0 && tls_key[0] != 0)
+	{
+		g_tls.m_bktls = g_config.GetBool("tls_ktls", true);
+		if (g_tls.InitServer(tls_cert, tls_key) == false)
+		{
+			LOG_FATAL(g_logger, "load tls cert %s and key %s failed\n", tls_cert, tls_key);
+			g_logger.Stop();
+			return 1;
+		}
+		g_server.m_tls = &g_tls;
+	}
+	ApplyConfig(false);
+
+	g_server.AddHandler("PING", HandlePing);
+	g_server.AddHandler("ECHO", HandleEcho);
+	g_server.AddHandler("STATS", HandleStats);
+	if (g_config.GetBool("broker", false) == true)
+	{
+		g_broker.m_max_topics = g_config.GetInt("broker_max_topics", 1024);
+		if (g_broker.Start() == false)
+		{
+			LOG_FATAL(g_logger, "start broker failed: %s\n", strerror(errno));
+			g_logger.Stop();
+			return 1;
+		}
+		g_server.AddHandler("SUB", HandleSub);
+		g_server.AddHandler("PUB", HandlePub);
+	}
+	if (g_config.GetBool("kv", false) == true)
+	{
+		if (g_kvcache.Init((size_t)g_config.GetLong("kv_max_mb", 64) * 1024 * 1024, g_config.GetInt("kv_shards", 0)) == false)
+		{
+			LOG_FATAL(g_logger, "init kv cache failed\n");
+			g_logger.Stop();
+			return 1;
+		}
+		g_server.AddHandler("GET", HandleGet);
+		g_server.AddHandler("SET", HandleSet);
+		g_server.AddHandler("DEL", HandleDel);
+		g_server.AddHandler("MGET", HandleMGet);
+	}
+	StrCopy(g_wal_dir, sizeof(g_wal_dir), g_config.GetStr("wal_dir", ""));
+	if (g_wal_dir[0] != 0)
+	{
+		g_wal.m_segment_bytes = (size_t)g_config.GetLong("wal_segment_mb", 64) * 1024 * 1024;
+		if (g_wal.Open(g_wal_dir) == false)
+		{
+			LOG_FATAL(g_logger, "open wal %s failed: %s\n", g_wal_dir, strerror(errno));
+			g_logger.Stop();
+			return 1;
+		}
+		LOG_INFO(g_logger, "wal %s opened, last durable seq %lu\n", g_wal_dir, g_wal.Durable());
+		g_server.AddHandler("QPUT", HandleQPut);
+		g_server.AddHandler("QGET", HandleQGet);
+	}
+	g_server.SetDefaultHandler(HandleDefault);
+
+	// 由旧进程的SIGUSR2启动时接管它的监听socket，否则自己监听
+	const char *hot_restart = g_config.GetStr("hot_restart", "");
+	bool binherited = false;
+	vector<int> fds;
+	if (hot_restart[0] != 0 && g_hotrestart.Inherit(hot_restart, fds) == true)
+	{
+		// 配置的端口和旧进程不一样时不接管，旧进程等不到就绪会继续服务
+		int iport = ListenPort(fds[0]);
+		if (iport != g_port)
+		{
+			LOG_WARN(g_logger, "inherited socket listens on port %d, not %d, ignored\n", iport, g_port);
+			g_hotrestart.Close();
+		}
+		else
+		{
+			binherited = g_server.Attach(fds[0]);
+		}
+		for (size_t i = 1; i < fds.size(); i++)
+		{
+			close(fds[i]);
+		}
+		if (binherited == false)
+		{
+			close(fds[0]);
+		}
+	}
+
+	if (binherited == false && g_server.Listen(g_port) == false)
+	{
+		LOG_FATAL(g_logger, "listen on port %d failed: %s\n", g_port, strerror(errno));
+		g_logger.Stop();
+		return 1;
+	}
+
+	if (g_server.Start() == false)
+	{
+		LOG_FATAL(g_logger, "start server failed: %s\n", strerror(errno));
+		g_logger.Stop();
+		return 1;
+	}
+
+	if (binherited == true)
+	{
+		g_hotrestart.NotifyReady();
+	}
+
+	// 重新读取配置文件后GetStr返回的指针失效，管理端口的地址要复制一份
+	char admin[108];
+	StrCopy(admin, sizeof(admin), g_config.GetStr("admin", ""));
+	if (admin[0] != 0 && MetricsStartAdmin(admin) == false)
+	{
+		LOG_WARN(g_logger, "start metrics admin on %s failed: %s\n", admin, strerror(errno));
+	}
+
+	if (hot_restart[0] != 0 && g_hotrestart.Listen(hot_restart) == false)
+	{
+		LOG_WARN(g_logger, "hot restart listen on %s failed: %s\n", hot_restart, strerror(errno));
+	}
+
+	LOG_INFO(g_logger, "moserver %d started on port %d%s%s, %d workers\n",
+			getpid(), ListenPort(g_server.ListenFd()), binherited ? " (inherited)" : "", g_server.m_tls != 0 ? " with tls" : "", g_server.m_workers);
+
+	bool brunning = true;
+	while (brunning == true)
+	{
+		struct pollfd pfds[2];
+		pfds[0].fd = sigfd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = g_hotrestart.ListenFd();
+		pfds[1].events = POLLIN;
+
+		if (poll(pfds, pfds[1].fd == -1 ? 1 : 2, -1) <= 0)
+		{
+			continue;
+		}
+
+		if ((pfds[0].revents & POLLIN) != 0)
+		{
+			struct signalfd_siginfo si;
+			if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+			{
+				continue;
+			}
+
+			switch (si.ssi_signo)
+			{
+				case SIGTERM:
+				case SIGINT:
+					LOG_INFO(g_logger, "received signal %d, draining\n", si.ssi_signo);
+					brunning = false;
+					break;
+				case SIGHUP:
+					if (g_config.m_filename[0] != 0 && g_config.Reload() == false)
+					{
+						LOG_ERROR(g_logger, "reload config %s failed, keep running with old config\n", g_config.m_filename);
+						break;
+					}
+					ApplyConfig(true);
+					LOG_INFO(g_logger, "config reloaded\n");
+					break;
+				case SIGUSR2:
+					if (g_hotrestart.ListenFd() == -1 || g_hotrestart.Spawn(argv) == false)
+					{
+						LOG_ERROR(g_logger, "hot restart spawn %s failed\n", argv[0]);
+					}
+					break;
+				case SIGCHLD:
+					while (waitpid(-1, 0, WNOHANG) > 0)
+					{
+					}
+					break;
+			}
+		}
+
+		if (pfds[1].fd != -1 && (pfds[1].revents & POLLIN) != 0)
+		{
+			// 新进程来接管，先让出管理端口，新进程失败时再恢复
+			MetricsStopAdmin();
+
+			vector<int> listenfds;
+			listenfds.push_back(g_server.ListenFd());
+			if (g_hotrestart.Handoff(listenfds, 30) == true)
+			{
+				LOG_INFO(g_logger, "listen socket handed off to new process, draining\n");
+				brunning = false;
+			}
+			else
+			{
+				LOG_ERROR(g_logger, "hot restart handoff failed, keep serving\n");
+				if (admin[0] != 0)
+				{
+					MetricsStartAdmin(admin);
+				}
+			}
+		}
+	}
+
+	int drain_timeout = g_config.GetInt("drain_timeout", 30);
+	if (g_server.Drain(drain_timeout) == false)
+	{
+		LOG_WARN(g_logger, "%d connections still open after %d seconds, closing\n", g_server.Connections(), drain_timeout);
+	}
+	g_server.Stop();
+	g_broker.Stop();
+	g_wal.Close();
+	MetricsStopAdmin();
+	g_hotrestart.Close();
+
+	LOG_INFO(g_logger, "moserver %d stopped\n", getpid());
+	g_logger.Stop();
+	close(sigfd);
+
+	return 0;
+}
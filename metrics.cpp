@@ -0,0 +1,567 @@
+#include "public.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <sys/un.h>
+
+static int g_metric_next_shard = 0;
+static __thread int t_metric_shard = -1;
+
+/**
+ * @brief 返回当前线程使用的分片编号
+ * @details 线程第一次调用时按顺序分配，超过分片数后多个线程共用一个分片，仍然正确，只是会有竞争
+ * @return 分片编号，0到METRIC_SHARDS-1
+ */
+int MetricShard()
+{
+	if (t_metric_shard < 0)
+	{
+		t_metric_shard = __atomic_fetch_add(&g_metric_next_shard, 1, __ATOMIC_RELAXED) % METRIC_SHARDS;
+	}
+
+	return t_metric_shard;
+}
+
+MetricCounter::MetricCounter()
+{
+	memset(m_shards, 0, sizeof(m_shards));
+}
+
+/**
+ * @brief 读取计数器的值
+ * @return 所有分片之和
+ */
+unsigned long MetricCounter::Value() const
+{
+	unsigned long total = 0;
+	for (int i = 0; i < METRIC_SHARDS; i++)
+	{
+		total += __atomic_load_n(&m_shards[i].m_value, __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+MetricGauge::MetricGauge()
+{
+	m_value = 0;
+}
+
+MetricHistogram::MetricHistogram()
+{
+	memset(m_shards, 0, sizeof(m_shards));
+}
+
+/**
+ * @brief 合并所有分片
+ * @param buckets 输出的桶计数，至少有METRIC_HIST_BUCKETS个元素
+ * @param sum 输出的数值之和，可以为0
+ * @return 总次数
+ */
+unsigned long MetricHistogram::Snapshot(unsigned long *buckets, unsigned long *sum) const
+{
+	unsigned long count = 0;
+	unsigned long total = 0;
+
+	memset(buckets, 0, sizeof(unsigned long) * METRIC_HIST_BUCKETS);
+	for (int i = 0; i < METRIC_HIST_SHARDS; i++)
+	{
+		for (int j = 0; j < METRIC_HIST_BUCKETS; j++)
+		{
+			unsigned long n = __atomic_load_n(&m_shards[i].m_buckets[j], __ATOMIC_RELAXED);
+			buckets[j] += n;
+			count += n;
+		}
+		total += __atomic_load_n(&m_shards[i].m_sum, __ATOMIC_RELAXED);
+	}
+
+	if (sum != 0)
+	{
+		*sum = total;
+	}
+
+	return count;
+}
+
+/**
+ * @brief 计算分位数
+ * @param q 分位，例如0.99
+ * @return 分位数所在桶的上界，没有数据时返回0
+ */
+unsigned long MetricHistogram::Percentile(const double q) const
+{
+	unsigned long buckets[METRIC_HIST_BUCKETS];
+	unsigned long count = Snapshot(buckets, 0);
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	unsigned long target = (unsigned long)ceil(q * count);
+	if (target == 0)
+	{
+		target = 1;
+	}
+
+	unsigned long seen = 0;
+	for (int i = 0; i < METRIC_HIST_BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen >= target)
+		{
+			return BucketUpperBound(i);
+		}
+	}
+
+	return BucketUpperBound(METRIC_HIST_BUCKETS - 1);
+}
+
+/**
+ * @brief 返回桶能记录的最大值
+ * @param index 桶下标
+ * @return 最大值
+ */
+unsigned long MetricHistogram::BucketUpperBound(const int index)
+{
+	if (index < (1 << METRIC_HIST_SUBBITS))
+	{
+		return index;
+	}
+
+	int imsb = (index >> METRIC_HIST_SUBBITS) + METRIC_HIST_SUBBITS - 1;
+	if (imsb > 63)
+	{
+		return ULONG_MAX;
+	}
+
+	unsigned long isub = index & ((1 << METRIC_HIST_SUBBITS) - 1);
+	unsigned long width = 1UL << (imsb - METRIC_HIST_SUBBITS);
+	unsigned long lower = (1UL << imsb) + isub * width;
+
+	return lower + (width - 1);
+}
+
+/*
+ * 已注册的指标
+ * */
+#define METRIC_TYPE_COUNTER   1
+#define METRIC_TYPE_GAUGE     2
+#define METRIC_TYPE_HISTOGRAM 3
+#define METRIC_MAX            256
+
+struct MetricEntry
+{
+	int    m_type;
+	char   m_name[128];
+	char   m_help[256];
+	char   m_labels[128];
+	double m_scale;
+	void  *m_metric;
+};
+
+static MetricEntry     g_metrics[METRIC_MAX];
+static int             g_metric_count = 0;
+static pthread_mutex_t g_metric_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 查找或创建指标
+ * @return 指标对象，类型不一致或者已满时返回0
+ */
+static void *RegisterMetric(const int type, const char *name, const char *help, const char *labels, const double scale)
+{
+	if (labels == 0)
+	{
+		labels = "";
+	}
+
+	pthread_mutex_lock(&g_metric_lock);
+
+	for (int i = 0; i < g_metric_count; i++)
+	{
+		if (strcmp(g_metrics[i].m_name, name) == 0 && strcmp(g_metrics[i].m_labels, labels) == 0)
+		{
+			void *metric = (g_metrics[i].m_type == type) ? g_metrics[i].m_metric : 0;
+			pthread_mutex_unlock(&g_metric_lock);
+			return metric;
+		}
+	}
+
+	if (g_metric_count >= METRIC_MAX)
+	{
+		pthread_mutex_unlock(&g_metric_lock);
+		return 0;
+	}
+
+	MetricEntry &entry = g_metrics[g_metric_count];
+	entry.m_type = type;
+	StrCopy(entry.m_name, sizeof(entry.m_name), name);
+	StrCopy(entry.m_help, sizeof(entry.m_help), help);
+	StrCopy(entry.m_labels, sizeof(entry.m_labels), labels);
+	entry.m_scale = scale;
+
+	if (type == METRIC_TYPE_COUNTER)
+	{
+		entry.m_metric = new MetricCounter;
+	}
+	else if (type == METRIC_TYPE_GAUGE)
+	{
+		entry.m_metric = new MetricGauge;
+	}
+	else
+	{
+		entry.m_metric = new MetricHistogram;
+	}
+
+	void *metric = entry.m_metric;
+	__atomic_store_n(&g_metric_count, g_metric_count + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&g_metric_lock);
+
+	return metric;
+}
+
+MetricCounter *NewMetricCounter(const char *name, const char *help, const char *labels)
+{
+	return (MetricCounter *)RegisterMetric(METRIC_TYPE_COUNTER, name, help, labels, 1);
+}
+
+MetricGauge *NewMetricGauge(const char *name, const char *help, const char *labels)
+{
+	return (MetricGauge *)RegisterMetric(METRIC_TYPE_GAUGE, name, help, labels, 1);
+}
+
+MetricHistogram *NewMetricHistogram(const char *name, const char *help, const char *labels, const double scale)
+{
+	return (MetricHistogram *)RegisterMetric(METRIC_TYPE_HISTOGRAM, name, help, labels, scale);
+}
+
+/**
+ * @brief 拼接指标名和标签，例如 name{side="client",le="0.001"}
+ */
+static void AppendSeries(string &out, const char *name, const char *suffix, const char *labels, const char *extra)
+{
+	out += name;
+	out += suffix;
+
+	bool blabels = (labels[0] != 0);
+	bool bextra = (extra != 0 && extra[0] != 0);
+	if (blabels == false && bextra == false)
+	{
+		return;
+	}
+
+	out += "{";
+	out += labels;
+	if (blabels == true && bextra == true)
+	{
+		out += ",";
+	}
+	if (bextra == true)
+	{
+		out += extra;
+	}
+	out += "}";
+}
+
+/**
+ * @brief 输出一个直方图
+ * @details 为了让输出保持紧凑，只在每个2的幂处输出一个累计桶，直到最大的非空桶为止
+ */
+static void DumpHistogram(string &out, const MetricEntry &entry)
+{
+	MetricHistogram *hist = (MetricHistogram *)entry.m_metric;
+	unsigned long buckets[METRIC_HIST_BUCKETS];
+	unsigned long sum = 0;
+	unsigned long count = hist->Snapshot(buckets, &sum);
+
+	int ilast = 0;
+	for (int i = 0; i < METRIC_HIST_BUCKETS; i++)
+	{
+		if (buckets[i] != 0)
+		{
+			ilast = i;
+		}
+	}
+
+	char line[128];
+	unsigned long cumulative = 0;
+	for (int i = 0; i < METRIC_HIST_BUCKETS; i++)
+	{
+		cumulative += buckets[i];
+
+		bool bboundary = ((i + 1) % (1 << METRIC_HIST_SUBBITS)) == 0;
+		if (bboundary == false || i > ilast + (1 << METRIC_HIST_SUBBITS))
+		{
+			continue;
+		}
+
+		char le[64];
+		snprintf(le, sizeof(le), "le=\"%.9g\"", (MetricHistogram::BucketUpperBound(i) + 1) * entry.m_scale);
+		AppendSeries(out, entry.m_name, "_bucket", entry.m_labels, le);
+		snprintf(line, sizeof(line), " %lu\n", cumulative);
+		out += line;
+	}
+
+	AppendSeries(out, entry.m_name, "_bucket", entry.m_labels, "le=\"+Inf\"");
+	snprintf(line, sizeof(line), " %lu\n", count);
+	out += line;
+
+	AppendSeries(out, entry.m_name, "_sum", entry.m_labels, 0);
+	snprintf(line, sizeof(line), " %.9g\n", sum * entry.m_scale);
+	out += line;
+
+	AppendSeries(out, entry.m_name, "_count", entry.m_labels, 0);
+	snprintf(line, sizeof(line), " %lu\n", count);
+	out += line;
+}
+
+/**
+ * @brief 按Prometheus文本格式输出所有指标，同名指标放在一起，只输出一次HELP和TYPE
+ * @param out 输出的字符串
+ */
+void MetricsDump(string &out)
+{
+	int icount = __atomic_load_n(&g_metric_count, __ATOMIC_ACQUIRE);
+	vector<bool> bdone(icount, false);
+	char line[640];
+
+	for (int i = 0; i < icount; i++)
+	{
+		if (bdone[i] == true)
+		{
+			continue;
+		}
+
+		const char *type = "counter";
+		if (g_metrics[i].m_type == METRIC_TYPE_GAUGE)
+		{
+			type = "gauge";
+		}
+		else if (g_metrics[i].m_type == METRIC_TYPE_HISTOGRAM)
+		{
+			type = "histogram";
+		}
+
+		snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", g_metrics[i].m_name, g_metrics[i].m_help,
+				g_metrics[i].m_name, type);
+		out += line;
+
+		for (int j = i; j < icount; j++)
+		{
+			if (bdone[j] == true || strcmp(g_metrics[j].m_name, g_metrics[i].m_name) != 0)
+			{
+				continue;
+			}
+			bdone[j] = true;
+
+			const MetricEntry &entry = g_metrics[j];
+			if (entry.m_type == METRIC_TYPE_HISTOGRAM)
+			{
+				DumpHistogram(out, entry);
+				continue;
+			}
+
+			AppendSeries(out, entry.m_name, "", entry.m_labels, 0);
+			if (entry.m_type == METRIC_TYPE_COUNTER)
+			{
+				snprintf(line, sizeof(line), " %lu\n", ((MetricCounter *)entry.m_metric)->Value());
+			}
+			else
+			{
+				snprintf(line, sizeof(line), " %ld\n", ((MetricGauge *)entry.m_metric)->Value());
+			}
+			out += line;
+		}
+	}
+}
+
+/**
+ * @brief 把指标快照写到文件
+ * @param filename 文件名
+ * @return 成功返回true，失败返回false
+ */
+bool MetricsWriteFile(const char *filename)
+{
+	string out;
+	MetricsDump(out);
+
+	char tmpname[310];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	FILE *fp = FOpen(tmpname, "w");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	bool bok = (fwrite(out.data(), 1, out.size(), fp) == out.size());
+	if (fclose(fp) != 0)
+	{
+		bok = false;
+	}
+
+	if (bok == false || rename(tmpname, filename) != 0)
+	{
+		unlink(tmpname);
+		return false;
+	}
+
+	return true;
+}
+
+static int       g_admin_fd = -1;
+static pthread_t g_admin_tid;
+static char      g_admin_path[108];
+
+/**
+ * @brief 管理端口线程，逐个处理连接，每个连接输出一份指标快照后关闭
+ */
+static void *AdminThread(void *arg)
+{
+	int listenfd = (int)(long)arg;
+
+	while (true)
+	{
+		int clientfd = accept(listenfd, 0, 0);
+		if (clientfd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+
+		// 最多等待100毫秒读取请求，没有请求也直接输出
+		char request[512];
+		int ilen = 0;
+		struct pollfd pfd;
+		pfd.fd = clientfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0)
+		{
+			ilen = recv(clientfd, request, sizeof(request) - 1, 0);
+		}
+
+		string body;
+		MetricsDump(body);
+
+		string response;
+		if (ilen >= 4 && strncmp(request, "GET ", 4) == 0)
+		{
+			char header[160];
+			snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)body.size());
+			response = header;
+		}
+		response += body;
+
+		size_t isent = 0;
+		while (isent < response.size())
+		{
+			int iret = send(clientfd, response.data() + isent, response.size() - isent, MSG_NOSIGNAL);
+			if (iret <= 0)
+			{
+				break;
+			}
+			isent += iret;
+		}
+
+		close(clientfd);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 启动管理端口
+ * @param path unix域套接字路径，或者本机TCP端口号
+ * @return 成功返回true，失败返回false
+ */
+bool MetricsStartAdmin(const char *path)
+{
+	if (path == 0 || g_admin_fd != -1)
+	{
+		return false;
+	}
+
+	int listenfd = -1;
+	if (path[0] == '/')
+	{
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path))
+		{
+			return false;
+		}
+		strcpy(addr.sun_path, path);
+
+		if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		{
+			return false;
+		}
+
+		unlink(path);
+		if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(listenfd);
+			return false;
+		}
+		StrCopy(g_admin_path, sizeof(g_admin_path), path);
+	}
+	else
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(atoi(path));
+
+		if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		{
+			return false;
+		}
+
+		int sock_opt = 1;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &sock_opt, sizeof(sock_opt));
+		if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(listenfd);
+			return false;
+		}
+		g_admin_path[0] = 0;
+	}
+
+	if (listen(listenfd, 16) != 0 || pthread_create(&g_admin_tid, 0, AdminThread, (void *)(long)listenfd) != 0)
+	{
+		close(listenfd);
+		return false;
+	}
+
+	g_admin_fd = listenfd;
+
+	return true;
+}
+
+/**
+ * @brief 停止管理端口线程
+ */
+void MetricsStopAdmin()
+{
+	if (g_admin_fd == -1)
+	{
+		return;
+	}
+
+	shutdown(g_admin_fd, SHUT_RDWR);
+	close(g_admin_fd);
+	pthread_join(g_admin_tid, 0);
+	g_admin_fd = -1;
+
+	if (g_admin_path[0] != 0)
+	{
+		unlink(g_admin_path);
+		g_admin_path[0] = 0;
+	}
+}
@@ -0,0 +1,174 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+#include "public.h"
+
+#define METRIC_SHARDS        64   // 计数器的分片数，每个线程固定使用其中一个分片
+#define METRIC_HIST_SHARDS   16   // 直方图的分片数
+#define METRIC_HIST_SUBBITS  3    // 每个2的幂区间再分成2^3个子区间，相对误差不超过12.5%
+#define METRIC_HIST_BUCKETS  512
+
+/*
+ * 返回当前线程使用的分片编号，线程第一次调用时分配
+ * */
+int MetricShard();
+
+/**
+ * @brief 计数器，只增不减
+ *
+ * 每个线程写自己的分片（按缓存行对齐），读取时把所有分片加起来，
+ * 写入路径上没有线程之间的缓存行竞争。
+ */
+class MetricCounter
+{
+	public:
+		MetricCounter();
+
+		void Add(const unsigned long n = 1)
+		{
+			__atomic_fetch_add(&m_shards[MetricShard()].m_value, n, __ATOMIC_RELAXED);
+		}
+
+		unsigned long Value() const;
+
+	private:
+		struct Shard
+		{
+			unsigned long m_value;
+			char          m_pad[64 - sizeof(unsigned long)];
+		} __attribute__((aligned(64)));
+
+		Shard m_shards[METRIC_SHARDS];
+};
+
+/**
+ * @brief 计量值，可增可减，例如当前的连接数
+ */
+class MetricGauge
+{
+	public:
+		MetricGauge();
+
+		void Add(const long n = 1)
+		{
+			__atomic_fetch_add(&m_value, n, __ATOMIC_RELAXED);
+		}
+
+		void Sub(const long n = 1)
+		{
+			__atomic_fetch_sub(&m_value, n, __ATOMIC_RELAXED);
+		}
+
+		void Set(const long n)
+		{
+			__atomic_store_n(&m_value, n, __ATOMIC_RELAXED);
+		}
+
+		long Value() const
+		{
+			return __atomic_load_n(&m_value, __ATOMIC_RELAXED);
+		}
+
+	private:
+		long m_value;
+};
+
+/**
+ * @brief 对数线性直方图，用于记录延迟等分布
+ *
+ * 和HDR直方图一样，把数值按最高位所在的2的幂分段，每段再等分成8个子区间，
+ * 记录一次只需要计算下标和一次原子加。数值单位由调用者决定，
+ * 套接字和日志的延迟统一使用纳秒。
+ */
+class MetricHistogram
+{
+	public:
+		MetricHistogram();
+
+		void Record(const unsigned long value)
+		{
+			Shard &shard = m_shards[MetricShard() % METRIC_HIST_SHARDS];
+			__atomic_fetch_add(&shard.m_buckets[BucketIndex(value)], 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&shard.m_sum, value, __ATOMIC_RELAXED);
+		}
+
+		/*
+		 * 把所有分片合并到buckets中，返回总次数，sum为所有数值之和
+		 * buckets 至少有METRIC_HIST_BUCKETS个元素
+		 * */
+		unsigned long Snapshot(unsigned long *buckets, unsigned long *sum) const;
+
+		/*
+		 * 返回分位数q（0到1之间）对应的数值，没有数据时返回0
+		 * */
+		unsigned long Percentile(const double q) const;
+
+		static int BucketIndex(const unsigned long value)
+		{
+			if (value < (1UL << METRIC_HIST_SUBBITS))
+			{
+				return (int)value;
+			}
+
+			int imsb = 63 - __builtin_clzl(value);
+			int isub = (int)((value >> (imsb - METRIC_HIST_SUBBITS)) & ((1UL << METRIC_HIST_SUBBITS) - 1));
+			return ((imsb - METRIC_HIST_SUBBITS + 1) << METRIC_HIST_SUBBITS) + isub;
+		}
+
+		/*
+		 * 返回下标为index的桶能记录的最大值
+		 * */
+		static unsigned long BucketUpperBound(const int index);
+
+	private:
+		struct Shard
+		{
+			unsigned long m_buckets[METRIC_HIST_BUCKETS];
+			unsigned long m_sum;
+		} __attribute__((aligned(64)));
+
+		Shard m_shards[METRIC_HIST_SHARDS];
+};
+
+/*
+ * 注册指标，同名同标签的指标只创建一次，返回的指针在程序运行期间一直有效
+ * name   指标名，按Prometheus的命名规则，例如moserver_tcp_read_bytes_total
+ * help   说明文字
+ * labels 标签，例如 side="client"，可以为0
+ * scale  直方图导出时数值要乘的系数，例如纳秒转为秒为1e-9
+ * */
+MetricCounter *NewMetricCounter(const char *name, const char *help, const char *labels = 0);
+
+MetricGauge *NewMetricGauge(const char *name, const char *help, const char *labels = 0);
+
+MetricHistogram *NewMetricHistogram(const char *name, const char *help, const char *labels = 0, const double scale = 1e-9);
+
+/*
+ * 把所有指标按Prometheus文本格式输出到out中
+ * */
+void MetricsDump(string &out);
+
+/*
+ * 把所有指标写到文件，先写临时文件再改名，读取方不会看到写了一半的文件
+ * */
+bool MetricsWriteFile(const char *filename);
+
+/*
+ * 启动管理端口线程，每个连接上来的客户端都会收到一份指标快照
+ * path 以'/'开头时为unix域套接字的路径，否则为本机127.0.0.1上的TCP端口号
+ * 请求以"GET "开头时按HTTP应答，可以直接给Prometheus或curl使用
+ * */
+bool MetricsStartAdmin(const char *path);
+
+void MetricsStopAdmin();
+
+/*
+ * 返回当前时间，单位为纳秒，用于计算延迟
+ * */
+static inline unsigned long MetricNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#endif
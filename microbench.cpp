@@ -0,0 +1,317 @@
+#include "public.h"
+#include "microbench.h"
+#include "utils.h"
+
+static double NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+MicroBenchRunner::MicroBenchRunner()
+{
+	m_runs = 15;
+	m_min_run_ms = 20;
+	m_warmup_ms = 50;
+	m_threshold = 0.05;
+}
+
+/**
+ * @brief 添加用例
+ * @param name 用例名，不能包含空格
+ * @param func 被测函数
+ * @param arg 传给被测函数的参数
+ */
+void MicroBenchRunner::Add(const char *name, MicroBenchFunc func, void *arg)
+{
+	Case c;
+	c.m_name = name;
+	c.m_func = func;
+	c.m_arg = arg;
+	m_cases.push_back(c);
+}
+
+/**
+ * @brief 执行一个用例
+ * @details 先预热并按指数增长的次数试跑，确定每轮的次数，再执行m_runs轮
+ */
+MicroBenchResult MicroBenchRunner::RunCase(const Case &c)
+{
+	MicroBenchResult result;
+	memset(&result, 0, sizeof(result));
+	StrCopy(result.m_name, sizeof(result.m_name), c.m_name);
+
+	// 预热，同时找到每轮的执行次数
+	long iters = 1;
+	double warmup_start = NowNs();
+	while (true)
+	{
+		double start = NowNs();
+		c.m_func(iters, c.m_arg);
+		double elapsed = NowNs() - start;
+
+		if (elapsed >= m_min_run_ms * 1e6 && NowNs() - warmup_start >= m_warmup_ms * 1e6)
+		{
+			break;
+		}
+
+		if (elapsed < m_min_run_ms * 1e6)
+		{
+			iters = elapsed < 1e3 ? iters * 10 : (long)(iters * (m_min_run_ms * 1e6 * 1.2 / elapsed)) + 1;
+		}
+	}
+
+	vector<double> samples;
+	for (int i = 0; i < m_runs; i++)
+	{
+		double start = NowNs();
+		c.m_func(iters, c.m_arg);
+		samples.push_back((NowNs() - start) / iters);
+	}
+
+	sort(samples.begin(), samples.end());
+
+	double sum = 0;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		sum += samples[i];
+	}
+	double mean = sum / samples.size();
+
+	double var = 0;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		var += (samples[i] - mean) * (samples[i] - mean);
+	}
+
+	result.m_iters = iters;
+	result.m_runs = m_runs;
+	result.m_min = samples.front();
+	result.m_max = samples.back();
+	result.m_mean = mean;
+	result.m_median = samples[samples.size() / 2];
+	result.m_stddev = samples.size() > 1 ? sqrt(var / (samples.size() - 1)) : 0;
+
+	return result;
+}
+
+/**
+ * @brief 执行用例
+ * @param filter 只执行名字中包含filter的用例，为0时执行全部
+ */
+void MicroBenchRunner::Run(const char *filter)
+{
+	for (size_t i = 0; i < m_cases.size(); i++)
+	{
+		if (filter != 0 && strstr(m_cases[i].m_name, filter) == 0)
+		{
+			continue;
+		}
+
+		m_results.push_back(RunCase(m_cases[i]));
+	}
+}
+
+/**
+ * @brief 读取基线文件
+ */
+static bool LoadBaseline(const char *filename, vector<pair<string, pair<double, double> > > &baseline)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), fp) != 0)
+	{
+		char name[128];
+		double median = 0;
+		double stddev = 0;
+		if (line[0] == '#' || sscanf(line, "%127s %lf %lf", name, &median, &stddev) < 2)
+		{
+			continue;
+		}
+		baseline.push_back(make_pair(string(name), make_pair(median, stddev)));
+	}
+	fclose(fp);
+
+	return true;
+}
+
+/**
+ * @brief 输出结果表格
+ * @details 和基线比较时，中位数的变化超过m_threshold并且超过两者标准差之和时才判为变快或变慢
+ * @param out 输出文件
+ * @param baseline 基线文件名，可以为0
+ * @return 比基线慢的用例个数
+ */
+int MicroBenchRunner::Print(FILE *out, const char *baseline)
+{
+	vector<pair<string, pair<double, double> > > base;
+	if (baseline != 0 && LoadBaseline(baseline, base) == false)
+	{
+		fprintf(stderr, "cannot read baseline %s\n", baseline);
+	}
+
+	fprintf(out, "%-32s %12s %12s %12s %10s %12s", "benchmark", "min ns/op", "median", "mean", "stddev", "iters x runs");
+	if (base.empty() == false)
+	{
+		fprintf(out, " %12s %9s", "baseline", "delta");
+	}
+	fprintf(out, "\n");
+
+	int islower = 0;
+	for (size_t i = 0; i < m_results.size(); i++)
+	{
+		const MicroBenchResult &r = m_results[i];
+		char iters[32];
+		snprintf(iters, sizeof(iters), "%ldx%d", r.m_iters, r.m_runs);
+		fprintf(out, "%-32s %12.2f %12.2f %12.2f %10.2f %12s", r.m_name, r.m_min, r.m_median, r.m_mean, r.m_stddev, iters);
+
+		for (size_t j = 0; j < base.size(); j++)
+		{
+			if (base[j].first != r.m_name || base[j].second.first <= 0)
+			{
+				continue;
+			}
+
+			double old_median = base[j].second.first;
+			double delta = (r.m_median - old_median) / old_median;
+			double noise = r.m_stddev + base[j].second.second;
+			const char *verdict = "";
+			if (fabs(delta) > m_threshold && fabs(r.m_median - old_median) > noise)
+			{
+				verdict = delta > 0 ? " SLOWER" : " faster";
+				if (delta > 0)
+				{
+					islower++;
+				}
+			}
+			fprintf(out, " %12.2f %+8.1f%%%s", old_median, delta * 100, verdict);
+			break;
+		}
+		fprintf(out, "\n");
+	}
+
+	return islower;
+}
+
+/**
+ * @brief 把结果写为JSON文件
+ * @param filename 文件名
+ * @return 成功返回true，失败返回false
+ */
+bool MicroBenchRunner::WriteJSON(const char *filename)
+{
+	FILE *fp = FOpen(filename, "w");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	fprintf(fp, "{\n  \"benchmark\": \"micro\",\n  \"results\": [\n");
+	for (size_t i = 0; i < m_results.size(); i++)
+	{
+		const MicroBenchResult &r = m_results[i];
+		fprintf(fp, "    {\"name\": \"%s\", \"iters\": %ld, \"runs\": %d, \"min_ns\": %.3f, \"median_ns\": %.3f, "
+				"\"mean_ns\": %.3f, \"stddev_ns\": %.3f, \"max_ns\": %.3f}%s\n",
+				r.m_name, r.m_iters, r.m_runs, r.m_min, r.m_median, r.m_mean, r.m_stddev, r.m_max,
+				i + 1 < m_results.size() ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+
+	return fclose(fp) == 0;
+}
+
+/**
+ * @brief 保存基线文件
+ * @param filename 文件名
+ * @return 成功返回true，失败返回false
+ */
+bool MicroBenchRunner::SaveBaseline(const char *filename)
+{
+	FILE *fp = FOpen(filename, "w");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	fprintf(fp, "# name median_ns stddev_ns\n");
+	for (size_t i = 0; i < m_results.size(); i++)
+	{
+		fprintf(fp, "%s %.3f %.3f\n", m_results[i].m_name, m_results[i].m_median, m_results[i].m_stddev);
+	}
+
+	return fclose(fp) == 0;
+}
+
+/**
+ * @brief 解析命令行参数并执行
+ * @return 进程退出码
+ */
+int MicroBenchMain(MicroBenchRunner &runner, int argc, char *argv[])
+{
+	const char *filter = 0;
+	const char *save = 0;
+	const char *compare = 0;
+	const char *json = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			fprintf(stderr, "usage: %s [--filter name] [--runs n] [--min-ms n] [--save file] [--compare file] [--json file]\n", argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--filter") == 0)
+		{
+			filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--runs") == 0)
+		{
+			runner.m_runs = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+		}
+		else if (strcmp(argv[i], "--min-ms") == 0)
+		{
+			runner.m_min_run_ms = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--save") == 0)
+		{
+			save = argv[++i];
+		}
+		else if (strcmp(argv[i], "--compare") == 0)
+		{
+			compare = argv[++i];
+		}
+		else if (strcmp(argv[i], "--json") == 0)
+		{
+			json = argv[++i];
+		}
+		else
+		{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	runner.Run(filter);
+	int islower = runner.Print(stdout, compare);
+
+	if (save != 0 && runner.SaveBaseline(save) == false)
+	{
+		fprintf(stderr, "cannot write baseline %s\n", save);
+		return 1;
+	}
+
+	if (json != 0 && runner.WriteJSON(json) == false)
+	{
+		fprintf(stderr, "cannot write %s\n", json);
+		return 1;
+	}
+
+	return islower > 0 ? 2 : 0;
+}
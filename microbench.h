@@ -0,0 +1,97 @@
+#ifndef __MICROBENCH_H__
+#define __MICROBENCH_H__
+#include "public.h"
+
+/*
+ * 阻止编译器把被测代码的结果优化掉
+ * */
+template <class T>
+static inline void DoNotOptimize(const T &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static inline void ClobberMemory()
+{
+	asm volatile("" : : : "memory");
+}
+
+/*
+ * 被测函数，执行iters次被测操作
+ * */
+typedef void (*MicroBenchFunc)(long iters, void *arg);
+
+/**
+ * @brief 一个测试用例的统计结果，单位为纳秒每次操作
+ */
+struct MicroBenchResult
+{
+	char   m_name[64];
+	long   m_iters;      // 每轮的执行次数
+	int    m_runs;       // 轮数
+	double m_min;
+	double m_median;
+	double m_mean;
+	double m_stddev;
+	double m_max;
+};
+
+/**
+ * @brief 微基准测试框架
+ *
+ * 每个用例先预热，再自动确定每轮的执行次数使一轮不少于m_min_run_ms毫秒，
+ * 然后执行m_runs轮，输出每次操作耗时的最小值、中位数、平均值、标准差和最大值。
+ * 结果可以保存为基线文件，之后的运行可以和基线比较。
+ */
+class MicroBenchRunner
+{
+	public:
+		int    m_runs;          // 每个用例执行的轮数
+		double m_min_run_ms;    // 每轮的最短时间，单位为毫秒
+		double m_warmup_ms;     // 预热时间，单位为毫秒
+		double m_threshold;     // 和基线比较时，中位数变化超过该比例视为有变化，例如0.05
+		vector<MicroBenchResult> m_results;
+
+		MicroBenchRunner();
+
+		void Add(const char *name, MicroBenchFunc func, void *arg = 0);
+
+		/*
+		 * 执行名字中包含filter的用例，filter为0时执行全部用例
+		 * */
+		void Run(const char *filter = 0);
+
+		/*
+		 * 按表格输出结果，baseline不为0时同时输出和基线的比较
+		 * 返回值为比基线慢的用例个数
+		 * */
+		int Print(FILE *out, const char *baseline = 0);
+
+		bool WriteJSON(const char *filename);
+
+		/*
+		 * 保存基线，每行为 用例名 中位数 标准差
+		 * */
+		bool SaveBaseline(const char *filename);
+
+	private:
+		struct Case
+		{
+			const char    *m_name;
+			MicroBenchFunc m_func;
+			void          *m_arg;
+		};
+
+		vector<Case> m_cases;
+
+		MicroBenchResult RunCase(const Case &c);
+};
+
+/*
+ * 解析常用的命令行参数并执行，供各个基准测试程序的main使用：
+ *   --filter 名字  --runs n  --min-ms n  --save 基线文件  --compare 基线文件  --json 文件
+ * 返回值为进程退出码，有用例比基线慢时返回2
+ * */
+int MicroBenchMain(MicroBenchRunner &runner, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,829 @@
+/*
+ * 网络损伤代理，在本机模拟广域网的延迟、抖动、带宽限制、报文分片和连接重置，
+ * 用来在一台机器上调超时和批量参数。代理接在TCPClient和TCPServer之间，不解析报文，
+ * 对普通报文、扩展报文和TLS连接都透明
+ *
+ * 用法：
+ *   netproxy --listen 6005 --upstream 127.0.0.1:5005 [损伤选项] [其他选项]
+ *   bench_tcp client --port 6005 ...
+ *
+ * 损伤选项，同时作用于两个方向，加上up-前缀只作用于客户端到服务端，down-前缀只作用于服务端到客户端，
+ * 例如--down-rate 10m：
+ *   --latency-ms 0        单向延迟，单位为毫秒，可以是小数
+ *   --jitter-ms 0         延迟在正负jitter-ms之间均匀分布，不会让数据乱序
+ *   --rate 0              带宽，单位为比特每秒，可以带k、m、g后缀，0为不限制
+ *   --frag 0              把数据拆成1到frag字节的随机小片分别发送，小于4时报文的长度头也会被拆开，
+ *                         0为不拆分
+ *   --frag-gap-us 100     两个小片之间的间隔，单位为微秒，保证接收方分多次读到
+ *   --reset-pct 0         每转发一块数据，按这个百分比的概率向两端发RST断开连接
+ *
+ * 其他选项：
+ *   --profile name        两端socket的选项：default、low_latency、bulk_throughput，总是设置TCP_NODELAY
+ *   --script file         按时间修改损伤选项的脚本，见下文
+ *   --duration 0          运行多少秒后退出，0为一直运行，直到收到SIGINT或者SIGTERM
+ *   --stats-interval 0    每隔多少秒输出一行JSON统计，0为只在退出时输出
+ *   --output file         把JSON统计写到文件，缺省输出到标准输出
+ *
+ * 脚本每行为"秒 选项 值"，从代理启动开始计时，选项和命令行的损伤选项相同但不带--，
+ * #开头的行为注释。例如先正常运行5秒，再加50毫秒延迟，10秒时把下行限速到1Mbit/s：
+ *   5  latency-ms 50
+ *   10 down-rate  1m
+ *   15 latency-ms 0
+ *
+ * 数据按读到的块转发，每块的发送时间为 max(到达时间, 上一块占满带宽的结束时间) + 传输时间 + 延迟，
+ * 并且不早于上一块的发送时间。每个方向最多缓存PROXY_MAX_QUEUED字节，超过时停止读取，
+ * 发送方的滑动窗口因此受到限制，和真实链路上的带宽时延积一样。
+ * 一端发FIN时转发给另一端，另一端继续可以发送；一端发RST时向另一端也发RST。
+ *
+ * 统计包括总连接数、当前连接数、每个方向转发的字节数、拆出的小片数和重置次数，
+ * --listen为0时自动选择端口，实际端口输出到标准错误，供脚本读取。
+ * */
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+
+#define PROXY_MAX_QUEUED (4 * 1024 * 1024)
+#define PROXY_MAX_CHUNK  65536
+
+enum
+{
+	PROXY_UP   = 0,   // 客户端到服务端
+	PROXY_DOWN = 1    // 服务端到客户端
+};
+
+/*
+ * 一个方向的损伤参数
+ * */
+struct ImpairConfig
+{
+	long   m_latency_ns;
+	long   m_jitter_ns;
+	long   m_rate;          // 字节每秒，0为不限制
+	int    m_frag;
+	int    m_frag_gap_us;
+	double m_reset_pct;
+};
+
+struct ProxyStats
+{
+	unsigned long m_conns;
+	long          m_active;
+	unsigned long m_upstream_errors;   // 连接服务端失败的次数
+	unsigned long m_bytes[2];
+	unsigned long m_chunks[2];
+	unsigned long m_frags[2];
+	unsigned long m_resets;            // 注入的重置次数
+	unsigned long m_peer_resets;       // 某一端发来RST，转发给另一端的次数
+};
+
+static ImpairConfig    g_config[2];
+static pthread_mutex_t g_config_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProxyStats      g_stats;
+
+struct ProxyChunk
+{
+	char         *m_data;
+	int           m_len;
+	unsigned long m_due;     // 发送时间（MetricNow）
+};
+
+struct ProxyConn;
+
+/*
+ * 一个方向，读线程从m_src读到队列，写线程按发送时间写到m_dst
+ * */
+struct ProxyPipe
+{
+	ProxyConn        *m_conn;
+	int               m_dir;
+	int               m_src;
+	int               m_dst;
+	pthread_mutex_t   m_lock;
+	pthread_cond_t    m_cond;        // 队列有变化或者连接关闭
+	deque<ProxyChunk> m_queue;
+	long              m_queued;      // 队列中的字节数
+	bool              m_beof;        // m_src已经读到FIN，队列发完后向m_dst发FIN
+	unsigned long     m_link_free;   // 带宽限制下链路空闲的时间
+	unsigned long     m_last_due;
+	unsigned int      m_seed;
+};
+
+struct ProxyConn
+{
+	TCPServer *m_server;
+	int        m_clientfd;
+	TCPClient  m_upstream;
+	ProxyPipe  m_pipes[2];
+	bool       m_bclosing;
+	int        m_refs;          // 还在运行的线程数，最后一个线程关闭连接
+};
+
+struct ProxyOptions
+{
+	int    m_listen;
+	char   m_host[64];
+	int    m_port;
+	char   m_profile_name[32];
+	char   m_script[256];
+	double m_duration;
+	double m_stats_interval;
+	char   m_output[256];
+};
+
+static ImpairConfig GetConfig(const int dir)
+{
+	pthread_mutex_lock(&g_config_lock);
+	ImpairConfig config = g_config[dir];
+	pthread_mutex_unlock(&g_config_lock);
+	return config;
+}
+
+/*
+ * 解析带k、m、g后缀的比特率，返回字节每秒
+ * */
+static long ParseRate(const char *value)
+{
+	char *end = 0;
+	double rate = strtod(value, &end);
+	switch (end != 0 ? tolower(*end) : 0)
+	{
+		case 'k': rate *= 1e3; break;
+		case 'm': rate *= 1e6; break;
+		case 'g': rate *= 1e9; break;
+		default: break;
+	}
+	return (long)(rate / 8);
+}
+
+/*
+ * 设置一个损伤选项，命令行和脚本共用
+ * name 不带--的选项名，可以带up-或者down-前缀
+ * 返回值 选项名不认识时返回false
+ * */
+static bool SetImpair(const char *name, const char *value)
+{
+	int first = PROXY_UP;
+	int last = PROXY_DOWN;
+	if (strncmp(name, "up-", 3) == 0)
+	{
+		last = PROXY_UP;
+		name += 3;
+	}
+	else if (strncmp(name, "down-", 5) == 0)
+	{
+		first = PROXY_DOWN;
+		name += 5;
+	}
+
+	bool bok = true;
+	pthread_mutex_lock(&g_config_lock);
+	for (int dir = first; dir <= last; dir++)
+	{
+		ImpairConfig &config = g_config[dir];
+		if (strcmp(name, "latency-ms") == 0)
+		{
+			config.m_latency_ns = (long)(atof(value) * 1e6);
+		}
+		else if (strcmp(name, "jitter-ms") == 0)
+		{
+			config.m_jitter_ns = (long)(atof(value) * 1e6);
+		}
+		else if (strcmp(name, "rate") == 0)
+		{
+			config.m_rate = ParseRate(value);
+		}
+		else if (strcmp(name, "frag") == 0)
+		{
+			config.m_frag = atoi(value);
+		}
+		else if (strcmp(name, "frag-gap-us") == 0)
+		{
+			config.m_frag_gap_us = atoi(value);
+		}
+		else if (strcmp(name, "reset-pct") == 0)
+		{
+			config.m_reset_pct = atof(value);
+		}
+		else
+		{
+			bok = false;
+		}
+	}
+	pthread_mutex_unlock(&g_config_lock);
+
+	return bok;
+}
+
+/*
+ * 关闭连接，唤醒所有线程，最后一个线程退出时才真正关闭socket，避免文件句柄被重用
+ * breset 为true时两端都发RST
+ * */
+static void Abort(ProxyConn *conn, const bool breset)
+{
+	if (__atomic_exchange_n(&conn->m_bclosing, true, __ATOMIC_ACQ_REL) == true)
+	{
+		return;
+	}
+
+	int fds[2] = {conn->m_clientfd, conn->m_upstream.m_connfd};
+	for (int i = 0; i < 2; i++)
+	{
+		if (breset == true)
+		{
+			// SO_LINGER为0时close发RST而不是FIN
+			struct linger lg = {1, 0};
+			setsockopt(fds[i], SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		}
+		// 只关闭读的一端，阻塞在recv中的读线程返回0，不向对端发任何东西
+		shutdown(fds[i], SHUT_RD);
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		ProxyPipe &pipe = conn->m_pipes[i];
+		pthread_mutex_lock(&pipe.m_lock);
+		pthread_cond_broadcast(&pipe.m_cond);
+		pthread_mutex_unlock(&pipe.m_lock);
+	}
+}
+
+static bool Closing(ProxyConn *conn)
+{
+	return __atomic_load_n(&conn->m_bclosing, __ATOMIC_ACQUIRE);
+}
+
+static void Release(ProxyConn *conn)
+{
+	if (__atomic_sub_fetch(&conn->m_refs, 1, __ATOMIC_ACQ_REL) > 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		ProxyPipe &pipe = conn->m_pipes[i];
+		for (ProxyChunk &chunk : pipe.m_queue)
+		{
+			delete[] chunk.m_data;
+		}
+		pthread_mutex_destroy(&pipe.m_lock);
+		pthread_cond_destroy(&pipe.m_cond);
+	}
+	conn->m_server->CloseClientSocket(conn->m_clientfd);
+	conn->m_upstream.Close();
+	__atomic_sub_fetch(&g_stats.m_active, 1, __ATOMIC_RELAXED);
+	delete conn;
+}
+
+/*
+ * 写完len字节，socket设置了SO_SNDTIMEO，对端不读时定期检查连接是否已经关闭
+ * */
+static bool SendAll(ProxyConn *conn, const int fd, const char *data, int len)
+{
+	while (len > 0)
+	{
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			data += n;
+			len -= n;
+			continue;
+		}
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) && Closing(conn) == false)
+		{
+			continue;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * 按配置拆成随机大小的小片发送
+ * */
+static bool SendChunk(ProxyPipe *pipe, const ProxyChunk &chunk)
+{
+	ImpairConfig config = GetConfig(pipe->m_dir);
+	if (config.m_frag <= 0)
+	{
+		return SendAll(pipe->m_conn, pipe->m_dst, chunk.m_data, chunk.m_len);
+	}
+
+	int off = 0;
+	while (off < chunk.m_len)
+	{
+		int len = min(1 + (int)(rand_r(&pipe->m_seed) % config.m_frag), chunk.m_len - off);
+		if (SendAll(pipe->m_conn, pipe->m_dst, chunk.m_data + off, len) == false)
+		{
+			return false;
+		}
+		off += len;
+		__atomic_add_fetch(&g_stats.m_frags[pipe->m_dir], 1, __ATOMIC_RELAXED);
+
+		if (off < chunk.m_len && config.m_frag_gap_us > 0)
+		{
+			usleep(config.m_frag_gap_us);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * 计算一块数据的发送时间，调用者持有pipe->m_lock
+ * */
+static unsigned long Schedule(ProxyPipe *pipe, const ImpairConfig &config, const int len, const unsigned long now)
+{
+	unsigned long start = max(now, pipe->m_link_free);
+	pipe->m_link_free = config.m_rate > 0 ? start + (unsigned long)len * 1000000000UL / config.m_rate : start;
+
+	long delay = config.m_latency_ns;
+	if (config.m_jitter_ns > 0)
+	{
+		delay += (long)((rand_r(&pipe->m_seed) / (RAND_MAX + 1.0) * 2 - 1) * config.m_jitter_ns);
+	}
+
+	unsigned long due = pipe->m_link_free + max(delay, 0L);
+	// TCP是字节流，抖动不能让后读到的数据先发出去
+	due = max(due, pipe->m_last_due);
+	pipe->m_last_due = due;
+	return due;
+}
+
+static void *PipeReaderThread(void *arg)
+{
+	ProxyPipe *pipe = (ProxyPipe *)arg;
+	ProxyConn *conn = pipe->m_conn;
+	char *buffer = new char[PROXY_MAX_CHUNK];
+
+	while (Closing(conn) == false)
+	{
+		ImpairConfig config = GetConfig(pipe->m_dir);
+		// 限速时每次少读一些，一块数据的传输时间不超过10毫秒，发送不会一阵一阵的
+		int size = PROXY_MAX_CHUNK;
+		if (config.m_rate > 0)
+		{
+			size = (int)min((long)PROXY_MAX_CHUNK, max(config.m_rate / 100, 512L));
+		}
+
+		ssize_t n = recv(pipe->m_src, buffer, size, 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			if (n == 0 && Closing(conn) == false)
+			{
+				pthread_mutex_lock(&pipe->m_lock);
+				pipe->m_beof = true;
+				pthread_cond_broadcast(&pipe->m_cond);
+				pthread_mutex_unlock(&pipe->m_lock);
+			}
+			else if (n < 0)
+			{
+				if (errno == ECONNRESET)
+				{
+					__atomic_add_fetch(&g_stats.m_peer_resets, 1, __ATOMIC_RELAXED);
+				}
+				Abort(conn, errno == ECONNRESET);
+			}
+			break;
+		}
+
+		if (config.m_reset_pct > 0 && rand_r(&pipe->m_seed) / (RAND_MAX + 1.0) * 100 < config.m_reset_pct)
+		{
+			__atomic_add_fetch(&g_stats.m_resets, 1, __ATOMIC_RELAXED);
+			Abort(conn, true);
+			break;
+		}
+
+		ProxyChunk chunk;
+		chunk.m_data = new char[n];
+		chunk.m_len = n;
+		memcpy(chunk.m_data, buffer, n);
+
+		pthread_mutex_lock(&pipe->m_lock);
+		while (pipe->m_queued >= PROXY_MAX_QUEUED && Closing(conn) == false)
+		{
+			pthread_cond_wait(&pipe->m_cond, &pipe->m_lock);
+		}
+		chunk.m_due = Schedule(pipe, config, n, MetricNow());
+		pipe->m_queue.push_back(chunk);
+		pipe->m_queued += n;
+		pthread_cond_broadcast(&pipe->m_cond);
+		pthread_mutex_unlock(&pipe->m_lock);
+
+		__atomic_add_fetch(&g_stats.m_bytes[pipe->m_dir], n, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&g_stats.m_chunks[pipe->m_dir], 1, __ATOMIC_RELAXED);
+	}
+
+	delete[] buffer;
+	Release(conn);
+	return 0;
+}
+
+static void *PipeWriterThread(void *arg)
+{
+	ProxyPipe *pipe = (ProxyPipe *)arg;
+	ProxyConn *conn = pipe->m_conn;
+
+	pthread_mutex_lock(&pipe->m_lock);
+	while (Closing(conn) == false)
+	{
+		if (pipe->m_queue.empty() == true)
+		{
+			if (pipe->m_beof == true)
+			{
+				pthread_mutex_unlock(&pipe->m_lock);
+				shutdown(pipe->m_dst, SHUT_WR);
+				Release(conn);
+				return 0;
+			}
+			pthread_cond_wait(&pipe->m_cond, &pipe->m_lock);
+			continue;
+		}
+
+		ProxyChunk chunk = pipe->m_queue.front();
+		unsigned long now = MetricNow();
+		if (chunk.m_due > now)
+		{
+			struct timespec ts;
+			ts.tv_sec = chunk.m_due / 1000000000UL;
+			ts.tv_nsec = chunk.m_due % 1000000000UL;
+			pthread_cond_timedwait(&pipe->m_cond, &pipe->m_lock, &ts);
+			continue;
+		}
+
+		pipe->m_queue.pop_front();
+		pipe->m_queued -= chunk.m_len;
+		pthread_cond_broadcast(&pipe->m_cond);
+		pthread_mutex_unlock(&pipe->m_lock);
+
+		bool bok = SendChunk(pipe, chunk);
+		bool breset = bok == false && errno == ECONNRESET;
+		delete[] chunk.m_data;
+		if (bok == false)
+		{
+			Abort(conn, breset);
+		}
+
+		pthread_mutex_lock(&pipe->m_lock);
+	}
+	pthread_mutex_unlock(&pipe->m_lock);
+
+	Release(conn);
+	return 0;
+}
+
+/*
+ * 连接服务端，为两个方向各启动一个读线程和一个写线程
+ * */
+static void StartConn(TCPServer *server, const int clientfd, const ProxyOptions &opts, const SocketProfile &profile)
+{
+	ProxyConn *conn = new ProxyConn;
+	conn->m_server = server;
+	conn->m_clientfd = clientfd;
+	conn->m_upstream.m_profile = profile;
+	conn->m_bclosing = false;
+	conn->m_refs = 4;
+
+	__atomic_add_fetch(&g_stats.m_conns, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_stats.m_active, 1, __ATOMIC_RELAXED);
+	if (conn->m_upstream.NewTCPClient(opts.m_host, opts.m_port) == false)
+	{
+		__atomic_add_fetch(&g_stats.m_upstream_errors, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&g_stats.m_active, 1, __ATOMIC_RELAXED);
+		server->CloseClientSocket(clientfd);
+		delete conn;
+		return;
+	}
+
+	// 小片要分别发出去，两端都关掉Nagle；发送超时用来定期检查连接是否已经关闭
+	int fds[2] = {clientfd, conn->m_upstream.m_connfd};
+	for (int i = 0; i < 2; i++)
+	{
+		int sock_opt = 1;
+		setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &sock_opt, sizeof(sock_opt));
+		struct timeval tv = {0, 200000};
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (int dir = PROXY_UP; dir <= PROXY_DOWN; dir++)
+	{
+		ProxyPipe &pipe = conn->m_pipes[dir];
+		pipe.m_conn = conn;
+		pipe.m_dir = dir;
+		pipe.m_src = dir == PROXY_UP ? clientfd : conn->m_upstream.m_connfd;
+		pipe.m_dst = dir == PROXY_UP ? conn->m_upstream.m_connfd : clientfd;
+		pthread_mutex_init(&pipe.m_lock, 0);
+		pthread_cond_init(&pipe.m_cond, &attr);
+		pipe.m_queued = 0;
+		pipe.m_beof = false;
+		pipe.m_link_free = 0;
+		pipe.m_last_due = 0;
+		pipe.m_seed = (unsigned int)MetricNow() ^ (clientfd << 8) ^ dir;
+	}
+	pthread_condattr_destroy(&attr);
+
+	for (int dir = PROXY_UP; dir <= PROXY_DOWN; dir++)
+	{
+		void *(*routines[2])(void *) = {PipeReaderThread, PipeWriterThread};
+		for (int i = 0; i < 2; i++)
+		{
+			pthread_t tid;
+			if (pthread_create(&tid, 0, routines[i], &conn->m_pipes[dir]) != 0)
+			{
+				// 没有启动的线程也要释放自己的引用
+				Abort(conn, false);
+				Release(conn);
+				continue;
+			}
+			pthread_detach(tid);
+		}
+	}
+}
+
+struct AcceptArg
+{
+	TCPServer          *m_server;
+	const ProxyOptions *m_opts;
+	SocketProfile       m_profile;
+};
+
+static void *AcceptThread(void *arg)
+{
+	AcceptArg *parg = (AcceptArg *)arg;
+
+	while (parg->m_server->Accept() == true)
+	{
+		int clientfd = parg->m_server->m_clientfd;
+		parg->m_server->m_clientfd = -1;
+		StartConn(parg->m_server, clientfd, *parg->m_opts, parg->m_profile);
+	}
+
+	return 0;
+}
+
+struct ScriptStep
+{
+	double m_at;
+	char   m_name[32];
+	char   m_value[32];
+};
+
+static bool LoadScript(const char *path, vector<ScriptStep> &steps)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == 0)
+	{
+		fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), fp) != 0)
+	{
+		lineno++;
+		const char *p = line;
+		while (isspace(*p))
+		{
+			p++;
+		}
+		if (*p == 0 || *p == '#')
+		{
+			continue;
+		}
+
+		ScriptStep step;
+		if (sscanf(p, "%lf %31s %31s", &step.m_at, step.m_name, step.m_value) != 3)
+		{
+			fprintf(stderr, "%s:%d: expected \"seconds option value\"\n", path, lineno);
+			fclose(fp);
+			return false;
+		}
+		steps.push_back(step);
+	}
+	fclose(fp);
+
+	stable_sort(steps.begin(), steps.end(), [](const ScriptStep &a, const ScriptStep &b) { return a.m_at < b.m_at; });
+	return true;
+}
+
+static void PrintStats(FILE *out, const double elapsed)
+{
+	ImpairConfig up = GetConfig(PROXY_UP);
+	ImpairConfig down = GetConfig(PROXY_DOWN);
+	fprintf(out, "{\"elapsed\": %.1f, \"conns\": %lu, \"active\": %ld, \"upstream_errors\": %lu, "
+			"\"up_bytes\": %lu, \"down_bytes\": %lu, \"up_chunks\": %lu, \"down_chunks\": %lu, "
+			"\"up_frags\": %lu, \"down_frags\": %lu, \"resets\": %lu, \"peer_resets\": %lu, "
+			"\"up_latency_ms\": %.3f, \"down_latency_ms\": %.3f, \"up_rate\": %ld, \"down_rate\": %ld}\n",
+			elapsed,
+			__atomic_load_n(&g_stats.m_conns, __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_active, __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_upstream_errors, __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_bytes[PROXY_UP], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_bytes[PROXY_DOWN], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_chunks[PROXY_UP], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_chunks[PROXY_DOWN], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_frags[PROXY_UP], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_frags[PROXY_DOWN], __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_resets, __ATOMIC_RELAXED),
+			__atomic_load_n(&g_stats.m_peer_resets, __ATOMIC_RELAXED),
+			up.m_latency_ns / 1e6, down.m_latency_ns / 1e6, up.m_rate * 8, down.m_rate * 8);
+	fflush(out);
+}
+
+static void Usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s --listen port --upstream host:port [--[up-|down-]latency-ms ms] "
+			"[--[up-|down-]jitter-ms ms] [--[up-|down-]rate bits] [--[up-|down-]frag bytes] "
+			"[--[up-|down-]frag-gap-us us] [--[up-|down-]reset-pct pct] [--profile name] [--script file] "
+			"[--duration sec] [--stats-interval sec] [--output file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	ProxyOptions opts;
+	opts.m_listen = -1;
+	opts.m_host[0] = 0;
+	opts.m_port = 0;
+	opts.m_profile_name[0] = 0;
+	opts.m_script[0] = 0;
+	opts.m_duration = 0;
+	opts.m_stats_interval = 0;
+	opts.m_output[0] = 0;
+
+	memset(g_config, 0, sizeof(g_config));
+	g_config[PROXY_UP].m_frag_gap_us = 100;
+	g_config[PROXY_DOWN].m_frag_gap_us = 100;
+	memset(&g_stats, 0, sizeof(g_stats));
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc || strncmp(argv[i], "--", 2) != 0)
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--listen") == 0)
+		{
+			opts.m_listen = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--upstream") == 0)
+		{
+			const char *value = argv[++i];
+			const char *colon = strrchr(value, ':');
+			if (colon == 0 || colon - value >= (long)sizeof(opts.m_host))
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+			snprintf(opts.m_host, sizeof(opts.m_host), "%.*s", (int)(colon - value), value);
+			opts.m_port = atoi(colon + 1);
+		}
+		else if (strcmp(argv[i], "--profile") == 0)
+		{
+			snprintf(opts.m_profile_name, sizeof(opts.m_profile_name), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--script") == 0)
+		{
+			snprintf(opts.m_script, sizeof(opts.m_script), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--duration") == 0)
+		{
+			opts.m_duration = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--stats-interval") == 0)
+		{
+			opts.m_stats_interval = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0)
+		{
+			snprintf(opts.m_output, sizeof(opts.m_output), "%s", argv[++i]);
+		}
+		else if (SetImpair(argv[i] + 2, argv[i + 1]) == true)
+		{
+			i++;
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.m_listen < 0 || opts.m_host[0] == 0 || opts.m_port <= 0)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+
+	SocketProfile profile;
+	if (opts.m_profile_name[0] != 0 && SocketProfile::ByName(opts.m_profile_name, &profile) == false)
+	{
+		fprintf(stderr, "unknown profile: %s\n", opts.m_profile_name);
+		return 1;
+	}
+
+	vector<ScriptStep> steps;
+	if (opts.m_script[0] != 0 && LoadScript(opts.m_script, steps) == false)
+	{
+		return 1;
+	}
+
+	FILE *out = stdout;
+	if (opts.m_output[0] != 0)
+	{
+		out = fopen(opts.m_output, "w");
+		if (out == 0)
+		{
+			fprintf(stderr, "open %s failed: %s\n", opts.m_output, strerror(errno));
+			return 1;
+		}
+	}
+
+	// 信号在所有线程中屏蔽，由主线程用sigtimedwait等待，必须在创建任何线程之前设置
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	TCPServer server;
+	server.m_profile = profile;
+	if (server.NewServer(opts.m_listen) == false)
+	{
+		fprintf(stderr, "listen on %d failed: %s\n", opts.m_listen, strerror(errno));
+		return 1;
+	}
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	getsockname(server.m_listenfd, (struct sockaddr *)&addr, &addrlen);
+	fprintf(stderr, "netproxy listening on %d, upstream %s:%d\n", ntohs(addr.sin_port), opts.m_host, opts.m_port);
+
+	AcceptArg accept_arg;
+	accept_arg.m_server = &server;
+	accept_arg.m_opts = &opts;
+	accept_arg.m_profile = profile;
+	pthread_t accept_tid;
+	pthread_create(&accept_tid, 0, AcceptThread, &accept_arg);
+	pthread_detach(accept_tid);
+
+	// 主线程按时间执行脚本、输出统计，直到超过--duration或者收到信号
+	unsigned long start = MetricNow();
+	double next_stats = opts.m_stats_interval;
+	size_t next_step = 0;
+	bool bprinted = false;
+	while (true)
+	{
+		bprinted = false;
+		double elapsed = (MetricNow() - start) / 1e9;
+		while (next_step < steps.size() && steps[next_step].m_at <= elapsed)
+		{
+			const ScriptStep &step = steps[next_step++];
+			if (SetImpair(step.m_name, step.m_value) == false)
+			{
+				fprintf(stderr, "script: unknown option %s\n", step.m_name);
+				continue;
+			}
+			fprintf(stderr, "%.1fs: %s %s\n", elapsed, step.m_name, step.m_value);
+		}
+		if (opts.m_stats_interval > 0 && elapsed >= next_stats)
+		{
+			PrintStats(out, elapsed);
+			next_stats += opts.m_stats_interval;
+			bprinted = true;
+		}
+		if (opts.m_duration > 0 && elapsed >= opts.m_duration)
+		{
+			break;
+		}
+
+		// 脚本和统计的时间精度为10毫秒
+		struct timespec ts = {0, 10000000};
+		if (sigtimedwait(&mask, 0, &ts) > 0)
+		{
+			break;
+		}
+	}
+
+	if (bprinted == false)
+	{
+		PrintStats(out, (MetricNow() - start) / 1e9);
+	}
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	// 连接线程还在运行，直接退出，由内核关闭所有socket
+	_exit(0);
+}
@@ -18,25 +18,45 @@
 #include <netdb.h>
 #include <locale.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
 #include <termios.h>
 #include <pthread.h>
 #include <poll.h>
 #include <semaphore.h>
+#include <spawn.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <algorithm>
 
 using namespace std;
 
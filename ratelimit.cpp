@@ -0,0 +1,310 @@
+#include "public.h"
+#include "ratelimit.h"
+#include "metrics.h"
+
+static MetricCounter *g_rejected_frames = NewMetricCounter("moserver_ratelimit_rejected_total",
+		"Frames rejected by the per-client rate limiter", "reason=\"frames\"");
+static MetricCounter *g_rejected_bytes = NewMetricCounter("moserver_ratelimit_rejected_total",
+		"Frames rejected by the per-client rate limiter", "reason=\"bytes\"");
+static MetricCounter *g_evictions = NewMetricCounter("moserver_ratelimit_evictions_total",
+		"Clients evicted from the rate limiter table");
+
+RateLimiter::RateLimiter()
+{
+	m_v4_prefix = 32;
+	m_v6_prefix = 64;
+
+	m_sets = 0;
+	m_set_bits = 0;
+
+	m_frame_interval = 0;
+	m_frame_burst_ns = 0;
+	m_byte_rate = 0;
+	m_byte_burst_ns = 0;
+}
+
+bool RateLimiter::Init(const int icapacity)
+{
+	if (icapacity <= 0)
+	{
+		return false;
+	}
+
+	// 组数取2的幂，至少两组，键的高位直接作为组号
+	int ibits = 1;
+	while (((long)RATELIMIT_WAYS << ibits) < icapacity && ibits < 40)
+	{
+		ibits++;
+	}
+
+	void *sets = 0;
+	size_t size = sizeof(Set) << ibits;
+	if (posix_memalign(&sets, 64, size) != 0)
+	{
+		return false;
+	}
+	memset(sets, 0, size);
+
+	free(m_sets);
+	m_sets = (Set *)sets;
+	m_set_bits = ibits;
+
+	return true;
+}
+
+void RateLimiter::SetFrameRate(const long rate, const long burst)
+{
+	long interval = rate > 0 ? 1000000000L / rate : 0;
+	if (rate > 0 && interval == 0)
+	{
+		interval = 1;
+	}
+
+	// 先设置突发量再设置间隔，Allow看到新的间隔时突发量一定也是新的
+	__atomic_store_n(&m_frame_burst_ns, (burst > 1 ? burst : 1) * interval, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_frame_interval, interval, __ATOMIC_RELEASE);
+}
+
+void RateLimiter::SetByteRate(const long rate, const long burst)
+{
+	long burst_ns = rate > 0 ? (long)((double)(burst > 1 ? burst : 1) * 1000000000.0 / rate) : 0;
+
+	__atomic_store_n(&m_byte_burst_ns, burst_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_byte_rate, rate > 0 ? rate : 0, __ATOMIC_RELEASE);
+}
+
+bool RateLimiter::Enabled() const
+{
+	return m_sets != 0 &&
+		(__atomic_load_n(&m_frame_interval, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&m_byte_rate, __ATOMIC_RELAXED) > 0);
+}
+
+static inline unsigned long Mix64(unsigned long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdUL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53UL;
+	x ^= x >> 33;
+	return x;
+}
+
+/**
+ * @brief 计算客户端地址的键
+ * @details 地址规整成128位，IPv4和IPv4映射的IPv6地址得到同样的键，
+ *          按前缀长度屏蔽后散列成64位，同一个前缀内的地址共享一个键
+ * @param addr AF_INET或者AF_INET6地址
+ * @return 键，不支持的地址族返回0
+ */
+unsigned long RateLimiter::Key(const struct sockaddr *addr) const
+{
+	unsigned char ip[16];
+	int iprefix = 0;
+
+	if (addr->sa_family == AF_INET)
+	{
+		memset(ip, 0, 10);
+		ip[10] = 0xff;
+		ip[11] = 0xff;
+		memcpy(ip + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		iprefix = 96 + (m_v4_prefix < 0 ? 0 : m_v4_prefix > 32 ? 32 : m_v4_prefix);
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		const struct in6_addr *addr6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+		memcpy(ip, addr6, 16);
+		if (IN6_IS_ADDR_V4MAPPED(addr6))
+		{
+			iprefix = 96 + (m_v4_prefix < 0 ? 0 : m_v4_prefix > 32 ? 32 : m_v4_prefix);
+		}
+		else
+		{
+			iprefix = m_v6_prefix < 0 ? 0 : m_v6_prefix > 128 ? 128 : m_v6_prefix;
+		}
+	}
+	else
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < 16; i++)
+	{
+		int ibits = iprefix - i * 8;
+		if (ibits <= 0)
+		{
+			ip[i] = 0;
+		}
+		else if (ibits < 8)
+		{
+			ip[i] &= (unsigned char)(0xff << (8 - ibits));
+		}
+	}
+
+	unsigned long hi, lo;
+	memcpy(&hi, ip, 8);
+	memcpy(&lo, ip + 8, 8);
+
+	unsigned long key = Mix64(hi ^ Mix64(lo + iprefix));
+
+	return key != 0 ? key : 1;
+}
+
+/**
+ * @brief 查找客户端的令牌桶，不存在时按CLOCK算法占用组内的一个槽位
+ * @return 两个令牌桶的理论到达时间，表未初始化时返回0
+ */
+long *RateLimiter::Lookup(const unsigned long key)
+{
+	if (m_sets == 0)
+	{
+		return 0;
+	}
+
+	Set *set = &m_sets[key >> (64 - m_set_bits)];
+	for (int i = 0; i < RATELIMIT_WAYS; i++)
+	{
+		if (__atomic_load_n(&set->m_keys[i], __ATOMIC_ACQUIRE) == key)
+		{
+			// 访问位已经置上时不写，热点客户端的查找不会弄脏缓存行
+			if (set->m_refs[i] == 0)
+			{
+				__atomic_store_n(&set->m_refs[i], 1, __ATOMIC_RELAXED);
+			}
+			return set->m_tats[i];
+		}
+	}
+
+	// 转两圈之内一定能找到访问位为0的槽位，除非其他线程一直在访问
+	for (int n = 0; n < RATELIMIT_WAYS * 2; n++)
+	{
+		int i = __atomic_fetch_add(&set->m_hand, 1, __ATOMIC_RELAXED) % RATELIMIT_WAYS;
+		unsigned long old = __atomic_load_n(&set->m_keys[i], __ATOMIC_RELAXED);
+
+		if (old != 0 && __atomic_load_n(&set->m_refs[i], __ATOMIC_RELAXED) != 0 && n < RATELIMIT_WAYS * 2 - 1)
+		{
+			__atomic_store_n(&set->m_refs[i], 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&set->m_keys[i], &old, key, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) == false)
+		{
+			continue;
+		}
+
+		__atomic_store_n(&set->m_tats[i][0], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&set->m_tats[i][1], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&set->m_refs[i], 1, __ATOMIC_RELAXED);
+		if (old != 0)
+		{
+			g_evictions->Add();
+		}
+
+		return set->m_tats[i];
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 从令牌桶中取cost纳秒的令牌
+ * @details 单个报文的开销超过突发量时，只在桶满的时候放行，平均速率仍然受限
+ */
+bool RateLimiter::Take(long *tat, const long cost, const long burst_ns, const long now)
+{
+	long limit = burst_ns - (cost < burst_ns ? cost : burst_ns);
+	long old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	while (true)
+	{
+		long base = old > now ? old : now;
+		if (base - now > limit)
+		{
+			return false;
+		}
+
+		if (__atomic_compare_exchange_n(tat, &old, base + cost, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			return true;
+		}
+	}
+}
+
+/**
+ * @brief 判断客户端的这个报文是否放行
+ * @param key Key返回的键
+ * @param ibytes 报文的字节数
+ * @param now 当前时间，单位为纳秒，0表示现取
+ * @return 放行返回true
+ */
+bool RateLimiter::Allow(const unsigned long key, const long ibytes, const unsigned long now)
+{
+	long frame_interval = __atomic_load_n(&m_frame_interval, __ATOMIC_ACQUIRE);
+	long byte_rate = __atomic_load_n(&m_byte_rate, __ATOMIC_ACQUIRE);
+	if (key == 0 || (frame_interval == 0 && byte_rate == 0))
+	{
+		return true;
+	}
+
+	long *tats = Lookup(key);
+	if (tats == 0)
+	{
+		return true;
+	}
+
+	long inow = (long)(now != 0 ? now : MetricNow());
+	if (frame_interval > 0 &&
+			Take(&tats[0], frame_interval, __atomic_load_n(&m_frame_burst_ns, __ATOMIC_RELAXED), inow) == false)
+	{
+		g_rejected_frames->Add();
+		return false;
+	}
+
+	if (byte_rate > 0)
+	{
+		long burst_ns = __atomic_load_n(&m_byte_burst_ns, __ATOMIC_RELAXED);
+		long cost = ibytes < LONG_MAX / 1000000000L ? ibytes * 1000000000L / byte_rate : burst_ns;
+		if (Take(&tats[1], cost, burst_ns, inow) == false)
+		{
+			// 字节数超限时退还已经扣除的报文令牌
+			if (frame_interval > 0)
+			{
+				__atomic_fetch_sub(&tats[0], frame_interval, __ATOMIC_RELAXED);
+			}
+			g_rejected_bytes->Add();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool RateLimiter::Allow(const struct sockaddr *addr, const long ibytes)
+{
+	return Allow(Key(addr), ibytes);
+}
+
+int RateLimiter::Size() const
+{
+	if (m_sets == 0)
+	{
+		return 0;
+	}
+
+	int icount = 0;
+	for (long i = 0; i < (1L << m_set_bits); i++)
+	{
+		for (int j = 0; j < RATELIMIT_WAYS; j++)
+		{
+			if (__atomic_load_n(&m_sets[i].m_keys[j], __ATOMIC_RELAXED) != 0)
+			{
+				icount++;
+			}
+		}
+	}
+
+	return icount;
+}
+
+RateLimiter::~RateLimiter()
+{
+	free(m_sets);
+}
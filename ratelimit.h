@@ -0,0 +1,92 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+#include "public.h"
+
+#define RATELIMIT_WAYS 8   // 每组的槽位数，一组的键正好占一个缓存行
+
+/**
+ * @brief 按客户端地址的限流表
+ *
+ * 每个客户端（IPv4地址或者IPv6前缀）有两个令牌桶，分别限制每秒的报文数和字节数，
+ * 令牌桶用GCRA算法实现，每个桶只是一个理论到达时间，用CAS更新，和LogSite一样。
+ *
+ * 表按组相联组织：地址规整成128位（IPv4按::ffff:a.b.c.d处理）并按前缀长度屏蔽后
+ * 散列成64位的键，键的高位选组，组内RATELIMIT_WAYS个槽位顺序比较。查找不加锁，
+ * 只读一个缓存行的键和一个缓存行的桶。组满时按CLOCK算法淘汰最近没有访问过的
+ * 客户端，近似LRU，表的大小固定，不会因为大量不同的地址而增长。
+ *
+ * 被淘汰的客户端下次出现时从满的令牌桶开始。淘汰和查找同时发生时，这一次请求
+ * 可能记到新的客户端上，对限流来说可以接受。
+ */
+class RateLimiter
+{
+	public:
+		int m_v4_prefix;   // IPv4按多长的前缀合并成一个客户端，缺省32
+		int m_v6_prefix;   // IPv6按多长的前缀合并成一个客户端，缺省64
+
+		RateLimiter();
+
+		/*
+		 * 分配可以容纳icapacity个客户端的表，之前的状态全部丢弃
+		 * 必须在开始调用Allow之前调用
+		 * */
+		bool Init(const int icapacity);
+
+		/*
+		 * 设置每秒的报文数和字节数，burst为允许的突发量，rate为0表示不限制
+		 * 运行中可以调用
+		 * */
+		void SetFrameRate(const long rate, const long burst);
+
+		void SetByteRate(const long rate, const long burst);
+
+		/*
+		 * 是否限制了报文数或者字节数
+		 * */
+		bool Enabled() const;
+
+		/*
+		 * 计算客户端地址的键，连接建立时算一次保存下来
+		 * 不支持的地址族返回0，Allow对键0总是放行
+		 * */
+		unsigned long Key(const struct sockaddr *addr) const;
+
+		/*
+		 * 客户端发来一个ibytes字节的报文时调用
+		 * now 当前时间，单位为纳秒，调用者已经取过时间时传入可以省掉一次clock_gettime，0表示现取
+		 * 返回值 true为放行，false为超过了限额，两个令牌桶都不扣除
+		 * */
+		bool Allow(const unsigned long key, const long ibytes, const unsigned long now = 0);
+
+		bool Allow(const struct sockaddr *addr, const long ibytes);
+
+		/*
+		 * 表中的客户端数，遍历整个表，只用于统计
+		 * */
+		int Size() const;
+
+		~RateLimiter();
+
+	private:
+		struct Set
+		{
+			unsigned long m_keys[RATELIMIT_WAYS];
+			long          m_tats[RATELIMIT_WAYS][2];   // 报文数和字节数令牌桶的理论到达时间
+			unsigned char m_refs[RATELIMIT_WAYS];      // CLOCK访问位
+			unsigned int  m_hand;
+		} __attribute__((aligned(64)));
+
+		Set *m_sets;
+		int  m_set_bits;
+
+		long m_frame_interval;    // 每个报文的时间，单位为纳秒
+		long m_frame_burst_ns;
+		long m_byte_rate;         // 每秒字节数，每个报文的时间按字节数现算
+		long m_byte_burst_ns;
+
+		long *Lookup(const unsigned long key);
+
+		bool Take(long *tat, const long cost, const long burst_ns, const long now);
+};
+
+#endif
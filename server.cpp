@@ -0,0 +1,1065 @@
+#include "public.h"
+#include "server.h"
+#include "utils.h"
+#include "trace.h"
+
+static MetricHistogram *g_server_queue_delay = NewMetricHistogram("moserver_server_queue_delay_seconds",
+		"Time a readable connection waited for a worker thread");
+static MetricCounter *g_server_expired = NewMetricCounter("moserver_server_expired_total",
+		"Requests dropped because their deadline passed before a worker picked them up");
+static MetricCounter *g_server_accept_fd_exhausted = NewMetricCounter("moserver_server_accept_fd_exhausted_total",
+		"Connections closed right after accept because the process ran out of file descriptors");
+
+#define CONN_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+static const char g_busy_frame[] = "BUSY";
+static const char g_expired_frame[] = "EXPIRED";
+
+#define DISCARD_SIZE (64 * 1024)
+
+FrameServer::FrameServer()
+{
+	m_workers = 4;
+	m_max_frame = 4 * 1024 * 1024;
+	m_backlog = 1024;
+	m_profile.m_bnodelay = true;
+	m_idle_timeout = 0;
+	m_read_timeout = 30;
+
+	m_epfd = -1;
+	m_wakefd = -1;
+	m_reserve_fd = -1;
+	m_accept_paused = 0;
+	m_discard = 0;
+	m_tls = 0;
+
+	memset(&m_default, 0, sizeof(m_default));
+	m_default.m_frames = NewMetricCounter("moserver_server_frames_total", "Frames handled by command", "cmd=\"default\"");
+	m_default.m_latency = NewMetricHistogram("moserver_server_handle_seconds", "Handler latency by command", "cmd=\"default\"");
+
+	pthread_mutex_init(&m_lock, 0);
+	pthread_cond_init(&m_queue_cond, 0);
+	pthread_cond_init(&m_drain_cond, 0);
+	m_conn_count = 0;
+	m_brunning = false;
+	m_bdraining = false;
+	m_bstop = false;
+}
+
+/**
+ * @brief 注册处理函数
+ * @param name 命令名
+ * @param handler 处理函数
+ * @param arg 传给处理函数的参数
+ * @return 成功返回true，命令名为空、太长、重复或者服务已经启动时返回false
+ */
+bool FrameServer::AddHandler(const char *name, FrameHandler handler, void *arg)
+{
+	if (m_brunning == true || name == 0 || name[0] == 0 || strlen(name) >= sizeof(m_default.m_name) || handler == 0)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < m_routes.size(); i++)
+	{
+		if (strcmp(m_routes[i].m_name, name) == 0)
+		{
+			return false;
+		}
+	}
+
+	char labels[64];
+	snprintf(labels, sizeof(labels), "cmd=\"%s\"", name);
+
+	Route route;
+	StrCopy(route.m_name, sizeof(route.m_name), name);
+	route.m_handler = handler;
+	route.m_arg = arg;
+	route.m_frames = NewMetricCounter("moserver_server_frames_total", "Frames handled by command", labels);
+	route.m_latency = NewMetricHistogram("moserver_server_handle_seconds", "Handler latency by command", labels);
+	m_routes.push_back(route);
+
+	return true;
+}
+
+void FrameServer::SetDefaultHandler(FrameHandler handler, void *arg)
+{
+	m_default.m_handler = handler;
+	m_default.m_arg = arg;
+}
+
+/*
+ * IO线程在一次通知中循环Accept直到没有新连接，监听socket必须是非阻塞的；
+ * 热重启时监听socket通过SCM_RIGHTS交给新进程，不需要在exec时继承
+ * */
+static bool SetListenFlags(const int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+	{
+		return false;
+	}
+
+	return fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+bool FrameServer::Listen(const unsigned int port)
+{
+	m_tcpserver.m_profile = m_profile;
+	m_tcpserver.m_profile.m_bnonblock = false;
+	if (m_tcpserver.NewServer(port, m_backlog) == false)
+	{
+		return false;
+	}
+
+	return SetListenFlags(m_tcpserver.m_listenfd);
+}
+
+bool FrameServer::Attach(const int listenfd)
+{
+	// 监听socket的选项由旧进程设置，这里只影响之后接受的连接
+	m_tcpserver.m_profile = m_profile;
+	m_tcpserver.m_profile.m_bnonblock = false;
+	if (m_tcpserver.AttachServer(listenfd) == false)
+	{
+		return false;
+	}
+
+	return SetListenFlags(m_tcpserver.m_listenfd);
+}
+
+int FrameServer::ListenFd() const
+{
+	return m_tcpserver.m_listenfd;
+}
+
+/**
+ * @brief 启动IO线程和工作线程
+ * @return 成功返回true，没有监听socket或者创建线程失败时返回false
+ */
+bool FrameServer::Start()
+{
+	if (m_brunning == true || m_tcpserver.m_listenfd == -1)
+	{
+		return false;
+	}
+
+	if ((m_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		return false;
+	}
+
+	if ((m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		close(m_epfd);
+		m_epfd = -1;
+		return false;
+	}
+
+	// 监听socket和eventfd用成员的地址作为标记，和连接的Conn指针区分
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &m_tcpserver;
+	epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tcpserver.m_listenfd, &ev);
+	ev.data.ptr = &m_wakefd;
+	epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev);
+
+	m_bstop = false;
+	m_bdraining = false;
+	m_accept_paused = 0;
+	if (m_reserve_fd == -1)
+	{
+		m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+
+	if (m_discard == 0)
+	{
+		m_discard = (char *)malloc(DISCARD_SIZE);
+	}
+
+	if (pthread_create(&m_io_tid, 0, IOThread, this) != 0)
+	{
+		close(m_wakefd);
+		close(m_epfd);
+		m_wakefd = -1;
+		m_epfd = -1;
+		return false;
+	}
+	m_brunning = true;
+
+	for (int i = 0; i < (m_workers > 0 ? m_workers : 1); i++)
+	{
+		pthread_t tid;
+		if (pthread_create(&tid, 0, WorkerThread, this) != 0)
+		{
+			Stop();
+			return false;
+		}
+		m_worker_tids.push_back(tid);
+	}
+
+	return true;
+}
+
+void FrameServer::Wake()
+{
+	unsigned long one = 1;
+	if (write(m_wakefd, &one, sizeof(one)) < 0)
+	{
+		// eventfd计数已满时IO线程一定会被唤醒，忽略错误
+	}
+}
+
+void *FrameServer::IOThread(void *arg)
+{
+	FrameServer *server = (FrameServer *)arg;
+	struct epoll_event events[64];
+	time_t last_sweep = 0;
+
+	int itimeout = 1000;
+
+	while (__atomic_load_n(&server->m_bstop, __ATOMIC_ACQUIRE) == false)
+	{
+		int n = epoll_wait(server->m_epfd, events, 64, itimeout);
+		bool bwoken = false;
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &server->m_tcpserver)
+			{
+				server->AcceptConns();
+			}
+			else if (events[i].data.ptr == &server->m_wakefd)
+			{
+				unsigned long value;
+				if (read(server->m_wakefd, &value, sizeof(value)) < 0)
+				{
+					// 计数已经被读走，不影响处理
+				}
+				bwoken = true;
+			}
+			else
+			{
+				server->Dispatch((Conn *)events[i].data.ptr);
+			}
+		}
+
+		itimeout = server->ResumePaused(MetricNow());
+
+		time_t now = time(0);
+		if (bwoken == true || now != last_sweep)
+		{
+			server->Sweep(now);
+			last_sweep = now;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief 接受所有等待中的连接，注册到epoll
+ */
+void FrameServer::AcceptConns()
+{
+	while (m_tcpserver.Accept() == true)
+	{
+		Conn *conn = new Conn;
+		conn->m_fd = m_tcpserver.m_clientfd;
+		m_tcpserver.m_clientfd = -1;
+		StrCopy(conn->m_ip, sizeof(conn->m_ip), m_tcpserver.GetClientIP());
+		conn->m_addr = m_tcpserver.GetClientAddr()->sin_addr.s_addr;
+		conn->m_rate_key = m_ratelimit.Key((const struct sockaddr *)m_tcpserver.GetClientAddr());
+		conn->m_bbusy = false;
+		conn->m_badmitted = false;
+		conn->m_bshed = false;
+		conn->m_tls = 0;
+		conn->m_last_active = time(0);
+		conn->m_enqueue_time = 0;
+
+		if (m_read_timeout > 0)
+		{
+			struct timeval tv;
+			tv.tv_sec = m_read_timeout;
+			tv.tv_usec = 0;
+			setsockopt(conn->m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		}
+
+		pthread_mutex_lock(&m_lock);
+		if (m_admission.AdmitConn(conn->m_addr) == false)
+		{
+			pthread_mutex_unlock(&m_lock);
+			// 新连接的发送缓冲区是空的，写一个很短的报文不会阻塞IO线程；TLS连接还没有握手，直接关闭
+			if (m_tls == 0)
+			{
+				TCPWrite(conn->m_fd, g_busy_frame, sizeof(g_busy_frame) - 1);
+			}
+			m_tcpserver.CloseClientSocket(conn->m_fd);
+			delete conn;
+			continue;
+		}
+
+		if ((int)m_conns.size() <= conn->m_fd)
+		{
+			m_conns.resize(conn->m_fd + 1, 0);
+		}
+		m_conns[conn->m_fd] = conn;
+		m_conn_count++;
+
+		struct epoll_event ev;
+		ev.events = CONN_EVENTS;
+		ev.data.ptr = conn;
+		if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, conn->m_fd, &ev) != 0)
+		{
+			CloseConnLocked(conn);
+		}
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	if (errno == EMFILE || errno == ENFILE)
+	{
+		AcceptExhausted();
+	}
+}
+
+/**
+ * @brief 文件句柄用完时，监听socket一直可读，不处理的话IO线程会空转
+ * @details 关闭预留的文件句柄，接受一个连接并马上关闭，客户端立即知道被拒绝，而不是在监听队列中
+ *          等到超时，然后重新预留。每次都拒绝掉一个连接，监听队列总会变空，不会空转；
+ *          预留的文件句柄也拿不回来时暂停监听，Sweep在下一秒恢复
+ */
+void FrameServer::AcceptExhausted()
+{
+	int listenfd = m_tcpserver.m_listenfd;
+	if (listenfd == -1)
+	{
+		return;
+	}
+
+	while (m_reserve_fd != -1)
+	{
+		close(m_reserve_fd);
+		int fd = accept4(listenfd, 0, 0, SOCK_CLOEXEC);
+		bool bempty = fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		if (fd != -1)
+		{
+			close(fd);
+			g_server_accept_fd_exhausted->Add();
+		}
+		m_reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		if (bempty == true)
+		{
+			return;
+		}
+		if (fd == -1)
+		{
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&m_lock);
+	if (m_accept_paused == 0)
+	{
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, listenfd, 0);
+		m_accept_paused = time(0);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+/**
+ * @brief 把有数据可读的连接放入工作队列
+ */
+void FrameServer::Dispatch(Conn *conn)
+{
+	pthread_mutex_lock(&m_lock);
+	EnqueueLocked(conn);
+	if (conn->m_bshed == false)
+	{
+		pthread_mutex_unlock(&m_lock);
+		return;
+	}
+
+	// 被拒绝的请求如果已经完整到达，由IO线程直接应答，不用唤醒工作线程
+	m_shed_queue.pop_back();
+	pthread_mutex_unlock(&m_lock);
+
+	int iret = RejectFast(conn);
+
+	pthread_mutex_lock(&m_lock);
+	if (iret > 0)
+	{
+		conn->m_bshed = false;
+		PauseLocked(conn);
+	}
+	else if (iret < 0)
+	{
+		conn->m_bbusy = false;
+		CloseConnLocked(conn);
+	}
+	else
+	{
+		m_shed_queue.push_back(conn);
+		pthread_cond_signal(&m_queue_cond);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+/**
+ * @brief 在IO线程中拒绝一个请求，只在整个报文已经在接收缓冲区中时才处理，不会阻塞
+ * @return 1为已经应答BUSY，0为报文不完整或者太大，需要交给工作线程，-1为连接已断开
+ */
+int FrameServer::RejectFast(Conn *conn)
+{
+	// TLS连接上的报文要经过解密，只能由工作线程读取
+	int iavail = 0;
+	if (m_tls != 0 || m_discard == 0 || ioctl(conn->m_fd, FIONREAD, &iavail) != 0 || iavail < 4)
+	{
+		return 0;
+	}
+
+	int ilen = 0;
+	if (recv(conn->m_fd, &ilen, 4, MSG_PEEK | MSG_DONTWAIT) != 4)
+	{
+		return 0;
+	}
+	ilen = ntohl(ilen);
+
+	// 长度由对端控制，比较时不能做可能溢出的加法
+	if (ilen < 0 || ilen > DISCARD_SIZE - 4 || iavail - 4 < ilen)
+	{
+		return 0;
+	}
+
+	if (recv(conn->m_fd, m_discard, ilen + 4, MSG_DONTWAIT) != ilen + 4)
+	{
+		return -1;
+	}
+
+	return TCPWrite(conn->m_fd, g_busy_frame, sizeof(g_busy_frame) - 1) == true ? 1 : -1;
+}
+
+/**
+ * @brief 暂停读取被拒绝的连接，调用者需要持有m_lock，连接保持m_bbusy状态
+ */
+void FrameServer::PauseLocked(Conn *conn)
+{
+	if (m_admission.m_reject_delay <= 0 || m_bdraining == true)
+	{
+		conn->m_bbusy = false;
+		RearmLocked(conn);
+		return;
+	}
+
+	// 暂停时间都一样，按暂停的先后顺序恢复，队列始终有序
+	bool bfirst = m_paused.empty();
+	m_paused.push_back(make_pair(MetricNow() + m_admission.m_reject_delay, conn));
+	if (bfirst == true)
+	{
+		Wake();
+	}
+}
+
+/**
+ * @brief 恢复暂停时间已到的连接，在IO线程中调用
+ * @param now 当前时间，单位为纳秒
+ * @return 下一次调用epoll_wait的超时时间，单位为毫秒
+ */
+int FrameServer::ResumePaused(const unsigned long now)
+{
+	pthread_mutex_lock(&m_lock);
+	while (m_paused.empty() == false && m_paused.front().first <= now)
+	{
+		Conn *conn = m_paused.front().second;
+		m_paused.pop_front();
+		conn->m_bbusy = false;
+
+		if (m_bdraining == true)
+		{
+			CloseConnLocked(conn);
+			continue;
+		}
+
+		RearmLocked(conn);
+	}
+
+	int itimeout = 1000;
+	if (m_paused.empty() == false)
+	{
+		itimeout = (int)((m_paused.front().first - now) / 1000000) + 1;
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	return itimeout;
+}
+
+/**
+ * @brief 按准入控制的结果放入工作队列或者拒绝队列，调用者需要持有m_lock
+ */
+void FrameServer::EnqueueLocked(Conn *conn)
+{
+	conn->m_bbusy = true;
+	conn->m_enqueue_time = MetricNow();
+	conn->m_badmitted = m_admission.AdmitRequest(conn->m_addr);
+	conn->m_bshed = (conn->m_badmitted == false);
+
+	if (conn->m_bshed == true)
+	{
+		m_shed_queue.push_back(conn);
+	}
+	else
+	{
+		m_queue.push_back(conn);
+	}
+	pthread_cond_signal(&m_queue_cond);
+}
+
+/**
+ * @brief 取出下一个要处理的连接，调用者需要持有m_lock，队列为空时返回0
+ * @details 先处理被拒绝的请求；过载时从队尾取，否则从队头取。
+ *          取出时再按排队延迟检查一次，排队太久的请求也改为拒绝
+ */
+FrameServer::Conn *FrameServer::DequeueLocked()
+{
+	Conn *conn = 0;
+	if (m_shed_queue.empty() == false)
+	{
+		conn = m_shed_queue.front();
+		m_shed_queue.pop_front();
+		return conn;
+	}
+
+	if (m_queue.empty() == true)
+	{
+		return 0;
+	}
+
+	if (m_admission.m_blifo == true && m_admission.Overloaded() == true)
+	{
+		conn = m_queue.back();
+		m_queue.pop_back();
+	}
+	else
+	{
+		conn = m_queue.front();
+		m_queue.pop_front();
+	}
+
+	unsigned long now = MetricNow();
+	if (m_admission.ShedOnDequeue(now - conn->m_enqueue_time, now) == true)
+	{
+		conn->m_bshed = true;
+	}
+
+	return conn;
+}
+
+/**
+ * @brief 关闭超时和排空中的空闲连接，在IO线程中每秒以及被唤醒时调用
+ * @details 排空时关闭监听socket。空闲连接上如果已经有请求到达，先处理完再关闭，
+ *          其余的空闲连接立即关闭
+ * @param now 当前时间
+ */
+void FrameServer::Sweep(const time_t now)
+{
+	pthread_mutex_lock(&m_lock);
+
+	if (m_bdraining == true && m_tcpserver.m_listenfd != -1)
+	{
+		epoll_ctl(m_epfd, EPOLL_CTL_DEL, m_tcpserver.m_listenfd, 0);
+		m_tcpserver.CloseServerSocket();
+	}
+	else if (m_accept_paused != 0 && now > m_accept_paused && m_tcpserver.m_listenfd != -1)
+	{
+		// 文件句柄用完时暂停的监听在一秒后恢复
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &m_tcpserver;
+		epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tcpserver.m_listenfd, &ev);
+		m_accept_paused = 0;
+	}
+
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		Conn *conn = m_conns[i];
+		if (conn == 0 || conn->m_bbusy == true)
+		{
+			continue;
+		}
+
+		if (m_bdraining == true)
+		{
+			if (HasInput(conn) == true)
+			{
+				// 先从epoll中摘下，避免IO线程再次把它放入队列
+				struct epoll_event ev;
+				ev.events = 0;
+				ev.data.ptr = conn;
+				epoll_ctl(m_epfd, EPOLL_CTL_MOD, conn->m_fd, &ev);
+				EnqueueLocked(conn);
+				continue;
+			}
+
+			CloseConnLocked(conn);
+			continue;
+		}
+
+		if (m_idle_timeout > 0 && now - conn->m_last_active > m_idle_timeout)
+		{
+			CloseConnLocked(conn);
+		}
+	}
+
+	pthread_mutex_unlock(&m_lock);
+}
+
+/**
+ * @brief 关闭连接，调用者需要持有m_lock
+ */
+void FrameServer::CloseConnLocked(Conn *conn, const bool bclose)
+{
+	epoll_ctl(m_epfd, EPOLL_CTL_DEL, conn->m_fd, 0);
+	m_conns[conn->m_fd] = 0;
+	m_conn_count--;
+	if (conn->m_badmitted == true)
+	{
+		m_admission.ReleaseRequest(conn->m_addr);
+	}
+	m_admission.ReleaseConn(conn->m_addr);
+	delete conn->m_tls;
+	if (bclose == true)
+	{
+		m_tcpserver.CloseClientSocket(conn->m_fd);
+	}
+	else
+	{
+		m_tcpserver.DetachClientSocket(conn->m_fd);
+	}
+	delete conn;
+
+	if (m_conn_count == 0)
+	{
+		pthread_cond_broadcast(&m_drain_cond);
+	}
+}
+
+void *FrameServer::WorkerThread(void *arg)
+{
+	FrameServer *server = (FrameServer *)arg;
+
+	// 多一个字节用于在报文末尾补0，处理函数可以把报文当作字符串使用
+	char *buffer = (char *)malloc(server->m_max_frame + 1);
+	if (buffer == 0)
+	{
+		return 0;
+	}
+
+	while (true)
+	{
+		pthread_mutex_lock(&server->m_lock);
+		Conn *conn;
+		while ((conn = server->DequeueLocked()) == 0 && server->m_bstop == false)
+		{
+			pthread_cond_wait(&server->m_queue_cond, &server->m_lock);
+		}
+		pthread_mutex_unlock(&server->m_lock);
+
+		if (conn == 0)
+		{
+			break;
+		}
+
+		server->HandleConn(conn, buffer);
+	}
+
+	free(buffer);
+
+	return 0;
+}
+
+/**
+ * @brief 按报文开头的命令查找处理函数
+ * @param data 报文
+ * @param len 报文长度
+ * @param icmd_len 返回命令的长度
+ * @return 匹配的路由，没有匹配时返回缺省路由
+ */
+const FrameServer::Route *FrameServer::FindRoute(const char *data, const int len, int *icmd_len)
+{
+	int ilen = 0;
+	while (ilen < len && data[ilen] != ' ' && data[ilen] != '\t' && data[ilen] != '\r' && data[ilen] != '\n')
+	{
+		ilen++;
+	}
+	*icmd_len = ilen;
+
+	for (size_t i = 0; i < m_routes.size(); i++)
+	{
+		if (strncmp(m_routes[i].m_name, data, ilen) == 0 && m_routes[i].m_name[ilen] == 0)
+		{
+			return &m_routes[i];
+		}
+	}
+
+	return &m_default;
+}
+
+/**
+ * @brief 在工作线程中读取并处理一个报文，然后重新注册连接或者关闭连接
+ */
+void FrameServer::HandleConn(Conn *conn, char *buffer)
+{
+	unsigned long dequeue_time = MetricNow();
+	g_server_queue_delay->Record(dequeue_time - conn->m_enqueue_time);
+
+	bool bkeep = true;
+	bool bframe = true;
+	if (m_tls != 0 && conn->m_tls == 0)
+	{
+		// 新的TLS连接先握手，握手之前就被拒绝的连接直接关闭，过载时不值得花CPU握手；
+		// 握手完成时客户端可能还没有发报文，不能阻塞等待
+		if (conn->m_bshed == false)
+		{
+			conn->m_tls = new TLSConn;
+			bkeep = conn->m_tls->Accept(m_tls, conn->m_fd);
+		}
+		else
+		{
+			bkeep = false;
+		}
+		bframe = (bkeep == true && HasInput(conn) == true);
+	}
+
+	int ilen = 0;
+	TCPFrameMeta meta;
+	memset(&meta, 0, sizeof(meta));
+	if (bframe == true)
+	{
+		bkeep = ReadFrame(conn, buffer, &ilen, &meta);
+	}
+
+	// 用取出时的时间，报文到达之后才取出，不会比实际时间晚
+	if (bframe == true && bkeep == true && conn->m_bshed == false &&
+			m_ratelimit.Allow(conn->m_rate_key, ilen + 4, dequeue_time) == false)
+	{
+		conn->m_bshed = true;
+	}
+
+	void (*on_detach)(int, void *) = 0;
+	void *detach_arg = 0;
+
+	bool bshed = conn->m_bshed;
+	if (bframe == true && bkeep == true && bshed == true)
+	{
+		// 报文必须读完，连接上后面的报文才能对齐
+		bkeep = WriteFrame(conn, g_busy_frame, sizeof(g_busy_frame) - 1, meta);
+	}
+	else if (bframe == true && bkeep == true && meta.m_deadline != 0 && MetricNow() >= meta.m_deadline)
+	{
+		g_server_expired->Add();
+		bkeep = WriteFrame(conn, g_expired_frame, sizeof(g_expired_frame) - 1, meta);
+	}
+	else if (bframe == true && bkeep == true)
+	{
+		buffer[ilen] = 0;
+
+		FrameRequest req;
+		req.m_fd = conn->m_fd;
+		req.m_client_ip = conn->m_ip;
+		req.m_data = buffer;
+		req.m_len = ilen;
+		req.m_breply = false;
+		req.m_bclose = false;
+		req.m_request_id = meta.m_request_id;
+		req.m_deadline = meta.m_deadline;
+		req.m_btls = (conn->m_tls != 0);
+		req.m_on_detach = 0;
+		req.m_detach_arg = 0;
+
+		int icmd_len = 0;
+		const Route *route = FindRoute(buffer, ilen, &icmd_len);
+		req.m_args = buffer + icmd_len;
+		while (req.m_args < buffer + ilen && (*req.m_args == ' ' || *req.m_args == '\t'))
+		{
+			req.m_args++;
+		}
+		req.m_args_len = buffer + ilen - req.m_args;
+
+		unsigned long start = MetricNow();
+		if (route->m_handler == 0)
+		{
+			req.Reply("ERR unknown command", 19);
+		}
+		else
+		{
+			TRACE_CALL(bkeep, "handle", route->m_handler(&req, route->m_arg), 0);
+		}
+		route->m_frames->Add();
+		route->m_latency->Record(MetricNow() - start);
+
+		if (bkeep == true && req.m_breply == true)
+		{
+			bkeep = WriteFrame(conn, req.m_reply.data(), req.m_reply.size(), meta);
+		}
+
+		if (req.m_bclose == true)
+		{
+			bkeep = false;
+		}
+		on_detach = req.m_on_detach;
+		detach_arg = req.m_detach_arg;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	conn->m_last_active = time(0);
+	if (conn->m_badmitted == true)
+	{
+		m_admission.ReleaseRequest(conn->m_addr);
+		conn->m_badmitted = false;
+	}
+	conn->m_bshed = false;
+
+	if (on_detach != 0)
+	{
+		// TLS的状态在TLSConn中，socket不能单独交出去
+		int fd = conn->m_fd;
+		bool bdetach = (bkeep == true && conn->m_tls == 0 && m_bstop == false);
+		CloseConnLocked(conn, !bdetach);
+		pthread_mutex_unlock(&m_lock);
+		on_detach(bdetach == true ? fd : -1, detach_arg);
+		return;
+	}
+
+	if (bkeep == true && m_bdraining == true && m_bstop == false)
+	{
+		// 排空时把已经到达的请求处理完再关闭连接
+		if (HasInput(conn) == true)
+		{
+			EnqueueLocked(conn);
+			pthread_mutex_unlock(&m_lock);
+			return;
+		}
+		bkeep = false;
+	}
+
+	if (bkeep == true && bshed == true && m_bstop == false)
+	{
+		PauseLocked(conn);
+		pthread_mutex_unlock(&m_lock);
+		return;
+	}
+
+	conn->m_bbusy = false;
+	if (bkeep == false || m_bstop == true)
+	{
+		CloseConnLocked(conn);
+	}
+	else
+	{
+		RearmLocked(conn);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+/**
+ * @brief 连接处理完后重新等待数据，调用者需要持有m_lock
+ * @details TLS连接上OpenSSL可能已经读入了下一个报文，epoll不会再通知，直接放入工作队列
+ */
+void FrameServer::RearmLocked(Conn *conn)
+{
+	if (conn->m_tls != 0 && conn->m_tls->Pending() == true)
+	{
+		EnqueueLocked(conn);
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = CONN_EVENTS;
+	ev.data.ptr = conn;
+	epoll_ctl(m_epfd, EPOLL_CTL_MOD, conn->m_fd, &ev);
+}
+
+/**
+ * @brief 连接上是否已经有数据可读，包括TLS层已经读入的数据
+ */
+bool FrameServer::HasInput(Conn *conn)
+{
+	if (conn->m_tls != 0 && conn->m_tls->Pending() == true)
+	{
+		return true;
+	}
+
+	struct pollfd pfd;
+	pfd.fd = conn->m_fd;
+	pfd.events = POLLIN;
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) != 0;
+}
+
+bool FrameServer::ReadFrame(Conn *conn, char *buffer, int *ilen, TCPFrameMeta *meta)
+{
+	if (conn->m_tls != 0)
+	{
+		return conn->m_tls->Read(buffer, ilen, m_max_frame);
+	}
+
+	if (TCPReadEx(conn->m_fd, buffer, ilen, meta, 0, m_max_frame) == false)
+	{
+		return false;
+	}
+
+	// 工作线程取出连接之后才读长度头，在工作队列中等待的时间也要计入预算，
+	// 从连接变为可读的时刻开始算，排队时已经过期的请求才能在处理之前被丢弃
+	if (meta->m_budget_us != 0)
+	{
+		meta->m_deadline = conn->m_enqueue_time + (unsigned long)meta->m_budget_us * 1000;
+	}
+
+	return true;
+}
+
+/**
+ * @brief 发送应答，请求是扩展报文时应答也用扩展报文，带回请求id
+ */
+bool FrameServer::WriteFrame(Conn *conn, const char *data, const int ilen, const TCPFrameMeta &meta)
+{
+	if (conn->m_tls != 0)
+	{
+		return conn->m_tls->Write(data, ilen);
+	}
+
+	if (meta.m_bext == true)
+	{
+		TCPFrameMeta reply;
+		reply.m_request_id = meta.m_request_id;
+		reply.m_deadline = 0;
+		reply.m_budget_us = 0;
+		reply.m_bext = true;
+		return TCPWriteEx(conn->m_fd, data, ilen, reply);
+	}
+
+	return TCPWrite(conn->m_fd, data, ilen);
+}
+
+/**
+ * @brief 排空连接
+ * @param drain_timeout 最长等待时间，单位为秒
+ * @return 所有连接都在超时之前关闭返回true
+ */
+bool FrameServer::Drain(const int drain_timeout)
+{
+	pthread_mutex_lock(&m_lock);
+	if (m_brunning == false)
+	{
+		pthread_mutex_unlock(&m_lock);
+		return true;
+	}
+	m_bdraining = true;
+	pthread_mutex_unlock(&m_lock);
+
+	// 监听socket和空闲连接由IO线程关闭
+	Wake();
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += drain_timeout;
+
+	pthread_mutex_lock(&m_lock);
+	while (m_conn_count > 0)
+	{
+		if (pthread_cond_timedwait(&m_drain_cond, &m_lock, &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+
+	bool bdrained = (m_conn_count == 0);
+	if (bdrained == false)
+	{
+		// 超时后强制关闭，阻塞在读写上的工作线程会立即返回失败
+		for (size_t i = 0; i < m_conns.size(); i++)
+		{
+			if (m_conns[i] != 0)
+			{
+				shutdown(m_conns[i]->m_fd, SHUT_RDWR);
+			}
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	return bdrained;
+}
+
+/**
+ * @brief 停止所有线程并关闭所有连接
+ */
+void FrameServer::Stop()
+{
+	if (m_brunning == false)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	__atomic_store_n(&m_bstop, true, __ATOMIC_RELEASE);
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		if (m_conns[i] != 0 && m_conns[i]->m_bbusy == true)
+		{
+			shutdown(m_conns[i]->m_fd, SHUT_RDWR);
+		}
+	}
+	pthread_cond_broadcast(&m_queue_cond);
+	pthread_mutex_unlock(&m_lock);
+	Wake();
+
+	pthread_join(m_io_tid, 0);
+	for (size_t i = 0; i < m_worker_tids.size(); i++)
+	{
+		pthread_join(m_worker_tids[i], 0);
+	}
+	m_worker_tids.clear();
+
+	pthread_mutex_lock(&m_lock);
+	m_queue.clear();
+	m_shed_queue.clear();
+	m_paused.clear();
+	for (size_t i = 0; i < m_conns.size(); i++)
+	{
+		if (m_conns[i] != 0)
+		{
+			CloseConnLocked(m_conns[i]);
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	m_tcpserver.CloseServerSocket();
+	free(m_discard);
+	m_discard = 0;
+	close(m_wakefd);
+	close(m_epfd);
+	m_wakefd = -1;
+	m_epfd = -1;
+	if (m_reserve_fd != -1)
+	{
+		close(m_reserve_fd);
+		m_reserve_fd = -1;
+	}
+	m_brunning = false;
+}
+
+int FrameServer::Connections()
+{
+	pthread_mutex_lock(&m_lock);
+	int icount = m_conn_count;
+	pthread_mutex_unlock(&m_lock);
+
+	return icount;
+}
+
+FrameServer::~FrameServer()
+{
+	Stop();
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_queue_cond);
+	pthread_cond_destroy(&m_drain_cond);
+}
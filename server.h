@@ -0,0 +1,243 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+#include "public.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "tls.h"
+
+/**
+ * @brief 一个请求报文以及它的应答
+ *
+ * 报文的格式为 命令 参数，命令是报文开头到第一个空白字符为止的部分，
+ * 服务端按命令把报文交给注册的处理函数。
+ * 扩展报文（见tcpsocket.h）带有请求id和截止时间，应答也用扩展报文并带回同样的id。
+ */
+struct FrameRequest
+{
+	int         m_fd;          // 客户端socket
+	const char *m_client_ip;   // 客户端IP地址
+	const char *m_data;        // 整个报文
+	int         m_len;         // 报文长度
+	const char *m_args;        // 命令后面的参数，已跳过空白字符
+	int         m_args_len;
+	string      m_reply;       // 应答内容
+	bool        m_breply;      // 是否发送应答
+	bool        m_bclose;      // 发送应答后是否关闭连接
+	unsigned long m_request_id;  // 扩展报文的请求id，普通报文为0
+	unsigned long m_deadline;    // 截止时间（MetricNow），0为没有截止时间，耗时的处理函数可以据此提前放弃
+	bool        m_btls;        // 连接使用TLS，这时不能Detach
+
+	void      (*m_on_detach)(int fd, void *arg);   // 由Detach设置
+	void       *m_detach_arg;
+
+	void Reply(const char *data, const int len)
+	{
+		m_reply.assign(data, len);
+		m_breply = true;
+	}
+
+	void Reply(const string &data)
+	{
+		m_reply = data;
+		m_breply = true;
+	}
+
+	/*
+	 * 发送应答后把连接从服务器中移出，不再读取报文，由func接管socket（包括关闭），
+	 * 用于订阅等服务端主动推送的连接。func在工作线程中调用，
+	 * 连接已经关闭或者使用TLS时fd为-1，func需要释放arg。
+	 * 使用TLS的连接（m_btls）应当在调用之前就拒绝请求
+	 * */
+	void Detach(void (*func)(int fd, void *arg), void *arg)
+	{
+		m_on_detach = func;
+		m_detach_arg = arg;
+	}
+};
+
+/*
+ * 报文处理函数，在工作线程中调用，返回false时关闭连接
+ * */
+typedef bool (*FrameHandler)(FrameRequest *req, void *arg);
+
+/**
+ * @brief 多线程报文服务器
+ *
+ * 一个IO线程用epoll等待监听socket和所有连接，连接上有数据时交给工作线程，
+ * 工作线程用TCPRead读取一个完整的报文，按命令调用处理函数，再用TCPWrite发送应答。
+ * 连接用EPOLLONESHOT注册，同一时刻只有一个工作线程处理同一个连接，
+ * 同一个连接上的请求按顺序处理和应答。
+ *
+ * 过载时由m_admission决定拒绝哪些连接和请求，被拒绝的连接和请求收到
+ * 内容为"BUSY"的应答，不调用处理函数，详见admission.h。
+ * 超过m_ratelimit中每个客户端的报文数或者字节数限额的请求同样应答"BUSY"。
+ * 取出时已经过了截止时间的请求应答"EXPIRED"，不调用处理函数，客户端已经放弃等待，
+ * 排队积压时不再为过期的请求花时间。
+ *
+ * 设置了m_tls时所有连接都使用TLS，连接上第一次有数据时由工作线程握手。
+ *
+ * 使用方法：
+ *   FrameServer server;
+ *   server.AddHandler("PING", HandlePing);
+ *   server.Listen(5005);
+ *   server.Start();
+ *   ...
+ *   server.Drain(30);
+ *   server.Stop();
+ */
+class FrameServer
+{
+	public:
+		int m_workers;         // 工作线程数，Start之前设置
+		int m_max_frame;       // 报文最大长度，单位为字节，Start之前设置
+		int m_backlog;         // 监听队列长度，Listen之前设置
+		int m_idle_timeout;    // 连接空闲超时，单位为秒，0表示不限制，运行中可以修改
+		int m_read_timeout;    // 读取一个报文的超时时间，单位为秒，防止慢速客户端长时间占用工作线程
+
+		SocketProfile m_profile; // 监听socket和连接的socket选项，Listen之前设置，缺省只设置TCP_NODELAY；
+		                         // 连接由工作线程阻塞读写，m_bnonblock总是按false处理
+
+		Admission   m_admission; // 准入控制，Start之前设置
+		RateLimiter m_ratelimit; // 按客户端地址限流，Start之前调用Init，限额运行中可以修改
+		TLSContext *m_tls;       // 服务端TLS配置，为0时使用明文，Start之前设置
+
+		FrameServer();
+
+		/*
+		 * 注册处理函数，需要在Start之前调用
+		 * name 命令名，区分大小写，最长31个字符
+		 * */
+		bool AddHandler(const char *name, FrameHandler handler, void *arg = 0);
+
+		/*
+		 * 设置没有匹配的命令时使用的处理函数，不设置时应答"ERR unknown command"
+		 * */
+		void SetDefaultHandler(FrameHandler handler, void *arg = 0);
+
+		/*
+		 * 在port上监听
+		 * */
+		bool Listen(const unsigned int port);
+
+		/*
+		 * 使用已经在监听的socket，用于热重启时接管旧进程的监听socket
+		 * */
+		bool Attach(const int listenfd);
+
+		int ListenFd() const;
+
+		/*
+		 * 启动IO线程和工作线程
+		 * */
+		bool Start();
+
+		/*
+		 * 停止接受新连接，等待正在处理的请求完成后关闭连接，空闲的连接立即关闭，
+		 * 超过drain_timeout秒仍未关闭的连接被强制关闭
+		 * 返回值 true为所有连接都在超时之前正常关闭
+		 * */
+		bool Drain(const int drain_timeout);
+
+		/*
+		 * 停止所有线程并关闭所有连接
+		 * */
+		void Stop();
+
+		int Connections();
+
+		~FrameServer();
+
+	private:
+		struct Conn
+		{
+			int           m_fd;
+			char          m_ip[INET_ADDRSTRLEN];
+			unsigned int  m_addr;           // 客户端IPv4地址，网络字节序
+			unsigned long m_rate_key;       // 客户端在m_ratelimit中的键
+			TLSConn      *m_tls;            // TLS状态，还没有握手时为0
+			bool          m_bbusy;          // 正在工作线程中处理
+			bool          m_badmitted;      // 请求已计入m_admission的在途请求
+			bool          m_bshed;          // 请求被拒绝，只读取报文并应答BUSY
+			time_t        m_last_active;
+			unsigned long m_enqueue_time;   // 放入工作队列的时刻，单位为纳秒
+		};
+
+		struct Route
+		{
+			char             m_name[32];
+			FrameHandler     m_handler;
+			void            *m_arg;
+			MetricCounter   *m_frames;
+			MetricHistogram *m_latency;
+		};
+
+		TCPServer m_tcpserver;
+		int       m_epfd;
+		int       m_wakefd;                // 唤醒IO线程的eventfd
+		int       m_reserve_fd;            // 预留的文件句柄，文件句柄用完时关闭它来拒绝连接
+
+		vector<Route> m_routes;
+		Route         m_default;
+
+		pthread_mutex_t m_lock;            // 保护下面的成员
+		pthread_cond_t  m_queue_cond;
+		pthread_cond_t  m_drain_cond;
+		deque<Conn *>   m_queue;
+		deque<Conn *>   m_shed_queue;      // 被拒绝的请求，优先处理，应答BUSY的开销很小
+		deque<pair<unsigned long, Conn *> > m_paused;   // 被拒绝后暂停读取的连接及恢复的时刻
+		char           *m_discard;         // IO线程直接拒绝请求时读取报文的缓冲区
+		vector<Conn *>  m_conns;           // 按fd为下标
+		int             m_conn_count;
+		bool            m_brunning;
+		bool            m_bdraining;
+		bool            m_bstop;
+		time_t          m_accept_paused;   // 文件句柄用完时暂停监听的时刻，0为没有暂停
+
+		pthread_t         m_io_tid;
+		vector<pthread_t> m_worker_tids;
+
+		static void *IOThread(void *arg);
+
+		static void *WorkerThread(void *arg);
+
+		void AcceptConns();
+
+		void AcceptExhausted();
+
+		void Dispatch(Conn *conn);
+
+		void EnqueueLocked(Conn *conn);
+
+		int RejectFast(Conn *conn);
+
+		void PauseLocked(Conn *conn);
+
+		int ResumePaused(const unsigned long now);
+
+		void RearmLocked(Conn *conn);
+
+		bool HasInput(Conn *conn);
+
+		bool ReadFrame(Conn *conn, char *buffer, int *ilen, TCPFrameMeta *meta);
+
+		bool WriteFrame(Conn *conn, const char *data, const int ilen, const TCPFrameMeta &meta);
+
+		Conn *DequeueLocked();
+
+		void Sweep(const time_t now);
+
+		void HandleConn(Conn *conn, char *buffer);
+
+		const Route *FindRoute(const char *data, const int len, int *icmd_len);
+
+		/*
+		 * bclose为false时只把连接移出服务器，socket交给调用者
+		 * */
+		void CloseConnLocked(Conn *conn, const bool bclose = true);
+
+		void Wake();
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "public.h"
+#include "sockopt.h"
+
+/*
+ * 函数功能：SocketProfile类构造函数，缺省配置只设置SO_REUSEADDR和监听队列长度
+ * */
+SocketProfile::SocketProfile()
+{
+	m_backlog = 4096;
+	m_bnodelay = false;
+	m_bquickack = false;
+	m_sndbuf = 0;
+	m_rcvbuf = 0;
+	m_defer_accept = 0;
+	m_fastopen = 0;
+	m_keepidle = 0;
+	m_keepintvl = 0;
+	m_keepcnt = 0;
+	m_user_timeout = 0;
+	m_bnonblock = false;
+}
+
+SocketProfile SocketProfile::LowLatency()
+{
+	SocketProfile profile;
+	profile.m_bnodelay = true;
+	profile.m_bquickack = true;
+	profile.m_defer_accept = 1;
+	profile.m_fastopen = 256;
+	profile.m_keepidle = 30;
+	profile.m_keepintvl = 5;
+	profile.m_keepcnt = 3;
+	profile.m_user_timeout = 10000;
+	return profile;
+}
+
+SocketProfile SocketProfile::BulkThroughput()
+{
+	SocketProfile profile;
+	profile.m_sndbuf = 4 * 1024 * 1024;
+	profile.m_rcvbuf = 4 * 1024 * 1024;
+	profile.m_keepidle = 120;
+	profile.m_keepintvl = 30;
+	profile.m_keepcnt = 4;
+	profile.m_user_timeout = 60000;
+	return profile;
+}
+
+bool SocketProfile::ByName(const char *name, SocketProfile *profile)
+{
+	if (strcmp(name, "default") == 0)
+	{
+		*profile = SocketProfile();
+	}
+	else if (strcmp(name, "low_latency") == 0)
+	{
+		*profile = LowLatency();
+	}
+	else if (strcmp(name, "bulk_throughput") == 0)
+	{
+		*profile = BulkThroughput();
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * 设置一个整数选项，失败时把bok置为false
+ * */
+static void SetInt(const int fd, const int level, const int name, const int value, bool *bok)
+{
+	if (setsockopt(fd, level, name, &value, sizeof(value)) != 0)
+	{
+		*bok = false;
+	}
+}
+
+/*
+ * 收发缓冲区，监听socket和客户端socket共用
+ * */
+static void SetBuffers(const SocketProfile *profile, const int fd, bool *bok)
+{
+	if (profile->m_sndbuf > 0)
+	{
+		SetInt(fd, SOL_SOCKET, SO_SNDBUF, profile->m_sndbuf, bok);
+	}
+	if (profile->m_rcvbuf > 0)
+	{
+		SetInt(fd, SOL_SOCKET, SO_RCVBUF, profile->m_rcvbuf, bok);
+	}
+}
+
+bool SocketProfile::ApplyListen(const int fd) const
+{
+	bool bok = true;
+
+	SetInt(fd, SOL_SOCKET, SO_REUSEADDR, 1, &bok);
+	SetBuffers(this, fd, &bok);
+
+	if (m_defer_accept > 0)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, m_defer_accept, &bok);
+	}
+	if (m_fastopen > 0)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_FASTOPEN, m_fastopen, &bok);
+	}
+
+	return bok;
+}
+
+bool SocketProfile::ApplyConnect(const int fd) const
+{
+	bool bok = true;
+
+	SetBuffers(this, fd, &bok);
+
+	// connect立即返回，SYN和第一次写的数据一起发出，服务端不支持时内核自动退回普通握手
+	if (m_fastopen > 0)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, &bok);
+	}
+
+	return bok;
+}
+
+/**
+ * @brief 设置已经建立的连接的选项
+ * @details 缺省配置下不做任何系统调用，每个连接都调用没有额外开销
+ */
+bool SocketProfile::ApplyConn(const int fd) const
+{
+	bool bok = true;
+
+	if (m_bnodelay == true)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_NODELAY, 1, &bok);
+	}
+	if (m_bquickack == true)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_QUICKACK, 1, &bok);
+	}
+
+	if (m_keepidle > 0)
+	{
+		SetInt(fd, SOL_SOCKET, SO_KEEPALIVE, 1, &bok);
+		SetInt(fd, IPPROTO_TCP, TCP_KEEPIDLE, m_keepidle, &bok);
+		if (m_keepintvl > 0)
+		{
+			SetInt(fd, IPPROTO_TCP, TCP_KEEPINTVL, m_keepintvl, &bok);
+		}
+		if (m_keepcnt > 0)
+		{
+			SetInt(fd, IPPROTO_TCP, TCP_KEEPCNT, m_keepcnt, &bok);
+		}
+	}
+
+	if (m_user_timeout > 0)
+	{
+		SetInt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, m_user_timeout, &bok);
+	}
+
+	return bok;
+}
+
+int SocketProfile::AcceptFlags() const
+{
+	return SOCK_CLOEXEC | (m_bnonblock == true ? SOCK_NONBLOCK : 0);
+}
@@ -0,0 +1,74 @@
+#ifndef __SOCKOPT_H__
+#define __SOCKOPT_H__
+#include "public.h"
+
+/**
+ * @brief 一组socket选项，TCPServer和TCPClient在创建、接受和建立连接时设置
+ *
+ * 缺省构造的配置和以前的行为相同：除了SO_REUSEADDR不设置任何选项，只把监听队列
+ * 从5改成4096（超过net.core.somaxconn时由内核截断），突发的连接请求不会因为队列满
+ * 被丢弃SYN、等待1秒以上的重传。
+ *
+ * 两个预置配置：
+ *   LowLatency      请求应答类的短报文：关闭Nagle算法、立即确认、延迟accept到第一个
+ *                   报文到达、TCP Fast Open、较短的保活和发送超时，及早发现断开的连接
+ *   BulkThroughput  大块数据传输：保留Nagle算法，收发缓冲区4MB，保活间隔较长
+ *
+ * 收发缓冲区必须在连接建立之前设置才能协商窗口扩大因子，所以服务端设置在监听socket上，
+ * 由accept出来的连接继承；客户端在connect之前设置。设置之后内核不再自动调整缓冲区大小。
+ *
+ * 各个选项设置失败时继续设置其余选项，Apply系列方法返回false，errno为最后一次失败的原因。
+ */
+class SocketProfile
+{
+	public:
+		int  m_backlog;          // 监听队列长度
+		bool m_bnodelay;         // TCP_NODELAY
+		bool m_bquickack;        // TCP_QUICKACK，内核在一段时间没有数据后会退出快速确认模式，连接建立时设置一次
+		int  m_sndbuf;           // SO_SNDBUF，单位为字节，0表示使用系统缺省值并自动调整
+		int  m_rcvbuf;           // SO_RCVBUF，同上
+		int  m_defer_accept;     // TCP_DEFER_ACCEPT，单位为秒，连接上有数据或者超时之后accept才返回，
+		                         // 只适用于客户端先发数据的协议（本库的报文协议都是），0表示不设置
+		int  m_fastopen;         // 服务端为TCP_FASTOPEN的队列长度，客户端为TCP_FASTOPEN_CONNECT，0表示不设置
+		                         // 服务端还需要net.ipv4.tcp_fastopen打开服务端支持
+		int  m_keepidle;         // 连接空闲多少秒后开始发送保活探测，0表示不打开SO_KEEPALIVE
+		int  m_keepintvl;        // 保活探测的间隔，单位为秒
+		int  m_keepcnt;          // 连续多少次探测没有应答时断开连接
+		int  m_user_timeout;     // TCP_USER_TIMEOUT，发出的数据多少毫秒没有被确认时断开连接，0表示不设置
+		bool m_bnonblock;        // 接受的连接设置SOCK_NONBLOCK，只用于自己管理事件循环的调用者，
+		                         // TCPServer的TCPReadBuffer等阻塞接口要求为false
+
+		SocketProfile();
+
+		static SocketProfile LowLatency();
+
+		static SocketProfile BulkThroughput();
+
+		/*
+		 * 按名字取配置：default、low_latency、bulk_throughput
+		 * 返回值 名字不认识时返回false，profile不变
+		 * */
+		static bool ByName(const char *name, SocketProfile *profile);
+
+		/*
+		 * 设置监听socket的选项，bind之前调用
+		 * */
+		bool ApplyListen(const int fd) const;
+
+		/*
+		 * 设置客户端socket在connect之前的选项
+		 * */
+		bool ApplyConnect(const int fd) const;
+
+		/*
+		 * 设置已经建立的连接的选项，服务端在accept之后、客户端在connect之后调用
+		 * */
+		bool ApplyConn(const int fd) const;
+
+		/*
+		 * accept4的flags
+		 * */
+		int AcceptFlags() const;
+};
+
+#endif
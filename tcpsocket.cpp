@@ -1,5 +1,42 @@
 #include "tcpsocket.h"
+#include "tls.h"
 #include "public.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+ * 套接字层的指标，程序启动时注册，可以通过MetricsDump导出
+ * */
+static MetricHistogram *g_tcp_read_latency = NewMetricHistogram("moserver_tcp_read_seconds",
+		"Time to receive one frame after data became readable");
+static MetricHistogram *g_tcp_write_latency = NewMetricHistogram("moserver_tcp_write_seconds",
+		"Time to send one frame");
+static MetricCounter *g_tcp_read_bytes = NewMetricCounter("moserver_tcp_read_bytes_total",
+		"Bytes received including frame headers");
+static MetricCounter *g_tcp_write_bytes = NewMetricCounter("moserver_tcp_write_bytes_total",
+		"Bytes sent including frame headers");
+static MetricCounter *g_tcp_read_errors = NewMetricCounter("moserver_tcp_errors_total",
+		"Failed socket operations", "op=\"read\"");
+static MetricCounter *g_tcp_write_errors = NewMetricCounter("moserver_tcp_errors_total",
+		"Failed socket operations", "op=\"write\"");
+static MetricCounter *g_tcp_client_timeouts = NewMetricCounter("moserver_tcp_timeouts_total",
+		"Reads that timed out waiting for data", "side=\"client\"");
+static MetricCounter *g_tcp_server_timeouts = NewMetricCounter("moserver_tcp_timeouts_total",
+		"Reads that timed out waiting for data", "side=\"server\"");
+static MetricCounter *g_tcp_raw_timeouts = NewMetricCounter("moserver_tcp_timeouts_total",
+		"Reads that timed out waiting for data", "side=\"raw\"");
+static MetricCounter *g_tcp_connect_failures = NewMetricCounter("moserver_tcp_connect_failures_total",
+		"Failed TCPClient connection attempts");
+static MetricGauge *g_tcp_client_conns = NewMetricGauge("moserver_tcp_open_connections",
+		"Currently open connections", "side=\"client\"");
+static MetricGauge *g_tcp_server_conns = NewMetricGauge("moserver_tcp_open_connections",
+		"Currently open connections", "side=\"server\"");
+static MetricCounter *g_tcp_busy_poll_hits = NewMetricCounter("moserver_tcp_busy_poll_total",
+		"Busy-poll reads by outcome", "result=\"hit\"");
+static MetricCounter *g_tcp_busy_poll_misses = NewMetricCounter("moserver_tcp_busy_poll_total",
+		"Busy-poll reads by outcome", "result=\"miss\"");
+
+#define TCP_SPIN_MAX_BACKOFF 1024   // 忙轮询连续落空时最多跳过的空转次数
 
 /*
  * 函数功能：向TCP连接写入数据
@@ -35,17 +72,76 @@ bool TCPWrite(const int sockfd, const char * buffer, const int ibuffer_len)
 	// 转换为网络字节序
 	int ilen_byte = htonl(ilen);
 
-	// 准备发送缓冲区，包含长度头和数据
-	char TCPBuffer[ilen + 4];
-	memset(TCPBuffer, 0, sizeof(TCPBuffer));
-	memcpy(TCPBuffer, &ilen_byte, 4);
-	memcpy(TCPBuffer + 4, buffer, ilen);
+	// 长度头和数据用writev一次发送，不在栈上拷贝整个报文，大报文也不会撑爆栈
+	struct iovec iov[2];
+	iov[0].iov_base = &ilen_byte;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = (void *)buffer;
+	iov[1].iov_len = ilen;
 
 	// 发送数据
-	if (TCPWriteN(sockfd, TCPBuffer, ilen + 4) == false)
+	unsigned long start = MetricNow();
+	bool bok;
+	TRACE_CALL(bok, "write", TCPWriteV(sockfd, iov, 2), ilen);
+	if (bok == false)
 	{
+		g_tcp_write_errors->Add();
 		return false;
 	}
+	g_tcp_write_latency->Record(MetricNow() - start);
+	g_tcp_write_bytes->Add(ilen + 4);
+	return true;
+}
+
+/*
+ * 函数功能：向TCP连接写入扩展报文
+ * 参数说明：
+ *   sockfd      - socket文件描述符
+ *   buffer      - 待发送数据的缓冲区
+ *   ibuffer_len - 待发送数据的长度，如果为0则按字符串处理
+ *   meta        - 请求id和截止时间
+ * 返回值：
+ *   true  - 发送成功
+ *   false - 发送失败
+ */
+bool TCPWriteEx(const int sockfd, const char *buffer, const int ibuffer_len, const TCPFrameMeta &meta)
+{
+	if (sockfd == -1)
+	{
+		return false;
+	}
+
+	int ilen = (ibuffer_len == 0) ? strlen(buffer) : ibuffer_len;
+	unsigned int header = htonl((unsigned int)ilen | TCP_FRAME_EXT);
+
+	// 预算向上取整到微秒，已经过期的请求按1微秒发送，由接收方丢弃
+	unsigned int budget_us = 0;
+	if (meta.m_deadline != 0)
+	{
+		unsigned long now = MetricNow();
+		unsigned long us = meta.m_deadline > now ? (meta.m_deadline - now + 999) / 1000 : 1;
+		budget_us = us < 0xffffffffUL ? us : 0xffffffffU;
+	}
+	unsigned int ext[4] = { htonl(meta.m_request_id >> 32), htonl(meta.m_request_id & 0xffffffff), htonl(budget_us), 0 };
+
+	struct iovec iov[3];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = ext;
+	iov[1].iov_len = TCP_FRAME_EXT_LEN;
+	iov[2].iov_base = (void *)buffer;
+	iov[2].iov_len = ilen;
+
+	unsigned long start = MetricNow();
+	bool bok;
+	TRACE_CALL(bok, "write", TCPWriteV(sockfd, iov, 3), ilen);
+	if (bok == false)
+	{
+		g_tcp_write_errors->Add();
+		return false;
+	}
+	g_tcp_write_latency->Record(MetricNow() - start);
+	g_tcp_write_bytes->Add(ilen + 4 + TCP_FRAME_EXT_LEN);
 	return true;
 }
 
@@ -56,11 +152,26 @@ bool TCPWrite(const int sockfd, const char * buffer, const int ibuffer_len)
  *   buffer      - 接收数据的缓冲区
  *   ibuffer_len - 接收到的数据长度
  *   itimeout    - 超时时间(秒)，0表示不超时，>0表示超时时间，-1表示无限等待
+ *   imaxlen     - 缓冲区大小，报文长度超过它时返回失败，0表示不检查
  * 返回值：
  *   true  - 读取成功
  *   false - 读取失败或超时
  */
-bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeout)
+bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeout, const int imaxlen)
+{
+	return TCPReadEx(sockfd, buffer, ibuffer_len, 0, itimeout, imaxlen);
+}
+
+/*
+ * 函数功能：从TCP连接读取普通报文或者扩展报文
+ * 参数说明：
+ *   meta        - 返回扩展头中的请求id和截止时间，可以为0
+ *   其他参数和TCPRead相同
+ * 返回值：
+ *   true  - 读取成功
+ *   false - 读取失败或超时
+ */
+bool TCPReadEx(const int sockfd, char *buffer, int *ibuffer_len, TCPFrameMeta *meta, const int itimeout, const int imaxlen)
 {
 	// 检查socket是否有效
 	if (sockfd == -1)
@@ -75,8 +186,13 @@ bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeou
 		struct pollfd pfd;
 		pfd.fd = sockfd;
 		pfd.events = POLLIN;
-		if (poll(&pfd, 1, itimeout * 1000) <= 0)
+		int iret;
+		if ((iret = poll(&pfd, 1, itimeout * 1000)) <= 0)
 		{
+			if (iret == 0)
+			{
+				g_tcp_raw_timeouts->Add();
+			}
 			return false;
 		}
 	}
@@ -95,21 +211,62 @@ bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeou
 
 	// 初始化接收长度
 	(*ibuffer_len) = 0;
+	if (meta != 0)
+	{
+		memset(meta, 0, sizeof(*meta));
+	}
 
 	// 先读取4字节的长度信息
-	if (TCPReadN(sockfd, (char *)ibuffer_len, 4) == false)
+	unsigned int header = 0;
+	bool bok;
+	TRACE_CALL(bok, "read_header", TCPReadN(sockfd, (char *)&header, 4), sockfd);
+	if (bok == false)
 	{
+		g_tcp_read_errors->Add();
 		return false;
 	}
+	unsigned long start = MetricNow();
+
+	// 转换网络字节序为主机字节序，扩展报文再读16字节的扩展头
+	header = ntohl(header);
+	int iext_len = 0;
+	if ((header & TCP_FRAME_EXT) != 0)
+	{
+		unsigned int ext[4];
+		if (TCPReadN(sockfd, (char *)ext, TCP_FRAME_EXT_LEN) == false)
+		{
+			g_tcp_read_errors->Add();
+			return false;
+		}
+		if (meta != 0)
+		{
+			unsigned long budget_us = ntohl(ext[2]);
+			meta->m_request_id = ((unsigned long)ntohl(ext[0]) << 32) | ntohl(ext[1]);
+			meta->m_deadline = budget_us != 0 ? start + budget_us * 1000 : 0;
+			meta->m_budget_us = budget_us;
+			meta->m_bext = true;
+		}
+		header &= ~TCP_FRAME_EXT;
+		iext_len = TCP_FRAME_EXT_LEN;
+	}
+	(*ibuffer_len) = header;
 
-	// 转换网络字节序为主机字节序
-	(*ibuffer_len) = ntohl(*ibuffer_len);
+	// 长度头来自对端，不可信，超过缓冲区大小时不能继续读
+	if ((*ibuffer_len) < 0 || (imaxlen > 0 && (*ibuffer_len) > imaxlen))
+	{
+		g_tcp_read_errors->Add();
+		return false;
+	}
 
 	// 读取实际数据
-	if (TCPReadN(sockfd, buffer, (*ibuffer_len)) == false)
+	TRACE_CALL(bok, "read_body", TCPReadN(sockfd, buffer, (*ibuffer_len)), (*ibuffer_len));
+	if (bok == false)
 	{
+		g_tcp_read_errors->Add();
 		return false;
 	}
+	g_tcp_read_latency->Record(MetricNow() - start);
+	g_tcp_read_bytes->Add((*ibuffer_len) + 4 + iext_len);
 
 	return true;
 }
@@ -177,6 +334,48 @@ bool TCPWriteN(const int sockfd, char *buffer, const size_t n)
 	return true;
 }
 
+/*
+ * 函数功能：把多段数据一次写入TCP连接
+ * 参数说明：
+ *   sockfd - socket文件描述符
+ *   iov    - 数据段数组，发送过程中会被修改
+ *   iovcnt - 数据段个数
+ * 返回值：
+ *   true  - 发送成功
+ *   false - 发送失败
+ */
+bool TCPWriteV(const int sockfd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t wbytes = writev(sockfd, iov, iovcnt);
+		if (wbytes <= 0)
+		{
+			if (wbytes < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		// 跳过已经发送完的数据段，调整发送了一部分的数据段
+		while (iovcnt > 0 && wbytes >= (ssize_t)iov->iov_len)
+		{
+			wbytes -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + wbytes;
+			iov->iov_len -= wbytes;
+		}
+	}
+
+	return true;
+}
+
 /*
  * 函数功能：TCPClient类构造函数
  * 功能说明：初始化TCPClient对象的成员变量
@@ -187,6 +386,12 @@ TCPClient::TCPClient()
 	memset(m_host, 0, sizeof(m_host));
 	m_port = 0;
 	m_timeout = false;
+	m_tls = 0;
+	m_spin_ns = 0;
+	m_spin_skip = 0;
+	m_spin_backoff = 0;
+	m_busy_poll_us = 0;
+	m_incoming_cpu = -1;
 }
 
 /*
@@ -202,8 +407,7 @@ bool TCPClient::NewTCPClient(const char *host, const int port)
 {
 	if (m_connfd != -1)
 	{
-		close(m_connfd);
-		m_connfd = -1;
+		Close();
 	}
 
 	signal(SIGPIPE, SIG_IGN);
@@ -212,46 +416,152 @@ bool TCPClient::NewTCPClient(const char *host, const int port)
 
 	m_port = port;
 
-	struct hostent* hstent;
 	struct sockaddr_in serv_addr;
 
-	if ((m_connfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if ((m_connfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
 	{
-		return false;
-	}
-
-	if (!(hstent = gethostbyname(m_host)))
-	{
-		close(m_connfd);
-		m_connfd = -1;
+		g_tcp_connect_failures->Add();
 		return false;
 	}
 
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
 	serv_addr.sin_port = htons(m_port);
-	memcpy(&serv_addr.sin_addr, hstent->h_addr_list, hstent->h_length);
+
+	// gethostbyname返回静态结构，多个线程同时连接时会互相覆盖，改用getaddrinfo
+	if (inet_pton(AF_INET, m_host, &serv_addr.sin_addr) != 1)
+	{
+		struct addrinfo hints;
+		struct addrinfo *result = 0;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(m_host, 0, &hints, &result) != 0 || result == 0)
+		{
+			close(m_connfd);
+			m_connfd = -1;
+			g_tcp_connect_failures->Add();
+			return false;
+		}
+		serv_addr.sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+		freeaddrinfo(result);
+	}
+
+	// 选项设置失败不影响连接，和以前没有设置选项时一样可以使用
+	m_profile.ApplyConnect(m_connfd);
 
 	if (connect(m_connfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0)
 	{
 		close(m_connfd);
 		m_connfd = -1;
+		g_tcp_connect_failures->Add();
 		return false;
 	}
+	g_tcp_client_conns->Add();
+
+	m_profile.ApplyConn(m_connfd);
+
+	if (m_busy_poll_us > 0 || m_incoming_cpu >= 0)
+	{
+		SetBusyPoll(m_spin_ns / 1000, m_busy_poll_us, m_incoming_cpu);
+	}
 
 	return true;
 }
 
+/*
+ * 函数功能：在已经建立的连接上进行TLS握手
+ * 参数说明：
+ *   ctx      - 客户端TLSContext
+ *   itimeout - 握手超时时间(秒)
+ * 返回值：
+ *   true  - 握手成功
+ *   false - 握手失败，连接已关闭
+ */
+bool TCPClient::StartTLS(TLSContext *ctx, const int itimeout)
+{
+	if (m_connfd == -1)
+	{
+		return false;
+	}
+
+	char session_key[64];
+	snprintf(session_key, sizeof(session_key), "%s:%d", m_host, m_port);
+
+	m_tls = new TLSConn;
+	if (m_tls->Connect(ctx, m_connfd, m_host, session_key, itimeout) == false)
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool TCPClient::SetBusyPoll(const int ispin_us, const int ibusy_poll_us, const int icpu)
+{
+	m_spin_ns = ispin_us > 0 ? (long)ispin_us * 1000 : 0;
+	m_spin_skip = 0;
+	m_spin_backoff = 0;
+	m_busy_poll_us = ibusy_poll_us > 0 ? ibusy_poll_us : 0;
+	m_incoming_cpu = icpu >= 0 ? icpu : -1;
+
+	if (m_connfd == -1)
+	{
+		return true;
+	}
+
+	bool bret = true;
+	if (m_busy_poll_us > 0 &&
+			setsockopt(m_connfd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll_us, sizeof(m_busy_poll_us)) != 0)
+	{
+		bret = false;
+	}
+
+	if (m_incoming_cpu >= 0 &&
+			setsockopt(m_connfd, SOL_SOCKET, SO_INCOMING_CPU, &m_incoming_cpu, sizeof(m_incoming_cpu)) != 0)
+	{
+		bret = false;
+	}
+
+	return bret;
+}
+
+/*
+ * 用非阻塞的MSG_PEEK空转等待数据，最多budget_ns纳秒
+ * 有数据、对端关闭或者出错时返回true，由TCPRead读取或者报告错误；预算用完返回false
+ * */
+static bool SpinRecv(const int sockfd, const long budget_ns)
+{
+	unsigned long start = MetricNow();
+	char c;
+
+	while (true)
+	{
+		ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		{
+			return true;
+		}
+
+		if ((long)(MetricNow() - start) >= budget_ns)
+		{
+			return false;
+		}
+	}
+}
+
 /*
  * 函数功能：从服务器读取数据
  * 参数说明：
  *   buffer   - 接收数据的缓冲区
  *   itimeout - 超时时间(秒)，0表示不超时
+ *   imaxlen  - 报文的最大长度，通常为缓冲区的大小，0表示不检查
  * 返回值：
  *   true  - 读取成功
- *   false - 读取失败或超时
+ *   false - 读取失败、超时或者报文超过imaxlen
  */
-bool TCPClient::ReadBuffer(char *buffer, const int itimeout)
+bool TCPClient::ReadBuffer(char *buffer, const int itimeout, const int imaxlen)
 {
 	// 检查socket连接是否有效
 	if (m_connfd == -1)
@@ -259,8 +569,36 @@ bool TCPClient::ReadBuffer(char *buffer, const int itimeout)
 		return false;
 	}
 
-	// 如果设置了超时时间，则进行超时检测
-	if (itimeout > 0)
+	// 忙轮询模式先空转等待，TLS连接的数据可能已经读进OpenSSL，不空转
+	bool bready = false;
+	if (m_spin_ns > 0 && m_tls == 0)
+	{
+		if (m_spin_skip > 0)
+		{
+			m_spin_skip--;
+		}
+		else if (SpinRecv(m_connfd, m_spin_ns) == true)
+		{
+			// 命中时退避减半而不是清零，偶尔命中一次不会马上恢复每次都空转
+			bready = true;
+			m_spin_backoff /= 2;
+			g_tcp_busy_poll_hits->Add();
+		}
+		else
+		{
+			// 落空说明报文间隔比预算长或者对端没有CPU可用，之后几次直接阻塞等待
+			m_spin_backoff = m_spin_backoff == 0 ? 1 : m_spin_backoff * 2;
+			if (m_spin_backoff > TCP_SPIN_MAX_BACKOFF)
+			{
+				m_spin_backoff = TCP_SPIN_MAX_BACKOFF;
+			}
+			m_spin_skip = m_spin_backoff;
+			g_tcp_busy_poll_misses->Add();
+		}
+	}
+
+	// 如果设置了超时时间，则进行超时检测，TLS层已经读入的数据不用等
+	if (itimeout > 0 && bready == false && (m_tls == 0 || m_tls->Pending() == false))
 	{
 		struct pollfd pfd;
 		pfd.fd = m_connfd;
@@ -274,14 +612,20 @@ bool TCPClient::ReadBuffer(char *buffer, const int itimeout)
 			if (iret == 0)
 			{
 				m_timeout = true; // 设置超时标志
+				g_tcp_client_timeouts->Add();
 			}
 			return false;
 		}
 	}
 
 	m_buffer_len = 0;
+	if (m_tls != 0)
+	{
+		return m_tls->Read(buffer, &m_buffer_len, imaxlen);
+	}
+
 	// 调用底层TCPRead函数读取数据
-	return (TCPRead(m_connfd, buffer, &m_buffer_len));
+	return (TCPRead(m_connfd, buffer, &m_buffer_len, 0, imaxlen));
 }
 
 /*
@@ -308,6 +652,11 @@ bool TCPClient::WriteBuffer(const char *buffer, const int ibuffer_len)
 		ilen = strlen(buffer);
 	}
 
+	if (m_tls != 0)
+	{
+		return m_tls->Write(buffer, ilen);
+	}
+
 	// 调用底层TCPWrite函数发送数据
 	return (TCPWrite(m_connfd, buffer, ilen));
 }
@@ -318,9 +667,16 @@ bool TCPClient::WriteBuffer(const char *buffer, const int ibuffer_len)
  */
 void TCPClient::Close()
 {
+	if (m_tls != 0)
+	{
+		delete m_tls;
+		m_tls = 0;
+	}
+
 	if (m_connfd > 0)
 	{
 		close(m_connfd);
+		g_tcp_client_conns->Sub();
 	}
 
 	m_connfd = -1;
@@ -344,6 +700,7 @@ TCPServer::TCPServer()
 	m_clientfd = -1;
 	m_socklen = 0;
 	m_btimeout = false;
+	m_cliip[0] = 0;
 }
 
 /*
@@ -370,9 +727,7 @@ bool TCPServer::NewServer(const unsigned int port, const int backlog)
 
 	signal(SIGPIPE, SIG_IGN);
 
-	int sock_opt = 1;
-	unsigned int len = sizeof(sock_opt);
-	setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &sock_opt, len);
+	m_profile.ApplyListen(m_listenfd);
 
 	memset(&m_servaddr, 0, sizeof(m_servaddr));
 	m_servaddr.sin_family = AF_INET;
@@ -385,7 +740,7 @@ bool TCPServer::NewServer(const unsigned int port, const int backlog)
 		return false;
 	}
 
-	if (listen(m_listenfd, backlog) != 0)
+	if (listen(m_listenfd, backlog > 0 ? backlog : m_profile.m_backlog) != 0)
 	{
 		CloseServerSocket();
 		return false;
@@ -394,6 +749,34 @@ bool TCPServer::NewServer(const unsigned int port, const int backlog)
 	return true;
 }
 
+/*
+ * 函数功能：使用已经在监听的socket作为服务器socket
+ * 参数说明：
+ *   listenfd - 监听socket，例如热重启时从旧进程继承的socket
+ * 返回值：
+ *   true  - 成功
+ *   false - listenfd不是处于监听状态的TCP socket
+ */
+bool TCPServer::AttachServer(const int listenfd)
+{
+	int iaccept = 0;
+	socklen_t len = sizeof(iaccept);
+	if (getsockopt(listenfd, SOL_SOCKET, SO_ACCEPTCONN, &iaccept, &len) != 0 || iaccept == 0)
+	{
+		return false;
+	}
+
+	CloseServerSocket();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	m_listenfd = listenfd;
+	len = sizeof(m_servaddr);
+	getsockname(m_listenfd, (struct sockaddr *)&m_servaddr, &len);
+
+	return true;
+}
+
 /*
  * 函数功能：接受客户端连接
  * 返回值：
@@ -409,20 +792,39 @@ bool TCPServer::Accept()
 
 	m_socklen = sizeof(struct sockaddr_in);
 
-	if ((m_clientfd = accept(m_listenfd, (struct sockaddr *)&m_cliaddr, (socklen_t*)&m_socklen)) < 0)
+	// 连接socket不能被exec出来的子进程继承，否则热重启后旧连接不会被关闭
+	TRACE_CALL(m_clientfd, "accept", accept4(m_listenfd, (struct sockaddr *)&m_cliaddr, (socklen_t*)&m_socklen, m_profile.AcceptFlags()), m_clientfd);
+	if (m_clientfd < 0)
 	{
 		return false;
 	}
+	g_tcp_server_conns->Add();
+	m_profile.ApplyConn(m_clientfd);
 	return true;
 }
 
 /*
  * 函数功能：获取已连接客户端的IP地址
- * 返回值：客户端IP地址字符串
+ * 返回值：客户端IP地址字符串，保存在对象内，下一次调用前有效
  */
 char *TCPServer::GetClientIP()
 {
-	return (inet_ntoa(m_cliaddr.sin_addr));
+	// inet_ntoa返回的是所有线程共用的静态缓冲区，多个TCPServer对象在不同线程中会互相覆盖
+	if (inet_ntop(AF_INET, &m_cliaddr.sin_addr, m_cliip, sizeof(m_cliip)) == 0)
+	{
+		m_cliip[0] = 0;
+	}
+
+	return m_cliip;
+}
+
+/*
+ * 函数功能：获取已连接客户端的地址
+ * 返回值：最近一次Accept得到的客户端地址
+ */
+const struct sockaddr_in *TCPServer::GetClientAddr()
+{
+	return &m_cliaddr;
 }
 
 /*
@@ -430,11 +832,12 @@ char *TCPServer::GetClientIP()
  * 参数说明：
  *   buffer   - 接收数据的缓冲区
  *   itimeout - 超时时间(秒)，0表示不超时
+ *   imaxlen  - 报文的最大长度，通常为缓冲区的大小，0表示不检查
  * 返回值：
  *   true  - 读取成功
- *   false - 读取失败或超时
+ *   false - 读取失败、超时或者报文超过imaxlen
  */
-bool TCPServer::TCPReadBuffer(char *buffer, const int itimeout)
+bool TCPServer::TCPReadBuffer(char *buffer, const int itimeout, const int imaxlen)
 {
 	if (m_clientfd == -1)
 	{
@@ -454,6 +857,7 @@ bool TCPServer::TCPReadBuffer(char *buffer, const int itimeout)
 			if (iret == 0)
 			{
 				m_btimeout = true;
+				g_tcp_server_timeouts->Add();
 				return false;
 			}
 		}
@@ -461,7 +865,7 @@ bool TCPServer::TCPReadBuffer(char *buffer, const int itimeout)
 
 	m_ibuffer_len = 0;
 
-	return (TCPRead(m_clientfd, buffer, &m_ibuffer_len));
+	return (TCPRead(m_clientfd, buffer, &m_ibuffer_len, 0, imaxlen));
 }
 
 /*
@@ -492,27 +896,52 @@ bool TCPServer::TCPWriteBuffer(const char *buffer, const int ibuffer_len)
 
 /*
  * 函数功能：关闭服务器socket
- * 功能说明：关闭监听socket和客户端socket
+ * 功能说明：关闭监听socket，已接受的客户端socket由CloseClientSocket关闭
  */
 void TCPServer::CloseServerSocket()
 {
 	if (m_listenfd > 0)
 	{
 		close(m_listenfd);
-		close(m_clientfd);
 	}
+
+	m_listenfd = -1;
 }
 
 /*
  * 函数功能：关闭客户端socket
- * 功能说明：关闭当前连接的客户端socket
+ * 功能说明：关闭当前连接的客户端socket，监听socket保持打开，可以继续Accept
  */
 void TCPServer::CloseClientSocket()
 {
 	if (m_clientfd > 0)
 	{
 		close(m_clientfd);
-		close(m_listenfd);
+		g_tcp_server_conns->Sub();
+	}
+
+	m_clientfd = -1;
+}
+
+/*
+ * 函数功能：关闭一个已经从m_clientfd取走的客户端socket
+ * 功能说明：多个连接由其他线程处理时，Accept之后取走m_clientfd并置为-1，
+ *           连接结束时调用本函数关闭，连接数的统计和CloseClientSocket一致
+ */
+void TCPServer::CloseClientSocket(const int clientfd)
+{
+	if (clientfd > 0)
+	{
+		close(clientfd);
+		g_tcp_server_conns->Sub();
+	}
+}
+
+void TCPServer::DetachClientSocket(const int clientfd)
+{
+	if (clientfd > 0)
+	{
+		g_tcp_server_conns->Sub();
 	}
 }
 
@@ -1,15 +1,56 @@
 #ifndef __TCPSOCKET__
 #define __TCPSOCKET__
 #include "public.h"
+#include "sockopt.h"
 
 bool TCPWrite(const int sockfd, const char * buffer, const int ibuffer_len);
 
 bool TCPWriteN(const int sockfd, char *buffer, const size_t n);
 
-bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeout = 0);
+bool TCPRead(const int sockfd, char *buffer, int *ibuffer_len, const int itimeout = 0, const int imaxlen = 0);
 
 bool TCPReadN(const int sockfd, char * buffer, const size_t n);
 
+bool TCPWriteV(const int sockfd, struct iovec *iov, int iovcnt);
+
+/*
+ * 扩展报文：长度头的最高位为1时，长度头后面是16字节的扩展头，再后面才是报文内容
+ *   8字节 请求id，网络字节序，应答带回同样的id，用于对冲请求等场合匹配应答
+ *   4字节 剩余的时间预算，单位为微秒，0为没有截止时间。传的是相对时间，
+ *         两端的时钟不需要同步，接收方收到长度头时加上本地的当前时间作为截止时间
+ *   4字节 保留，为0
+ * 长度头的低31位仍然是报文内容的长度，不包括扩展头。TCPRead能读取扩展报文，丢弃扩展头；
+ * 不认识扩展报文的旧版本把长度当作负数：最早的TCPRead不检查长度，返回true和负数长度，
+ * 扩展头和报文内容留在连接上，之后的报文都错位；加了长度检查的版本返回false，由调用者断开连接。
+ * 所以只能向确认支持扩展报文的对端发送。TLS连接不支持扩展报文。
+ * */
+#define TCP_FRAME_EXT     0x80000000U
+#define TCP_FRAME_EXT_LEN 16
+
+struct TCPFrameMeta
+{
+	unsigned long m_request_id;
+	unsigned long m_deadline;    // 截止时间（MetricNow），0为没有截止时间
+	unsigned int  m_budget_us;   // TCPReadEx收到的时间预算，0为没有截止时间
+	bool          m_bext;        // 是否为扩展报文，TCPReadEx设置
+};
+
+/*
+ * 发送扩展报文，meta.m_deadline已经过去时仍然发送，预算按1微秒计算
+ * */
+bool TCPWriteEx(const int sockfd, const char *buffer, const int ibuffer_len, const TCPFrameMeta &meta);
+
+/*
+ * 读取普通报文或者扩展报文，普通报文的meta中m_request_id和m_deadline为0
+ * m_deadline从读到长度头的时刻开始算，报文在此之前等待的时间不计入；
+ * 知道报文更早到达时间的调用者（例如FrameServer按连接变为可读的时刻）应当用m_budget_us自己计算
+ * */
+bool TCPReadEx(const int sockfd, char *buffer, int *ibuffer_len, TCPFrameMeta *meta, const int itimeout = 0,
+		const int imaxlen = 0);
+
+class TLSContext;
+class TLSConn;
+
 // TCP Client类
 class TCPClient
 {
@@ -26,6 +67,21 @@ class TCPClient
 		int  m_port; 
 		bool m_timeout;
 		int  m_buffer_len;
+		TLSConn *m_tls;   // StartTLS之后不为0，读写都经过TLS
+
+		/*
+		 * 忙轮询接收模式的状态，由SetBusyPoll设置
+		 * m_spin_ns      每次ReadBuffer空转等待的预算，单位为纳秒，0表示关闭
+		 * m_spin_skip    退避期间还要跳过空转的次数
+		 * m_spin_backoff 当前的退避长度，空转落空时翻倍，空转等到报文时减半
+		 * */
+		long m_spin_ns;
+		int  m_spin_skip;
+		int  m_spin_backoff;
+		int  m_busy_poll_us;   // SO_BUSY_POLL，0表示不设置
+		int  m_incoming_cpu;   // SO_INCOMING_CPU，-1表示不设置
+
+		SocketProfile m_profile;   // 连接使用的socket选项，NewTCPClient之前设置
 
 		TCPClient(); // TCPClient构造函数
 
@@ -37,13 +93,38 @@ class TCPClient
 		 * */
 		bool NewTCPClient(const char *host, const int port);
 
+		/*
+		 * 在NewTCPClient建立的连接上进行TLS握手，之后ReadBuffer和WriteBuffer都经过TLS
+		 * ctx 用InitClient初始化的TLSContext，按"主机:端口"恢复之前的会话
+		 * itimeout 握手超时时间，单位为秒
+		 * 返回值为 true为成功，false为失败，失败时连接已关闭
+		 * */
+		bool StartTLS(TLSContext *ctx, const int itimeout = 10);
+
+		/*
+		 * 打开忙轮询接收模式，用于对延迟敏感、报文间隔短的连接
+		 * ReadBuffer先用非阻塞recv空转等待报文到达，省掉poll睡眠和唤醒的开销，
+		 * 预算用完还没有报文时退回poll阻塞等待。连续落空时按指数退避暂停空转，
+		 * 报文间隔变长或者CPU不够用时不会一直空转浪费CPU
+		 * ispin_us      空转预算，单位为微秒，0表示关闭
+		 * ibusy_poll_us 设置SO_BUSY_POLL，阻塞等待时由内核轮询网卡队列，0表示不设置，
+		 *               超过net.core.busy_poll需要CAP_NET_ADMIN
+		 * icpu          设置SO_INCOMING_CPU，-1表示不设置
+		 * 可以在NewTCPClient之前调用，socket选项在建立连接时设置
+		 * 返回值 socket选项设置失败时返回false，空转模式仍然生效
+		 * */
+		bool SetBusyPoll(const int ispin_us, const int ibusy_poll_us = 0, const int icpu = -1);
+
 		/*
 		 * 用于接收服务的发送过来的数据
 		 * buffer 用于接收数据的的缓冲区地址, 接收的长度为m_buffer_len
 		 * itimeout 等待接收数据超时时间，单位为秒，缺省值为0表示无限等待
-		 * 返回值为 true为成功 false为失败，失败的情况有两种1.等待超时，成员变量m_timeout的值被设置为true, 2. socket连接不可用
+		 * imaxlen 报文的最大长度，通常为buffer的大小，长度头来自对端，超过时返回false；缺省值为0表示不检查，
+		 *         只能用于完全信任对端的场合
+		 * 返回值为 true为成功 false为失败，失败的情况有三种1.等待超时，成员变量m_timeout的值被设置为true, 2. socket连接不可用,
+		 *         3. 报文超过imaxlen，连接上的数据已经无法对齐，应当关闭连接
 		 * */
-		bool ReadBuffer(char *buffer, const int itimeout = 0);
+		bool ReadBuffer(char *buffer, const int itimeout = 0, const int imaxlen = 0);
 
 		/*
 		 * 用于向服务端发送数据
@@ -66,20 +147,36 @@ class TCPServer
 		int  m_clientfd;
 		bool m_btimeout;
 		int  m_ibuffer_len;
+		SocketProfile m_profile;   // 监听socket和接受的连接使用的socket选项，NewServer之前设置
 	private:
 		int    m_socklen;
 		struct sockaddr_in m_servaddr;
 		struct sockaddr_in m_cliaddr;
+		char   m_cliip[INET6_ADDRSTRLEN];
 
+	public:
 	TCPServer();
 
-	bool NewServer(const unsigned int port, const int backlog = 5);
+	/*
+	 * 在port上监听，backlog为0时使用m_profile.m_backlog
+	 * */
+	bool NewServer(const unsigned int port, const int backlog = 0);
+
+	/*
+	 * 使用已经在监听的socket，用于热重启时接管旧进程的监听socket
+	 * */
+	bool AttachServer(const int listenfd);
 
 	bool Accept();
 
 	char *GetClientIP();
 
-	bool TCPReadBuffer(char *buffer, const int itimeout = 0);
+	const struct sockaddr_in *GetClientAddr();
+
+	/*
+	 * imaxlen 报文的最大长度，含义和TCPClient::ReadBuffer相同
+	 * */
+	bool TCPReadBuffer(char *buffer, const int itimeout = 0, const int imaxlen = 0);
 
 	bool TCPWriteBuffer(const char *buffer, const int ibuffer_len = 0);
 
@@ -87,6 +184,16 @@ class TCPServer
 
 	void CloseClientSocket();
 
+	/*
+	 * 关闭一个Accept之后已经取走的客户端socket
+	 * */
+	void CloseClientSocket(const int clientfd);
+
+	/*
+	 * 客户端socket交给其他模块管理，不关闭，只是不再计入打开的连接数
+	 * */
+	void DetachClientSocket(const int clientfd);
+
 	~TCPServer();
 };
 
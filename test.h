@@ -0,0 +1,74 @@
+/*
+ * 测试程序共用的检查宏，测试程序不使用第三方框架，每个test_*.cpp是一个独立的程序：
+ *
+ *   int main()
+ *   {
+ *       CHECK(Add(1, 2) == 3);
+ *       return TestResult("test_add");
+ *   }
+ *
+ * CHECK失败时打印文件、行号和条件并记录失败次数，不中断测试，
+ * TestResult打印结果，有失败时返回1，作为进程的退出码，make test据此判断是否通过。
+ * */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include "public.h"
+
+static int g_test_checks = 0;
+static int g_test_failures = 0;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		g_test_checks++; \
+		if (!(cond)) \
+		{ \
+			g_test_failures++; \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		} \
+	} while (0)
+
+/*
+ * 打印测试结果，返回进程退出码
+ * */
+static inline int TestResult(const char *name)
+{
+	printf("%s: %s, %d checks, %d failed\n", name, g_test_failures == 0 ? "PASS" : "FAIL", g_test_checks, g_test_failures);
+	return g_test_failures == 0 ? 0 : 1;
+}
+
+/*
+ * 监听socket实际绑定的端口，测试用端口0监听，由内核分配空闲端口，失败时返回-1
+ * */
+static inline int TestListenPort(const int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (fd == -1 || getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+	{
+		return -1;
+	}
+
+	if (addr.ss_family == AF_INET)
+	{
+		return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	}
+	if (addr.ss_family == AF_INET6)
+	{
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	}
+
+	return -1;
+}
+
+/*
+ * 在/tmp下创建一个空的临时目录，路径写到dir，失败时返回false
+ * */
+static inline bool TestTempDir(char *dir, const int ilen, const char *name)
+{
+	snprintf(dir, ilen, "/tmp/%s.XXXXXX", name);
+	return mkdtemp(dir) != 0;
+}
+
+#endif
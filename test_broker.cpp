@@ -0,0 +1,372 @@
+/*
+ * 发布订阅测试，订阅者使用socketpair，测试程序在另一端读取推送的报文：
+ *
+ *   转发：每个订阅者收到完整的报文，4字节网络字节序的长度头加内容
+ *   drop_oldest：订阅者不读时队列保持max_queue条，丢弃最旧的，读取后收到的是最新的消息
+ *   disconnect：队列满时断开订阅者，主题随之回收
+ *   block：发布者等待订阅者读取，读得慢不丢消息；不读时等待m_block_timeout后断开订阅者
+ *   主题回收：最后一个订阅者退订后主题不再占用m_max_topics的名额
+ * */
+#include "public.h"
+#include "broker.h"
+#include "test.h"
+
+#define TEST_WAIT_MS 3000
+
+static char g_payload[65536];
+
+/*
+ * 创建订阅者的socketpair，fds[0]交给broker，fds[1]由测试读取，
+ * 发送缓冲区设置得很小，broker的队列很快就会积压
+ * */
+static bool NewPair(int fds[2])
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+	{
+		return false;
+	}
+
+	int isize = 4096;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &isize, sizeof(isize));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &isize, sizeof(isize));
+	return true;
+}
+
+/*
+ * 读满len字节，超时或者对端关闭时返回false
+ * */
+static bool ReadFull(const int fd, char *buf, const int len, const int itimeout_ms)
+{
+	int idone = 0;
+	while (idone < len)
+	{
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, itimeout_ms) <= 0)
+		{
+			return false;
+		}
+
+		int n = read(fd, buf + idone, len - idone);
+		if (n <= 0)
+		{
+			return false;
+		}
+		idone += n;
+	}
+
+	return true;
+}
+
+/*
+ * 读取一个报文，内容的长度写到ilen，没有报文或者格式不对时返回false
+ * */
+static bool ReadFrame(const int fd, char *buf, const int imaxlen, int *ilen, const int itimeout_ms = TEST_WAIT_MS)
+{
+	unsigned int nlen = 0;
+	if (ReadFull(fd, (char *)&nlen, 4, itimeout_ms) == false)
+	{
+		return false;
+	}
+
+	*ilen = ntohl(nlen);
+	return *ilen <= imaxlen && ReadFull(fd, buf, *ilen, itimeout_ms) == true;
+}
+
+/*
+ * 等待主题的订阅者数变为n，订阅者由发送线程异步关闭
+ * */
+static bool WaitSubscribers(Broker *broker, const char *topic, const int n)
+{
+	for (int i = 0; i < TEST_WAIT_MS; i++)
+	{
+		if (broker->Subscribers(topic) == n)
+		{
+			return true;
+		}
+		usleep(1000);
+	}
+
+	return false;
+}
+
+/*
+ * 创建订阅者，主题名额用完时重试：订阅者离开主题的订阅者列表之后，
+ * 发送线程处理完本轮事件才释放它，主题随之回收
+ * */
+static BrokerSub *WaitNewSub(Broker *broker, const char *topic)
+{
+	for (int i = 0; i < TEST_WAIT_MS; i++)
+	{
+		BrokerSub *sub = broker->NewSub(topic, BROKER_DROP_OLDEST, 4);
+		if (sub != 0)
+		{
+			return sub;
+		}
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+/*
+ * 对端关闭之前把推送的数据读完，返回读到的字节数
+ * */
+static long Drain(const int fd)
+{
+	long itotal = 0;
+	char buf[65536];
+	int n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		itotal += n;
+	}
+	return itotal;
+}
+
+/*
+ * 生成第i条消息，开头是序号，其余部分填充到ilen字节
+ * */
+static int MakeMsg(const int i, const int ilen)
+{
+	memset(g_payload, 'a' + i % 26, ilen);
+	snprintf(g_payload, 16, "%08d", i);
+	return ilen;
+}
+
+static void TestForward(Broker *broker)
+{
+	int fds1[2], fds2[2];
+	CHECK(NewPair(fds1) == true && NewPair(fds2) == true);
+
+	BrokerSub *sub1 = broker->NewSub("fwd", BROKER_DROP_OLDEST, 16);
+	BrokerSub *sub2 = broker->NewSub("fwd", BROKER_DROP_OLDEST, 16);
+	CHECK(sub1 != 0 && sub2 != 0);
+	CHECK(broker->Attach(sub1, fds1[0]) == true);
+	CHECK(broker->Attach(sub2, fds2[0]) == true);
+	CHECK(broker->Subscribers("fwd") == 2);
+
+	CHECK(broker->Publish("fwd", "hello", 5) == 2);
+	CHECK(broker->Publish("nobody", "hello", 5) == 0);
+
+	char buf[64];
+	int ilen = 0;
+	CHECK(ReadFrame(fds1[1], buf, sizeof(buf), &ilen) == true && ilen == 5 && memcmp(buf, "hello", 5) == 0);
+	CHECK(ReadFrame(fds2[1], buf, sizeof(buf), &ilen) == true && ilen == 5 && memcmp(buf, "hello", 5) == 0);
+
+	// 对端关闭时自动退订
+	close(fds1[1]);
+	CHECK(WaitSubscribers(broker, "fwd", 1) == true);
+	close(fds2[1]);
+	CHECK(WaitSubscribers(broker, "fwd", 0) == true);
+}
+
+static void TestDropOldest(Broker *broker)
+{
+	int fds[2];
+	CHECK(NewPair(fds) == true);
+
+	BrokerSub *sub = broker->NewSub("drop", BROKER_DROP_OLDEST, 4);
+	CHECK(sub != 0);
+	CHECK(broker->Attach(sub, fds[0]) == true);
+
+	// 订阅者不读，socket缓冲区满之后队列中只保留最新的消息，发布总是成功
+	const int imsgs = 200;
+	for (int i = 0; i < imsgs; i++)
+	{
+		CHECK(broker->Publish("drop", g_payload, MakeMsg(i, 8192)) == 1);
+	}
+	CHECK(broker->Subscribers("drop") == 1);
+
+	// 读出的序号递增，中间有跳过，最后一条一定是最新的消息
+	char *buf = new char[65536];
+	int ilen = 0, ilast = -1, icount = 0;
+	while (ReadFrame(fds[1], buf, 65536, &ilen, 200) == true)
+	{
+		int iseq = atoi(buf);
+		CHECK(ilen == 8192 && iseq > ilast);
+		ilast = iseq;
+		icount++;
+	}
+	CHECK(ilast == imsgs - 1);
+	CHECK(icount < imsgs);
+	delete[] buf;
+
+	close(fds[1]);
+	CHECK(WaitSubscribers(broker, "drop", 0) == true);
+}
+
+static void TestDisconnect(Broker *broker)
+{
+	int fds[2];
+	CHECK(NewPair(fds) == true);
+
+	BrokerSub *sub = broker->NewSub("disc", BROKER_DISCONNECT, 4);
+	CHECK(sub != 0);
+	CHECK(broker->Attach(sub, fds[0]) == true);
+
+	// 订阅者不读，队列满时被断开，之后的消息没有订阅者
+	int idelivered = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		idelivered += broker->Publish("disc", g_payload, MakeMsg(i, 8192));
+	}
+	CHECK(idelivered < 200);
+	CHECK(WaitSubscribers(broker, "disc", 0) == true);
+	CHECK(broker->Publish("disc", "late", 4) == 0);
+
+	// 对端能读到断开之前已经交给内核的数据，然后是EOF
+	CHECK(Drain(fds[1]) > 0);
+	close(fds[1]);
+}
+
+struct SlowReader
+{
+	int  m_fd;
+	int  m_count;
+	bool m_border;
+};
+
+static void *SlowReaderThread(void *arg)
+{
+	SlowReader *reader = (SlowReader *)arg;
+	char *buf = new char[65536];
+	int ilen = 0;
+	while (ReadFrame(reader->m_fd, buf, 65536, &ilen) == true)
+	{
+		if (atoi(buf) != reader->m_count)
+		{
+			reader->m_border = false;
+		}
+		reader->m_count++;
+		if (reader->m_count % 16 == 0)
+		{
+			usleep(1000);
+		}
+	}
+	delete[] buf;
+	return 0;
+}
+
+static void TestBlock(Broker *broker)
+{
+	broker->m_block_timeout = 2000;
+
+	// 读得慢的订阅者：发布者等待，一条都不丢
+	int fds[2];
+	CHECK(NewPair(fds) == true);
+	BrokerSub *sub = broker->NewSub("block", BROKER_BLOCK, 4);
+	CHECK(sub != 0);
+	CHECK(broker->Attach(sub, fds[0]) == true);
+
+	SlowReader reader;
+	reader.m_fd = fds[1];
+	reader.m_count = 0;
+	reader.m_border = true;
+	pthread_t tid;
+	CHECK(pthread_create(&tid, 0, SlowReaderThread, &reader) == 0);
+
+	const int imsgs = 300;
+	int idelivered = 0;
+	for (int i = 0; i < imsgs; i++)
+	{
+		idelivered += broker->Publish("block", g_payload, MakeMsg(i, 8192));
+	}
+	CHECK(idelivered == imsgs);
+
+	// 订阅者收完之后关闭，读线程读到EOF结束
+	for (int i = 0; i < TEST_WAIT_MS && __atomic_load_n(&reader.m_count, __ATOMIC_RELAXED) < imsgs; i++)
+	{
+		usleep(1000);
+	}
+	shutdown(fds[1], SHUT_RDWR);
+	pthread_join(tid, 0);
+	close(fds[1]);
+	CHECK(reader.m_count == imsgs);
+	CHECK(reader.m_border == true);
+	CHECK(WaitSubscribers(broker, "block", 0) == true);
+
+	// 不读的订阅者：发布者最多等待m_block_timeout，然后断开订阅者
+	broker->m_block_timeout = 100;
+	CHECK(NewPair(fds) == true);
+	sub = broker->NewSub("block", BROKER_BLOCK, 4);
+	CHECK(sub != 0);
+	CHECK(broker->Attach(sub, fds[0]) == true);
+
+	struct timeval begin, end;
+	gettimeofday(&begin, 0);
+	idelivered = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		idelivered += broker->Publish("block", g_payload, MakeMsg(i, 8192));
+	}
+	gettimeofday(&end, 0);
+	long ielapsed_ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_usec - begin.tv_usec) / 1000;
+
+	CHECK(idelivered < 200);
+	CHECK(ielapsed_ms >= 90);
+	CHECK(ielapsed_ms < TEST_WAIT_MS);
+	CHECK(WaitSubscribers(broker, "block", 0) == true);
+	Drain(fds[1]);
+	close(fds[1]);
+}
+
+static void TestTopicReclaim(Broker *broker)
+{
+	// TestMain中m_max_topics为4，这里的主题数远超过它，每个主题退订后都被回收
+	char topic[32];
+	for (int i = 0; i < 100; i++)
+	{
+		snprintf(topic, sizeof(topic), "reclaim.%d", i);
+		BrokerSub *sub = WaitNewSub(broker, topic);
+		CHECK(sub != 0);
+		if (sub == 0)
+		{
+			break;
+		}
+
+		// 没有Attach的订阅者用-1放弃
+		CHECK(broker->Attach(sub, -1) == true);
+	}
+
+	// 名额用完时拒绝新主题，已有主题上的订阅不受影响
+	BrokerSub *subs[4];
+	for (int i = 0; i < 4; i++)
+	{
+		snprintf(topic, sizeof(topic), "full.%d", i);
+		subs[i] = WaitNewSub(broker, topic);
+		CHECK(subs[i] != 0);
+	}
+	CHECK(broker->NewSub("full.4", BROKER_DROP_OLDEST, 4) == 0);
+	BrokerSub *extra = broker->NewSub("full.0", BROKER_DROP_OLDEST, 4);
+	CHECK(extra != 0);
+
+	CHECK(broker->Attach(extra, -1) == true);
+	for (int i = 0; i < 4; i++)
+	{
+		CHECK(broker->Attach(subs[i], -1) == true);
+	}
+
+	BrokerSub *sub = WaitNewSub(broker, "full.4");
+	CHECK(sub != 0);
+	CHECK(broker->Attach(sub, -1) == true);
+}
+
+int main()
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	Broker broker;
+	broker.m_max_topics = 4;
+	CHECK(broker.Start() == true);
+
+	TestForward(&broker);
+	TestDropOldest(&broker);
+	TestDisconnect(&broker);
+	TestBlock(&broker);
+	TestTopicReclaim(&broker);
+
+	broker.Stop();
+	return TestResult("test_broker");
+}
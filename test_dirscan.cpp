@@ -0,0 +1,260 @@
+/*
+ * 目录扫描测试，在/tmp下的临时目录中创建文件：
+ *
+ *   全量扫描：通配符和正则过滤、跳过隐藏文件、按名字和大小排序
+ *   增量模式：写完关闭报告ADDED，再次写完报告MODIFIED，删除和改名移出报告REMOVED，
+ *             Watch的初始扫描不返回还在写的文件，关闭时作为ADDED报告
+ *   队列溢出：一次产生超过max_queued_events个事件，Poll重新扫描，每个新文件只报告一次，
+ *             溢出期间删除的文件报告REMOVED，还在写的文件不报告，写完关闭时再报告
+ * */
+#include "public.h"
+#include "dirscan.h"
+#include "test.h"
+
+static bool WriteFile(const char *dir, const char *name, const char *data)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	bool bok = write(fd, data, strlen(data)) == (ssize_t)strlen(data);
+	close(fd);
+	return bok;
+}
+
+/*
+ * 打开文件写，不关闭，返回描述符
+ * */
+static int OpenWriting(const char *dir, const char *name)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1 && write(fd, "half", 4) != 4)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void RemoveFile(const char *dir, const char *name)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	unlink(path);
+}
+
+static void RemoveDir(const char *dir)
+{
+	DirScanner scanner;
+	scanner.m_bfiles_only = false;
+	vector<DirEntry> entries;
+	scanner.Scan(dir, entries);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		RemoveFile(dir, entries[i].m_name.c_str());
+	}
+	rmdir(dir);
+}
+
+/*
+ * 找一个变化，返回在changes中的个数
+ * */
+static int CountChange(const vector<DirChange> &changes, const DirChangeType type, const char *name)
+{
+	int n = 0;
+	for (size_t i = 0; i < changes.size(); i++)
+	{
+		if (changes[i].m_type == type && changes[i].m_entry.m_name == name)
+		{
+			n++;
+		}
+	}
+	return n;
+}
+
+static void TestScan()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_dirscan") == true);
+	CHECK(WriteFile(dir, "b.log", "bbbb") == true);
+	CHECK(WriteFile(dir, "a.log", "aaaaaaaa") == true);
+	CHECK(WriteFile(dir, "c.txt", "c") == true);
+	CHECK(WriteFile(dir, ".hidden.log", "h") == true);
+	char sub[128];
+	snprintf(sub, sizeof(sub), "%s/sub.log", dir);
+	CHECK(mkdir(sub, 0755) == 0);
+
+	DirScanner scanner;
+	vector<DirEntry> entries;
+	CHECK(scanner.Scan(dir, entries, DIRSCAN_SORT_NAME) == true);
+	CHECK(entries.size() == 3);
+	CHECK(entries.size() == 3 && entries[0].m_name == "a.log" && entries[1].m_name == "b.log" && entries[2].m_name == "c.txt");
+
+	CHECK(scanner.SetGlob("*.log") == true);
+	CHECK(scanner.Scan(dir, entries, DIRSCAN_SORT_SIZE, true) == true);
+	CHECK(entries.size() == 2 && entries[0].m_name == "a.log" && entries[0].m_size == 8 && entries[1].m_size == 4);
+
+	CHECK(scanner.SetRegex("^b") == true);
+	CHECK(scanner.Scan(dir, entries) == true);
+	CHECK(entries.size() == 1 && entries[0].m_name == "b.log");
+
+	// 目录也返回
+	CHECK(scanner.SetRegex("") == true);
+	scanner.m_bfiles_only = false;
+	CHECK(scanner.Scan(dir, entries, DIRSCAN_SORT_NAME) == true);
+	CHECK(entries.size() == 3 && entries[2].m_name == "sub.log" && entries[2].m_type == DT_DIR);
+
+	rmdir(sub);
+	RemoveDir(dir);
+}
+
+static void TestWatch()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_dirscan") == true);
+	CHECK(WriteFile(dir, "done.dat", "all") == true);
+	int wfd = OpenWriting(dir, "writing.dat");
+	CHECK(wfd != -1);
+
+	// 初始扫描不返回还在写的文件
+	DirScanner scanner;
+	vector<DirEntry> entries;
+	CHECK(scanner.Watch(dir, entries, DIRSCAN_SORT_NAME) == true);
+	CHECK(entries.size() == 1 && entries[0].m_name == "done.dat");
+	CHECK(scanner.Known() == 1);
+
+	vector<DirChange> changes;
+	CHECK(scanner.Poll(changes, 0) == true && changes.empty());
+
+	close(wfd);
+	CHECK(scanner.Poll(changes, 1000) == true);
+	CHECK(changes.size() == 1 && CountChange(changes, DIRSCAN_ADDED, "writing.dat") == 1);
+
+	CHECK(WriteFile(dir, "done.dat", "again") == true);
+	CHECK(scanner.Poll(changes, 1000) == true);
+	CHECK(changes.size() == 1 && CountChange(changes, DIRSCAN_MODIFIED, "done.dat") == 1);
+	CHECK(changes.size() == 1 && changes[0].m_entry.m_size == 5);
+
+	// 改名移出和移入
+	char from[128], to[128];
+	snprintf(from, sizeof(from), "%s/done.dat", dir);
+	snprintf(to, sizeof(to), "%s/moved.dat", dir);
+	CHECK(rename(from, to) == 0);
+	RemoveFile(dir, "writing.dat");
+	CHECK(scanner.Poll(changes, 1000) == true);
+	CHECK(CountChange(changes, DIRSCAN_REMOVED, "done.dat") == 1);
+	CHECK(CountChange(changes, DIRSCAN_ADDED, "moved.dat") == 1);
+	CHECK(CountChange(changes, DIRSCAN_REMOVED, "writing.dat") == 1);
+	CHECK(scanner.Known() == 1);
+
+	// 目录被删除后Poll返回false
+	RemoveFile(dir, "moved.dat");
+	rmdir(dir);
+	bool bok = true;
+	for (int i = 0; i < 10 && bok == true; i++)
+	{
+		bok = scanner.Poll(changes, 100);
+	}
+	CHECK(bok == false);
+}
+
+static int MaxQueuedEvents()
+{
+	int n = 16384;
+	FILE *fp = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+	if (fp != 0)
+	{
+		if (fscanf(fp, "%d", &n) != 1)
+		{
+			n = 16384;
+		}
+		fclose(fp);
+	}
+	return n;
+}
+
+static void TestOverflow()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_dirscan") == true);
+	CHECK(WriteFile(dir, "old.dat", "old") == true);
+	CHECK(WriteFile(dir, "gone.dat", "gone") == true);
+	CHECK(WriteFile(dir, "changed.dat", "before") == true);
+
+	DirScanner scanner;
+	vector<DirEntry> entries;
+	CHECK(scanner.Watch(dir, entries) == true);
+	CHECK(entries.size() == 3);
+
+	// 每个文件产生IN_CREATE和IN_CLOSE_WRITE两个事件，超过队列长度
+	int nfiles = MaxQueuedEvents() / 2 + 1000;
+	char name[64];
+	int wfd = OpenWriting(dir, "writing.dat");
+	CHECK(wfd != -1);
+	for (int i = 0; i < nfiles; i++)
+	{
+		snprintf(name, sizeof(name), "f%06d.dat", i);
+		CHECK(WriteFile(dir, name, "x") == true);
+	}
+	RemoveFile(dir, "gone.dat");
+	CHECK(WriteFile(dir, "changed.dat", "after, longer") == true);
+
+	vector<DirChange> changes;
+	CHECK(scanner.Poll(changes, 1000) == true);
+
+	// 每个新文件恰好一次ADDED，不管它的事件是在溢出之前读到的还是重新扫描发现的
+	vector<int> added(nfiles, 0);
+	int iother_added = 0;
+	for (size_t i = 0; i < changes.size(); i++)
+	{
+		int n = -1;
+		if (changes[i].m_type == DIRSCAN_ADDED && sscanf(changes[i].m_entry.m_name.c_str(), "f%d.dat", &n) == 1 &&
+				n >= 0 && n < nfiles)
+		{
+			added[n]++;
+		}
+		else if (changes[i].m_type == DIRSCAN_ADDED)
+		{
+			iother_added++;
+		}
+	}
+	int ibad = 0;
+	for (int i = 0; i < nfiles; i++)
+	{
+		if (added[i] != 1)
+		{
+			ibad++;
+		}
+	}
+	CHECK(ibad == 0);
+	CHECK(iother_added == 0);
+	CHECK(CountChange(changes, DIRSCAN_ADDED, "writing.dat") == 0);
+	CHECK(CountChange(changes, DIRSCAN_REMOVED, "gone.dat") == 1);
+	CHECK(CountChange(changes, DIRSCAN_MODIFIED, "changed.dat") == 1);
+	CHECK(CountChange(changes, DIRSCAN_MODIFIED, "old.dat") == 0);
+	CHECK(scanner.Known() == (size_t)nfiles + 2);
+
+	// 还在写的文件写完关闭时报告
+	close(wfd);
+	CHECK(scanner.Poll(changes, 1000) == true);
+	CHECK(changes.size() == 1 && CountChange(changes, DIRSCAN_ADDED, "writing.dat") == 1);
+	CHECK(scanner.Known() == (size_t)nfiles + 3);
+
+	scanner.Close();
+	RemoveDir(dir);
+}
+
+int main()
+{
+	TestScan();
+	TestWatch();
+	TestOverflow();
+
+	return TestResult("test_dirscan");
+}
@@ -0,0 +1,223 @@
+/*
+ * 键值缓存测试：
+ *
+ *   基本操作：写入、替换、读取、删除和参数检查
+ *   内存上限：任何时候Bytes()不超过Init的上限
+ *   淘汰：内存上限不允许散列表扩大时，每次写入新键为装载因子最多淘汰一个条目，
+ *         已删除标记累积后原地重建，不会在一次Set中成批淘汰
+ *   CLOCK：一直被访问的条目不被淘汰
+ *   并发：多个线程同时读写，内存上限和条目内容保持正确
+ * */
+#include "public.h"
+#include "kvcache.h"
+#include "test.h"
+
+#define TEST_MAX_BYTES (1024 * 1024)
+
+static int MakeKey(char *key, const int ilen, const char *prefix, const long i)
+{
+	return snprintf(key, ilen, "%s%ld", prefix, i);
+}
+
+static void TestBasic()
+{
+	KVCache kv;
+	CHECK(kv.Init(TEST_MAX_BYTES, 4) == true);
+	CHECK(kv.Shards() == 4);
+
+	string value;
+	CHECK(kv.Get("a", 1, value) == false);
+	CHECK(kv.Set("a", 1, "one", 3) == true);
+	CHECK(kv.Get("a", 1, value) == true && value == "one");
+	CHECK(kv.Items() == 1);
+
+	// 替换，Get把值追加到value后面
+	CHECK(kv.Set("a", 1, "uno", 3) == true);
+	value.assign(1, 'x');
+	CHECK(kv.Get("a", 1, value) == true && value == "xuno");
+	CHECK(kv.Items() == 1);
+
+	CHECK(kv.Set("empty", 5, "", 0) == true);
+	value.clear();
+	CHECK(kv.Get("empty", 5, value) == true && value.empty());
+
+	CHECK(kv.Del("a", 1) == true);
+	CHECK(kv.Del("a", 1) == false);
+	CHECK(kv.Get("a", 1, value) == false);
+	CHECK(kv.Items() == 1);
+
+	// 键太长、条目超过分片容量的一半
+	char key[KV_MAX_KEY + 2];
+	memset(key, 'k', sizeof(key));
+	CHECK(kv.Set(key, KV_MAX_KEY, "v", 1) == true);
+	CHECK(kv.Set(key, KV_MAX_KEY + 1, "v", 1) == false);
+	string big(TEST_MAX_BYTES / 4, 'b');
+	CHECK(kv.Set("big", 3, big.data(), big.size()) == false);
+}
+
+static void TestMemoryCap()
+{
+	KVCache kv;
+	CHECK(kv.Init(TEST_MAX_BYTES, 2) == true);
+
+	// 大小不一的值，替换时也有变大的情况
+	char key[32];
+	string value(4096, 'v');
+	size_t imax_bytes = 0;
+	for (long i = 0; i < 100000; i++)
+	{
+		int klen = MakeKey(key, sizeof(key), "key", i % 20000);
+		CHECK(kv.Set(key, klen, value.data(), (i * 7919) % value.size()) == true);
+		imax_bytes = max(imax_bytes, kv.Bytes());
+	}
+	CHECK(imax_bytes <= TEST_MAX_BYTES);
+	CHECK(kv.Items() > 0);
+
+	// 刚写入的键一定还在
+	string got;
+	int klen = MakeKey(key, sizeof(key), "key", 99999 % 20000);
+	CHECK(kv.Get(key, klen, got) == true && got.size() == (99999 * 7919) % value.size());
+}
+
+static void TestEvictionPerSet(const size_t max_bytes)
+{
+	// 小条目很多，散列表在内存上限内扩大不了，写入新键只能靠淘汰维持装载因子
+	KVCache kv;
+	CHECK(kv.Init(max_bytes, 1) == true);
+
+	char key[32];
+	size_t iprev = 0, imax_extra = 0;
+	for (long i = 0; i < 500000; i++)
+	{
+		int klen = MakeKey(key, sizeof(key), "key", i);
+		CHECK(kv.Set(key, klen, "v", 1) == true);
+
+		// 新键使条目数加一，再减去这次淘汰的条目数，条目数减少说明淘汰了不止一个
+		size_t items = kv.Items();
+		if (iprev > items && iprev - items > imax_extra)
+		{
+			imax_extra = iprev - items;
+		}
+		iprev = items;
+	}
+	// 条目大小相同，内存上限最多淘汰一个，装载因子最多再淘汰一个
+	CHECK(imax_extra <= 1);
+	CHECK(kv.Bytes() <= max_bytes);
+
+	// 淘汰之后条目数保持在接近装满的水平，而不是降到一半
+	size_t items = kv.Items();
+	for (long i = 500000; i < 510000; i++)
+	{
+		int klen = MakeKey(key, sizeof(key), "key", i);
+		kv.Set(key, klen, "v", 1);
+		CHECK(kv.Items() + 1 >= items);
+	}
+}
+
+static void TestClock()
+{
+	KVCache kv;
+	CHECK(kv.Init(TEST_MAX_BYTES, 1) == true);
+
+	char key[32];
+	string value(200, 'v');
+	for (long i = 0; i < 16; i++)
+	{
+		int klen = MakeKey(key, sizeof(key), "hot", i);
+		CHECK(kv.Set(key, klen, value.data(), value.size()) == true);
+	}
+
+	// 写入远超过容量的冷数据，期间一直访问热数据
+	string got;
+	bool bhit = true;
+	for (long i = 0; i < 50000; i++)
+	{
+		int klen = MakeKey(key, sizeof(key), "cold", i);
+		kv.Set(key, klen, value.data(), value.size());
+
+		klen = MakeKey(key, sizeof(key), "hot", i % 16);
+		got.clear();
+		if (kv.Get(key, klen, got) == false || got != value)
+		{
+			bhit = false;
+		}
+	}
+	CHECK(bhit == true);
+
+	int klen = MakeKey(key, sizeof(key), "cold", 0);
+	CHECK(kv.Get(key, klen, got) == false);
+}
+
+struct Worker
+{
+	KVCache *m_kv;
+	int      m_id;
+	int      m_errors;
+};
+
+static void *WorkerThread(void *arg)
+{
+	Worker *worker = (Worker *)arg;
+	char key[32], value[64];
+	string got;
+	for (long i = 0; i < 100000; i++)
+	{
+		long n = (i * 2654435761UL) % 5000;
+		int klen = MakeKey(key, sizeof(key), "key", n);
+		int vlen = snprintf(value, sizeof(value), "value-of-%ld", n);
+		if (i % 4 == 0)
+		{
+			worker->m_kv->Set(key, klen, value, vlen);
+		}
+		else if (i % 97 == 0)
+		{
+			worker->m_kv->Del(key, klen);
+		}
+		else
+		{
+			// 所有线程给同一个键写入同样的值，读到的值必须是完整的
+			got.clear();
+			if (worker->m_kv->Get(key, klen, got) == true && got != string(value, vlen))
+			{
+				worker->m_errors++;
+			}
+		}
+	}
+	return 0;
+}
+
+static void TestConcurrent()
+{
+	KVCache kv;
+	CHECK(kv.Init(64 * 1024, 4) == true);
+
+	Worker workers[4];
+	pthread_t tids[4];
+	for (int i = 0; i < 4; i++)
+	{
+		workers[i].m_kv = &kv;
+		workers[i].m_id = i;
+		workers[i].m_errors = 0;
+		CHECK(pthread_create(&tids[i], 0, WorkerThread, &workers[i]) == 0);
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		pthread_join(tids[i], 0);
+		CHECK(workers[i].m_errors == 0);
+	}
+	CHECK(kv.Bytes() <= 64 * 1024);
+}
+
+int main()
+{
+	TestBasic();
+	TestMemoryCap();
+	// 散列表扩大一倍刚好超过上限的几种大小
+	TestEvictionPerSet(TEST_MAX_BYTES);
+	TestEvictionPerSet(1600000);
+	TestEvictionPerSet(1800000);
+	TestClock();
+	TestConcurrent();
+
+	return TestResult("test_kvcache");
+}
@@ -0,0 +1,102 @@
+/*
+ * TLS回环测试，使用make certs生成的自签名证书，需要在仓库根目录下运行：
+ *
+ *   WITH_TLS=1：握手成功，PING应答PONG，第二次连接恢复第一次连接的会话
+ *   没有WITH_TLS：TLS初始化失败，m_tls为0时服务端回退到明文，PING同样应答PONG
+ * */
+#include "public.h"
+#include "server.h"
+#include "tcpsocket.h"
+#include "tls.h"
+#include "test.h"
+
+#define TEST_CERT "certs/server.crt"
+#define TEST_KEY  "certs/server.key"
+
+static bool HandlePing(FrameRequest *req, void *)
+{
+	req->Reply("PONG", 4);
+	return true;
+}
+
+/*
+ * 连接服务端，ctx不为0时握手，发送PING检查应答，bresumed返回是否恢复了会话
+ * */
+static bool Ping(const int port, TLSContext *ctx, bool *bresumed)
+{
+	TCPClient client;
+	if (client.NewTCPClient("127.0.0.1", port) == false)
+	{
+		return false;
+	}
+	if (ctx != 0 && client.StartTLS(ctx, 5) == false)
+	{
+		return false;
+	}
+
+	char reply[64];
+	bool bok = client.WriteBuffer("PING", 4) == true && client.ReadBuffer(reply, 5, sizeof(reply)) == true &&
+		client.m_buffer_len == 4 && memcmp(reply, "PONG", 4) == 0;
+	if (bresumed != 0)
+	{
+		*bresumed = client.m_tls != 0 && client.m_tls->m_bresumed;
+	}
+	client.Close();
+	return bok;
+}
+
+int main()
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	TLSContext server_ctx;
+	TLSContext client_ctx;
+	bool btls = server_ctx.InitServer(TEST_CERT, TEST_KEY);
+
+#ifdef WITH_TLS
+	CHECK(btls == true);
+	CHECK(client_ctx.InitClient(TEST_CERT, true) == true);
+#else
+	CHECK(btls == false);
+	CHECK(client_ctx.InitClient(TEST_CERT, true) == false);
+#endif
+
+	FrameServer server;
+	server.m_workers = 2;
+	server.m_tls = btls == true ? &server_ctx : 0;
+	CHECK(server.AddHandler("PING", HandlePing) == true);
+	CHECK(server.Listen(0) == true);
+	CHECK(server.Start() == true);
+
+	int port = TestListenPort(server.ListenFd());
+	CHECK(port > 0);
+
+	bool bresumed = true;
+	if (btls == true)
+	{
+		CHECK(Ping(port, &client_ctx, &bresumed) == true);
+		CHECK(bresumed == false);
+
+		// 第一次连接收到的会话票据缓存在client_ctx中，按host:port查找
+		CHECK(Ping(port, &client_ctx, &bresumed) == true);
+		CHECK(bresumed == true);
+
+		// 明文客户端连接TLS服务端不能得到应答
+		CHECK(Ping(port, 0, 0) == false);
+
+		// 不信任自签名证书的客户端握手失败
+		TLSContext strict_ctx;
+		CHECK(strict_ctx.InitClient(0, true) == true);
+		CHECK(Ping(port, &strict_ctx, 0) == false);
+	}
+	else
+	{
+		CHECK(Ping(port, 0, &bresumed) == true);
+		CHECK(bresumed == false);
+	}
+
+	CHECK(server.Drain(1) == true);
+	server.Stop();
+
+	return TestResult("test_tls");
+}
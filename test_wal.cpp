@@ -0,0 +1,338 @@
+/*
+ * 预写日志测试，日志写在/tmp下的临时目录中：
+ *
+ *   追加和读取：序号连续，内容一致，Locate的位置可以作为读取器的提示
+ *   分段：超过m_segment_bytes后切换到新的段，读取器跨段读取，Purge删除旧的段
+ *   崩溃恢复：最后一个段尾部有垃圾、写了一半的记录或者CRC不对的记录时，从第一条坏记录开始
+ *             丢弃，之后的记录接着写；段文件不变短，恢复之前已经映射了段的读取器继续读到新记录
+ *   组提交：多个线程并发追加，序号不重复，fdatasync的次数少于记录数
+ * */
+#include "public.h"
+#include "wal.h"
+#include "test.h"
+
+#define TEST_RECORD_LEN 5
+#define TEST_RECORD_BYTES (WAL_HEADER_LEN + TEST_RECORD_LEN)
+
+static void SegmentPath(char *path, const int ilen, const char *dir, const unsigned long first_seq)
+{
+	snprintf(path, ilen, "%s/%020lu.wal", dir, first_seq);
+}
+
+static off_t FileSize(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void RemoveDir(const char *dir)
+{
+	vector<unsigned long> segs;
+	WALSegments(dir, segs);
+	char path[300];
+	for (size_t i = 0; i < segs.size(); i++)
+	{
+		SegmentPath(path, sizeof(path), dir, segs[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/*
+ * 追加n条TEST_RECORD_LEN字节的记录，内容是序号对10取模的数字重复
+ * */
+static bool AppendRecords(WAL *wal, const int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		char data[TEST_RECORD_LEN];
+		memset(data, '0' + (wal->Durable() + 1) % 10, sizeof(data));
+		if (wal->Append(data, sizeof(data)) == false)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * 读完所有记录，检查序号连续和内容，返回读到的条数，出错时返回-1
+ * */
+static int ReadAll(WALReader *reader, unsigned long first_seq)
+{
+	const char *data;
+	int ilen;
+	unsigned long seq;
+	int n = 0;
+	while (reader->Next(&data, &ilen, &seq) == true)
+	{
+		if (seq != first_seq + n || ilen != TEST_RECORD_LEN || data[0] != (char)('0' + seq % 10) ||
+				data[TEST_RECORD_LEN - 1] != data[0])
+		{
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}
+
+static void TestAppendRead()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_wal") == true);
+
+	WAL wal;
+	CHECK(wal.Open(dir) == true);
+	CHECK(wal.Durable() == 0);
+
+	unsigned long seq = 0;
+	CHECK(wal.Append("x", 1, &seq) == true && seq == 1);
+	CHECK(wal.Append("", 0, &seq) == true && seq == 2);
+	CHECK(wal.Durable() == 2);
+
+	WALReader reader;
+	CHECK(reader.Open(dir, 0) == true);
+	const char *data;
+	int ilen;
+	CHECK(reader.Next(&data, &ilen, &seq) == true && seq == 1 && ilen == 1 && data[0] == 'x');
+	CHECK(reader.Next(&data, &ilen, &seq) == true && seq == 2 && ilen == 0);
+	CHECK(reader.Next(&data, &ilen, &seq) == false);
+
+	// 没有新记录之后再追加，同一个读取器可以继续读
+	string big(WAL_INDEX_BYTES / 4, 'b');
+	for (int i = 0; i < 10; i++)
+	{
+		CHECK(wal.Append(big.data(), big.size()) == true);
+	}
+	int n = 0;
+	while (reader.Next(&data, &ilen, &seq) == true)
+	{
+		CHECK(seq == 3 + (unsigned long)n && ilen == (int)big.size() && memcmp(data, big.data(), ilen) == 0);
+		n++;
+	}
+	CHECK(n == 10);
+
+	// 按Locate的提示从中间开始读
+	WALPosition pos;
+	CHECK(wal.Locate(10, &pos) == true && pos.m_seq <= 10 && pos.m_seq > 1);
+	WALReader hinted;
+	CHECK(hinted.Open(dir, 10, &pos) == true);
+	CHECK(hinted.Next(&data, &ilen, &seq) == true && seq == 10);
+
+	wal.Close();
+	reader.Close();
+	hinted.Close();
+	RemoveDir(dir);
+}
+
+static void TestSegments()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_wal") == true);
+
+	WAL wal;
+	wal.m_segment_bytes = 4096;
+	CHECK(wal.Open(dir) == true);
+	CHECK(AppendRecords(&wal, 1000) == true);
+
+	vector<unsigned long> segs;
+	CHECK(WALSegments(dir, segs) == true && segs.size() > 3 && segs[0] == 1);
+
+	WALReader reader;
+	CHECK(reader.Open(dir, 0) == true);
+	CHECK(ReadAll(&reader, 1) == 1000);
+	reader.Close();
+
+	// 重新打开从最后一个段恢复，序号接着写
+	wal.Close();
+	CHECK(wal.Open(dir) == true);
+	CHECK(wal.Durable() == 1000);
+	CHECK(AppendRecords(&wal, 10) == true);
+	CHECK(wal.Durable() == 1010);
+
+	// 删除之后从最早的段读
+	CHECK(wal.Purge(500) > 0);
+	vector<unsigned long> left;
+	CHECK(WALSegments(dir, left) == true && left.size() < segs.size() && left[0] <= 500);
+	CHECK(reader.Open(dir, 0) == true);
+	CHECK(ReadAll(&reader, left[0]) == (int)(1011 - left[0]));
+
+	wal.Close();
+	reader.Close();
+	RemoveDir(dir);
+}
+
+/*
+ * 写10条记录后关闭，用damage模拟崩溃在最后一个段留下的各种尾部，
+ * 恢复之后应当保留前ikeep条记录
+ * */
+static void TestRecover(const char *name, void (*damage)(const char *path), const int ikeep)
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_wal") == true);
+
+	WAL wal;
+	CHECK(wal.Open(dir) == true);
+	CHECK(AppendRecords(&wal, 10) == true);
+	wal.Close();
+
+	char path[300];
+	SegmentPath(path, sizeof(path), dir, 1);
+	damage(path);
+	off_t size = FileSize(path);
+
+	// 恢复之前打开的读取器映射着坏的尾部，只能读到有效的记录
+	WALReader reader;
+	CHECK(reader.Open(dir, 0) == true);
+	int n = ReadAll(&reader, 1);
+	CHECK(n == ikeep);
+
+	CHECK(wal.Open(dir) == true);
+	if (wal.Durable() != (unsigned long)ikeep)
+	{
+		fprintf(stderr, "%s: durable %lu after recovery, expected %d\n", name, wal.Durable(), ikeep);
+	}
+	CHECK(wal.Durable() == (unsigned long)ikeep);
+	CHECK(FileSize(path) >= size);
+
+	// 新记录从第一条坏记录的位置接着写，原来的读取器读到的是新记录
+	CHECK(AppendRecords(&wal, 5) == true);
+	CHECK(wal.Durable() == (unsigned long)ikeep + 5);
+	CHECK(ReadAll(&reader, ikeep + 1) == 5);
+
+	// 再次恢复时没有需要丢弃的内容
+	wal.Close();
+	CHECK(wal.Open(dir) == true);
+	CHECK(wal.Durable() == (unsigned long)ikeep + 5);
+
+	WALReader fresh;
+	CHECK(fresh.Open(dir, 0) == true);
+	CHECK(ReadAll(&fresh, 1) == ikeep + 5);
+
+	wal.Close();
+	reader.Close();
+	fresh.Close();
+	RemoveDir(dir);
+}
+
+/*
+ * 最后一个批次之后有非零的垃圾
+ * */
+static void DamageGarbage(const char *path)
+{
+	int fd = open(path, O_WRONLY);
+	char junk[100000];
+	memset(junk, 'j', sizeof(junk));
+	CHECK(pwrite(fd, junk, sizeof(junk), 10 * TEST_RECORD_BYTES) == sizeof(junk));
+	close(fd);
+}
+
+/*
+ * 最后一条记录只写了一部分：文件末尾截掉最后一条记录的后半
+ * */
+static void DamageTorn(const char *path)
+{
+	CHECK(truncate(path, 9 * TEST_RECORD_BYTES + WAL_HEADER_LEN / 2) == 0);
+}
+
+/*
+ * 第8条记录的内容被改写，CRC对不上，之后的记录即使完好也丢弃
+ * */
+static void DamageCRC(const char *path)
+{
+	int fd = open(path, O_WRONLY);
+	CHECK(pwrite(fd, "?", 1, 7 * TEST_RECORD_BYTES + WAL_HEADER_LEN) == 1);
+	close(fd);
+}
+
+/*
+ * 第6条记录的长度字段远超过文件
+ * */
+static void DamageLength(const char *path)
+{
+	int fd = open(path, O_WRONLY);
+	unsigned int ilen = WAL_MAX_RECORD + 1;
+	CHECK(pwrite(fd, &ilen, 4, 5 * TEST_RECORD_BYTES) == 4);
+	close(fd);
+}
+
+struct Appender
+{
+	WAL          *m_wal;
+	unsigned long m_seqs[200];
+	bool          m_bok;
+};
+
+static void *AppendThread(void *arg)
+{
+	Appender *appender = (Appender *)arg;
+	appender->m_bok = true;
+	for (int i = 0; i < 200; i++)
+	{
+		if (appender->m_wal->Append("group", 5, &appender->m_seqs[i]) == false)
+		{
+			appender->m_bok = false;
+		}
+	}
+	return 0;
+}
+
+static void TestGroupCommit()
+{
+	char dir[64];
+	CHECK(TestTempDir(dir, sizeof(dir), "test_wal") == true);
+
+	WAL wal;
+	CHECK(wal.Open(dir) == true);
+
+	Appender appenders[8];
+	pthread_t tids[8];
+	for (int i = 0; i < 8; i++)
+	{
+		appenders[i].m_wal = &wal;
+		CHECK(pthread_create(&tids[i], 0, AppendThread, &appenders[i]) == 0);
+	}
+
+	vector<bool> seen(1601, false);
+	bool bunique = true;
+	for (int i = 0; i < 8; i++)
+	{
+		pthread_join(tids[i], 0);
+		CHECK(appenders[i].m_bok == true);
+		for (int j = 0; j < 200; j++)
+		{
+			unsigned long seq = appenders[i].m_seqs[j];
+			if (seq == 0 || seq > 1600 || seen[seq] == true)
+			{
+				bunique = false;
+				continue;
+			}
+			seen[seq] = true;
+
+			// 同一个线程的记录序号递增
+			if (j > 0 && seq <= appenders[i].m_seqs[j - 1])
+			{
+				bunique = false;
+			}
+		}
+	}
+	CHECK(bunique == true);
+	CHECK(wal.Durable() == 1600);
+	CHECK(wal.Syncs() < 1600);
+
+	wal.Close();
+	RemoveDir(dir);
+}
+
+int main()
+{
+	TestAppendRead();
+	TestSegments();
+	TestRecover("garbage", DamageGarbage, 10);
+	TestRecover("torn", DamageTorn, 9);
+	TestRecover("crc", DamageCRC, 7);
+	TestRecover("length", DamageLength, 5);
+	TestGroupCommit();
+
+	return TestResult("test_wal");
+}
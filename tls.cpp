@@ -0,0 +1,636 @@
+#include "public.h"
+#include "tls.h"
+#include "tcpsocket.h"
+#include "metrics.h"
+#include "utils.h"
+
+#ifdef WITH_TLS
+#include <sys/sendfile.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+#define TLS_RECORD_SIZE 16384   // TLS记录的最大明文长度
+#define TLS_MAX_SESSIONS 1024   // 客户端会话缓存的最大条数
+
+static MetricCounter *g_tls_full = NewMetricCounter("moserver_tls_handshakes_total",
+		"TLS handshakes completed", "type=\"full\"");
+static MetricCounter *g_tls_resumed = NewMetricCounter("moserver_tls_handshakes_total",
+		"TLS handshakes completed", "type=\"resumed\"");
+static MetricCounter *g_tls_failures = NewMetricCounter("moserver_tls_handshake_failures_total",
+		"TLS handshakes that failed");
+static MetricCounter *g_tls_ktls_send = NewMetricCounter("moserver_tls_ktls_total",
+		"TLS connections with record crypto offloaded to the kernel", "dir=\"send\"");
+static MetricCounter *g_tls_ktls_recv = NewMetricCounter("moserver_tls_ktls_total",
+		"TLS connections with record crypto offloaded to the kernel", "dir=\"recv\"");
+
+TLSContext::TLSContext()
+{
+	m_bktls = true;
+	m_ctx = 0;
+	m_bserver = false;
+	pthread_mutex_init(&m_lock, 0);
+}
+
+bool TLSContext::IsServer() const
+{
+	return m_bserver;
+}
+
+struct ssl_ctx_st *TLSContext::Ctx() const
+{
+	return m_ctx;
+}
+
+TLSContext::~TLSContext()
+{
+	Free();
+	pthread_mutex_destroy(&m_lock);
+}
+
+TLSConn::TLSConn()
+{
+	m_fd = -1;
+	m_bresumed = false;
+	m_bktls_send = false;
+	m_bktls_recv = false;
+	m_ssl = 0;
+	m_session_key[0] = 0;
+}
+
+TLSConn::~TLSConn()
+{
+	Close();
+}
+
+#ifdef WITH_TLS
+
+/*
+ * 客户端收到新的会话票据时由OpenSSL调用，TLS 1.3的票据在握手完成之后才到达
+ * */
+static int NewSessionCallback(SSL *ssl, SSL_SESSION *sess)
+{
+	const char *key = (const char *)SSL_get_app_data(ssl);
+	TLSContext *ctx = (TLSContext *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	if (key == 0 || key[0] == 0 || ctx == 0)
+	{
+		return 0;
+	}
+
+	ctx->PutSession(key, sess);
+
+	return 1;
+}
+
+void TLSContext::Free()
+{
+	pthread_mutex_lock(&m_lock);
+	for (unordered_map<string, SSL_SESSION *>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+	{
+		SSL_SESSION_free(it->second);
+	}
+	m_sessions.clear();
+	pthread_mutex_unlock(&m_lock);
+
+	if (m_ctx != 0)
+	{
+		SSL_CTX_free(m_ctx);
+		m_ctx = 0;
+	}
+}
+
+bool TLSContext::InitServer(const char *cert_file, const char *key_file)
+{
+	Free();
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == 0)
+	{
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(ctx) != 1)
+	{
+		SSL_CTX_free(ctx);
+		return false;
+	}
+
+	// 只用无状态的会话票据恢复会话，服务端不保存会话，多个工作线程之间不用同步
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_num_tickets(ctx, 1);
+	if (m_bktls == true)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+
+	m_ctx = ctx;
+	m_bserver = true;
+
+	return true;
+}
+
+bool TLSContext::InitClient(const char *ca_file, const bool bverify)
+{
+	Free();
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == 0)
+	{
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if (bverify == true)
+	{
+		int iret = ca_file != 0 ? SSL_CTX_load_verify_locations(ctx, ca_file, 0) : SSL_CTX_set_default_verify_paths(ctx);
+		if (iret != 1)
+		{
+			SSL_CTX_free(ctx);
+			return false;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+	}
+
+	// 会话由TLSContext按主机和端口保存，不用OpenSSL的内部缓存
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, NewSessionCallback);
+	SSL_CTX_set_app_data(ctx, this);
+	if (m_bktls == true)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+
+	m_ctx = ctx;
+	m_bserver = false;
+
+	return true;
+}
+
+SSL_SESSION *TLSContext::GetSession(const char *key)
+{
+	SSL_SESSION *sess = 0;
+
+	pthread_mutex_lock(&m_lock);
+	unordered_map<string, SSL_SESSION *>::iterator it = m_sessions.find(key);
+	if (it != m_sessions.end())
+	{
+		sess = it->second;
+		SSL_SESSION_up_ref(sess);
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	return sess;
+}
+
+void TLSContext::PutSession(const char *key, SSL_SESSION *sess)
+{
+	pthread_mutex_lock(&m_lock);
+	unordered_map<string, SSL_SESSION *>::iterator it = m_sessions.find(key);
+	if (it != m_sessions.end())
+	{
+		SSL_SESSION_free(it->second);
+		it->second = sess;
+	}
+	else
+	{
+		// 连接的服务端一般是固定的几个，超过上限说明目标地址在不断变化，全部丢弃重来
+		if (m_sessions.size() >= TLS_MAX_SESSIONS)
+		{
+			for (it = m_sessions.begin(); it != m_sessions.end(); ++it)
+			{
+				SSL_SESSION_free(it->second);
+			}
+			m_sessions.clear();
+		}
+		m_sessions[key] = sess;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+/*
+ * 握手完成之后记录会话恢复和kTLS的情况
+ * */
+static void HandshakeDone(SSL *ssl, TLSConn *conn)
+{
+	conn->m_bresumed = (SSL_session_reused(ssl) == 1);
+	conn->m_bktls_send = (BIO_get_ktls_send(SSL_get_wbio(ssl)) == 1);
+	conn->m_bktls_recv = (BIO_get_ktls_recv(SSL_get_rbio(ssl)) == 1);
+
+	if (conn->m_bresumed == true)
+	{
+		g_tls_resumed->Add();
+	}
+	else
+	{
+		g_tls_full->Add();
+	}
+	if (conn->m_bktls_send == true)
+	{
+		g_tls_ktls_send->Add();
+	}
+	if (conn->m_bktls_recv == true)
+	{
+		g_tls_ktls_recv->Add();
+	}
+}
+
+bool TLSConn::Accept(TLSContext *ctx, const int fd)
+{
+	Close();
+
+	if (ctx == 0 || ctx->Ctx() == 0 || (m_ssl = SSL_new(ctx->Ctx())) == 0)
+	{
+		return false;
+	}
+
+	m_fd = fd;
+	if (SSL_set_fd(m_ssl, fd) != 1 || SSL_accept(m_ssl) != 1)
+	{
+		ERR_clear_error();
+		g_tls_failures->Add();
+		Close();
+		return false;
+	}
+
+	HandshakeDone(m_ssl, this);
+
+	return true;
+}
+
+bool TLSConn::Connect(TLSContext *ctx, const int fd, const char *host, const char *session_key, const int itimeout)
+{
+	Close();
+
+	if (ctx == 0 || ctx->Ctx() == 0 || (m_ssl = SSL_new(ctx->Ctx())) == 0)
+	{
+		return false;
+	}
+
+	m_fd = fd;
+	SSL_set_fd(m_ssl, fd);
+
+	// SNI只能用主机名，IP地址按证书中的IP地址验证
+	struct in6_addr addr;
+	bool bip = (inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1);
+	if (bip == false)
+	{
+		SSL_set_tlsext_host_name(m_ssl, host);
+	}
+	if (SSL_get_verify_mode(m_ssl) != SSL_VERIFY_NONE)
+	{
+		if (bip == true)
+		{
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl), host);
+		}
+		else
+		{
+			SSL_set1_host(m_ssl, host);
+		}
+	}
+
+	if (session_key != 0)
+	{
+		StrCopy(m_session_key, sizeof(m_session_key), session_key);
+		SSL_set_app_data(m_ssl, m_session_key);
+
+		SSL_SESSION *sess = ctx->GetSession(session_key);
+		if (sess != 0)
+		{
+			SSL_set_session(m_ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+	}
+
+	// 握手期间用SO_RCVTIMEO和SO_SNDTIMEO限制时间，完成后恢复为不超时
+	struct timeval tv;
+	tv.tv_sec = itimeout;
+	tv.tv_usec = 0;
+	if (itimeout > 0)
+	{
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	int iret = SSL_connect(m_ssl);
+
+	if (itimeout > 0)
+	{
+		tv.tv_sec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	if (iret != 1)
+	{
+		ERR_clear_error();
+		g_tls_failures->Add();
+		Close();
+		return false;
+	}
+
+	HandshakeDone(m_ssl, this);
+
+	return true;
+}
+
+bool TLSConn::ReadN(char *buffer, const size_t n)
+{
+	if (m_ssl == 0)
+	{
+		return false;
+	}
+
+	size_t ileft = n;
+	while (ileft > 0)
+	{
+		size_t ibytes = 0;
+		if (SSL_read_ex(m_ssl, buffer + (n - ileft), ileft, &ibytes) != 1)
+		{
+			ERR_clear_error();
+			return false;
+		}
+		ileft -= ibytes;
+	}
+
+	return true;
+}
+
+bool TLSConn::Read(char *buffer, int *ilen, const int imaxlen)
+{
+	*ilen = 0;
+	if (ReadN((char *)ilen, 4) == false)
+	{
+		return false;
+	}
+
+	*ilen = ntohl(*ilen);
+	if (*ilen < 0 || (imaxlen > 0 && *ilen > imaxlen))
+	{
+		return false;
+	}
+
+	return ReadN(buffer, *ilen);
+}
+
+bool TLSConn::SSLWrite(const char *buffer, size_t n)
+{
+	while (n > 0)
+	{
+		size_t ibytes = 0;
+		if (SSL_write_ex(m_ssl, buffer, n, &ibytes) != 1)
+		{
+			ERR_clear_error();
+			return false;
+		}
+		buffer += ibytes;
+		n -= ibytes;
+	}
+
+	return true;
+}
+
+bool TLSConn::Write(const char *buffer, const int ilen)
+{
+	if (m_ssl == 0)
+	{
+		return false;
+	}
+
+	int ibytes = ilen == 0 ? strlen(buffer) : ilen;
+	int ilen_byte = htonl(ibytes);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &ilen_byte;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = (void *)buffer;
+	iov[1].iov_len = ibytes;
+
+	return WriteV(iov, 2);
+}
+
+bool TLSConn::WriteV(struct iovec *iov, int iovcnt)
+{
+	if (m_ssl == 0)
+	{
+		return false;
+	}
+
+	// 内核加密时和明文连接一样直接writev，内核按记录切分
+	if (m_bktls_send == true)
+	{
+		return TCPWriteV(m_fd, iov, iovcnt);
+	}
+
+	// 否则把小的数据段拼成接近一个记录大小再交给OpenSSL，避免长度头单独占一个记录
+	char record[TLS_RECORD_SIZE];
+	size_t iused = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		const char *data = (const char *)iov[i].iov_base;
+		size_t ileft = iov[i].iov_len;
+		while (ileft > 0)
+		{
+			if (iused == 0 && ileft >= TLS_RECORD_SIZE)
+			{
+				size_t ibytes = ileft - ileft % TLS_RECORD_SIZE;
+				if (SSLWrite(data, ibytes) == false)
+				{
+					return false;
+				}
+				data += ibytes;
+				ileft -= ibytes;
+				continue;
+			}
+
+			size_t ibytes = TLS_RECORD_SIZE - iused < ileft ? TLS_RECORD_SIZE - iused : ileft;
+			memcpy(record + iused, data, ibytes);
+			iused += ibytes;
+			data += ibytes;
+			ileft -= ibytes;
+
+			if (iused == TLS_RECORD_SIZE)
+			{
+				if (SSLWrite(record, iused) == false)
+				{
+					return false;
+				}
+				iused = 0;
+			}
+		}
+	}
+
+	return iused == 0 || SSLWrite(record, iused);
+}
+
+bool TLSConn::SendFile(const int filefd, off_t offset, size_t count)
+{
+	if (m_ssl == 0)
+	{
+		return false;
+	}
+
+	if (m_bktls_send == true)
+	{
+		while (count > 0)
+		{
+			ssize_t ibytes = sendfile(m_fd, filefd, &offset, count);
+			if (ibytes <= 0)
+			{
+				if (ibytes < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			count -= ibytes;
+		}
+		return true;
+	}
+
+	char buffer[TLS_RECORD_SIZE];
+	while (count > 0)
+	{
+		ssize_t ibytes = pread(filefd, buffer, count < sizeof(buffer) ? count : sizeof(buffer), offset);
+		if (ibytes <= 0)
+		{
+			if (ibytes < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		if (SSLWrite(buffer, ibytes) == false)
+		{
+			return false;
+		}
+		offset += ibytes;
+		count -= ibytes;
+	}
+
+	return true;
+}
+
+bool TLSConn::Pending() const
+{
+	return m_ssl != 0 && SSL_has_pending(m_ssl) == 1;
+}
+
+void TLSConn::Close()
+{
+	if (m_ssl != 0)
+	{
+		// 对端不读时发送缓冲区可能是满的，close_notify不能阻塞调用者
+		if (m_fd != -1)
+		{
+			int flags = fcntl(m_fd, F_GETFL);
+			if (flags != -1 && (flags & O_NONBLOCK) == 0)
+			{
+				fcntl(m_fd, F_SETFL, flags | O_NONBLOCK);
+				SSL_shutdown(m_ssl);
+				fcntl(m_fd, F_SETFL, flags);
+			}
+			else
+			{
+				SSL_shutdown(m_ssl);
+			}
+		}
+		SSL_free(m_ssl);
+		ERR_clear_error();
+		m_ssl = 0;
+	}
+
+	m_fd = -1;
+	m_bresumed = false;
+	m_bktls_send = false;
+	m_bktls_recv = false;
+	m_session_key[0] = 0;
+}
+
+#else
+
+/*
+ * 没有用WITH_TLS编译时的空实现，初始化总是失败，调用者据此报错
+ * */
+void TLSContext::Free()
+{
+}
+
+bool TLSContext::InitServer(const char *, const char *)
+{
+	errno = ENOTSUP;
+	return false;
+}
+
+bool TLSContext::InitClient(const char *, const bool)
+{
+	errno = ENOTSUP;
+	return false;
+}
+
+struct ssl_session_st *TLSContext::GetSession(const char *)
+{
+	return 0;
+}
+
+void TLSContext::PutSession(const char *, struct ssl_session_st *)
+{
+}
+
+bool TLSConn::Accept(TLSContext *, const int)
+{
+	g_tls_failures->Add();
+	return false;
+}
+
+bool TLSConn::Connect(TLSContext *, const int, const char *, const char *, const int)
+{
+	g_tls_failures->Add();
+	return false;
+}
+
+bool TLSConn::ReadN(char *, const size_t)
+{
+	return false;
+}
+
+bool TLSConn::Read(char *, int *ilen, const int)
+{
+	*ilen = 0;
+	return false;
+}
+
+bool TLSConn::SSLWrite(const char *, size_t)
+{
+	return false;
+}
+
+bool TLSConn::Write(const char *, const int)
+{
+	return false;
+}
+
+bool TLSConn::WriteV(struct iovec *, int)
+{
+	return false;
+}
+
+bool TLSConn::SendFile(const int, off_t, size_t)
+{
+	return false;
+}
+
+bool TLSConn::Pending() const
+{
+	return false;
+}
+
+void TLSConn::Close()
+{
+	m_fd = -1;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+#include "public.h"
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+/**
+ * @brief TLS配置，封装OpenSSL的SSL_CTX
+ *
+ * 服务端和客户端各用一个TLSContext，多个连接共用。需要用make WITH_TLS=1编译，
+ * 否则Init系列方法总是返回false。
+ *
+ * 会话恢复：服务端签发会话票据（session ticket），不保存会话状态；客户端按
+ * "主机:端口"缓存最近一次收到的会话，重新连接时带上，握手省掉证书验证和密钥交换。
+ *
+ * kTLS：m_bktls为true时握手之后尝试把记录层的加解密交给内核，需要内核加载了
+ * tls模块并且协商的是内核支持的加密套件。发送方向交给内核之后，TLSConn的WriteV
+ * 和SendFile直接对socket调用writev和sendfile，和明文连接一样零拷贝；内核不支持时
+ * 自动退回OpenSSL在用户态加解密，功能不受影响。
+ */
+class TLSContext
+{
+	public:
+		bool m_bktls;   // 是否尝试使用kTLS，Init之前设置，缺省为true
+
+		TLSContext();
+
+		/*
+		 * 初始化服务端，cert_file为PEM格式的证书链，key_file为PEM格式的私钥
+		 * */
+		bool InitServer(const char *cert_file, const char *key_file);
+
+		/*
+		 * 初始化客户端
+		 * ca_file 用于验证服务端证书的CA证书，为0时使用系统缺省的CA
+		 * bverify 是否验证服务端证书和主机名，自签名证书测试时可以关闭
+		 * */
+		bool InitClient(const char *ca_file, const bool bverify = true);
+
+		bool IsServer() const;
+
+		struct ssl_ctx_st *Ctx() const;
+
+		/*
+		 * 客户端会话缓存，key一般为"主机:端口"
+		 * GetSession返回的会话增加了引用计数，调用者用完后要调用SSL_SESSION_free
+		 * PutSession接管sess的引用
+		 * */
+		struct ssl_session_st *GetSession(const char *key);
+
+		void PutSession(const char *key, struct ssl_session_st *sess);
+
+		~TLSContext();
+
+	private:
+		struct ssl_ctx_st *m_ctx;
+		bool               m_bserver;
+
+		pthread_mutex_t m_lock;
+		unordered_map<string, struct ssl_session_st *> m_sessions;
+
+		void Free();
+};
+
+/**
+ * @brief 一个TLS连接，读写的报文格式和TCPRead/TCPWrite相同
+ *
+ * socket由调用者创建和关闭，TLSConn只负责TLS层。socket应该是阻塞的，
+ * 读超时由调用者用SO_RCVTIMEO或者在读之前poll控制。
+ * 同一个连接不能在多个线程中同时读写。
+ *
+ * OpenSSL可能一次读入多个报文，调用者用epoll等待数据之前要先检查Pending。
+ */
+class TLSConn
+{
+	public:
+		int  m_fd;
+		bool m_bresumed;      // 握手是否恢复了之前的会话
+		bool m_bktls_send;    // 发送方向是否由内核加密
+		bool m_bktls_recv;    // 接收方向是否由内核解密
+
+		TLSConn();
+
+		/*
+		 * 服务端握手，阻塞直到完成或者失败
+		 * */
+		bool Accept(TLSContext *ctx, const int fd);
+
+		/*
+		 * 客户端握手
+		 * host 服务端主机名或者IP地址，用于SNI和证书验证
+		 * session_key 会话缓存的键，为0时不恢复会话
+		 * itimeout 握手超时时间，单位为秒，0表示不超时
+		 * */
+		bool Connect(TLSContext *ctx, const int fd, const char *host, const char *session_key, const int itimeout = 0);
+
+		/*
+		 * 读取一个报文，ilen返回报文长度，imaxlen为缓冲区大小，0表示不检查
+		 * */
+		bool Read(char *buffer, int *ilen, const int imaxlen = 0);
+
+		bool ReadN(char *buffer, const size_t n);
+
+		/*
+		 * 发送一个报文，ilen为0时按字符串处理
+		 * */
+		bool Write(const char *buffer, const int ilen);
+
+		/*
+		 * 发送多段数据，不加长度头，iov在发送过程中会被修改
+		 * */
+		bool WriteV(struct iovec *iov, int iovcnt);
+
+		/*
+		 * 发送文件filefd从offset开始的count个字节，kTLS发送时由内核完成
+		 * */
+		bool SendFile(const int filefd, off_t offset, size_t count);
+
+		/*
+		 * OpenSSL中是否还有没有读出的数据
+		 * */
+		bool Pending() const;
+
+		/*
+		 * 发送close_notify并释放TLS状态，不关闭socket，不会阻塞
+		 * */
+		void Close();
+
+		~TLSConn();
+
+	private:
+		struct ssl_st *m_ssl;
+		char           m_session_key[128];
+
+		bool SSLWrite(const char *buffer, size_t n);
+};
+
+#endif
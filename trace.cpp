@@ -0,0 +1,240 @@
+#include "public.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <sys/syscall.h>
+
+int g_trace_enabled = 0;
+
+struct TraceEvent
+{
+	const char   *m_name;
+	unsigned long m_begin;
+	unsigned long m_end;
+	long          m_arg;
+};
+
+/*
+ * 每个线程一个环形缓冲区，只有所属线程写入，导出时其他线程只读
+ * m_head 为累计写入的事件个数，写完事件后用release语义更新
+ * */
+struct TraceRing
+{
+	TraceEvent    m_events[TRACE_RING_SIZE];
+	unsigned long m_head;
+	int           m_tid;
+	int           m_bfree;      // 所属线程已退出，可以被新线程重用
+	TraceRing    *m_next;
+};
+
+static TraceRing *g_trace_rings = 0;
+static __thread TraceRing *t_trace_ring = 0;
+static pthread_key_t  g_trace_key;
+static pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+
+static double g_ticks_per_us = 0;   // 每微秒的时间戳计数
+static unsigned long g_ticks_base = 0;
+
+/**
+ * @brief 线程退出时把它的环形缓冲区标记为可重用，已记录的事件仍然可以导出
+ */
+static void TraceThreadExit(void *arg)
+{
+	TraceRing *ring = (TraceRing *)arg;
+	__atomic_store_n(&ring->m_bfree, 1, __ATOMIC_RELEASE);
+}
+
+static void TraceKeyCreate()
+{
+	pthread_key_create(&g_trace_key, TraceThreadExit);
+}
+
+/**
+ * @brief 取得当前线程的环形缓冲区，优先重用已退出线程的缓冲区
+ * @return 环形缓冲区，内存不足时返回0
+ */
+static TraceRing *TraceGetRing()
+{
+	pthread_once(&g_trace_once, TraceKeyCreate);
+
+	int tid = (int)syscall(SYS_gettid);
+	TraceRing *ring = 0;
+
+	for (TraceRing *p = __atomic_load_n(&g_trace_rings, __ATOMIC_ACQUIRE); p != 0; p = p->m_next)
+	{
+		int expected = 1;
+		if (__atomic_compare_exchange_n(&p->m_bfree, &expected, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			ring = p;
+			break;
+		}
+	}
+
+	if (ring == 0)
+	{
+		ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+		if (ring == 0)
+		{
+			return 0;
+		}
+
+		TraceRing *head = __atomic_load_n(&g_trace_rings, __ATOMIC_ACQUIRE);
+		do
+		{
+			ring->m_next = head;
+		} while (__atomic_compare_exchange_n(&g_trace_rings, &head, ring, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) == false);
+	}
+
+	ring->m_tid = tid;
+	pthread_setspecific(g_trace_key, ring);
+	t_trace_ring = ring;
+
+	return ring;
+}
+
+/**
+ * @brief 记录一个区间
+ * @param name 区间名，必须是静态字符串
+ * @param begin 开始时间戳
+ * @param end 结束时间戳
+ * @param arg 附带的数值
+ */
+void TraceRecord(const char *name, const unsigned long begin, const unsigned long end, const long arg)
+{
+	if (begin == 0)
+	{
+		return;
+	}
+
+	TraceRing *ring = t_trace_ring;
+	if (ring == 0 && (ring = TraceGetRing()) == 0)
+	{
+		return;
+	}
+
+	unsigned long head = ring->m_head;
+	TraceEvent &event = ring->m_events[head & (TRACE_RING_SIZE - 1)];
+	event.m_name = name;
+	event.m_begin = begin;
+	event.m_end = end;
+	event.m_arg = arg;
+	__atomic_store_n(&ring->m_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 校准时间戳频率
+ * @details 用CLOCK_MONOTONIC测量约10毫秒内时间戳的增量
+ */
+static void TraceCalibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec ts0, ts1;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	unsigned long t0 = TraceTicks();
+
+	struct timespec sleep_ts = { 0, 10000000 };
+	nanosleep(&sleep_ts, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	unsigned long t1 = TraceTicks();
+
+	double us = (ts1.tv_sec - ts0.tv_sec) * 1e6 + (ts1.tv_nsec - ts0.tv_nsec) / 1e3;
+	g_ticks_per_us = (t1 - t0) / us;
+#else
+	g_ticks_per_us = 1000.0;
+#endif
+	g_ticks_base = TraceTicks();
+}
+
+/**
+ * @brief 开启或关闭跟踪
+ * @param benable true为开启，false为关闭
+ */
+void TraceEnable(const bool benable)
+{
+	if (benable == true && g_ticks_per_us == 0)
+	{
+		TraceCalibrate();
+	}
+
+	__atomic_store_n(&g_trace_enabled, benable ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 清空所有线程的环形缓冲区
+ * @details 只是把事件标记为无效，正在写入的线程不受影响
+ */
+void TraceClear()
+{
+	for (TraceRing *ring = __atomic_load_n(&g_trace_rings, __ATOMIC_ACQUIRE); ring != 0; ring = ring->m_next)
+	{
+		unsigned long head = __atomic_load_n(&ring->m_head, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < TRACE_RING_SIZE; i++)
+		{
+			if (head > (unsigned long)i)
+			{
+				ring->m_events[(head - 1 - i) & (TRACE_RING_SIZE - 1)].m_begin = 0;
+			}
+		}
+	}
+}
+
+/**
+ * @brief 导出为Chrome trace-event JSON
+ * @details 每个线程的事件先拷贝出来，拷贝后再检查一次m_head，丢弃拷贝期间被覆盖的事件
+ * @param filename 输出文件名
+ * @return 成功返回true，失败返回false
+ */
+bool TraceExport(const char *filename)
+{
+	FILE *fp = FOpen(filename, "w");
+	if (fp == 0)
+	{
+		return false;
+	}
+
+	if (g_ticks_per_us == 0)
+	{
+		TraceCalibrate();
+	}
+
+	int pid = getpid();
+	bool bfirst = true;
+	vector<TraceEvent> events;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+
+	for (TraceRing *ring = __atomic_load_n(&g_trace_rings, __ATOMIC_ACQUIRE); ring != 0; ring = ring->m_next)
+	{
+		unsigned long head = __atomic_load_n(&ring->m_head, __ATOMIC_ACQUIRE);
+		unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		events.clear();
+		for (unsigned long i = first; i < head; i++)
+		{
+			events.push_back(ring->m_events[i & (TRACE_RING_SIZE - 1)]);
+		}
+
+		unsigned long head_after = __atomic_load_n(&ring->m_head, __ATOMIC_ACQUIRE);
+		unsigned long valid_from = head_after > TRACE_RING_SIZE ? head_after - TRACE_RING_SIZE : 0;
+
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			if (first + i < valid_from || events[i].m_begin == 0 || events[i].m_name == 0)
+			{
+				continue;
+			}
+
+			double ts = (double)(long)(events[i].m_begin - g_ticks_base) / g_ticks_per_us;
+			double dur = (double)(events[i].m_end - events[i].m_begin) / g_ticks_per_us;
+
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%ld}}",
+					bfirst ? "" : ",\n", events[i].m_name, ts, dur, pid, ring->m_tid, events[i].m_arg);
+			bfirst = false;
+		}
+	}
+
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	return fclose(fp) == 0;
+}
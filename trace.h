@@ -0,0 +1,110 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include "public.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_RING_SIZE 8192    // 每个线程环形缓冲区保存的事件个数，必须是2的幂
+
+/*
+ * 是否记录跟踪事件，关闭时每个用TRACE_CALL记录的区间只有一次可预测的分支判断
+ * */
+extern int g_trace_enabled;
+
+/*
+ * 读取时间戳，x86上使用rdtsc，其他平台使用CLOCK_MONOTONIC，单位由TraceExport换算
+ * */
+static inline unsigned long TraceTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * 把一个已经结束的区间写到当前线程的环形缓冲区，begin为0时不记录
+ * name 区间名，必须是静态字符串
+ * arg  附带的数值，例如字节数或者文件描述符
+ * */
+void TraceRecord(const char *name, const unsigned long begin, const unsigned long end, const long arg = 0);
+
+/*
+ * 执行expr，把结果赋给ret，并把expr作为一个区间记录下来
+ * 开始和结束共用一次g_trace_enabled的判断，expr在两个分支里各展开一份，
+ * 跟踪关闭时只多一次可预测的分支，热路径上的跟踪点都用它
+ * ret  接收expr结果的变量
+ * name 区间名，必须是静态字符串
+ * expr 要记录的表达式，例如一次系统调用
+ * arg  附带的数值，在expr执行和赋值之后才求值，可以是ret或者expr的输出，例如读到的字节数
+ * */
+#define TRACE_CALL(ret, name, expr, arg) \
+	do \
+	{ \
+		if (__builtin_expect(g_trace_enabled, 0)) \
+		{ \
+			unsigned long _trace_begin = TraceTicks(); \
+			(ret) = (expr); \
+			TraceRecord((name), _trace_begin, TraceTicks(), (arg)); \
+		} \
+		else \
+		{ \
+			(ret) = (expr); \
+		} \
+	} while (0)
+
+/**
+ * @brief 作用域跟踪区间，构造时记录开始时间，析构时写入环形缓冲区
+ * @details 构造和析构各判断一次，跟踪关闭时有两次分支，热路径上用TRACE_CALL
+ */
+class TraceSpan
+{
+	public:
+		TraceSpan(const char *name, const long arg = 0)
+		{
+			m_name = name;
+			m_arg = arg;
+			m_begin = __builtin_expect(g_trace_enabled, 0) ? TraceTicks() : 0UL;
+		}
+
+		~TraceSpan()
+		{
+			if (__builtin_expect(m_begin != 0, 0))
+			{
+				TraceRecord(m_name, m_begin, TraceTicks(), m_arg);
+			}
+		}
+
+	private:
+		const char   *m_name;
+		long          m_arg;
+		unsigned long m_begin;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(_trace_span_, __LINE__)(name)
+
+/*
+ * 开启或关闭跟踪，第一次开启时校准时间戳频率（约10毫秒）
+ * */
+void TraceEnable(const bool benable);
+
+/*
+ * 清空所有线程的环形缓冲区
+ * */
+void TraceClear();
+
+/*
+ * 把所有线程环形缓冲区中的事件按Chrome trace-event JSON格式写到文件，
+ * 可以在chrome://tracing或Perfetto中打开
+ * 返回值 true为成功，false为失败
+ * */
+bool TraceExport(const char *filename);
+
+#endif
@@ -1,5 +1,6 @@
 #include "public.h"
 #include "utils.h"
+#include "dircache.h"
 
 /**
  * @brief 安全的字符串复制函数
@@ -225,52 +226,31 @@ void StrTrimR(char *str, const char chr)
 
 /**
  * @brief 递归创建目录
- * @details 根据文件路径创建必要的目录结构
+ * @details 根据文件路径创建必要的目录结构，已经确认存在的目录记在DefaultDirCache中，
+ *          再次调用时不需要系统调用
  * @param filename 文件或目录的完整路径
  * @param bisfile 是否为文件，true表示文件，false表示目录
  * @return 成功返回true，失败返回false
  */
 bool MKdir(const char *filename, bool bisfile)
 {
-	char spath[301];
-	int ilen = strlen(filename);
-
-	for (int i = 1; i < ilen; i++)
+	if (bisfile == false)
 	{
-		if (filename[i] != '/')
-		{
-			continue;
-		}
-
-		StrNCopy(spath, sizeof(spath), filename, i);
-		if (access(spath, F_OK) == 0)
-		{
-			continue;
-		}
-
-		if (mkdir(spath, 0755) != 0)
-		{
-			return false;
-		}
+		return DefaultDirCache().MakeDirs(filename);
 	}
 
-	if (bisfile == false)
+	const char *slash = strrchr(filename, '/');
+	if (slash == 0 || slash == filename)
 	{
-		if (access(filename, F_OK) != 0)
-		{
-			if (mkdir(filename, 0755) != 0)
-			{
-				return false;
-			}
-		}
+		return true;
 	}
 
-	return true;
+	return DefaultDirCache().MakeDirs(filename, slash - filename);
 }
 
 /**
  * @brief 安全的文件打开函数
- * @details 打开文件前会自动创建必要的目录结构
+ * @details 打开文件前会自动创建必要的目录结构，目录已经缓存时只有fopen的一次openat
  * @param filename 要打开的文件的完整路径
  * @param mode 文件打开模式
  * @return 成功返回文件指针，失败返回0
@@ -282,7 +262,18 @@ FILE *FOpen(const char *filename, const char *mode)
 		return 0;
 	}
 
-	return fopen(filename, mode);
+	FILE *fp = fopen(filename, mode);
+	if (fp == 0 && errno == ENOENT && mode[0] != 'r')
+	{
+		// 缓存的目录在外部被删除了，重新创建
+		DefaultDirCache().Clear();
+		if (MKdir(filename) == true)
+		{
+			fp = fopen(filename, mode);
+		}
+	}
+
+	return fp;
 }
 
 /**
@@ -320,6 +311,13 @@ void time2str(const time_t ltime, char *stime, const char *fmt)
 		return;
 	}
 
+	if (strcmp(fmt, "yyyy-mm-dd-hh24-mi-ss") == 0)
+	{
+		snprintf(stime, 20, "%04u-%02u-%02u-%02u-%02u-%02u", sttm.tm_year, 
+				sttm.tm_mon, sttm.tm_mday, sttm.tm_hour, sttm.tm_min, sttm.tm_sec);
+		return;
+	}
+
 	if (strcmp(fmt, "yyyy-mm-dd hh24:mi") == 0)
 	{
 		snprintf(stime, 20, "%04u-%02u-%02u %02u:%02u", sttm.tm_year, 
@@ -469,13 +467,14 @@ void LocalTime(char *stime, const char *fmt, const int timeval)
 
 /**
  * @brief 安全的格式化字符串函数
- * @details 将格式化的数据写入指定的缓冲区，确保不会发生缓冲区溢出
+ * @details 将格式化的数据写入指定的缓冲区，确保不会发生缓冲区溢出，总是以0结尾，
+ *          不清零缓冲区的其他部分。热点路径上用format.h的FormatTo，格式串在编译期解析
  * @param dest 目标缓冲区
  * @param destlen 目标缓冲区的大小
- * @param n 要写入的最大字符数
+ * @param n 最多写入的字符数，不包括结尾的0，不小于destlen时按destlen - 1
  * @param fmt 格式化字符串
  * @param ... 可变参数列表
- * @return 成功返回写入的字符数，失败返回-1
+ * @return 不截断时的长度，和vsnprintf一样，失败返回-1
  */
 int SNPrintf(char *dest, const size_t destlen, size_t n, const char *fmt, ...)
 {
@@ -484,18 +483,120 @@ int SNPrintf(char *dest, const size_t destlen, size_t n, const char *fmt, ...)
 		return -1;
 	}
 
-	memset(dest, 0, destlen);
-	int ilen = n;
-	if (n < destlen)
-	{
-		ilen = destlen;
-	}
-
 	va_list ap;
 
 	va_start(ap, fmt);
-	int iret = vsnprintf(dest, ilen, fmt, ap);
+	int iret = vsnprintf(dest, n < destlen ? n + 1 : destlen, fmt, ap);
 	va_end(ap);
 
 	return iret;
 }
+
+static unsigned int g_crc32c_table[8][256];
+
+static unsigned int Crc32cSoft(unsigned int crc, const unsigned char *p, size_t len);
+
+/**
+ * @brief 生成按8个字节一次查表的CRC32C表并检测CPU是否支持crc32指令，启动时调用一次
+ * @return true为使用crc32指令
+ */
+static bool InitCrc32c()
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int crc = i;
+		for (int j = 0; j < 8; j++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		g_crc32c_table[0][i] = crc;
+	}
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		for (int k = 1; k < 8; k++)
+		{
+			unsigned int prev = g_crc32c_table[k - 1][i];
+			g_crc32c_table[k][i] = (prev >> 8) ^ g_crc32c_table[0][prev & 0xff];
+		}
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+static bool g_crc32c_hard = InitCrc32c();
+
+static unsigned int Crc32cSoft(unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len >= 8)
+	{
+		unsigned long word;
+		memcpy(&word, p, 8);
+		word ^= crc;
+		crc = g_crc32c_table[7][word & 0xff] ^ g_crc32c_table[6][(word >> 8) & 0xff] ^
+			g_crc32c_table[5][(word >> 16) & 0xff] ^ g_crc32c_table[4][(word >> 24) & 0xff] ^
+			g_crc32c_table[3][(word >> 32) & 0xff] ^ g_crc32c_table[2][(word >> 40) & 0xff] ^
+			g_crc32c_table[1][(word >> 48) & 0xff] ^ g_crc32c_table[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0)
+	{
+		crc = (crc >> 8) ^ g_crc32c_table[0][(crc ^ *p) & 0xff];
+		p++;
+		len--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int Crc32cHard(unsigned int crc, const unsigned char *p, size_t len)
+{
+	unsigned long crc64 = crc;
+	while (len >= 8)
+	{
+		unsigned long word;
+		memcpy(&word, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	crc = (unsigned int)crc64;
+	while (len > 0)
+	{
+		crc = __builtin_ia32_crc32qi(crc, *p);
+		p++;
+		len--;
+	}
+
+	return crc;
+}
+#endif
+
+/**
+ * @brief 计算CRC32C
+ * @details 用于WAL等需要校验数据完整性的地方。编译时没有指定-march时也按运行的CPU选择实现，
+ *          有SSE4.2时每个周期接近8个字节，查表实现每次处理8个字节
+ * @param crc 前面数据的CRC，第一段传0
+ * @param data 数据
+ * @param len 数据长度
+ * @return 到这段数据为止的CRC
+ */
+unsigned int Crc32c(unsigned int crc, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (g_crc32c_hard == true)
+	{
+		return ~Crc32cHard(crc, p, len);
+	}
+#endif
+	return ~Crc32cSoft(crc, p, len);
+}
@@ -22,10 +22,16 @@ bool MKdir(const char *filename, bool bisfile = true);
 
 void time2str(const time_t ltime, char *stime, const char *fmt=0);
 
-void str2time(const char *stime);
+time_t str2time(const char *stime);
 
 void LocalTime(char *stime, const char *fmt=0, const int timeval=0);
 
 int SNPrintf(char *dest, const size_t destlen, size_t n, const char *fmt, ...);
 
+/*
+ * CRC32C（Castagnoli），crc为前面数据的结果，第一段传0，可以分段计算
+ * CPU支持SSE4.2时用crc32指令，否则查表
+ * */
+unsigned int Crc32c(unsigned int crc, const void *data, size_t len);
+
 #endif
@@ -0,0 +1,699 @@
+#include "public.h"
+#include "wal.h"
+#include "utils.h"
+#include "metrics.h"
+
+static MetricCounter *g_wal_appends = NewMetricCounter("moserver_wal_appends_total", "Records appended to the write-ahead log");
+static MetricCounter *g_wal_bytes = NewMetricCounter("moserver_wal_bytes_total", "Bytes written to the write-ahead log including headers");
+static MetricCounter *g_wal_syncs = NewMetricCounter("moserver_wal_syncs_total", "Group commits, each one write and one fdatasync");
+static MetricCounter *g_wal_truncated = NewMetricCounter("moserver_wal_truncated_bytes_total", "Bytes of torn records dropped by recovery");
+static MetricHistogram *g_wal_batch = NewMetricHistogram("moserver_wal_batch_records", "Records per group commit", 0, 1);
+static MetricHistogram *g_wal_sync_latency = NewMetricHistogram("moserver_wal_sync_seconds", "Time to write and fdatasync one group commit");
+
+struct WALHeader
+{
+	unsigned int  m_len;
+	unsigned int  m_crc;
+	unsigned long m_seq;
+};
+
+static_assert(sizeof(WALHeader) == WAL_HEADER_LEN, "WAL header must be 16 bytes");
+
+/*
+ * CRC先算内容再算序号，内容的部分可以在拿到序号之前、锁外面计算
+ * */
+static inline unsigned int RecordCrc(const unsigned int data_crc, const unsigned long seq)
+{
+	return Crc32c(data_crc, &seq, sizeof(seq));
+}
+
+/**
+ * @brief 校验从p开始的一条记录
+ * @param avail p之后可以读的字节数
+ * @param seq 期望的序号
+ * @return 记录的总长度，包括头部，不完整或者不合法时返回0
+ */
+static size_t CheckRecord(const char *p, const size_t avail, const unsigned long seq)
+{
+	if (avail < WAL_HEADER_LEN)
+	{
+		return 0;
+	}
+
+	WALHeader header;
+	memcpy(&header, p, sizeof(header));
+	if (header.m_len > WAL_MAX_RECORD || WAL_HEADER_LEN + (size_t)header.m_len > avail || header.m_seq != seq)
+	{
+		return 0;
+	}
+	if (RecordCrc(Crc32c(0, p + WAL_HEADER_LEN, header.m_len), seq) != header.m_crc)
+	{
+		return 0;
+	}
+
+	return WAL_HEADER_LEN + header.m_len;
+}
+
+static void SegmentPath(char *path, const size_t pathlen, const char *dir, const unsigned long first_seq)
+{
+	snprintf(path, pathlen, "%s/%020lu.wal", dir, first_seq);
+}
+
+bool WALSegments(const char *dir, vector<unsigned long> &segs)
+{
+	segs.clear();
+
+	DIR *pdir = opendir(dir);
+	if (pdir == 0)
+	{
+		return false;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(pdir)) != 0)
+	{
+		// 20位数字加.wal
+		const char *name = entry->d_name;
+		if (strlen(name) != 24 || strcmp(name + 20, ".wal") != 0)
+		{
+			continue;
+		}
+		bool bdigits = true;
+		for (int i = 0; i < 20 && bdigits == true; i++)
+		{
+			bdigits = (name[i] >= '0' && name[i] <= '9');
+		}
+		if (bdigits == true)
+		{
+			segs.push_back(strtoul(name, 0, 10));
+		}
+	}
+	closedir(pdir);
+
+	sort(segs.begin(), segs.end());
+
+	return true;
+}
+
+/*
+ * 把目录项落盘，新建的段文件在崩溃后才一定能找到
+ * */
+static void SyncDir(const char *dir)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+}
+
+WAL::WAL()
+{
+	m_segment_bytes = 64 * 1024 * 1024;
+	m_dir[0] = 0;
+	m_fd = -1;
+	m_segment_size = 0;
+	m_segment_seq = 1;
+	m_index_off = (size_t)-1;
+	m_next_seq = 1;
+	m_durable_seq = 0;
+	m_bflushing = false;
+	m_bfailed = false;
+	m_syncs = 0;
+	pthread_mutex_init(&m_lock, 0);
+	pthread_cond_init(&m_cond, 0);
+}
+
+bool WAL::Open(const char *dir)
+{
+	Close();
+
+	StrCopy(m_dir, sizeof(m_dir), dir);
+	if (MKdir(m_dir, false) == false)
+	{
+		return false;
+	}
+
+	vector<unsigned long> segs;
+	if (WALSegments(m_dir, segs) == false)
+	{
+		return false;
+	}
+
+	m_bfailed = false;
+	m_pending.clear();
+	m_index.clear();
+
+	if (segs.empty() == true)
+	{
+		m_next_seq = 1;
+		m_durable_seq = 0;
+		return OpenSegment(1);
+	}
+
+	char path[301];
+	SegmentPath(path, sizeof(path), m_dir, segs.back());
+
+	return Recover(path, segs.back());
+}
+
+/**
+ * @brief 把段中[off, size)清零，文件大小不变
+ * @details 先打洞，文件系统不支持时写0。读取器可能还映射着这个段，截短文件会让它访问
+ *          新的文件末尾之后的页时收到SIGBUS，清零之后这些页仍然可以访问，读到的是校验不过的记录
+ */
+static bool ZeroTail(const int fd, const size_t off, const size_t size)
+{
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size - off) == 0)
+	{
+		return true;
+	}
+
+	static const char zeros[65536] = { 0 };
+	for (size_t pos = off; pos < size; )
+	{
+		size_t ilen = size - pos < sizeof(zeros) ? size - pos : sizeof(zeros);
+		ssize_t n = pwrite(fd, zeros, ilen, pos);
+		if (n <= 0)
+		{
+			return false;
+		}
+		pos += n;
+	}
+
+	return true;
+}
+
+/**
+ * @brief 崩溃恢复，校验最后一个段，把尾部写了一半的记录清零，之后在这个段后面继续写
+ * @details 不截短文件，见ZeroTail。以前恢复时清零过的尾部全是0，不再重复清零
+ */
+bool WAL::Recover(const char *path, const unsigned long first_seq)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t size = st.st_size;
+	size_t off = 0;
+	bool bdirty = false;
+	unsigned long seq = first_seq;
+	m_segment_seq = first_seq;
+	m_index_off = (size_t)-1;
+	if (size > 0)
+	{
+		char *map = (char *)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+
+		size_t ilen;
+		while ((ilen = CheckRecord(map + off, size - off, seq)) > 0)
+		{
+			IndexRecord(seq, off, m_index);
+			off += ilen;
+			seq++;
+		}
+
+		bdirty = false;
+		for (size_t i = off; i < size && bdirty == false; i++)
+		{
+			bdirty = (map[i] != 0);
+		}
+		munmap(map, size);
+	}
+
+	if (bdirty == true)
+	{
+		if (ZeroTail(fd, off, size) == false || fdatasync(fd) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		g_wal_truncated->Add(size - off);
+	}
+
+	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
+	{
+		close(fd);
+		return false;
+	}
+
+	m_fd = fd;
+	m_segment_size = off;
+	m_segment_seq = first_seq;
+	m_next_seq = seq;
+	m_durable_seq = seq - 1;
+
+	return true;
+}
+
+/**
+ * @brief 新建一个段并切换过去，旧的段在写完最后一个批次时已经fdatasync，直接关闭
+ */
+bool WAL::OpenSegment(const unsigned long first_seq)
+{
+	char path[301];
+	SegmentPath(path, sizeof(path), m_dir, first_seq);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	// 预先分配磁盘空间，不改变文件长度，追加时不需要再分配块，失败时不影响正确性
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, m_segment_bytes) != 0)
+	{
+		// 文件系统不支持时忽略
+	}
+	SyncDir(m_dir);
+
+	if (m_fd != -1)
+	{
+		close(m_fd);
+	}
+	m_fd = fd;
+	m_segment_size = 0;
+	m_segment_seq = first_seq;
+	m_index_off = (size_t)-1;
+
+	return true;
+}
+
+/**
+ * @brief 段中的第一条记录，以及离上一个索引位置超过WAL_INDEX_BYTES的记录加入索引
+ */
+void WAL::IndexRecord(const unsigned long seq, const size_t off, vector<WALPosition> &index)
+{
+	if (m_index_off != (size_t)-1 && off < m_index_off + WAL_INDEX_BYTES)
+	{
+		return;
+	}
+
+	WALPosition pos;
+	pos.m_segment = m_segment_seq;
+	pos.m_seq = seq;
+	pos.m_off = off;
+	index.push_back(pos);
+	m_index_off = off;
+}
+
+/**
+ * @brief 写一个批次并fdatasync，只由当前写盘的线程调用
+ */
+bool WAL::WriteBatch(const char *data, const size_t len, const unsigned long first_seq)
+{
+	if (m_segment_size > 0 && m_segment_size + len > m_segment_bytes && OpenSegment(first_seq) == false)
+	{
+		return false;
+	}
+
+	size_t off = 0;
+	while (off < len)
+	{
+		ssize_t n = write(m_fd, data + off, len - off);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		off += n;
+	}
+	size_t base = m_segment_size;
+	m_segment_size += len;
+
+	if (fdatasync(m_fd) != 0)
+	{
+		return false;
+	}
+
+	// 批次中的记录已经校验过长度，按记录头逐条前进
+	unsigned long seq = first_seq;
+	for (off = 0; off < len; seq++)
+	{
+		IndexRecord(seq, base + off, m_batch_index);
+		WALHeader header;
+		memcpy(&header, data + off, sizeof(header));
+		off += WAL_HEADER_LEN + header.m_len;
+	}
+
+	return true;
+}
+
+/**
+ * @brief 追加一条记录并等待落盘
+ * @details 没有线程在写盘时由当前线程写，它只写一个批次就返回，写盘期间到达的记录由
+ *          被唤醒的调用者中的一个接着写，写盘的线程不会因为记录源源不断而一直不能返回
+ */
+bool WAL::Append(const char *data, const int len, unsigned long *seq)
+{
+	if (len < 0 || len > WAL_MAX_RECORD)
+	{
+		return false;
+	}
+
+	unsigned int data_crc = Crc32c(0, data, len);
+
+	pthread_mutex_lock(&m_lock);
+	if (m_fd == -1 || m_bfailed == true)
+	{
+		pthread_mutex_unlock(&m_lock);
+		return false;
+	}
+
+	WALHeader header;
+	header.m_len = len;
+	header.m_seq = m_next_seq++;
+	header.m_crc = RecordCrc(data_crc, header.m_seq);
+	m_pending.append((const char *)&header, sizeof(header));
+	m_pending.append(data, len);
+
+	while (m_bfailed == false && m_durable_seq < header.m_seq)
+	{
+		if (m_bflushing == true)
+		{
+			pthread_cond_wait(&m_cond, &m_lock);
+			continue;
+		}
+
+		// 批次中的记录序号连续，前面的批次都已经落盘
+		m_bflushing = true;
+		m_writing.swap(m_pending);
+		m_pending.clear();
+		unsigned long first_seq = m_durable_seq + 1;
+		unsigned long last_seq = m_next_seq - 1;
+		pthread_mutex_unlock(&m_lock);
+
+		unsigned long start = MetricNow();
+		bool bok = WriteBatch(m_writing.data(), m_writing.size(), first_seq);
+		g_wal_sync_latency->Record(MetricNow() - start);
+		g_wal_syncs->Add();
+		g_wal_batch->Record(last_seq - first_seq + 1);
+		g_wal_appends->Add(last_seq - first_seq + 1);
+		g_wal_bytes->Add(m_writing.size());
+
+		pthread_mutex_lock(&m_lock);
+		if (bok == true)
+		{
+			m_durable_seq = last_seq;
+			m_index.insert(m_index.end(), m_batch_index.begin(), m_batch_index.end());
+		}
+		else
+		{
+			m_bfailed = true;
+		}
+		m_batch_index.clear();
+		m_bflushing = false;
+		m_syncs++;
+		pthread_cond_broadcast(&m_cond);
+	}
+
+	bool bok = m_durable_seq >= header.m_seq;
+	pthread_mutex_unlock(&m_lock);
+
+	if (bok == true && seq != 0)
+	{
+		*seq = header.m_seq;
+	}
+
+	return bok;
+}
+
+unsigned long WAL::Durable()
+{
+	pthread_mutex_lock(&m_lock);
+	unsigned long seq = m_durable_seq;
+	pthread_mutex_unlock(&m_lock);
+
+	return seq;
+}
+
+unsigned long WAL::Syncs()
+{
+	pthread_mutex_lock(&m_lock);
+	unsigned long syncs = m_syncs;
+	pthread_mutex_unlock(&m_lock);
+
+	return syncs;
+}
+
+bool WAL::Locate(const unsigned long seq, WALPosition *pos)
+{
+	pthread_mutex_lock(&m_lock);
+	auto it = upper_bound(m_index.begin(), m_index.end(), seq,
+			[](const unsigned long value, const WALPosition &p) { return value < p.m_seq; });
+	bool bfound = it != m_index.begin();
+	if (bfound == true)
+	{
+		*pos = *(it - 1);
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	return bfound;
+}
+
+int WAL::Purge(const unsigned long seq)
+{
+	vector<unsigned long> segs;
+	if (WALSegments(m_dir, segs) == false)
+	{
+		return 0;
+	}
+
+	// 第i个段的最后一条记录是下一个段的起始序号减1，最后一个段一直保留
+	int icount = 0;
+	size_t i = 0;
+	for (; i + 1 < segs.size() && segs[i + 1] - 1 < seq; i++)
+	{
+		char path[301];
+		SegmentPath(path, sizeof(path), m_dir, segs[i]);
+		if (unlink(path) == 0)
+		{
+			icount++;
+		}
+	}
+
+	// 删掉的段的索引位置也去掉，没有删掉的段也不会再被读到，一起去掉
+	if (i > 0)
+	{
+		pthread_mutex_lock(&m_lock);
+		unsigned long first_kept = segs[i];
+		auto it = m_index.begin();
+		while (it != m_index.end() && it->m_segment < first_kept)
+		{
+			++it;
+		}
+		m_index.erase(m_index.begin(), it);
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	return icount;
+}
+
+void WAL::Close()
+{
+	pthread_mutex_lock(&m_lock);
+	while (m_bflushing == true)
+	{
+		pthread_cond_wait(&m_cond, &m_lock);
+	}
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+WAL::~WAL()
+{
+	Close();
+	pthread_mutex_destroy(&m_lock);
+	pthread_cond_destroy(&m_cond);
+}
+
+WALReader::WALReader()
+{
+	m_dir[0] = 0;
+	m_fd = -1;
+	m_map = 0;
+	m_map_len = 0;
+	m_off = 0;
+	m_next_seq = 1;
+}
+
+bool WALReader::Open(const char *dir, const unsigned long seq, const WALPosition *hint)
+{
+	Close();
+	StrCopy(m_dir, sizeof(m_dir), dir);
+
+	const char *data;
+	int ilen;
+	unsigned long rseq;
+	if (hint != 0 && hint->m_seq <= seq && OpenSegment(hint->m_segment) == true)
+	{
+		// 提示的位置上必须是那条记录，否则段已经被删除重建过
+		if (m_map != 0 && hint->m_off < m_map_len &&
+				CheckRecord(m_map + hint->m_off, m_map_len - hint->m_off, hint->m_seq) > 0)
+		{
+			m_off = hint->m_off;
+			m_next_seq = hint->m_seq;
+			while (m_next_seq < seq && Next(&data, &ilen, &rseq) == true)
+			{
+			}
+			return true;
+		}
+		Close();
+	}
+
+	vector<unsigned long> segs;
+	if (WALSegments(m_dir, segs) == false)
+	{
+		return false;
+	}
+
+	m_next_seq = seq > 0 ? seq : 1;
+	if (segs.empty() == true)
+	{
+		return true;
+	}
+
+	// 包含seq的段是起始序号不大于seq的最后一个段
+	unsigned long first_seq = segs[0];
+	for (size_t i = 0; i < segs.size() && segs[i] <= seq; i++)
+	{
+		first_seq = segs[i];
+	}
+	if (OpenSegment(first_seq) == false)
+	{
+		return false;
+	}
+
+	while (m_next_seq < seq && Next(&data, &ilen, &rseq) == true)
+	{
+	}
+
+	return true;
+}
+
+bool WALReader::OpenSegment(const unsigned long first_seq)
+{
+	char path[301];
+	SegmentPath(path, sizeof(path), m_dir, first_seq);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	Close();
+	m_fd = fd;
+	m_off = 0;
+	m_next_seq = first_seq;
+
+	Remap();
+
+	return true;
+}
+
+/**
+ * @brief 文件变长时重新映射
+ * @return true为文件变长了
+ */
+bool WALReader::Remap()
+{
+	struct stat st;
+	if (m_fd == -1 || fstat(m_fd, &st) != 0 || (size_t)st.st_size <= m_map_len)
+	{
+		return false;
+	}
+
+	char *map = (char *)mmap(0, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (m_map != 0)
+	{
+		munmap(m_map, m_map_len);
+	}
+	m_map = map;
+	m_map_len = st.st_size;
+
+	return true;
+}
+
+bool WALReader::Next(const char **data, int *len, unsigned long *seq)
+{
+	while (true)
+	{
+		if (m_map != 0)
+		{
+			size_t ilen = CheckRecord(m_map + m_off, m_map_len - m_off, m_next_seq);
+			if (ilen > 0)
+			{
+				*data = m_map + m_off + WAL_HEADER_LEN;
+				*len = ilen - WAL_HEADER_LEN;
+				*seq = m_next_seq;
+				m_off += ilen;
+				m_next_seq++;
+				return true;
+			}
+		}
+
+		// 读到了当前映射的末尾，或者记录还没有写完整
+		if (Remap() == true)
+		{
+			continue;
+		}
+
+		// 当前段已经写完，写的一方切换到了从m_next_seq开始的新段
+		char path[301];
+		SegmentPath(path, sizeof(path), m_dir, m_next_seq);
+		if ((m_fd == -1 || m_off > 0) && access(path, F_OK) == 0 && OpenSegment(m_next_seq) == true)
+		{
+			continue;
+		}
+
+		return false;
+	}
+}
+
+void WALReader::Close()
+{
+	if (m_map != 0)
+	{
+		munmap(m_map, m_map_len);
+		m_map = 0;
+		m_map_len = 0;
+	}
+	if (m_fd != -1)
+	{
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+WALReader::~WALReader()
+{
+	Close();
+}
@@ -0,0 +1,178 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+#include "public.h"
+
+#define WAL_HEADER_LEN  16          // 记录头：长度、CRC、序号
+#define WAL_MAX_RECORD  (64 * 1024 * 1024)
+#define WAL_INDEX_BYTES (256 * 1024)  // 稀疏索引的间隔，定位一条记录最多从段中扫描这么多字节
+
+/*
+ * 一条记录在日志中的位置
+ * */
+struct WALPosition
+{
+	unsigned long m_segment;   // 段的起始序号
+	unsigned long m_seq;       // 记录的序号
+	size_t        m_off;       // 记录在段中的偏移
+};
+
+/**
+ * @brief 分段的预写日志，组提交
+ *
+ * 记录按追加顺序编号，序号从1开始连续递增。记录的格式为
+ *   4字节内容长度 | 4字节CRC32C | 8字节序号 | 内容
+ * 都是本机字节序，CRC覆盖序号和内容。
+ *
+ * 日志写在目录下的多个段文件中，文件名是段中第一条记录的序号，例如00000000000000000001.wal，
+ * 段超过m_segment_bytes后下一批记录写到新的段。旧的段不会再修改，由调用者按序号删除。
+ *
+ * 组提交：Append把记录放进内存中的批次，如果当前没有线程在写盘就由自己写，
+ * 否则等待。写盘的线程取走整个批次，一次write和一次fdatasync之后唤醒批次中所有的
+ * 调用者，写盘期间到达的记录组成下一个批次。并发越高批次越大，fdatasync的次数
+ * 不随记录数增加，单条记录的耗时在低并发时接近一次fdatasync。
+ *
+ * 写盘或者fdatasync失败后不再重试（失败之后页缓存中的数据状态不确定），之后的Append都返回false，
+ * 需要重新Open，由恢复过程决定哪些记录有效。
+ *
+ * 已经落盘的记录每隔WAL_INDEX_BYTES字节在内存中记一个位置，Locate按序号查找，
+ * 读取器从这个位置开始，不用每次都从段头校验到要读的记录。恢复时只为最后一个段建索引，
+ * 更早的段没有索引，仍然从段头扫描。
+ *
+ * 崩溃恢复只扫描最后一个段：旧的段在切换之前已经fdatasync，只有最后一个段的尾部可能有
+ * 写了一半的批次，从头校验记录，遇到长度不合法、CRC不对或者序号不连续的记录时把这条记录
+ * 及之后的内容清零，新的记录从这里接着写。
+ *
+ * 段文件在任何时候都不会变短：WALReader用mmap读，其他进程或者之前的WAL对象的读取器可能
+ * 还映射着最后一个段，截短文件会让它访问原来的末尾时收到SIGBUS。删除段文件（Purge）不受影响，
+ * 已经映射的内存在munmap之前一直有效。
+ *
+ * 使用方法：
+ *   WAL wal;
+ *   wal.Open("/data/queue");
+ *   unsigned long seq;
+ *   wal.Append(data, len, &seq);     // 返回时已经落盘
+ *
+ *   WALReader reader;
+ *   reader.Open("/data/queue", 1);
+ *   while (reader.Next(&data, &len, &seq) == true) ...
+ */
+class WAL
+{
+	public:
+		size_t m_segment_bytes;   // 段的大小，Open之前设置，缺省64MB
+
+		WAL();
+
+		/*
+		 * 打开目录下的日志，目录不存在时创建，有旧的日志时做崩溃恢复
+		 * */
+		bool Open(const char *dir);
+
+		/*
+		 * 追加一条记录，返回时记录已经fdatasync，可以向发送者确认
+		 * seq 返回记录的序号，可以为0
+		 * */
+		bool Append(const char *data, const int len, unsigned long *seq = 0);
+
+		/*
+		 * 已经落盘的最后一条记录的序号，没有记录时为0
+		 * */
+		unsigned long Durable();
+
+		/*
+		 * 组提交的次数，即fdatasync的次数，用于计算平均批次大小
+		 * */
+		unsigned long Syncs();
+
+		/*
+		 * 查找序号不大于seq的最近一个索引位置，作为WALReader::Open的提示
+		 * 返回值 没有这样的位置时返回false
+		 * */
+		bool Locate(const unsigned long seq, WALPosition *pos);
+
+		/*
+		 * 删除最后一条记录的序号小于seq的段，当前正在写的段不删除
+		 * 返回值 删除的段数
+		 * */
+		int Purge(const unsigned long seq);
+
+		void Close();
+
+		~WAL();
+
+	private:
+		char   m_dir[256];
+		int    m_fd;                 // 当前段，只由写盘的线程访问
+		size_t m_segment_size;       // 当前段已经写入的字节数
+		unsigned long m_segment_seq; // 当前段的起始序号
+		size_t m_index_off;          // 当前段最后一个索引位置的偏移，还没有时为-1
+		vector<WALPosition> m_batch_index;   // 正在写盘的批次中的索引位置，落盘后加入m_index
+
+		pthread_mutex_t m_lock;      // 保护下面的成员
+		pthread_cond_t  m_cond;      // 批次落盘或者失败时广播
+		string          m_pending;   // 下一个批次
+		string          m_writing;   // 正在写盘的批次，复用内存
+		unsigned long   m_next_seq;
+		unsigned long   m_durable_seq;
+		bool            m_bflushing; // 有线程在写盘
+		bool            m_bfailed;
+		unsigned long   m_syncs;
+		vector<WALPosition> m_index; // 按序号递增的稀疏索引，只包含已经落盘的记录
+
+		bool Recover(const char *path, const unsigned long first_seq);
+
+		bool OpenSegment(const unsigned long first_seq);
+
+		void IndexRecord(const unsigned long seq, const size_t off, vector<WALPosition> &index);
+
+		bool WriteBatch(const char *data, const size_t len, const unsigned long first_seq);
+};
+
+/**
+ * @brief 用mmap顺序读取WAL
+ *
+ * 把段文件只读映射到内存，Next返回的指针直接指向映射的内存，不拷贝，
+ * 在下一次调用Next之前有效。读到段尾时检查文件是否变长或者有没有更新的段，
+ * 可以一边写一边读，不会读到CRC不对的记录。
+ */
+class WALReader
+{
+	public:
+		WALReader();
+
+		/*
+		 * 从序号为seq的记录开始读，seq为0或者早于最早的段时从最早的记录开始
+		 * hint WAL::Locate返回的位置，从这里开始找seq；提示的位置已经失效（段被删除或者截断）时
+		 *      从段头开始找
+		 * */
+		bool Open(const char *dir, const unsigned long seq, const WALPosition *hint = 0);
+
+		/*
+		 * 取下一条记录
+		 * 返回值 没有新的记录时返回false，之后有新记录时可以再次调用
+		 * */
+		bool Next(const char **data, int *len, unsigned long *seq);
+
+		void Close();
+
+		~WALReader();
+
+	private:
+		char          m_dir[256];
+		int           m_fd;
+		char         *m_map;
+		size_t        m_map_len;
+		size_t        m_off;
+		unsigned long m_next_seq;    // 下一条要返回的记录的序号
+
+		bool OpenSegment(const unsigned long first_seq);
+
+		bool Remap();
+};
+
+/*
+ * 列出目录下所有段的起始序号，从小到大排序
+ * */
+bool WALSegments(const char *dir, vector<unsigned long> &segs);
+
+#endif